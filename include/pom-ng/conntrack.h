@@ -26,10 +26,20 @@
 
 #define CONNTRACK_PKT_FIELD_NONE -1
 
+/// Maximum size of each value for protocols using fixed size keys
+#define CONNTRACK_KEY_MAX_SIZE 16
+
 struct proto_process_stack;
 
+struct conntrack_key {
+	uint32_t fwd[CONNTRACK_KEY_MAX_SIZE / sizeof(uint32_t)]; ///< Forward value
+	uint32_t rev[CONNTRACK_KEY_MAX_SIZE / sizeof(uint32_t)]; ///< Reverse value
+	void *parent; ///< Parent conntrack
+};
+
 struct conntrack_entry {
 
+	struct conntrack_key key; ///< Packed values if the protocol uses fixed size keys
 	struct ptype *fwd_value, *rev_value; ///< Forward and reverse value for hashing
 	struct conntrack_node_list *parent; ///< Parent conntrack
 	struct conntrack_node_list *children; ///< Children of this conntrack
@@ -41,6 +51,9 @@ struct conntrack_entry {
 	pthread_mutex_t lock; ///< Lock of the conntrack entry
 	uint32_t hash; ///< Full hash prior to modulo
 	unsigned int refcount; ///< Reference count (mostly in how many proto_stack it's referenced)
+	struct conntrack_entry *next; ///< Next conntrack in the hash bucket
+	struct conntrack_entry *retired_next; ///< Next conntrack waiting to be released
+	uint64_t retired_epoch; ///< Epoch at which the conntrack was removed from its table
 };
 
 struct conntrack_node_list {
@@ -50,14 +63,10 @@ struct conntrack_node_list {
 	uint32_t hash; ///< Hash of the conntrack
 };
 
-struct conntrack_list {
-	struct conntrack_entry *ce; ///< Corresponding conntrack
-	struct conntrack_list *prev, *next; ///< Next and previous connection in the list
-};
-
 struct conntrack_info {
 	int (*cleanup_handler) (void *ce_priv);
 	unsigned int default_table_size;
+	unsigned int key_size; ///< Size of the values if they can be compared as raw bytes, 0 to use the ptype
 	int fwd_pkt_field_id, rev_pkt_field_id;
 };
 
@@ -31,7 +31,11 @@
 #define CORE_PROTO_STACK_MAX		16
 
 int core_process_multi_packet(struct proto_process_stack *s, unsigned int stack_index, struct packet *p);
+// Queue a packet, it's released if it could not be queued
 int core_queue_packet(struct packet *p, unsigned int flags, unsigned int thread_affinity);
+// Queue a burst of packets from the same input, thread_affinity holds one value per packet if needed
+// The packets which could not be queued are released
+int core_queue_packets(struct packet **pkts, unsigned int count, unsigned int flags, unsigned int *thread_affinity);
 struct proto_process_stack *core_stack_backup(struct proto_process_stack *stack, struct packet* old_pkt, struct packet *new_pkt);
 void core_stack_release(struct proto_process_stack *stack);
 ptime core_get_clock();
@@ -84,6 +84,7 @@ struct dataset_query {
 	struct datavalue *values;
 
 	unsigned int prepared;
+	unsigned int bulk; ///< Number of rows announced to datastore_dataset_write_bulk_begin()
 	uint64_t data_id; ///< id of the data in the dataset
 	struct datavalue_condition *cond;
 	struct datavalue_read_order *read_order;
@@ -164,6 +165,11 @@ struct datastore_reg_info {
 	int (*dataset_write) (struct dataset_query *dsq);
 	int (*dataset_delete) (struct dataset_query *dsq);
 
+	// Optional, used to write many rows at once
+	int (*dataset_write_bulk_begin) (struct dataset_query *dsq, unsigned int count);
+	int (*dataset_write_bulk) (struct dataset_query *dsq);
+	int (*dataset_write_bulk_end) (struct dataset_query *dsq, int cancel);
+
 	int (*dataset_query_alloc) (struct dataset_query *dsq);
 	int (*dataset_query_prepare) (struct dataset_query *dsq);
 	int (*dataset_query_cleanup) (struct dataset_query *dsq);
@@ -188,6 +194,10 @@ int datastore_dataset_read_single(struct dataset_query *dsq);
 int datastore_dataset_write(struct dataset_query *dsq);
 int datastore_dataset_delete(struct dataset_query *dsq);
 
+int datastore_dataset_write_bulk_begin(struct dataset_query *dsq, unsigned int count);
+int datastore_dataset_write_bulk(struct dataset_query *dsq);
+int datastore_dataset_write_bulk_end(struct dataset_query *dsq, int cancel);
+
 struct dataset_query *datastore_dataset_query_alloc(struct dataset *ds, struct datastore_connection *dc);
 struct dataset_query *datastore_dataset_query_open(struct datastore *d, char *name, struct datavalue_template *dt, struct datastore_connection *dc);
 int datastore_dataset_query_cleanup(struct dataset_query *dsq);
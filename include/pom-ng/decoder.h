@@ -40,6 +40,9 @@ struct decoder {
 	char *next_in;
 
 	void *priv;
+
+	// Memory used by the decoder state, kept up to date by the decoders which allocate it as they go
+	size_t state_size;
 };
 
 struct decoder_reg_info {
@@ -30,6 +30,9 @@
 // Indicate that the event generates a payload
 #define EVENT_REG_FLAG_PAYLOAD		0x1
 
+// Drop the events when the queue of an asynchronous listener is full instead of waiting
+#define EVENT_LISTENER_ASYNC_FLAG_DROP	0x1
+
 struct event_reg;
 struct event;
 
@@ -58,6 +61,7 @@ int event_payload_listen_stop();
 
 int event_listener_register(struct event_reg *evt_reg, void *obj, int (*process_begin) (struct event *evt, void *obj, struct proto_process_stack *stack, unsigned int stack_index), int (*process_end) (struct event *evt, void *obj), struct filter *filter);
 int event_listener_unregister(struct event_reg *evt_reg, void *obj);
+int event_listener_set_async(struct event_reg *evt_reg, void *obj, unsigned int queue_size, unsigned int flags);
 int event_has_listener(struct event_reg *evt_reg);
 
 int event_process(struct event *evt, struct proto_process_stack *stack, int stack_index, ptime ts);
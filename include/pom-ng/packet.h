@@ -71,9 +71,15 @@ struct packet_info {
 
 int packet_buffer_alloc(struct packet *pkt, size_t size, size_t align_offset);
 
+struct packet_buffer *packet_buffer_external_alloc(void (*release) (void *priv), void *priv);
+void packet_buffer_external_attach(struct packet *pkt, struct packet_buffer *pb, void *buff, size_t len);
+void packet_buffer_external_cleanup(struct packet_buffer *pb);
+
 struct packet *packet_alloc();
 struct packet *packet_clone(struct packet *src, unsigned int flags);
 int packet_release(struct packet *p);
+// Must be called by threads allocating packets before they exit
+void packet_cache_thread_cleanup();
 
 struct packet_multipart *packet_multipart_alloc(struct proto *proto, unsigned int flags, unsigned int align_offset);
 int packet_multipart_cleanup(struct packet_multipart *m);
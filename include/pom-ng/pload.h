@@ -63,7 +63,7 @@ struct pload_type {
 	struct registry_instance *reg_instance;
 
 	struct registry_perf *perf_analyzed;
-
+	struct registry_perf *perf_signature_hits;
 
 	UT_hash_handle hh;
 };
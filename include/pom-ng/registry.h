@@ -37,7 +37,8 @@ struct registry_param;
 enum registry_perf_type {
 	registry_perf_type_counter,
 	registry_perf_type_gauge,
-	registry_perf_type_timeticks
+	registry_perf_type_timeticks,
+	registry_perf_type_histogram
 
 };
 
@@ -53,8 +54,12 @@ void registry_perf_inc(struct registry_perf *p, uint64_t val);
 void registry_perf_dec(struct registry_perf *p, uint64_t val);
 void registry_perf_timeticks_stop(struct registry_perf *p);
 void registry_perf_timeticks_restart(struct registry_perf *p);
+uint64_t registry_perf_histogram_start();
+void registry_perf_histogram_stop(struct registry_perf *p, uint64_t start);
+void registry_perf_histogram_record(struct registry_perf *p, uint64_t val);
 uint64_t registry_perf_getval(struct registry_perf *p);
 void registry_perf_reset(struct registry_perf *p);
+void registry_perf_thread_cleanup();
 
 int registry_param_info_set_min_max(struct registry_param *p, uint32_t min, uint32_t max);
 int registry_param_info_add_value(struct registry_param *p, char *value);
@@ -25,6 +25,7 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include "mod.h"
+#include "core.h"
 
 #define ADDON_REGISTRY "addon"
 
@@ -35,6 +36,11 @@
 #define ADDON_REG_REGISTRY_KEY "addon_reg"
 #define ADDON_INSTANCE "__instance"
 
+// Each processing thread has its own replica of an output state
+#define ADDON_REPLICA_MAX CORE_PROCESS_THREAD_MAX
+#define ADDON_SLOT_MAIN -1
+#define ADDON_SLOT_CURRENT -2
+
 struct addon {
 
 	char *name;
@@ -53,6 +59,20 @@ struct addon_param {
 	struct addon_param *next;
 };
 
+struct addon_shared_counter {
+	char *name;
+	int64_t value;
+	struct addon_shared_counter *next;
+};
+
+struct addon_msg {
+	int type;
+	lua_Number num;
+	char *str;
+	size_t len;
+	struct addon_msg *next;
+};
+
 struct addon_instance_priv {
 
 	lua_State *L; // Main lua state for the output
@@ -60,6 +80,20 @@ struct addon_instance_priv {
 	void *instance;
 	struct addon_param *params;
 
+	// Only used for replicas, NULL and ADDON_SLOT_MAIN for the main state
+	struct addon_instance_priv *main;
+	int slot;
+
+	// Per thread replicas of the main state
+	int per_thread, running;
+	pthread_rwlock_t replicas_lock;
+	struct addon_instance_priv **replicas;
+
+	// State shared between the main state and the replicas
+	pthread_mutex_t shared_lock;
+	struct addon_shared_counter *counters;
+	struct addon_msg *msg_head, *msg_tail;
+
 };
 
 int addon_init();
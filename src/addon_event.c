@@ -21,6 +21,7 @@
 #include "addon.h"
 #include "addon_event.h"
 #include "addon_data.h"
+#include "addon_output.h"
 
 static int addon_event_get_field(lua_State *L) {
 
@@ -57,9 +58,10 @@ int addon_event_lua_register(lua_State *L) {
 
 int addon_event_process_begin(struct event *evt, void *obj, struct proto_process_stack *stack, unsigned int stack_index) {
 
-	struct addon_instance_priv *p = obj;
+	struct addon_instance_priv *o = obj;
 
-	pom_mutex_lock(&p->lock);
+	// Use the state of this thread if the output has one
+	struct addon_instance_priv *p = addon_instance_lock(o, ADDON_SLOT_CURRENT);
 
 	lua_getfield(p->L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
 
@@ -67,7 +69,7 @@ int addon_event_process_begin(struct event *evt, void *obj, struct proto_process
 	lua_pushlightuserdata(p->L, evt->reg); // Stack : self, evt_reg
 	lua_gettable(p->L, -2); // Stack : self, evt_table
 	if (!lua_istable(p->L, -1)) {
-		pom_mutex_unlock(&p->lock);
+		addon_instance_unlock(o, p);
 		pomlog(POMLOG_ERR "Listener not registered for event %s", evt->reg->info->name);
 		return POM_ERR;
 	}
@@ -77,7 +79,7 @@ int addon_event_process_begin(struct event *evt, void *obj, struct proto_process
 
 	if (lua_isnil(p->L, -1)) {
 		lua_pop(p->L, 3); // Stack : empty
-		pom_mutex_unlock(&p->lock);
+		addon_instance_unlock(o, p);
 		return POM_OK;
 	}
 
@@ -86,7 +88,7 @@ int addon_event_process_begin(struct event *evt, void *obj, struct proto_process
 	// Push event
 	if (addon_event_push(p->L, evt) != POM_OK) { // Stack : self, evt_table, process_func, self, evt
 		lua_pop(p->L, 4);
-		pom_mutex_unlock(&p->lock);
+		addon_instance_unlock(o, p);
 		return POM_ERR;
 	}
 
@@ -94,16 +96,17 @@ int addon_event_process_begin(struct event *evt, void *obj, struct proto_process
 	
 	lua_pop(p->L, 2); // Stack : empty
 
-	pom_mutex_unlock(&p->lock);
+	addon_instance_unlock(o, p);
 
 	return res;
 }
 
 int addon_event_process_end(struct event *evt, void *obj) {
 
-	struct addon_instance_priv *p = obj;
+	struct addon_instance_priv *o = obj;
 
-	pom_mutex_lock(&p->lock);
+	// Use the state of this thread if the output has one
+	struct addon_instance_priv *p = addon_instance_lock(o, ADDON_SLOT_CURRENT);
 
 	lua_getfield(p->L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
 
@@ -111,7 +114,7 @@ int addon_event_process_end(struct event *evt, void *obj) {
 	lua_pushlightuserdata(p->L, evt->reg);
 	lua_gettable(p->L, -2); // Stack : self, evt_table
 	if (!lua_istable(p->L, -1)) {
-		pom_mutex_unlock(&p->lock);
+		addon_instance_unlock(o, p);
 		pomlog(POMLOG_ERR "Listener not registered for event %s", evt->reg->info->name);
 		return POM_ERR;
 	}
@@ -122,7 +125,7 @@ int addon_event_process_end(struct event *evt, void *obj) {
 	// Check if there is an end function
 	if (lua_isnil(p->L, -1)) {
 		lua_pop(p->L, 3); // Stack : empty
-		pom_mutex_unlock(&p->lock);
+		addon_instance_unlock(o, p);
 		return POM_OK;
 	}
 
@@ -131,14 +134,14 @@ int addon_event_process_end(struct event *evt, void *obj) {
 	// Push event
 	if (addon_event_push(p->L, evt) != POM_OK) { // Stack : self, evt_table, process_func, self, evt
 		lua_pop(p->L, 4);
-		pom_mutex_unlock(&p->lock);
+		addon_instance_unlock(o, p);
 		return POM_ERR;
 	}
 
 	int res = addon_pcall(p->L, 2, 0); // Stack : self, evt_table
 
 	lua_pop(p->L, 2); // Stack : empty
-	pom_mutex_unlock(&p->lock);
+	addon_instance_unlock(o, p);
 
 	return res;
 }
@@ -37,11 +37,22 @@ static int addon_output_new(lua_State *L) {
 	// 1) name
 	// 2) output description
 	// 3) parameter table
+	// 4) options table if any
 
 	// Stack : name, params
 
 	luaL_checkstring(L, 1);
 
+	// Check if each thread should get its own copy of the output
+	int per_thread = 0;
+	if (lua_gettop(L) >= 4) {
+		if (lua_istable(L, 4)) {
+			lua_getfield(L, 4, "per_thread");
+			per_thread = lua_toboolean(L, -1);
+		}
+		lua_settop(L, 3);
+	}
+
 	// Create a new addon class
 	lua_newtable(L); // Stack : name, descr, params, class
 
@@ -49,6 +60,9 @@ static int addon_output_new(lua_State *L) {
 	luaL_getmetatable(L, ADDON_OUTPUT_METATABLE); // Stack : name, descr, params, class, metatable
 	lua_setmetatable(L, -2); // Stack : name, descr, params, class
 
+	lua_pushboolean(L, per_thread); // Stack : name, descr, params, class, per_thread
+	lua_setfield(L, -2, "__per_thread"); // Stack : name, descr, params, class
+
 	// Save the parameter table
 	lua_pushvalue(L, -2); // Stack : name, descr, params, class, params
 	lua_setfield(L, -2, "__params"); // Stack : name, descr, params, class
@@ -83,6 +97,197 @@ static struct addon_instance_priv *addon_output_get_priv(lua_State *L, int t) {
 	return luaL_checkudata(L, -1, ADDON_OUTPUT_PRIV_METATABLE);
 }
 
+// Create a copy of the output state for one thread
+static struct addon_instance_priv *addon_output_replica_alloc(struct addon_instance_priv *p, int slot) {
+
+	struct output *o = p->instance;
+	struct addon *addon = o->info->reg_info->mod->priv;
+
+	lua_State *L = addon_create_state(addon->filename); // Stack : empty
+	if (!L) {
+		pomlog(POMLOG_ERR "Error while creating lua replica for output %s", o->name);
+		return p;
+	}
+
+	// Get the output from the outputs table
+	lua_getfield(L, LUA_REGISTRYINDEX, ADDON_OUTPUTS_TABLE); // Stack : outputs
+	lua_getfield(L, -1, o->info->reg_info->name); // Stack : outputs, output
+	lua_remove(L, -2); // Stack : output
+	lua_pushnil(L); // Stack : output, nil
+	lua_setfield(L, LUA_REGISTRYINDEX, ADDON_OUTPUTS_TABLE); // Stack : output
+	lua_pushvalue(L, -1); // Stack : output, output
+	lua_setfield(L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : output
+
+	struct addon_instance_priv *r = lua_newuserdata(L, sizeof(struct addon_instance_priv)); // Stack : output, priv
+	memset(r, 0, sizeof(struct addon_instance_priv));
+	r->L = L;
+	r->instance = o;
+	r->main = p;
+	r->slot = slot;
+	if (pthread_mutex_init(&r->lock, NULL)) {
+		pomlog(POMLOG_ERR "Error while initializing mutex : %s", pom_strerror(errno));
+		lua_close(L);
+		return p;
+	}
+
+	luaL_getmetatable(L, ADDON_OUTPUT_PRIV_METATABLE); // Stack : output, priv, metatable
+	lua_setmetatable(L, -2); // Stack : output, priv
+	lua_setfield(L, -2, "__priv"); // Stack : output
+
+	// Let the replica setup its processing functions, the main state does the actual listening
+	lua_getfield(L, -1, "open"); // Stack : output, open_func
+	lua_pushvalue(L, -2); // Stack : output, open_func, output
+	if (addon_pcall(L, 1, 0) != POM_OK) { // Stack : output
+		lua_close(L);
+		return p;
+	}
+	lua_pop(L, 1); // Stack : empty
+
+	pomlog(POMLOG_DEBUG "Created lua replica %i for output %s", slot, o->name);
+
+	return r;
+}
+
+static void addon_output_replica_cleanup(struct addon_instance_priv *r) {
+
+	lua_getfield(r->L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
+	lua_getfield(r->L, -1, "close"); // Stack : self, close_func
+	lua_pushvalue(r->L, -2); // Stack : self, close_func, self
+	addon_pcall(r->L, 1, 0); // Stack : self
+	lua_pop(r->L, 1); // Stack : empty
+
+	// This will free the replica priv
+	lua_close(r->L);
+}
+
+static void addon_output_msg_push(lua_State *L, struct addon_msg *msg) {
+
+	switch (msg->type) {
+		case LUA_TBOOLEAN:
+			lua_pushboolean(L, msg->num);
+			break;
+		case LUA_TNUMBER:
+			lua_pushnumber(L, msg->num);
+			break;
+		case LUA_TSTRING:
+			lua_pushlstring(L, msg->str, msg->len);
+			break;
+		default:
+			lua_pushnil(L);
+			break;
+	}
+}
+
+// Deliver the pending messages to the receive() function of the main state
+static void addon_output_msg_deliver(struct addon_instance_priv *p) {
+
+	while (__atomic_load_n(&p->msg_head, __ATOMIC_ACQUIRE)) {
+
+		// Whoever holds the lock will deliver the messages when releasing it
+		if (pthread_mutex_trylock(&p->lock))
+			return;
+
+		while (1) {
+			pom_mutex_lock(&p->shared_lock);
+			struct addon_msg *msg = p->msg_head;
+			if (msg) {
+				__atomic_store_n(&p->msg_head, msg->next, __ATOMIC_RELEASE);
+				if (!msg->next)
+					p->msg_tail = NULL;
+			}
+			pom_mutex_unlock(&p->shared_lock);
+
+			if (!msg)
+				break;
+
+			lua_getfield(p->L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
+			lua_getfield(p->L, -1, "receive"); // Stack : self, receive_func
+			if (lua_isfunction(p->L, -1)) {
+				lua_pushvalue(p->L, -2); // Stack : self, receive_func, self
+				addon_output_msg_push(p->L, msg); // Stack : self, receive_func, self, msg
+				addon_pcall(p->L, 2, 0); // Stack : self
+				lua_pop(p->L, 1); // Stack : empty
+			} else {
+				lua_pop(p->L, 2); // Stack : empty
+			}
+
+			if (msg->str)
+				free(msg->str);
+			free(msg);
+		}
+
+		pom_mutex_unlock(&p->lock);
+	}
+}
+
+struct addon_instance_priv *addon_instance_lock(struct addon_instance_priv *p, int slot) {
+
+	if (!p->per_thread) {
+		pom_mutex_lock(&p->lock);
+		return p;
+	}
+
+	// Prevent the replicas from being cleaned up while in use
+	pom_rwlock_rlock(&p->replicas_lock);
+
+	if (slot == ADDON_SLOT_CURRENT) {
+		// Processing threads use the replica of their id, the other ones use the main state
+		slot = core_get_thread_id();
+
+		// Only this thread can create the replica of its slot
+		if (slot >= 0 && slot < ADDON_REPLICA_MAX && p->running && !p->replicas[slot]) {
+			struct addon_instance_priv *r = addon_output_replica_alloc(p, slot);
+			__atomic_store_n(&p->replicas[slot], r, __ATOMIC_RELEASE);
+		}
+	}
+
+	struct addon_instance_priv *r = NULL;
+	if (slot >= 0 && slot < ADDON_REPLICA_MAX)
+		r = __atomic_load_n(&p->replicas[slot], __ATOMIC_ACQUIRE);
+
+	// Use the main state if there is no replica
+	if (!r)
+		r = p;
+
+	pom_mutex_lock(&r->lock);
+
+	return r;
+}
+
+void addon_instance_unlock(struct addon_instance_priv *p, struct addon_instance_priv *r) {
+
+	pom_mutex_unlock(&r->lock);
+
+	if (p->per_thread)
+		pom_rwlock_unlock(&p->replicas_lock);
+
+	addon_output_msg_deliver(p);
+}
+
+// Check if the lua state belongs to an output processing in multiple threads
+int addon_output_is_per_thread(lua_State *L) {
+
+	int res = 0;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1); // Stack : empty
+		return 0;
+	}
+
+	lua_getfield(L, -1, "__priv"); // Stack : self, priv
+	struct addon_instance_priv *p = lua_touserdata(L, -1);
+	if (p && lua_getmetatable(L, -1)) { // Stack : self, priv, metatable
+		luaL_getmetatable(L, ADDON_OUTPUT_PRIV_METATABLE); // Stack : self, priv, metatable, output_metatable
+		if (lua_rawequal(L, -1, -2))
+			res = p->per_thread || p->main;
+		lua_pop(L, 2); // Stack : self, priv
+	}
+	lua_pop(L, 2); // Stack : empty
+
+	return res;
+}
+
 // Called from lua to listen to a new event from an instance
 static int addon_output_event_listen_start(lua_State *L) {
 	
@@ -109,19 +314,22 @@ static int addon_output_event_listen_start(lua_State *L) {
 	if (lua_isfunction(L, 4))
 		process_end = addon_event_process_end;
 
-	struct filter *filter = NULL;
-	if (!lua_isnoneornil(L, 5)) {
-		const char *filter_str = luaL_checkstring(L, 5);
-		filter = event_filter_compile((char*)filter_str, evt);
-		if (!filter)
-			luaL_error(L, "Error while parsing filter \"%s\"", filter_str);
-	}
-
 	// Get the output
 	struct addon_instance_priv *p = addon_output_get_priv(L, 1);
 
-	if (event_listener_register(evt, p, process_begin, process_end, filter) != POM_OK)
-		luaL_error(L, "Error while listening to event %s", evt_name);
+	// Replicas only need the processing functions
+	if (!p->main) {
+		struct filter *filter = NULL;
+		if (!lua_isnoneornil(L, 5)) {
+			const char *filter_str = luaL_checkstring(L, 5);
+			filter = event_filter_compile((char*)filter_str, evt);
+			if (!filter)
+				luaL_error(L, "Error while parsing filter \"%s\"", filter_str);
+		}
+
+		if (event_listener_register(evt, p, process_begin, process_end, filter) != POM_OK)
+			luaL_error(L, "Error while listening to event %s", evt_name);
+	}
 
 	// Add a table to self for the processing functions of this event
 	lua_newtable(L);
@@ -163,7 +371,7 @@ static int addon_output_event_listen_stop(lua_State *L) {
 	// Get the output
 	struct addon_instance_priv *p = addon_output_get_priv(L, 1);
 	
-	if (event_listener_unregister(evt, p) != POM_OK)
+	if (!p->main && event_listener_unregister(evt, p) != POM_OK)
 		luaL_error(L, "Error while unregistering event listener");
 
 	// Forget about listening to the event
@@ -177,21 +385,24 @@ static int addon_output_event_listen_stop(lua_State *L) {
 // Called from C to open a pload
 static int addon_output_pload_open(void *obj, void **priv, struct pload *pload) {
 
-	struct addon_instance_priv *p = obj;
+	struct addon_instance_priv *o = obj;
 
 	// Lock the output
-	pom_mutex_lock(&p->lock);
+	struct addon_instance_priv *p = addon_instance_lock(o, ADDON_SLOT_CURRENT);
 
 	lua_getfield(p->L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
 
 	struct addon_output_pload_priv *ppriv = malloc(sizeof(struct addon_output_pload_priv));
 	if (!ppriv) {
-		pom_mutex_unlock(&p->lock);
+		addon_instance_unlock(o, p);
 		pom_oom(sizeof(struct addon_output_pload_priv));
 		return POM_ERR;
 	}
 	memset(ppriv, 0, sizeof(struct addon_output_pload_priv));
 
+	// The payload will be processed by the same state until it's closed
+	ppriv->slot = p->slot;
+
 	*priv = ppriv;
 
 	// Get the __pload_listener table
@@ -202,7 +413,7 @@ static int addon_output_pload_open(void *obj, void **priv, struct pload *pload)
 
 	// Check if there is an open function
 	if (lua_isnil(p->L, -1)) {
-		pom_mutex_unlock(&p->lock);
+		addon_instance_unlock(o, p);
 		lua_pop(p->L, 3); // Stack : empty
 		return POM_OK;
 	}
@@ -246,7 +457,7 @@ static int addon_output_pload_open(void *obj, void **priv, struct pload *pload)
 
 	// Remove leftovers
 	lua_pop(p->L, 3); // Stack : empty
-	pom_mutex_unlock(&p->lock);
+	addon_instance_unlock(o, p);
 
 	return POM_OK;
 }
@@ -255,9 +466,9 @@ static int addon_output_pload_open(void *obj, void **priv, struct pload *pload)
 static int addon_output_pload_write(void *output_priv, void *pload_instance_priv, void *data, size_t len) {
 
 	struct addon_output_pload_priv *ppriv = pload_instance_priv;
-	struct addon_instance_priv *p = output_priv;
+	struct addon_instance_priv *o = output_priv;
 
-	pom_mutex_lock(&p->lock);
+	struct addon_instance_priv *p = addon_instance_lock(o, ppriv->slot);
 
 	// First process all the plugins attached to this pload
 	struct addon_output_pload_plugin *tmp;
@@ -281,7 +492,7 @@ static int addon_output_pload_write(void *output_priv, void *pload_instance_priv
 	// Check if there is a write function
 	if (lua_isnil(p->L, -1)) {
 		lua_pop(p->L, 3); // Stack : empty
-		pom_mutex_unlock(&p->lock);
+		addon_instance_unlock(o, p);
 		return POM_OK;
 	}
 
@@ -293,7 +504,7 @@ static int addon_output_pload_write(void *output_priv, void *pload_instance_priv
 	if (lua_isnil(p->L, -1)) {
 		// There is no pload_priv_table, payload doesn't need to be processed
 		lua_pop(p->L, 5); // Stack : empty
-		pom_mutex_unlock(&p->lock);
+		addon_instance_unlock(o, p);
 		return POM_OK;
 	}
 
@@ -301,7 +512,6 @@ static int addon_output_pload_write(void *output_priv, void *pload_instance_priv
 
 	// Update the pload_data
 	addon_pload_data_update(p->L, -1, data, len);
-	pom_mutex_unlock(&p->lock);
 
 	int res = addon_pcall(p->L, 3, 1); // Stack : self, __pload_listener, result
 
@@ -324,7 +534,7 @@ static int addon_output_pload_write(void *output_priv, void *pload_instance_priv
 
 	lua_pop(p->L, 3); // Stack : empty
 
-	pom_mutex_unlock(&p->lock);
+	addon_instance_unlock(o, p);
 
 	return POM_OK;
 }
@@ -333,11 +543,11 @@ static int addon_output_pload_write(void *output_priv, void *pload_instance_priv
 static int addon_output_pload_close(void *output_priv, void *pload_instance_priv) {
 
 	struct addon_output_pload_priv *ppriv = pload_instance_priv;
-	struct addon_instance_priv *p = output_priv;
+	struct addon_instance_priv *o = output_priv;
 	int res = POM_OK;
 
 
-	pom_mutex_lock(&p->lock);
+	struct addon_instance_priv *p = addon_instance_lock(o, ppriv->slot);
 
 	// Process all the plugins attached to this pload
 	struct addon_output_pload_plugin *tmp;
@@ -385,7 +595,7 @@ static int addon_output_pload_close(void *output_priv, void *pload_instance_priv
 
 cleanup:
 
-	pom_mutex_unlock(&p->lock);
+	addon_instance_unlock(o, p);
 
 	while (ppriv->plugins) {
 		tmp = ppriv->plugins;
@@ -426,17 +636,19 @@ static int addon_output_pload_listen_start(lua_State *L) {
 	if (!lua_isnil(L, -1))
 		luaL_error(L, "The output is already listening for payloads");
 
-	struct filter *filter = NULL;
+	if (!p->main) {
+		struct filter *filter = NULL;
 
-	if (!lua_isnoneornil(L, 5)) {
-		const char *filter_str = luaL_checkstring(L, 5);
-		filter = pload_filter_compile((char*)filter_str);
-		if (!filter)
-			luaL_error(L, "Error while parsing filter \"%s\"", filter_str);
-	}
+		if (!lua_isnoneornil(L, 5)) {
+			const char *filter_str = luaL_checkstring(L, 5);
+			filter = pload_filter_compile((char*)filter_str);
+			if (!filter)
+				luaL_error(L, "Error while parsing filter \"%s\"", filter_str);
+		}
 
-	if (pload_listen_start(p, NULL, filter, addon_output_pload_open, addon_output_pload_write, addon_output_pload_close) != POM_OK)
-		luaL_error(L, "Error while registering the payload listener");
+		if (pload_listen_start(p, NULL, filter, addon_output_pload_open, addon_output_pload_write, addon_output_pload_close) != POM_OK)
+			luaL_error(L, "Error while registering the payload listener");
+	}
 
 
 	// Create table to track pload listener functions
@@ -479,7 +691,7 @@ static int addon_output_pload_listen_stop(lua_State *L) {
 	if (lua_isnil(L, 1))
 		luaL_error(L, "The output is not listening for payloads");
 
-	if (pload_listen_stop(p, NULL) != POM_OK)
+	if (!p->main && pload_listen_stop(p, NULL) != POM_OK)
 		luaL_error(L, "Error while stopping payload listening");
 	
 	lua_pushnil(L); // Stack : instance, nil
@@ -493,6 +705,8 @@ static int addon_output_pload_listen_stop(lua_State *L) {
 static int addon_output_param_get(lua_State *L) {
 
 	struct addon_instance_priv *p = addon_output_get_priv(L, 1);
+	if (p->main)
+		p = p->main;
 
 	const char *name = luaL_checkstring(L, 2);
 
@@ -507,6 +721,141 @@ static int addon_output_param_get(lua_State *L) {
 	return 1;
 }
 
+// Find a counter shared by all the states of an output
+static struct addon_shared_counter *addon_output_counter_find(lua_State *L, struct addon_instance_priv *p, const char *name) {
+
+	// Look in the counters already used by this state
+	lua_getfield(L, LUA_REGISTRYINDEX, ADDON_OUTPUT_COUNTERS_TABLE); // Stack : counters
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1); // Stack : empty
+		lua_newtable(L); // Stack : counters
+		lua_pushvalue(L, -1); // Stack : counters, counters
+		lua_setfield(L, LUA_REGISTRYINDEX, ADDON_OUTPUT_COUNTERS_TABLE); // Stack : counters
+	}
+
+	lua_getfield(L, -1, name); // Stack : counters, counter
+	struct addon_shared_counter *c = lua_touserdata(L, -1);
+	lua_pop(L, 1); // Stack : counters
+
+	if (c) {
+		lua_pop(L, 1); // Stack : empty
+		return c;
+	}
+
+	pom_mutex_lock(&p->shared_lock);
+	for (c = p->counters; c && strcmp(c->name, name); c = c->next);
+	if (!c) {
+		c = malloc(sizeof(struct addon_shared_counter));
+		if (!c) {
+			pom_mutex_unlock(&p->shared_lock);
+			addon_oom(L, sizeof(struct addon_shared_counter));
+		}
+		memset(c, 0, sizeof(struct addon_shared_counter));
+		c->name = strdup(name);
+		if (!c->name) {
+			pom_mutex_unlock(&p->shared_lock);
+			free(c);
+			addon_oom(L, strlen(name) + 1);
+		}
+		c->next = p->counters;
+		p->counters = c;
+	}
+	pom_mutex_unlock(&p->shared_lock);
+
+	lua_pushlightuserdata(L, c); // Stack : counters, counter
+	lua_setfield(L, -2, name); // Stack : counters
+	lua_pop(L, 1); // Stack : empty
+
+	return c;
+}
+
+// Called from lua to increment a shared counter
+static int addon_output_counter_add(lua_State *L) {
+
+	// Args should be :
+	// 1) self
+	// 2) counter name
+	// 3) increment, 1 if not provided
+
+	struct addon_instance_priv *p = addon_output_get_priv(L, 1);
+	if (p->main)
+		p = p->main;
+
+	const char *name = luaL_checkstring(L, 2);
+	int64_t inc = luaL_optinteger(L, 3, 1);
+
+	struct addon_shared_counter *c = addon_output_counter_find(L, p, name);
+
+	lua_pushnumber(L, __sync_add_and_fetch(&c->value, inc));
+
+	return 1;
+}
+
+// Called from lua to get the value of a shared counter
+static int addon_output_counter_get(lua_State *L) {
+
+	struct addon_instance_priv *p = addon_output_get_priv(L, 1);
+	if (p->main)
+		p = p->main;
+
+	const char *name = luaL_checkstring(L, 2);
+
+	struct addon_shared_counter *c = addon_output_counter_find(L, p, name);
+
+	lua_pushnumber(L, __atomic_load_n(&c->value, __ATOMIC_RELAXED));
+
+	return 1;
+}
+
+// Called from lua to send a value to the receive() function of the main state
+static int addon_output_send(lua_State *L) {
+
+	// Args should be :
+	// 1) self
+	// 2) value to send
+
+	struct addon_instance_priv *p = addon_output_get_priv(L, 1);
+	if (p->main)
+		p = p->main;
+
+	luaL_checkany(L, 2);
+
+	int type = lua_type(L, 2);
+	if (type != LUA_TNIL && type != LUA_TBOOLEAN && type != LUA_TNUMBER && type != LUA_TSTRING)
+		luaL_error(L, "Only nil, booleans, numbers and strings can be sent");
+
+	struct addon_msg *msg = malloc(sizeof(struct addon_msg));
+	if (!msg)
+		addon_oom(L, sizeof(struct addon_msg));
+	memset(msg, 0, sizeof(struct addon_msg));
+	msg->type = type;
+
+	if (type == LUA_TBOOLEAN) {
+		msg->num = lua_toboolean(L, 2);
+	} else if (type == LUA_TNUMBER) {
+		msg->num = lua_tonumber(L, 2);
+	} else if (type == LUA_TSTRING) {
+		const char *str = lua_tolstring(L, 2, &msg->len);
+		msg->str = malloc(msg->len + 1);
+		if (!msg->str) {
+			free(msg);
+			addon_oom(L, msg->len + 1);
+		}
+		memcpy(msg->str, str, msg->len + 1);
+	}
+
+	pom_mutex_lock(&p->shared_lock);
+	if (p->msg_tail) {
+		p->msg_tail->next = msg;
+	} else {
+		__atomic_store_n(&p->msg_head, msg, __ATOMIC_RELEASE);
+	}
+	p->msg_tail = msg;
+	pom_mutex_unlock(&p->shared_lock);
+
+	return 0;
+}
+
 // Garbage collector function for an output parameter
 static int addon_output_priv_gc(lua_State *L) {
 	struct addon_instance_priv *priv = luaL_checkudata(L, 1, ADDON_OUTPUT_PRIV_METATABLE);
@@ -521,6 +870,31 @@ static int addon_output_priv_gc(lua_State *L) {
 
 	pthread_mutex_destroy(&priv->lock);
 
+	// The rest is only used by the main state
+	if (priv->main)
+		return 0;
+
+	while (priv->counters) {
+		struct addon_shared_counter *tmp = priv->counters;
+		priv->counters = tmp->next;
+		free(tmp->name);
+		free(tmp);
+	}
+
+	while (priv->msg_head) {
+		struct addon_msg *tmp = priv->msg_head;
+		priv->msg_head = tmp->next;
+		if (tmp->str)
+			free(tmp->str);
+		free(tmp);
+	}
+
+	if (priv->replicas)
+		free(priv->replicas);
+
+	pthread_mutex_destroy(&priv->shared_lock);
+	pthread_rwlock_destroy(&priv->replicas_lock);
+
 	return 0;
 }
 
@@ -550,6 +924,9 @@ int addon_output_lua_register(lua_State *L) {
 		{ "pload_listen_start", addon_output_pload_listen_start },
 		{ "pload_listen_stop", addon_output_pload_listen_stop },
 		{ "param_get", addon_output_param_get },
+		{ "counter_add", addon_output_counter_add },
+		{ "counter_get", addon_output_counter_get },
+		{ "send", addon_output_send },
 
 		{ 0 }
 	};
@@ -674,12 +1051,27 @@ int addon_output_init(struct output *o) {
 	o->priv = p;
 	p->instance = o;
 	p->L = L;
-	if (pthread_mutex_init(&p->lock, NULL)) {
+	p->slot = ADDON_SLOT_MAIN;
+	if (pthread_mutex_init(&p->lock, NULL) || pthread_mutex_init(&p->shared_lock, NULL) || pthread_rwlock_init(&p->replicas_lock, NULL)) {
 		pomlog(POMLOG_ERR "Error while initializing mutex : %s", pom_strerror(errno));
 		abort();
 		return POM_ERR;
 	}
 
+	lua_getfield(L, -2, "__per_thread"); // Stack : output, priv, per_thread
+	p->per_thread = lua_toboolean(L, -1);
+	lua_pop(L, 1); // Stack : output, priv
+
+	if (p->per_thread) {
+		size_t size = sizeof(struct addon_instance_priv *) * ADDON_REPLICA_MAX;
+		p->replicas = malloc(size);
+		if (!p->replicas) {
+			pom_oom(size);
+			return POM_ERR;
+		}
+		memset(p->replicas, 0, size);
+	}
+
 	// Assign the output_priv metatable
 	luaL_getmetatable(L, ADDON_OUTPUT_PRIV_METATABLE); // Stack : output, priv, metatable
 	lua_setmetatable(L, -2); // Stack : output, priv
@@ -800,6 +1192,13 @@ int addon_output_open(void *output_priv) {
 
 	struct addon_instance_priv *p = output_priv;
 
+	if (p->per_thread) {
+		// Replicas will be created by each thread when needed
+		pom_rwlock_wlock(&p->replicas_lock);
+		p->running = 1;
+		pom_rwlock_unlock(&p->replicas_lock);
+	}
+
 	pom_mutex_lock(&p->lock);
 
 	lua_getfield(p->L, LUA_REGISTRYINDEX, ADDON_INSTANCE); // Stack : self
@@ -814,6 +1213,8 @@ int addon_output_open(void *output_priv) {
 
 	pom_mutex_unlock(&p->lock);
 
+	addon_output_msg_deliver(p);
+
 	return res;
 }
 
@@ -832,6 +1233,22 @@ int addon_output_close(void *output_priv) {
 	lua_pop(p->L, 1); // Stack : empty
 	pom_mutex_unlock(&p->lock);
 
+	if (p->per_thread) {
+		// Wait for the replicas to be unused and close them
+		pom_rwlock_wlock(&p->replicas_lock);
+		p->running = 0;
+		int i;
+		for (i = 0; i < ADDON_REPLICA_MAX; i++) {
+			struct addon_instance_priv *r = p->replicas[i];
+			p->replicas[i] = NULL;
+			if (r && r != p)
+				addon_output_replica_cleanup(r);
+		}
+		pom_rwlock_unlock(&p->replicas_lock);
+	}
+
+	addon_output_msg_deliver(p);
+
 	return res;
 }
 
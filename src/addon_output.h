@@ -29,6 +29,7 @@
 #define ADDON_OUTPUT_METATABLE		"addon.output"
 #define ADDON_OUTPUT_PRIV_METATABLE	"addon.output_priv"
 #define ADDON_OUTPUT_REG_METATABLE	"addon.output_reg"
+#define ADDON_OUTPUT_COUNTERS_TABLE	"output_counters"
 
 struct addon_output {
 
@@ -51,6 +52,9 @@ struct addon_output_pload_priv {
 
 	void *plugin_priv;
 
+	// Slot of the state processing this payload
+	int slot;
+
 	// Used by pload plugins for this output
 	struct addon_output_pload_plugin *plugins;
 
@@ -64,6 +68,10 @@ int addon_output_cleanup(void *output_priv);
 int addon_output_open(void *output_priv);
 int addon_output_close(void *output_priv);
 
+struct addon_instance_priv *addon_instance_lock(struct addon_instance_priv *p, int slot);
+void addon_instance_unlock(struct addon_instance_priv *p, struct addon_instance_priv *r);
+int addon_output_is_per_thread(lua_State *L);
+
 struct addon_output_pload_plugin *addon_output_pload_plugin_alloc(struct addon_plugin_reg *addon_reg);
 
 #endif
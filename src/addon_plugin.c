@@ -32,6 +32,10 @@ struct addon_plugin_reg *addon_plugin_head = NULL;
 static int addon_plugin_new(lua_State *L) {
 
 	const char *name = luaL_checkstring(L, 1);
+
+	// Each replica would open its own instance of the plugin and listen to the same events
+	if (addon_output_is_per_thread(L))
+		luaL_error(L, "Plugin %s cannot be used from a per thread output", name);
 	
 	struct addon_plugin_reg *tmp;
 	for (tmp = addon_plugin_head; tmp && strcmp(tmp->name, name); tmp = tmp->next);
@@ -57,6 +61,9 @@ static int addon_plugin_open(lua_State *L) {
 
 	struct addon_plugin *a = luaL_checkudata(L, 1, ADDON_PLUGIN_METATABLE);
 
+	if (addon_output_is_per_thread(L))
+		luaL_error(L, "Plugin %s cannot be used from a per thread output", a->reg->name);
+
 	if (a->reg->open && a->reg->open(a->priv) != POM_OK)
 		luaL_error(L, "Error while opening plugin %s", a->reg->name);
 
@@ -105,6 +112,9 @@ static int addon_plugin_event_listen_start(lua_State *L) {
 	if (a->reg->type != addon_plugin_type_event)
 		luaL_error(L, "Plugin %s cannot listen to events", a->reg->name);
 
+	if (addon_output_is_per_thread(L))
+		luaL_error(L, "Plugin %s cannot be used from a per thread output", a->reg->name);
+
 	const char *evt_name = luaL_checkstring(L, 2);
 
 	struct event_reg *evt = event_find(evt_name);
@@ -36,6 +36,343 @@
 #define debug_conntrack(x ...)
 #endif
 
+static struct conntrack_reader *conntrack_readers = NULL;
+static pthread_mutex_t conntrack_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct conntrack_reader *conntrack_thread_reader = NULL;
+
+// Incremented each time something is retired
+static uint64_t conntrack_epoch = 1;
+
+static struct conntrack_reader *conntrack_reader_get() {
+
+	if (conntrack_thread_reader)
+		return conntrack_thread_reader;
+
+	pom_mutex_lock(&conntrack_readers_lock);
+
+	// Reuse the reader of a thread which went away
+	struct conntrack_reader *r;
+	for (r = conntrack_readers; r && r->in_use; r = r->next);
+
+	if (!r) {
+		r = malloc(sizeof(struct conntrack_reader));
+		if (!r) {
+			pom_mutex_unlock(&conntrack_readers_lock);
+			pom_oom(sizeof(struct conntrack_reader));
+			return NULL;
+		}
+		memset(r, 0, sizeof(struct conntrack_reader));
+		r->reclaim_at = CONNTRACK_RECLAIM_BATCH;
+
+		// Readers are never removed while running so the list can be browsed without locking
+		r->next = conntrack_readers;
+		__atomic_store_n(&conntrack_readers, r, __ATOMIC_RELEASE);
+	}
+
+	r->in_use = 1;
+
+	pom_mutex_unlock(&conntrack_readers_lock);
+
+	conntrack_thread_reader = r;
+
+	return r;
+}
+
+static inline void conntrack_read_lock(struct conntrack_reader *r) {
+
+	r->epoch = __atomic_load_n(&conntrack_epoch, __ATOMIC_ACQUIRE);
+	// Make sure the epoch is visible before reading the tables
+	__sync_synchronize();
+}
+
+static inline void conntrack_read_unlock(struct conntrack_reader *r) {
+
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+static void conntrack_release(struct conntrack_entry *ce) {
+
+	if (ce->parent)
+		free(ce->parent);
+
+	if (ce->fwd_value)
+		ptype_cleanup(ce->fwd_value);
+	if (ce->rev_value)
+		ptype_cleanup(ce->rev_value);
+
+	pthread_mutex_destroy(&ce->lock);
+
+	free(ce);
+}
+
+static void conntrack_reclaim(struct conntrack_reader *self) {
+
+	// Find the oldest read section still running
+	uint64_t oldest = UINT64_MAX;
+	struct conntrack_reader *r;
+	for (r = __atomic_load_n(&conntrack_readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+		uint64_t epoch = r->epoch;
+		if (epoch && epoch < oldest)
+			oldest = epoch;
+	}
+
+	// Release everything that was retired before it started
+	struct conntrack_entry **ce_ref = &self->retired;
+	while (*ce_ref) {
+		struct conntrack_entry *ce = *ce_ref;
+		if (ce->retired_epoch < oldest) {
+			*ce_ref = ce->retired_next;
+			conntrack_release(ce);
+			self->retired_count--;
+		} else {
+			ce_ref = &ce->retired_next;
+		}
+	}
+
+	struct conntrack_buckets **b_ref = &self->retired_buckets;
+	while (*b_ref) {
+		struct conntrack_buckets *b = *b_ref;
+		if (b->retired_epoch < oldest) {
+			*b_ref = b->retired_next;
+			free(b);
+		} else {
+			b_ref = &b->retired_next;
+		}
+	}
+
+	self->reclaim_at = self->retired_count + CONNTRACK_RECLAIM_BATCH;
+}
+
+// Release the conntrack once no thread can be reading it anymore
+static void conntrack_retire(struct conntrack_entry *ce) {
+
+	struct conntrack_reader *r = conntrack_reader_get();
+	if (!r)
+		return;
+
+	ce->retired_epoch = __sync_fetch_and_add(&conntrack_epoch, 1);
+	ce->retired_next = r->retired;
+	r->retired = ce;
+
+	if (++r->retired_count >= r->reclaim_at)
+		conntrack_reclaim(r);
+}
+
+static void conntrack_retire_buckets(struct conntrack_buckets *b) {
+
+	struct conntrack_reader *r = conntrack_reader_get();
+	if (!r)
+		return;
+
+	b->retired_epoch = __sync_fetch_and_add(&conntrack_epoch, 1);
+	b->retired_next = r->retired_buckets;
+	r->retired_buckets = b;
+}
+
+void conntrack_thread_cleanup() {
+
+	struct conntrack_reader *r = conntrack_thread_reader;
+	if (!r)
+		return;
+
+	conntrack_reclaim(r);
+
+	// Whatever is left will be released by the next thread using this reader
+	pom_mutex_lock(&conntrack_readers_lock);
+	r->in_use = 0;
+	pom_mutex_unlock(&conntrack_readers_lock);
+
+	conntrack_thread_reader = NULL;
+}
+
+void conntrack_readers_cleanup() {
+
+	// No thread is reading the tables anymore
+	while (conntrack_readers) {
+		struct conntrack_reader *r = conntrack_readers;
+		conntrack_readers = r->next;
+
+		while (r->retired) {
+			struct conntrack_entry *ce = r->retired;
+			r->retired = ce->retired_next;
+			conntrack_release(ce);
+		}
+
+		while (r->retired_buckets) {
+			struct conntrack_buckets *b = r->retired_buckets;
+			r->retired_buckets = b->retired_next;
+			free(b);
+		}
+
+		free(r);
+	}
+
+	conntrack_thread_reader = NULL;
+}
+
+static struct conntrack_buckets *conntrack_buckets_alloc(size_t size) {
+
+	size_t len = sizeof(struct conntrack_buckets) + (sizeof(struct conntrack_entry *) * size);
+	struct conntrack_buckets *b = malloc(len);
+	if (!b) {
+		pom_oom(len);
+		return NULL;
+	}
+	memset(b, 0, len);
+	b->size = size;
+
+	return b;
+}
+
+static inline struct conntrack_entry **conntrack_bucket(struct conntrack_buckets *b, uint32_t hash) {
+
+	return &b->table[hash & (b->size - 1)];
+}
+
+static inline pthread_mutex_t *conntrack_table_lock(struct conntrack_tables *ct, uint32_t hash) {
+
+	// The table is never smaller than the number of locks so each bucket has a single lock
+	return &ct->locks[hash & ct->lock_mask];
+}
+
+static void conntrack_table_lock_all(struct conntrack_tables *ct) {
+
+	unsigned int i;
+	for (i = 0; i <= ct->lock_mask; i++)
+		pom_mutex_lock(&ct->locks[i]);
+}
+
+static void conntrack_table_unlock_all(struct conntrack_tables *ct) {
+
+	unsigned int i;
+	for (i = 0; i <= ct->lock_mask; i++)
+		pom_mutex_unlock(&ct->locks[i]);
+}
+
+// Must be called with the hash locked
+static void conntrack_table_insert(struct conntrack_tables *ct, struct conntrack_entry *ce) {
+
+	struct conntrack_entry **head = conntrack_bucket(ct->buckets, ce->hash);
+	ce->next = *head;
+	__atomic_store_n(head, ce, __ATOMIC_RELEASE);
+	__sync_fetch_and_add(&ct->count, 1);
+}
+
+// Find the link to the conntrack, must be called with the hash locked
+static struct conntrack_entry **conntrack_table_find_ref(struct conntrack_tables *ct, uint32_t hash, struct conntrack_entry *ce) {
+
+	struct conntrack_entry **ref;
+	for (ref = conntrack_bucket(ct->buckets, hash); *ref; ref = &(*ref)->next) {
+		if (*ref == ce)
+			return ref;
+	}
+
+	if (!ct->old)
+		return NULL;
+
+	for (ref = conntrack_bucket(ct->old, hash); *ref; ref = &(*ref)->next) {
+		if (*ref == ce)
+			return ref;
+	}
+
+	return NULL;
+}
+
+// Must be called with the hash locked, the conntrack's next pointer is kept for the readers
+static void conntrack_table_remove(struct conntrack_tables *ct, struct conntrack_entry **ref, struct conntrack_entry *ce) {
+
+	__atomic_store_n(ref, ce->next, __ATOMIC_RELEASE);
+	__sync_fetch_and_sub(&ct->count, 1);
+}
+
+static void conntrack_table_rehash(struct conntrack_tables *ct) {
+
+	if (pthread_mutex_trylock(&ct->rehash_lock))
+		return;
+
+	struct conntrack_buckets *old = ct->old, *cur = ct->buckets;
+	if (!old) {
+		pom_mutex_unlock(&ct->rehash_lock);
+		return;
+	}
+
+	unsigned int i;
+	for (i = 0; i < CONNTRACK_REHASH_STEP && ct->rehash_pos < old->size; i++, ct->rehash_pos++) {
+
+		pthread_mutex_t *lock = conntrack_table_lock(ct, ct->rehash_pos);
+		pom_mutex_lock(lock);
+
+		struct conntrack_entry *ce = old->table[ct->rehash_pos];
+		while (ce) {
+			struct conntrack_entry *next = ce->next;
+			struct conntrack_entry **head = conntrack_bucket(cur, ce->hash);
+			// Readers still walking the old bucket will end up in the new one
+			__atomic_store_n(&ce->next, *head, __ATOMIC_RELEASE);
+			__atomic_store_n(head, ce, __ATOMIC_RELEASE);
+			ce = next;
+		}
+		old->table[ct->rehash_pos] = NULL;
+
+		pom_mutex_unlock(lock);
+	}
+
+	if (ct->rehash_pos >= old->size) {
+		conntrack_table_lock_all(ct);
+		ct->old = NULL;
+		conntrack_table_unlock_all(ct);
+		conntrack_retire_buckets(old);
+		debug_conntrack("Conntrack table %p rehashed to %zu buckets", ct, cur->size);
+	}
+
+	pom_mutex_unlock(&ct->rehash_lock);
+}
+
+// Grow or shrink the table depending on its load, the buckets are then moved incrementally
+static void conntrack_table_update(struct conntrack_tables *ct) {
+
+	if (ct->old) {
+		conntrack_table_rehash(ct);
+		return;
+	}
+
+	size_t size = ct->size, new_size;
+	unsigned int count = ct->count;
+
+	if (count > size * CONNTRACK_TABLE_LOAD_MAX && size < CONNTRACK_TABLE_MAX_SIZE)
+		new_size = size << 1;
+	else if (count < size / CONNTRACK_TABLE_LOAD_MIN && size > ct->min_size)
+		new_size = size >> 1;
+	else
+		return;
+
+	if (pthread_mutex_trylock(&ct->rehash_lock))
+		return;
+
+	if (ct->old || ct->size != size) {
+		// Someone else did it already
+		pom_mutex_unlock(&ct->rehash_lock);
+		return;
+	}
+
+	struct conntrack_buckets *b = conntrack_buckets_alloc(new_size);
+	if (!b) {
+		pom_mutex_unlock(&ct->rehash_lock);
+		return;
+	}
+
+	// New conntracks will go in the new buckets from now on
+	conntrack_table_lock_all(ct);
+	ct->old = ct->buckets;
+	ct->rehash_pos = 0;
+	__atomic_store_n(&ct->buckets, b, __ATOMIC_RELEASE);
+	ct->size = new_size;
+	conntrack_table_unlock_all(ct);
+
+	pom_mutex_unlock(&ct->rehash_lock);
+
+	debug_conntrack("Resizing conntrack table %p from %zu to %zu buckets", ct, size, new_size);
+}
+
 struct conntrack_tables* conntrack_table_alloc(size_t table_size, int has_rev) {
 
 	struct conntrack_tables *ct = malloc(sizeof(struct conntrack_tables));
@@ -45,33 +382,47 @@ struct conntrack_tables* conntrack_table_alloc(size_t table_size, int has_rev) {
 	}
 	memset(ct, 0, sizeof(struct conntrack_tables));
 
+	int res = pthread_mutex_init(&ct->rehash_lock, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Could not initialize the conntrack rehash lock : %s", pom_strerror(res));
+		free(ct);
+		return NULL;
+	}
+
+	// Buckets are addressed with a mask
+	size_t size = 1;
+	while (size < table_size && size < CONNTRACK_TABLE_MAX_SIZE)
+		size <<= 1;
 
-	size_t size = sizeof(struct conntrack_list) * table_size;
-	ct->table = malloc(size);
-	if (!ct->table) {
-		pom_oom(size);
+	ct->buckets = conntrack_buckets_alloc(size);
+	if (!ct->buckets)
 		goto err;
-	}
-	memset(ct->table, 0, size);
+	ct->size = size;
+	ct->min_size = size;
 
-	size = sizeof(pthread_mutex_t) *table_size;
-	ct->locks = malloc(size);
+	unsigned int lock_count = (size < CONNTRACK_LOCK_STRIPES ? size : CONNTRACK_LOCK_STRIPES);
+	size_t locks_size = sizeof(pthread_mutex_t) * lock_count;
+	ct->locks = malloc(locks_size);
 	if (!ct->locks) {
-		pom_oom(size);
+		pom_oom(locks_size);
 		goto err;
 
 	}
 
 	unsigned int i;
 
-	for (i = 0; i < table_size; i++) {
-		int res = pthread_mutex_init(&ct->locks[i], NULL);
+	for (i = 0; i < lock_count; i++) {
+		res = pthread_mutex_init(&ct->locks[i], NULL);
 		if (res) {
 			pomlog(POMLOG_ERR "Could not initialize conntrack hash lock : %s", pom_strerror(res));
+			while (i--)
+				pthread_mutex_destroy(&ct->locks[i]);
+			free(ct->locks);
+			ct->locks = NULL;
 			goto err;
 		}
 	}
-	ct->table_size = table_size;
+	ct->lock_mask = lock_count - 1;
 
 	return ct;
 
@@ -83,17 +434,24 @@ err:
 
 int conntrack_table_empty(struct conntrack_tables *ct) {
 
-	if (!ct || !ct->table)
+	if (!ct || !ct->buckets)
 		return POM_ERR;
 
-	unsigned int i;
-	for (i = 0; i < ct->table_size; i++) {
-		while (ct->table[i]) {
-			struct conntrack_list *tmp = ct->table[i];
-			conntrack_cleanup(ct, tmp->ce->hash, tmp->ce);
+	// Finish moving the buckets first
+	while (ct->old)
+		conntrack_table_rehash(ct);
+
+	size_t i;
+	for (i = 0; i < ct->buckets->size; i++) {
+		while (ct->buckets->table[i]) {
+			struct conntrack_entry *ce = ct->buckets->table[i];
+			conntrack_cleanup(ct, ce->hash, ce);
 		}
 	}
 
+	if (conntrack_thread_reader)
+		conntrack_reclaim(conntrack_thread_reader);
+
 	return POM_OK;
 }
 
@@ -103,14 +461,14 @@ int conntrack_table_cleanup(struct conntrack_tables *ct) {
 		return POM_OK;
 
 
-	if (ct->table) {
+	if (ct->buckets) {
 		conntrack_table_empty(ct);
-		free(ct->table);
+		free(ct->buckets);
 	}
 
 	if (ct->locks) {
 		unsigned int i;
-		for (i = 0; i < ct->table_size; i++) {
+		for (i = 0; i <= ct->lock_mask; i++) {
 			int res = pthread_mutex_destroy(&ct->locks[i]);
 			if (res) {
 				pomlog(POMLOG_WARN "Error while destroying a hash lock : %s", pom_strerror(errno));
@@ -119,6 +477,7 @@ int conntrack_table_cleanup(struct conntrack_tables *ct) {
 		free(ct->locks);
 	}
 
+	pthread_mutex_destroy(&ct->rehash_lock);
 
 	free(ct);
 
@@ -169,14 +528,45 @@ uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent) {
 }
 
 
-struct conntrack_entry *conntrack_find(struct conntrack_list *lst, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent) {
+static inline void conntrack_key_init(struct conntrack_key *key, unsigned int key_size, struct ptype *fwd_value, struct ptype *rev_value, void *parent) {
+
+	memset(key, 0, sizeof(struct conntrack_key));
+	memcpy(key->fwd, fwd_value->value, key_size);
+	if (rev_value)
+		memcpy(key->rev, rev_value->value, key_size);
+	key->parent = parent;
+}
+
+static inline uint32_t conntrack_key_hash(struct conntrack_key *key, unsigned int key_size) {
+
+	// Use the parent pointer as an init value
+	uint32_t hash = (uint32_t) ((uint64_t)key->parent & 0xFFFFFFFF);
+
+	// Combine both directions first so the hash is the same for both of them
+	unsigned int i, words = (key_size + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+	for (i = 0; i < words; i++)
+		hash = jhash_2words(key->fwd[i] + key->rev[i], key->fwd[i] ^ key->rev[i], hash);
+
+	return hash;
+}
+
+static inline struct conntrack_entry *conntrack_find_key(struct conntrack_entry *ce, struct conntrack_key *key) {
+
+	for (; ce; ce = __atomic_load_n(&ce->next, __ATOMIC_ACQUIRE)) {
+		if (!memcmp(&ce->key, key, sizeof(struct conntrack_key)))
+			return ce;
+	}
+
+	return NULL;
+}
+
+struct conntrack_entry *conntrack_find(struct conntrack_entry *ce, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent) {
 
 	if (!fwd_value)
 		return NULL;
 
 
-	for (; lst; lst = lst->next) {
-		struct conntrack_entry *ce = lst->ce;
+	for (; ce; ce = __atomic_load_n(&ce->next, __ATOMIC_ACQUIRE)) {
 
 		// Check the parent conntrack
 		if (ce->parent && ce->parent->ce != parent)
@@ -209,6 +599,47 @@ struct conntrack_entry *conntrack_find(struct conntrack_list *lst, struct ptype
 	return NULL;
 }
 
+// Look in both directions, either with the hash locked or within a read section
+// The packed keys are used instead of the values when provided
+static struct conntrack_entry *conntrack_table_lookup(struct conntrack_tables *ct, uint32_t hash, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_key *key, struct conntrack_key *rev_key, struct conntrack_entry *parent, int *dir) {
+
+	struct conntrack_buckets *b[2];
+	b[0] = __atomic_load_n(&ct->buckets, __ATOMIC_ACQUIRE);
+	b[1] = __atomic_load_n(&ct->old, __ATOMIC_ACQUIRE);
+
+	unsigned int i;
+	for (i = 0; i < 2 && b[i]; i++) {
+
+		struct conntrack_entry *head = __atomic_load_n(conntrack_bucket(b[i], hash), __ATOMIC_ACQUIRE);
+		if (!head)
+			continue;
+
+		struct conntrack_entry *ce = NULL;
+		if (key)
+			ce = conntrack_find_key(head, key);
+		else
+			ce = conntrack_find(head, fwd_value, rev_value, parent);
+		if (ce) {
+			*dir = POM_DIR_FWD;
+			return ce;
+		}
+
+		// It wasn't found in the forward way, maybe in the reverse direction ?
+		if (rev_value) {
+			if (key)
+				ce = conntrack_find_key(head, rev_key);
+			else
+				ce = conntrack_find(head, rev_value, fwd_value, parent);
+			if (ce) {
+				*dir = POM_DIR_REV;
+				return ce;
+			}
+		}
+	}
+
+	return NULL;
+}
+
 int conntrack_get_unique(struct proto_process_stack *stack, unsigned int stack_index) {
 
 	struct proto_process_stack *s = &stack[stack_index];
@@ -229,23 +660,22 @@ int conntrack_get_unique(struct proto_process_stack *stack, unsigned int stack_i
 	}
 
 	struct conntrack_tables *ct = s->proto->ct;
-	pom_mutex_lock(&ct->locks[0]);
+	pom_mutex_lock(conntrack_table_lock(ct, 0));
 
-	struct conntrack_list *lst = ct->table[0];
+	struct conntrack_entry *ce;
+	for (ce = *conntrack_bucket(ct->buckets, 0); ce && ce->parent; ce = ce->next);
 
-	for (lst = ct->table[0]; lst && lst->ce->parent; lst = lst->next);
-
-	if (lst) {
+	if (ce) {
 		// Conntrack found
-		s->ce = lst->ce;
-		pom_mutex_unlock(&ct->locks[0]);
+		s->ce = ce;
+		pom_mutex_unlock(conntrack_table_lock(ct, 0));
 	} else {
 		// Alloc the conntrack
 		struct conntrack_entry *res = NULL;
 		res = malloc(sizeof(struct conntrack_entry));
 		if (!res) {
 			pom_oom(sizeof(struct conntrack_entry));
-			pom_mutex_unlock(&ct->locks[0]);
+			pom_mutex_unlock(conntrack_table_lock(ct, 0));
 			return POM_ERR;
 		}
 
@@ -253,29 +683,14 @@ int conntrack_get_unique(struct proto_process_stack *stack, unsigned int stack_i
 		res->proto = s->proto;
 
 		if (pom_mutex_init_type(&res->lock, PTHREAD_MUTEX_ERRORCHECK) != POM_OK) {
-			pom_mutex_unlock(&ct->locks[0]);
-			free(res);
-			return POM_ERR;
-		}
-
-		// Alloc the list node
-		lst = malloc(sizeof(struct conntrack_list));
-		if (!lst) {
-			pom_oom(sizeof(struct conntrack_list));
-			pom_mutex_unlock(&ct->locks[0]);
-			pthread_mutex_destroy(&res->lock);
+			pom_mutex_unlock(conntrack_table_lock(ct, 0));
 			free(res);
 			return POM_ERR;
 		}
-		memset(lst, 0, sizeof(struct conntrack_list));
-		lst->ce = res;
 
 		// Add the conntrack to the table
-		lst->next = ct->table[0];
-		if (lst->next)
-			lst->next->prev = lst;
-		ct->table[0] = lst;
-		pom_mutex_unlock(&ct->locks[0]);
+		conntrack_table_insert(ct, res);
+		pom_mutex_unlock(conntrack_table_lock(ct, 0));
 		debug_conntrack("Allocated unique conntrack %p", res);
 
 		registry_perf_inc(s->proto->perf_conn_cur, 1);
@@ -296,7 +711,6 @@ int conntrack_get_unique(struct proto_process_stack *stack, unsigned int stack_i
 int conntrack_get_unique_from_parent(struct proto_process_stack *stack, unsigned int stack_index) {
 
 	struct conntrack_node_list *child = NULL;
-	struct conntrack_list *lst = NULL;
 
 	struct proto_process_stack *s = &stack[stack_index];
 	struct proto_process_stack *s_prev = &stack[stack_index - 1];
@@ -373,15 +787,6 @@ int conntrack_get_unique_from_parent(struct proto_process_stack *stack, unsigned
 		res->parent->ct = parent->proto->ct;
 		res->parent->hash = parent->hash;
 
-		// Alloc the list node
-		lst = malloc(sizeof(struct conntrack_list));
-		if (!lst) {
-			pom_oom(sizeof(struct conntrack_list));
-			goto err;
-		}
-		memset(lst, 0, sizeof(struct conntrack_list));
-		lst->ce = res;
-
 		// Add the child to the parent
 		child->next = parent->children;
 		if (child->next)
@@ -389,12 +794,9 @@ int conntrack_get_unique_from_parent(struct proto_process_stack *stack, unsigned
 		parent->children = child;
 
 		// Add the conntrack to the table
-		pom_mutex_lock(&ct->locks[0]);
-		lst->next = ct->table[0];
-		if (lst->next)
-			lst->next->prev = lst;
-		ct->table[0] = lst;
-		pom_mutex_unlock(&ct->locks[0]);
+		pom_mutex_lock(conntrack_table_lock(ct, 0));
+		conntrack_table_insert(ct, res);
+		pom_mutex_unlock(conntrack_table_lock(ct, 0));
 		debug_conntrack("Allocated conntrack %p with parent %p (uniq child)", res, parent);
 
 		registry_perf_inc(s->proto->perf_conn_cur, 1);
@@ -454,47 +856,70 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 
 	struct conntrack_tables *ct = s->proto->ct;
 
-	uint32_t hash = conntrack_hash(fwd_value, rev_value, s_prev->ce) % ct->table_size;
-
-	// Lock the specific hash while browsing for a conntrack
-	pom_mutex_lock(&ct->locks[hash]);
-
-	// Try to find the conntrack in the forward table
+	// Pack the values when they have a fixed size to avoid comparing the ptypes
+	unsigned int key_size = s->proto->info->ct_info->key_size;
+	struct conntrack_key key_buff, rev_key_buff, *key = NULL, *rev_key = NULL;
+	uint32_t hash;
+	if (key_size) {
+		key = &key_buff;
+		conntrack_key_init(key, key_size, fwd_value, rev_value, s_prev->ce);
+		if (rev_value) {
+			rev_key = &rev_key_buff;
+			conntrack_key_init(rev_key, key_size, rev_value, fwd_value, s_prev->ce);
+		}
+		hash = conntrack_key_hash(key, key_size);
+	} else {
+		hash = conntrack_hash(fwd_value, rev_value, s_prev->ce);
+	}
 
-	// Check if we can find this entry in the forward way
-	if (ct->table[hash]) {
-		s->ce = conntrack_find(ct->table[hash], fwd_value, rev_value, s_prev->ce);
-		if (s->ce) {
-			int dir = POM_DIR_FWD;
+	struct conntrack_reader *r = conntrack_reader_get();
+	if (!r)
+		return POM_ERR;
 
-			if (fwd_value && rev_value && ptype_compare_val(PTYPE_OP_EQ, fwd_value, rev_value)) {
-				// The conntrack could match in both direction
-				// Use the previous stack for the direction
-				dir = s_prev->direction;
-			}
+	// Resize or move some buckets now, the stripe locks must never be taken while holding a conntrack lock
+	conntrack_table_update(ct);
 
-			s->direction = dir;
-			s_next->direction = dir;
-			pom_mutex_lock(&s->ce->lock);
+	// Look for the conntrack without locking the table first
+	int dir = POM_DIR_FWD;
+	conntrack_read_lock(r);
+	s->ce = conntrack_table_lookup(ct, hash, fwd_value, rev_value, key, rev_key, s_prev->ce, &dir);
+	if (s->ce) {
+		pom_mutex_lock(&s->ce->lock);
+		if (s->ce->cleanup_timer == (void *) -1) {
+			// It was removed from the table in the meantime
+			pom_mutex_unlock(&s->ce->lock);
+			s->ce = NULL;
+		} else {
 			__sync_fetch_and_add(&s->ce->refcount, 1);
-			pom_mutex_unlock(&ct->locks[hash]);
-			return POM_OK;;
 		}
 	}
+	conntrack_read_unlock(r);
 
+	pthread_mutex_t *lock = conntrack_table_lock(ct, hash);
 
-	// It wasn't found in the forward way, maybe in the reverse direction ?
-	if (rev_value) {
-		s->ce = conntrack_find(ct->table[hash], rev_value, fwd_value, s_prev->ce);
+	if (!s->ce) {
+		// Lock the specific hash and look again before creating it
+		pom_mutex_lock(lock);
+		s->ce = conntrack_table_lookup(ct, hash, fwd_value, rev_value, key, rev_key, s_prev->ce, &dir);
 		if (s->ce) {
-			s->direction = POM_DIR_REV;
-			s_next->direction = POM_DIR_REV;
 			pom_mutex_lock(&s->ce->lock);
 			__sync_fetch_and_add(&s->ce->refcount, 1);
-			pom_mutex_unlock(&ct->locks[hash]);
-			return POM_OK;
+			pom_mutex_unlock(lock);
 		}
+	}
 
+	if (s->ce) {
+
+		if (dir == POM_DIR_FWD && rev_value && ptype_compare_val(PTYPE_OP_EQ, fwd_value, rev_value)) {
+			// The conntrack could match in both direction
+			// Use the previous stack for the direction
+			dir = s_prev->direction;
+		}
+
+		s->direction = dir;
+		s_next->direction = dir;
+
+		return POM_OK;
 	}
 
 	// It's not found in the reverse direction either, let's create it then
@@ -511,14 +936,14 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 	// Alloc the conntrack entry
 	struct conntrack_entry *ce = malloc(sizeof(struct conntrack_entry));
 	if (!ce) {
-		pom_mutex_unlock(&ct->locks[hash]);
+		pom_mutex_unlock(lock);
 		pom_oom(sizeof(struct conntrack_entry));
 		return POM_ERR;
 	}
 	memset(ce, 0, sizeof(struct conntrack_entry));
 
 	if (pom_mutex_init_type(&ce->lock, PTHREAD_MUTEX_ERRORCHECK) != POM_OK) {
-		pom_mutex_unlock(&ct->locks[hash]);
+		pom_mutex_unlock(lock);
 		free(ce);
 		return POM_ERR;
 	}
@@ -534,7 +959,7 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 		child = malloc(sizeof(struct conntrack_node_list));
 		if (!child) {
 			pthread_mutex_destroy(&ce->lock);
-			pom_mutex_unlock(&ct->locks[hash]);
+			pom_mutex_unlock(lock);
 			free(ce);
 			pom_oom(sizeof(struct conntrack_node_list));
 			return POM_ERR;
@@ -548,7 +973,7 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 		ce->parent = malloc(sizeof(struct conntrack_node_list));
 		if (!ce->parent) {
 			pthread_mutex_destroy(&ce->lock);
-			pom_mutex_unlock(&ct->locks[hash]);
+			pom_mutex_unlock(lock);
 			free(child);
 			free(ce);
 			pom_oom(sizeof(struct conntrack_node_list));
@@ -564,7 +989,13 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 
 	ce->hash = hash;
 
-	struct conntrack_list *lst = NULL;
+	if (key_size) {
+		if (key_size > CONNTRACK_KEY_MAX_SIZE || ptype_get_value_size(fwd_value) != key_size || (rev_value && ptype_get_value_size(rev_value) != key_size)) {
+			pomlog(POMLOG_ERR "Conntrack values of proto %s do not match its key size", s->proto->info->name);
+			goto err;
+		}
+		conntrack_key_init(&ce->key, key_size, fwd_value, rev_value, s_prev->ce);
+	}
 
 	ce->fwd_value = ptype_alloc_from(fwd_value);
 	if (!ce->fwd_value)
@@ -575,22 +1006,10 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 		if (!ce->rev_value)
 			goto err;
 	}
-	// Alloc the list node
-	lst = malloc(sizeof(struct conntrack_list));
-	if (!lst) {
-		pom_oom(sizeof(struct conntrack_list));
-		goto err;
-	}
-	memset(lst, 0, sizeof(struct conntrack_list));
-	lst->ce = ce;
-
 	// Insert in the conntrack table
-	lst->next = ct->table[hash];
-	if (lst->next) {
-		lst->next->prev = lst;
+	if (*conntrack_bucket(ct->buckets, hash))
 		registry_perf_inc(s->proto->perf_conn_hash_col, 1);
-	}
-	ct->table[hash] = lst;
+	conntrack_table_insert(ct, ce);
 
 	// Add the child to the parent if any
 	if (child) {
@@ -612,7 +1031,7 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 	}
 	pom_mutex_lock(&ce->lock);
 	__sync_fetch_and_add(&ce->refcount, 1);
-	pom_mutex_unlock(&ct->locks[hash]);
+	pom_mutex_unlock(lock);
 
 	s->ce = ce;
 	s->direction = s_prev->direction;
@@ -626,7 +1045,7 @@ int conntrack_get(struct proto_process_stack *stack, unsigned int stack_index) {
 	return POM_OK;
 
 err:
-	pom_mutex_unlock(&ct->locks[hash]);
+	pom_mutex_unlock(lock);
 
 	pthread_mutex_destroy(&ce->lock);
 	if (child)
@@ -770,15 +1189,14 @@ int conntrack_timed_cleanup(void *timer, ptime now) {
 int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntrack_entry *ce) {
 
 	// Remove the conntrack from the conntrack table
-	pom_mutex_lock(&ct->locks[hash]);
+	pthread_mutex_t *lock = conntrack_table_lock(ct, hash);
+	pom_mutex_lock(lock);
 
 	// Try to find the conntrack in the list
-	struct conntrack_list *lst = NULL;
+	struct conntrack_entry **ref = conntrack_table_find_ref(ct, hash, ce);
 
-	for (lst = ct->table[hash]; lst && lst->ce != ce; lst = lst->next);
-
-	if (!lst) {
-		pom_mutex_unlock(&ct->locks[hash]);
+	if (!ref) {
+		pom_mutex_unlock(lock);
 		pomlog(POMLOG_ERR "Trying to cleanup a non existing conntrack : %p", ce);
 		return POM_OK;
 	}
@@ -788,27 +1206,19 @@ int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntra
 		debug_conntrack(POMLOG_ERR "Conntrack %p is still being referenced : %u !", ce, ce->refcount);
 		conntrack_delayed_cleanup(ce, 1, core_get_clock_last());
 		conntrack_unlock(ce);
-		pom_mutex_unlock(&ct->locks[hash]);
+		pom_mutex_unlock(lock);
 		return POM_OK;
 	}
 
+	conntrack_table_remove(ct, ref, ce);
 
-	if (lst->prev)
-		lst->prev->next = lst->next;
-	else
-		ct->table[hash] = lst->next;
-
-	if (lst->next)
-		lst->next->prev = lst->prev;
-
-	free(lst);
-
-	pom_mutex_unlock(&ct->locks[hash]);
+	pom_mutex_unlock(lock);
 
-	if (ce->cleanup_timer && ce->cleanup_timer != (void *) -1) {
+	if (ce->cleanup_timer && ce->cleanup_timer != (void *) -1)
 		conntrack_timer_cleanup(ce->cleanup_timer);
-		ce->cleanup_timer = (void *) -1; // Mark that the conntrack is being cleaned up
-	}
+
+	// Mark that the conntrack is being cleaned up, lockless lookups will skip it
+	ce->cleanup_timer = (void *) -1;
 
 	// Once the conntrack is removed from the hash table, it will not be referenced ever again
 	conntrack_unlock(ce);
@@ -825,11 +1235,10 @@ int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntra
 		
 		// Make sure the parent still exists
 		uint32_t hash = ce->parent->hash;
-		pom_mutex_lock(&ce->parent->ct->locks[hash]);
-		
-		for (lst = ce->parent->ct->table[hash]; lst && lst->ce != ce->parent->ce; lst = lst->next);
+		pthread_mutex_t *parent_lock = conntrack_table_lock(ce->parent->ct, hash);
+		pom_mutex_lock(parent_lock);
 
-		if (lst) {
+		if (conntrack_table_find_ref(ce->parent->ct, hash, ce->parent->ce)) {
 
 			conntrack_lock(ce->parent->ce);
 			struct conntrack_node_list *tmp = ce->parent->ce->children;
@@ -858,9 +1267,7 @@ int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntra
 			debug_conntrack("Parent conntrack %p not found while cleaning child %p !", ce->parent->ce, ce);
 		}
 
-		pom_mutex_unlock(&ce->parent->ct->locks[hash]);
-
-		free(ce->parent);
+		pom_mutex_unlock(parent_lock);
 	}
 
 	if (ce->session)
@@ -897,17 +1304,11 @@ int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntra
 		free(child);
 	}
 
-	
-	if (ce->fwd_value)
-		ptype_cleanup(ce->fwd_value);
-	if (ce->rev_value)
-		ptype_cleanup(ce->rev_value);
-
-	pthread_mutex_destroy(&ce->lock);
 
 	registry_perf_dec(ce->proto->perf_conn_cur, 1);
 
-	free(ce);
+	// Lockless lookups might still be looking at it
+	conntrack_retire(ce);
 
 	return POM_OK;
 }
@@ -976,16 +1377,14 @@ int conntrack_timer_process(void *priv, ptime now) {
 	struct conntrack_tables *ct = t->proto->ct;
 
 	// Lock the main table
-	pom_mutex_lock(&ct->locks[t->hash]);
+	pthread_mutex_t *lock = conntrack_table_lock(ct, t->hash);
+	pom_mutex_lock(lock);
 
 	// Check if the conntrack still exists
 
-	struct conntrack_list *lst = NULL;
-	for (lst = ct->table[t->hash]; lst && lst->ce != t->ce; lst = lst->next);
-
-	if (!lst) {
+	if (!conntrack_table_find_ref(ct, t->hash, t->ce)) {
 		pomlog(POMLOG_DEBUG "Timer fired but conntrack doesn't exists anymore");
-		pom_mutex_unlock(&ct->locks[t->hash]);
+		pom_mutex_unlock(lock);
 		return POM_OK;
 	}
 
@@ -995,7 +1394,7 @@ int conntrack_timer_process(void *priv, ptime now) {
 
 	// The handler will unlock the conntrack
 	conntrack_lock(ce);
-	pom_mutex_unlock(&ct->locks[t->hash]);
+	pom_mutex_unlock(lock);
 	
 	int res = t->handler(ce, t->priv, now);
 	
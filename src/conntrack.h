@@ -27,10 +27,46 @@
 
 #define CONNTRACK_CHILDLESS_TIMEOUT	10
 
+// Maximum number of locks protecting a table, whatever its size
+#define CONNTRACK_LOCK_STRIPES		1024
+
+// Tables grow when there are more than twice as many conntracks as buckets
+#define CONNTRACK_TABLE_LOAD_MAX	2
+// And shrink back when there is less than one conntrack per 8 buckets
+#define CONNTRACK_TABLE_LOAD_MIN	8
+#define CONNTRACK_TABLE_MAX_SIZE	(1 << 24)
+
+// Number of buckets moved to the new table on each update while rehashing
+#define CONNTRACK_REHASH_STEP		8
+
+// Number of retired conntracks after which a thread tries to release them
+#define CONNTRACK_RECLAIM_BATCH		64
+
+struct conntrack_buckets {
+	size_t size; // Always a power of 2
+	struct conntrack_buckets *retired_next;
+	uint64_t retired_epoch;
+	struct conntrack_entry *table[];
+};
+
 struct conntrack_tables {
-	struct conntrack_list **table;
+	struct conntrack_buckets *buckets;
+	struct conntrack_buckets *old; // Buckets being moved to the new table
+	size_t size, rehash_pos, min_size;
+	pthread_mutex_t rehash_lock;
+	unsigned int count;
 	pthread_mutex_t *locks;
-	size_t table_size;
+	unsigned int lock_mask;
+};
+
+// Thread reading the tables without locking them
+struct conntrack_reader {
+	volatile uint64_t epoch; // 0 when not reading
+	int in_use;
+	struct conntrack_entry *retired;
+	struct conntrack_buckets *retired_buckets;
+	unsigned int retired_count, reclaim_at;
+	struct conntrack_reader *next;
 };
 
 struct conntrack_session {
@@ -64,9 +100,11 @@ struct conntrack_tables* conntrack_table_alloc(size_t table_size, int has_rev);
 int conntrack_table_empty(struct conntrack_tables *ct);
 int conntrack_table_cleanup(struct conntrack_tables *ct);
 uint32_t conntrack_hash(struct ptype *a, struct ptype *b, void *parent);
-struct conntrack_entry *conntrack_find(struct conntrack_list *lst, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent);
+struct conntrack_entry *conntrack_find(struct conntrack_entry *ce, struct ptype *fwd_value, struct ptype *rev_value, struct conntrack_entry *parent);
 int conntrack_timed_cleanup(void *timer, ptime now);
 int conntrack_cleanup(struct conntrack_tables *ct, uint32_t hash, struct conntrack_entry *ce);
+void conntrack_thread_cleanup();
+void conntrack_readers_cleanup();
 
 
 int conntrack_timer_process(void *priv, ptime now);
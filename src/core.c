@@ -31,10 +31,21 @@
 #include "analyzer.h"
 #include "dns.h"
 #include "pload.h"
+#include "jhash.h"
 
 #include <pom-ng/ptype_bool.h>
 #include <pom-ng/ptype_string.h>
 
+#include <pom-ng/ptype_uint32.h>
+
+#include <arpa/inet.h>
+#include <limits.h>
+
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 #if 0
 #define debug_core(x ...) pomlog(POMLOG_DEBUG x)
 #else
@@ -51,21 +62,487 @@ static ptime core_start_time;
 static struct core_processing_thread *core_processing_threads[CORE_PROCESS_THREAD_MAX];
 static unsigned int core_num_threads = 0;
 static pthread_rwlock_t core_processing_lock = PTHREAD_RWLOCK_INITIALIZER;
-static volatile unsigned int core_pkt_queue_count = 0;
 
-static pthread_mutex_t core_pkt_queue_wait_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t core_pkt_queue_wait_cond = PTHREAD_COND_INITIALIZER;
+// Producers are only added to the list and freed at cleanup
+static struct core_producer * volatile core_producers = NULL;
+static pthread_mutex_t core_producers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct core_producer *core_thread_producer = NULL;
+static __thread int core_thread_id = -1;
 
 static volatile ptime core_clock[CORE_PROCESS_THREAD_MAX] = { 0 };
 
 static struct registry_class *core_registry_class = NULL;
-static struct ptype *core_param_dump_pkt = NULL, *core_param_offline_dns = NULL, *core_param_reset_perf_on_restart = NULL, *core_param_http_admin_password = NULL;
+static struct ptype *core_param_dump_pkt = NULL, *core_param_offline_dns = NULL, *core_param_reset_perf_on_restart = NULL, *core_param_http_admin_password = NULL, *core_param_flow_affinity = NULL, *core_param_pkt_queue_depth = NULL, *core_param_perf_layer_latency = NULL;
+
+// Protocols the flow classifier knows how to parse
+static struct proto *core_proto_ethernet = NULL, *core_proto_ipv4 = NULL, *core_proto_ipv6 = NULL;
 
 // Perf objects
 struct registry_perf *perf_pkt_queue = NULL;
 struct registry_perf *perf_thread_active = NULL;
 struct registry_perf *perf_pkt_dropped = NULL;
+struct registry_perf *perf_pkt_queue_wait = NULL;
+struct registry_perf *perf_pkt_process_time = NULL;
+
+
+static int core_wait_init(struct core_wait *w) {
+
+	memset(w, 0, sizeof(struct core_wait));
+
+#ifndef HAVE_LINUX_FUTEX_H
+	int res = pthread_mutex_init(&w->lock, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while initializing a wait lock : %s", pom_strerror(res));
+		return POM_ERR;
+	}
+
+	res = pthread_cond_init(&w->cond, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while initializing a wait condition : %s", pom_strerror(res));
+		pthread_mutex_destroy(&w->lock);
+		return POM_ERR;
+	}
+#endif
+
+	return POM_OK;
+}
+
+static void core_wait_cleanup(struct core_wait *w) {
+
+#ifndef HAVE_LINUX_FUTEX_H
+	int res = pthread_mutex_destroy(&w->lock);
+	if (res)
+		pomlog(POMLOG_WARN "Error while destroying a wait lock : %s", pom_strerror(res));
+
+	res = pthread_cond_destroy(&w->cond);
+	if (res)
+		pomlog(POMLOG_WARN "Error while destroying a wait condition : %s", pom_strerror(res));
+#endif
+}
+
+// Announce that we are about to wait, the condition must be checked again afterwards
+static unsigned int core_wait_prepare(struct core_wait *w) {
+
+	unsigned int seq = w->seq;
+	__sync_fetch_and_add(&w->waiting, 1);
+	return seq;
+}
+
+// The condition became true while preparing to wait
+static void core_wait_cancel(struct core_wait *w) {
+
+	__sync_fetch_and_sub(&w->waiting, 1);
+}
+
+static void core_wait_sleep(struct core_wait *w, unsigned int seq) {
+
+#ifdef HAVE_LINUX_FUTEX_H
+	// Returns right away if seq changed in the mean time
+	syscall(SYS_futex, &w->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+#else
+	pom_mutex_lock(&w->lock);
+	while (w->seq == seq) {
+		int res = pthread_cond_wait(&w->cond, &w->lock);
+		if (res) {
+			pomlog(POMLOG_ERR "Error while waiting for the wait condition : %s", pom_strerror(res));
+			abort();
+		}
+	}
+	pom_mutex_unlock(&w->lock);
+#endif
+
+	__sync_fetch_and_sub(&w->waiting, 1);
+}
+
+static void core_wait_wake(struct core_wait *w) {
+
+	// Make sure our update is visible before checking for waiters
+	__sync_synchronize();
+
+	if (!w->waiting)
+		return;
+
+#ifdef HAVE_LINUX_FUTEX_H
+	__sync_fetch_and_add(&w->seq, 1);
+	syscall(SYS_futex, &w->seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+	pom_mutex_lock(&w->lock);
+	w->seq++;
+	int res = pthread_cond_broadcast(&w->cond);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while signaling the wait condition : %s", pom_strerror(res));
+		abort();
+	}
+	pom_mutex_unlock(&w->lock);
+#endif
+}
+
+static inline void core_cpu_relax() {
+#if defined(__i386__) || defined(__x86_64__)
+	__asm__ __volatile__ ("pause" ::: "memory");
+#else
+	__sync_synchronize();
+#endif
+}
+
+static inline unsigned int core_pkt_ring_count(struct core_pkt_ring *r) {
+	return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+// Called only by the producer
+static inline int core_pkt_ring_push(struct core_pkt_ring *r, struct packet *p, uint64_t queued) {
+
+	unsigned int tail = r->tail;
+
+	if (tail - r->head_cache >= r->size) {
+		// Our copy says it's full, check the real value
+		r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (tail - r->head_cache >= r->size)
+			return POM_ERR;
+	}
+
+	r->pkts[tail & r->mask] = p;
+	r->queued[tail & r->mask] = queued;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return POM_OK;
+}
+
+// Called only by the consumer
+static inline struct packet *core_pkt_ring_pop(struct core_pkt_ring *r, unsigned int *remaining, uint64_t *queued) {
+
+	unsigned int head = r->head;
+
+	if (head == r->tail_cache) {
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (head == r->tail_cache)
+			return NULL;
+	}
+
+	struct packet *p = r->pkts[head & r->mask];
+	*queued = r->queued[head & r->mask];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+	unsigned int count = r->tail_cache - (head + 1);
+	if (count <= (r->size >> 1)) {
+		// Our copy of tail may be outdated, use the real value when it matters
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		count = r->tail_cache - (head + 1);
+	}
+	*remaining = count;
+
+	return p;
+}
+
+static struct core_producer *core_producer_alloc(unsigned int depth) {
+
+	struct core_producer *prod = malloc(sizeof(struct core_producer));
+	if (!prod) {
+		pom_oom(sizeof(struct core_producer));
+		return NULL;
+	}
+	memset(prod, 0, sizeof(struct core_producer));
+
+	prod->depth = depth;
+
+	if (core_wait_init(&prod->wait) != POM_OK) {
+		free(prod);
+		return NULL;
+	}
+
+	size_t size = sizeof(struct core_pkt_ring) * core_num_threads;
+	void *rings = NULL;
+	if (posix_memalign(&rings, CORE_CACHE_LINE_SIZE, size)) {
+		pom_oom(size);
+		core_wait_cleanup(&prod->wait);
+		free(prod);
+		return NULL;
+	}
+	memset(rings, 0, size);
+	prod->rings = rings;
+
+	unsigned int i;
+	for (i = 0; i < core_num_threads; i++) {
+		struct core_pkt_ring *r = &prod->rings[i];
+		r->size = depth;
+		r->mask = depth - 1;
+		r->pkts = malloc(sizeof(struct packet *) * depth);
+		r->queued = malloc(sizeof(uint64_t) * depth);
+		if (!r->pkts || !r->queued) {
+			pom_oom((sizeof(struct packet *) + sizeof(uint64_t)) * depth);
+			free(r->pkts);
+			free(r->queued);
+			for (; i--; ) {
+				free(prod->rings[i].pkts);
+				free(prod->rings[i].queued);
+			}
+			free(prod->rings);
+			core_wait_cleanup(&prod->wait);
+			free(prod);
+			return NULL;
+		}
+	}
+
+	return prod;
+}
+
+static struct core_producer *core_producer_get() {
+
+	if (core_thread_producer)
+		return core_thread_producer;
+
+	// Rings size must be a power of 2
+	uint32_t param_depth = *PTYPE_UINT32_GETVAL(core_param_pkt_queue_depth);
+	unsigned int depth = CORE_THREAD_PKT_QUEUE_MIN;
+	while (depth < param_depth && depth < CORE_THREAD_PKT_QUEUE_MAX)
+		depth <<= 1;
+
+	pom_mutex_lock(&core_producers_lock);
+
+	// Reuse the rings of a thread which stopped queuing
+	struct core_producer *prod;
+	for (prod = core_producers; prod && (prod->in_use || prod->depth != depth); prod = prod->next);
+
+	if (!prod) {
+		prod = core_producer_alloc(depth);
+		if (!prod) {
+			pom_mutex_unlock(&core_producers_lock);
+			return NULL;
+		}
+
+		// Make sure the rings are initialized before the consumers see them
+		prod->next = core_producers;
+		__sync_synchronize();
+		core_producers = prod;
+	}
+
+	prod->in_use = 1;
+	pom_mutex_unlock(&core_producers_lock);
+
+	core_thread_producer = prod;
+
+	return prod;
+}
+
+void core_queue_thread_cleanup() {
+
+	if (!core_thread_producer)
+		return;
+
+	// Processing threads will still process what's left in the rings
+	pom_mutex_lock(&core_producers_lock);
+	core_thread_producer->in_use = 0;
+	pom_mutex_unlock(&core_producers_lock);
+
+	core_thread_producer = NULL;
+}
+
+static int core_perf_pkt_queue_update(uint64_t *value, void *priv) {
+
+	uint64_t count = 0;
+
+	struct core_producer *prod;
+	for (prod = core_producers; prod; prod = prod->next) {
+		unsigned int i;
+		for (i = 0; i < core_num_threads; i++)
+			count += core_pkt_ring_count(&prod->rings[i]);
+	}
+
+	*value = count;
+
+	return POM_OK;
+}
+
+// Fetch the next packet for this thread from any of the producers
+static struct packet *core_thread_dequeue(struct core_processing_thread *t, uint64_t *queued) {
+
+	struct core_producer *start = t->cur_producer;
+	if (!start) {
+		start = core_producers;
+		if (!start)
+			return NULL;
+	}
+
+	struct core_producer *prod = start;
+	do {
+		unsigned int remaining;
+		struct packet *p = core_pkt_ring_pop(&prod->rings[t->thread_id], &remaining, queued);
+
+		struct core_producer *next = prod->next;
+		if (!next)
+			next = core_producers;
+
+		if (p) {
+			// A producer only waits on a full ring, wake it up once half of it is free
+			if (remaining == (prod->depth >> 1))
+				core_wait_wake(&prod->wait);
+
+			t->cur_producer = next;
+			return p;
+		}
+
+		prod = next;
+	} while (prod != start);
+
+	return NULL;
+}
+
+#define CORE_FLOW_INITVAL 0x3c5e8a17 // random value for hashing flows
+
+static void core_flow_resolve_protos() {
+
+	core_proto_ethernet = proto_get("ethernet");
+	core_proto_ipv4 = proto_get("ipv4");
+	core_proto_ipv6 = proto_get("ipv6");
+}
+
+static uint32_t core_flow_hash_tuple(uint32_t src, uint32_t dst, uint16_t sport, uint16_t dport, uint8_t ip_proto) {
+
+	// Order both endpoints so that each direction of a flow gives the same hash
+	if (src > dst || (src == dst && sport > dport)) {
+		uint32_t tmp_addr = src;
+		src = dst;
+		dst = tmp_addr;
+		uint16_t tmp_port = sport;
+		sport = dport;
+		dport = tmp_port;
+	}
+
+	return jhash_3words(src, dst, ((uint32_t)sport << 16) | dport, CORE_FLOW_INITVAL ^ ip_proto);
+}
+
+static void core_flow_get_ports(uint8_t ip_proto, unsigned char *buff, size_t len, uint16_t *sport, uint16_t *dport) {
+
+	// Only TCP and UDP are taken into account, other protocols are hashed on their addresses
+	if ((ip_proto != IPPROTO_TCP && ip_proto != IPPROTO_UDP) || len < 2 * sizeof(uint16_t))
+		return;
+
+	memcpy(sport, buff, sizeof(uint16_t));
+	memcpy(dport, buff + sizeof(uint16_t), sizeof(uint16_t));
+}
+
+static int core_flow_hash_ipv4(unsigned char *buff, size_t len, uint32_t *hash) {
+
+	if (len < 20 || (buff[0] >> 4) != 4)
+		return POM_ERR;
+
+	unsigned int hdr_len = (buff[0] & 0xf) * 4;
+	if (hdr_len < 20 || hdr_len > len)
+		return POM_ERR;
+
+	uint32_t src, dst;
+	memcpy(&src, buff + 12, sizeof(uint32_t));
+	memcpy(&dst, buff + 16, sizeof(uint32_t));
+
+	uint16_t sport = 0, dport = 0;
+
+	// Fragments other than the first one don't have the ports
+	// Ignore them for all the fragments so they end up in the same thread
+	uint16_t frag;
+	memcpy(&frag, buff + 6, sizeof(uint16_t));
+	if (!(ntohs(frag) & 0x3fff))
+		core_flow_get_ports(buff[9], buff + hdr_len, len - hdr_len, &sport, &dport);
+
+	*hash = core_flow_hash_tuple(src, dst, sport, dport, buff[9]);
 
+	return POM_OK;
+}
+
+static int core_flow_hash_ipv6(unsigned char *buff, size_t len, uint32_t *hash) {
+
+	if (len < 40 || (buff[0] >> 4) != 6)
+		return POM_ERR;
+
+	// Fold the addresses in a single word
+	uint32_t addr[8];
+	memcpy(addr, buff + 8, sizeof(addr));
+	uint32_t src = addr[0] ^ addr[1] ^ addr[2] ^ addr[3];
+	uint32_t dst = addr[4] ^ addr[5] ^ addr[6] ^ addr[7];
+
+	uint8_t nhdr = buff[6];
+	size_t offset = 40;
+	int fragment = 0;
+
+	// Skip the extension headers
+	unsigned int i;
+	for (i = 0; i < CORE_FLOW_IPV6_MAX_EXT_HDR && offset + 8 <= len; i++) {
+		if (nhdr == 0 || nhdr == 43 || nhdr == 60) { // Hop-by-hop, routing, destination
+			nhdr = buff[offset];
+			offset += (buff[offset + 1] + 1) * 8;
+		} else if (nhdr == 44) { // Fragment
+			nhdr = buff[offset];
+			offset += 8;
+			fragment = 1;
+		} else if (nhdr == 51) { // Authentication header
+			nhdr = buff[offset];
+			offset += (buff[offset + 1] + 2) * 4;
+		} else {
+			break;
+		}
+	}
+
+	uint16_t sport = 0, dport = 0;
+	if (!fragment && offset < len)
+		core_flow_get_ports(nhdr, buff + offset, len - offset, &sport, &dport);
+
+	*hash = core_flow_hash_tuple(src, dst, sport, dport, nhdr);
+
+	return POM_OK;
+}
+
+static int core_flow_hash_ethernet(unsigned char *buff, size_t len, uint32_t *hash) {
+
+	if (len < 14)
+		return POM_ERR;
+
+	size_t offset = 12;
+	uint16_t type = (buff[offset] << 8) | buff[offset + 1];
+	offset += 2;
+
+	// Skip the VLAN tags
+	while (type == 0x8100 || type == 0x88a8) {
+		if (offset + 4 > len)
+			return POM_ERR;
+		type = (buff[offset + 2] << 8) | buff[offset + 3];
+		offset += 4;
+	}
+
+	// PPPoE session
+	if (type == 0x8864) {
+		if (offset + 8 > len)
+			return POM_ERR;
+		uint16_t ppp_proto = (buff[offset + 6] << 8) | buff[offset + 7];
+		offset += 8;
+		if (ppp_proto == 0x0021)
+			type = 0x0800;
+		else if (ppp_proto == 0x0057)
+			type = 0x86dd;
+		else
+			return POM_ERR;
+	}
+
+	if (type == 0x0800)
+		return core_flow_hash_ipv4(buff + offset, len - offset, hash);
+	else if (type == 0x86dd)
+		return core_flow_hash_ipv6(buff + offset, len - offset, hash);
+
+	return POM_ERR;
+}
+
+static int core_flow_hash(struct packet *p, uint32_t *hash) {
+
+	if (!p->datalink)
+		return POM_ERR;
+
+	if (p->datalink == core_proto_ethernet)
+		return core_flow_hash_ethernet(p->buff, p->len, hash);
+	else if (p->datalink == core_proto_ipv4)
+		return core_flow_hash_ipv4(p->buff, p->len, hash);
+	else if (p->datalink == core_proto_ipv6)
+		return core_flow_hash_ipv6(p->buff, p->len, hash);
+
+	return POM_ERR;
+}
 
 int core_init(unsigned int num_threads) {
 
@@ -78,10 +555,14 @@ int core_init(unsigned int num_threads) {
 	perf_pkt_queue = registry_class_add_perf(core_registry_class, "pkt_queue", registry_perf_type_gauge, "Number of packets in the queue waiting to be processed", "pkts");
 	perf_thread_active = registry_class_add_perf(core_registry_class, "active_thread", registry_perf_type_gauge, "Number of active threads", "threads");
 	perf_pkt_dropped = registry_class_add_perf(core_registry_class, "dropped_pkt", registry_perf_type_counter, "Number of packets dropped from the inputs", "pkts");
+	perf_pkt_queue_wait = registry_class_add_perf(core_registry_class, "pkt_queue_wait", registry_perf_type_histogram, "Time spent by packets in the queue", NULL);
+	perf_pkt_process_time = registry_class_add_perf(core_registry_class, "pkt_process_time", registry_perf_type_histogram, "Time spent processing each packet", NULL);
 
-	if (!perf_pkt_queue || !perf_thread_active || !perf_pkt_dropped)
+	if (!perf_pkt_queue || !perf_thread_active || !perf_pkt_dropped || !perf_pkt_queue_wait || !perf_pkt_process_time)
 		return POM_ERR;
 
+	registry_perf_set_update_hook(perf_pkt_queue, core_perf_pkt_queue_update, NULL);
+
 	core_param_dump_pkt = ptype_alloc("bool");
 	if (!core_param_dump_pkt)
 		goto err;
@@ -98,6 +579,18 @@ int core_init(unsigned int num_threads) {
 	if (!core_param_http_admin_password)
 		goto err;
 
+	core_param_flow_affinity = ptype_alloc("bool");
+	if (!core_param_flow_affinity)
+		goto err;
+
+	core_param_pkt_queue_depth = ptype_alloc_unit("uint32", "pkts");
+	if (!core_param_pkt_queue_depth)
+		goto err;
+
+	core_param_perf_layer_latency = ptype_alloc("bool");
+	if (!core_param_perf_layer_latency)
+		goto err;
+
 	param = registry_new_param("dump_pkt", "no", core_param_dump_pkt, "Dump packets to logs", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
 	if (registry_class_add_param(core_registry_class, param) != POM_OK)
 		goto err;
@@ -113,9 +606,23 @@ int core_init(unsigned int num_threads) {
 	param = registry_new_param("http_admin_password", "", core_param_http_admin_password, "HTTP password for the user admin", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
 	if (registry_class_add_param(core_registry_class, param) != POM_OK)
 		goto err;
+
+	param = registry_new_param("flow_affinity", "yes", core_param_flow_affinity, "Process both directions of a connection in the same thread", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
+
+	param = registry_new_param("pkt_queue_depth", "512", core_param_pkt_queue_depth, "Number of packets each input can queue to a processing thread, rounded to a power of 2", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
+
+	param = registry_new_param("perf_layer_latency", "yes", core_param_perf_layer_latency, "Record the processing time of each protocol layer and listener, this costs two clock reads per call", REGISTRY_PARAM_FLAG_CLEANUP_VAL);
+	if (registry_class_add_param(core_registry_class, param) != POM_OK)
+		goto err;
 	
 	param = NULL;
 
+	core_flow_resolve_protos();
+
 	if (dns_init() != POM_OK)
 		goto err;
 
@@ -154,26 +661,14 @@ int core_init(unsigned int num_threads) {
 
 		tmp->thread_id = i;
 
-		int res = pthread_mutex_init(&tmp->pkt_queue_lock, NULL);
-		if (res) {
-			pomlog(POMLOG_ERR "Error while initializing a thread pkt_queue lock : %s", pom_strerror(res));
+		if (core_wait_init(&tmp->wait) != POM_OK) {
 			free(tmp);
 			goto err;
 		}
 
-		res = pthread_cond_init(&tmp->pkt_queue_cond, NULL);
-		if (res) {
-			pomlog(POMLOG_ERR "Error while initializing a thread pkt_queue condition : %s", pom_strerror(res));
-			pthread_mutex_destroy(&tmp->pkt_queue_lock);
-			free(tmp);
-			goto err;
-		}
-
-
 		if (pthread_create(&tmp->thread, NULL, core_processing_thread_func, tmp)) {
 			pomlog(POMLOG_ERR "Error while creating a new processing thread : %s", pom_strerror(errno));
-			pthread_mutex_destroy(&tmp->pkt_queue_lock);
-			pthread_cond_destroy(&tmp->pkt_queue_cond);
+			core_wait_cleanup(&tmp->wait);
 			free(tmp);
 			goto err;
 		}
@@ -199,181 +694,204 @@ int core_cleanup(int emergency_cleanup) {
 
 	core_run = 0;
 
+	// Wake up the inputs waiting for room in the queues
+	struct core_producer *prod;
+	for (prod = core_producers; prod; prod = prod->next)
+		core_wait_wake(&prod->wait);
 
 	int i;
 	for (i = 0; i < CORE_PROCESS_THREAD_MAX && core_processing_threads[i]; i++) {
 		struct core_processing_thread *t = core_processing_threads[i];
-		int res = pthread_cond_signal(&t->pkt_queue_cond);
-		if (res) {
-			pomlog(POMLOG_ERR "Error while signaling the restart condition : %s", pom_strerror(res));
-			abort();
-		}
+		core_wait_wake(&t->wait);
 		pthread_join(t->thread, NULL);
-		res = pthread_mutex_destroy(&t->pkt_queue_lock);
-		if (res)
-			pomlog(POMLOG_WARN "Error while destroying a processing thread lock : %s", pom_strerror(res));
-		
-		res = pthread_cond_destroy(&t->pkt_queue_cond);
-		if (res)
-			pomlog(POMLOG_WARN "Error while destroying a processing thread condition : %s", pom_strerror(res));
-
+		core_wait_cleanup(&t->wait);
+		free(t);
+		core_processing_threads[i] = NULL;
+	}
 
-		struct core_packet_queue *tmp = NULL;
-		while (t->pkt_queue_head) {
-			tmp = t->pkt_queue_head;
-			t->pkt_queue_head = tmp->next;
-			// packet_pool_cleanup() was already called when the thread stopped
-			// packet_pool_release(tmp->pkt);
-			free(tmp);
-			pomlog(POMLOG_WARN "A packet was still in a thread's queue");
-		}
+	while (core_producers) {
+		prod = core_producers;
+		core_producers = prod->next;
 
-		while (t->pkt_queue_unused) {
-			tmp = t->pkt_queue_unused;
-			t->pkt_queue_unused = tmp->next;
+		unsigned int j;
+		for (j = 0; j < core_num_threads; j++) {
 			// packet_pool_cleanup() was already called when the thread stopped
-			// packet_pool_release(tmp->pkt);
-			free(tmp);
+			if (core_pkt_ring_count(&prod->rings[j]))
+				pomlog(POMLOG_WARN "Packets were still in a thread's queue");
+			free(prod->rings[j].pkts);
+			free(prod->rings[j].queued);
 		}
-
-		free(t);
+		free(prod->rings);
+		core_wait_cleanup(&prod->wait);
+		free(prod);
 	}
 
 	return POM_OK;
 }
 
-int core_queue_packet(struct packet *p, unsigned int flags, unsigned int thread_affinity) {
+static void core_queue_wake(uint64_t *threads) {
 
-	
-	// Update the counters
-	registry_perf_inc(p->input->perf_pkts_in, 1);
-	registry_perf_inc(p->input->perf_bytes_in, p->len);
+	// Wake up the threads we queued packets to if they're sleeping
+	while (*threads) {
+		unsigned int thread_id = __builtin_ctzll(*threads);
+		*threads &= *threads - 1;
+		core_wait_wake(&core_processing_threads[thread_id]->wait);
+	}
+}
+
+static unsigned int core_queue_burst(struct packet **pkts, unsigned int count, unsigned int flags, unsigned int *thread_affinity) {
+
+	// Update the counters, all the packets come from the same input
+	size_t bytes = 0;
+	unsigned int j;
+	for (j = 0; j < count; j++)
+		bytes += pkts[j]->len;
+	registry_perf_inc(pkts[0]->input->perf_pkts_in, count);
+	registry_perf_inc(pkts[0]->input->perf_bytes_in, bytes);
 
 	if (!core_run)
-		return POM_ERR;
+		return 0;
 
-	debug_core("Queuing packet %p (%u.%06u)", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts));
+	struct core_producer *prod = core_producer_get();
+	if (!prod)
+		return 0;
 
-	// Find the right thread to queue to
+	int flow_affinity = (!(flags & CORE_QUEUE_HAS_THREAD_AFFINITY) && core_num_threads > 1 && *PTYPE_BOOL_GETVAL(core_param_flow_affinity));
+
+	static __thread unsigned int start = 0;
+	uint64_t wake = 0;
+	uint64_t queued = registry_perf_histogram_start();
+	unsigned int dropped = 0;
+
+	for (j = 0; j < count; j++) {
+
+		struct packet *p = pkts[j];
+		unsigned int pkt_flags = flags;
+		unsigned int affinity = (thread_affinity ? thread_affinity[j] : 0);
+
+		debug_core("Queuing packet %p (%u.%06u)", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts));
+
+		// Keep packets of the same flow on the same thread
+		if (flow_affinity) {
+			uint32_t hash;
+			if (core_flow_hash(p, &hash) == POM_OK) {
+				pkt_flags |= CORE_QUEUE_HAS_THREAD_AFFINITY;
+				affinity = hash;
+			}
+		}
+
+		// Find the right thread to queue to
+		unsigned int thread_id = 0;
+		unsigned int spin = 0, waiting = 0, seq = 0, drop = 0;
 
-	struct core_processing_thread *t = NULL;
-	if (flags & CORE_QUEUE_HAS_THREAD_AFFINITY) {
-		t = core_processing_threads[thread_affinity % core_num_threads];
-		pom_mutex_lock(&t->pkt_queue_lock);
-	} else {
-		static volatile unsigned int start = 0;
-		unsigned int i;
 		while (1) {
-			unsigned int thread_id = start;
-			for (i = 0; i < core_num_threads; i++) {
-				thread_id++;
-				if (thread_id >= core_num_threads)
-					thread_id -= core_num_threads;
-				t = core_processing_threads[thread_id];
-				int res = pthread_mutex_trylock(&t->pkt_queue_lock);
-				if (res == EBUSY) {
-					// Thread is busy, go to the next one
-					continue;
-				} else if (res) {
-					pomlog(POMLOG_ERR "Error while locking a processing thread pkt_queue mutex : %s", pom_strerror(res));
-					abort();
-					return POM_ERR;
-				}
 
-				// We've got the lock, check if it's ok to queue here
-				if (t->pkt_count < CORE_THREAD_PKT_QUEUE_MAX) {
-					// Use this thread
+			if (pkt_flags & CORE_QUEUE_HAS_THREAD_AFFINITY) {
+				thread_id = affinity % core_num_threads;
+				if (core_pkt_ring_push(&prod->rings[thread_id], p, queued) == POM_OK)
 					break;
+			} else {
+				unsigned int i;
+				for (i = 0; i < core_num_threads; i++) {
+					thread_id = start + 1 + i;
+					if (thread_id >= core_num_threads)
+						thread_id %= core_num_threads;
+					if (core_pkt_ring_push(&prod->rings[thread_id], p, queued) == POM_OK)
+						break;
 				}
+				if (i < core_num_threads) {
+					start = thread_id;
+					break;
+				}
+			}
 
-				// Too many packets pending in this thread, go to the next one
-				pom_mutex_unlock(&t->pkt_queue_lock);
+			if (waiting) {
+				// Still full after announcing we'd wait
+				core_wait_sleep(&prod->wait, seq);
+				waiting = 0;
+				if (!core_run)
+					goto end;
+				// Don't account the time we waited for room in the queue
+				queued = registry_perf_histogram_start();
+				continue;
 			}
 
-			if (i < core_num_threads) {
-				// We locked on a thread
-				start = thread_id;
+			// Queue full
+			if (pkt_flags & CORE_QUEUE_DROP_IF_FULL) {
+				packet_release(p);
+				dropped++;
+				drop = 1;
+				debug_core("Dropped packet %p (%u.%06u)", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts));
 				break;
 			}
 
-			// No thread found
-			if (core_pkt_queue_count >= ((CORE_THREAD_PKT_QUEUE_MAX - 1) * core_num_threads)) {
-				// Queue full
-				if (flags & CORE_QUEUE_DROP_IF_FULL) {
-					packet_release(p);
-					registry_perf_inc(perf_pkt_dropped, 1);
-					debug_core("Dropped packet %p (%u.%06u) to thread %u", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts));
-					return POM_OK;
-				}
-
-				// We're not going to drop this. Wait then
-				debug_core("All queues full. Waiting ...");
-				pom_mutex_lock(&core_pkt_queue_wait_lock);
-
-				// Recheck the count after locking
-				if (core_pkt_queue_count >= ((CORE_THREAD_PKT_QUEUE_MAX - 1) * core_num_threads)) {
-					int res = pthread_cond_wait(&core_pkt_queue_wait_cond, &core_pkt_queue_wait_lock);
-					if (res) {
-						pomlog(POMLOG_ERR "Error while waiting for the core pkt_queue condition : %s", pom_strerror(res));
-						abort();
-					}
-				}
-				pom_mutex_unlock(&core_pkt_queue_wait_lock);
+			// The threads must process what we queued so far before there is room
+			core_queue_wake(&wake);
 
+			// We're not going to drop this. Spin for a while and then wait
+			if (spin < CORE_THREAD_SPIN_COUNT) {
+				spin++;
+				core_cpu_relax();
+				continue;
 			}
+
+			debug_core("Queue full. Waiting ...");
+			seq = core_wait_prepare(&prod->wait);
+			waiting = 1;
 		}
 
-	}
+		if (waiting)
+			core_wait_cancel(&prod->wait);
 
-	// We've got the thread's lock, add it to the queue
+		if (drop)
+			continue;
 
-	struct core_packet_queue *tmp = NULL;
-	if (t->pkt_queue_unused) {
-		tmp = t->pkt_queue_unused;
-		t->pkt_queue_unused = tmp->next;
-	} else {
-		tmp = malloc(sizeof(struct core_packet_queue));
-		if (!tmp) {
-			pom_mutex_unlock(&t->pkt_queue_lock);
-			pom_oom(sizeof(struct core_packet_queue));
-			return POM_ERR;
-		}
+		wake |= (uint64_t) 1 << thread_id;
+
+		debug_core("Queued packet %p (%u.%06u) to thread %u", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts), thread_id);
 	}
 
-	tmp->pkt = p;
-	tmp->next = NULL;
-	if (t->pkt_queue_tail) {
-		t->pkt_queue_tail->next = tmp;
-	} else {
-		t->pkt_queue_head = tmp;
+end:
+	core_queue_wake(&wake);
 
-		// The queue was empty, we need to signal it
-		int res = pthread_cond_signal(&t->pkt_queue_cond);
-		if (res) {
-			pomlog(POMLOG_ERR "Error while signaling the thread pkt_queue restart condition : %s", pom_strerror(res));
-			abort();
-			return POM_ERR;
-		}
+	if (dropped)
+		registry_perf_inc(perf_pkt_dropped, dropped);
+
+	return j;
+}
 
+int core_queue_packet(struct packet *p, unsigned int flags, unsigned int thread_affinity) {
+
+	if (core_queue_burst(&p, 1, flags, &thread_affinity) != 1) {
+		// Like core_queue_packets(), the packet is ours even if it could not be queued
+		packet_release(p);
+		return POM_ERR;
 	}
-	t->pkt_queue_tail = tmp;
 
-	t->pkt_count++;
-	__sync_fetch_and_add(&core_pkt_queue_count, 1);
+	return POM_OK;
+}
 
-	registry_perf_inc(perf_pkt_queue, 1);
+int core_queue_packets(struct packet **pkts, unsigned int count, unsigned int flags, unsigned int *thread_affinity) {
 
-	debug_core("Queued packet %p (%u.%06u) to thread %u", p, pom_ptime_sec(p->ts), pom_ptime_usec(p->ts), t->thread_id);
+	if (!count)
+		return POM_OK;
 
-	pom_mutex_unlock(&t->pkt_queue_lock);
+	unsigned int queued = core_queue_burst(pkts, count, flags, thread_affinity);
+	if (queued == count)
+		return POM_OK;
 
-	return POM_OK;
+	// Release what could not be queued
+	for (; queued < count; queued++)
+		packet_release(pkts[queued]);
+
+	return POM_ERR;
 }
 
 
 void *core_processing_thread_func(void *priv) {
 
 	struct core_processing_thread *tpriv = priv;
+	core_thread_id = tpriv->thread_id;
 
 	if (packet_info_pool_init()) {
 		halt("Error while initializing the packet_info_pool", 1);
@@ -384,68 +902,48 @@ void *core_processing_thread_func(void *priv) {
 
 
 	while (core_run) {
-		
-		pom_mutex_lock(&tpriv->pkt_queue_lock);
-		while (!tpriv->pkt_queue_head) {
-			// We are not active while waiting for a packet
-			registry_perf_dec(perf_thread_active, 1);
-
-			debug_core("thread %u : waiting", tpriv->thread_id);
-
-			if (registry_perf_getval(perf_thread_active) == 0) {
-				if (core_get_state() == core_state_finishing)
-					core_set_state(core_state_idle);
-			}
 
-			if (!core_run) {
-				pom_mutex_unlock(&tpriv->pkt_queue_lock);
-				goto end;
-			}
+		uint64_t queued = 0;
+		struct packet *pkt = core_thread_dequeue(tpriv, &queued);
 
-			int res = pthread_cond_wait(&tpriv->pkt_queue_cond, &tpriv->pkt_queue_lock);
-			if (res) {
-				pomlog(POMLOG_ERR "Error while waiting for restart condition : %s", pom_strerror(res));
-				abort();
-				return NULL;
-			}
-			registry_perf_inc(perf_thread_active, 1);
+		// Spin a bit before going to sleep
+		unsigned int spin;
+		for (spin = 0; !pkt && spin < CORE_THREAD_SPIN_COUNT && core_run; spin++) {
+			core_cpu_relax();
+			pkt = core_thread_dequeue(tpriv, &queued);
 		}
 
+		if (!pkt) {
+			// We are not active while waiting for a packet
+			registry_perf_dec(perf_thread_active, 1);
 
-		// Dequeue a packet
-		struct core_packet_queue *tmp = tpriv->pkt_queue_head;
-		tpriv->pkt_queue_head = tmp->next;
-		if (!tpriv->pkt_queue_head)
-			tpriv->pkt_queue_tail = NULL;
-
-
-		// Add it to the unused list
-		tmp->next = tpriv->pkt_queue_unused;
-		tpriv->pkt_queue_unused = tmp;
+			while (!pkt) {
 
-		tpriv->pkt_count--;
+				debug_core("thread %u : waiting", tpriv->thread_id);
 
-		registry_perf_dec(perf_pkt_queue, 1);
+				if (registry_perf_getval(perf_thread_active) == 0) {
+					if (core_get_state() == core_state_finishing)
+						core_set_state(core_state_idle);
+				}
 
-		__sync_fetch_and_sub(&core_pkt_queue_count, 1);
+				unsigned int seq = core_wait_prepare(&tpriv->wait);
 
-		if (tpriv->pkt_count < CORE_THREAD_PKT_QUEUE_MIN) {
+				if (!core_run) {
+					core_wait_cancel(&tpriv->wait);
+					goto end;
+				}
 
-			pom_mutex_lock(&core_pkt_queue_wait_lock);
-			// Tell the input processes that they can continue queuing packets
-			int res = pthread_cond_broadcast(&core_pkt_queue_wait_cond);
-			if (res) {
-				pomlog(POMLOG_ERR "Error while signaling the main pkt_queue condition : %s", pom_strerror(res));
-				abort();
+				pkt = core_thread_dequeue(tpriv, &queued);
+				if (pkt)
+					core_wait_cancel(&tpriv->wait);
+				else
+					core_wait_sleep(&tpriv->wait, seq);
 			}
-			pom_mutex_unlock(&core_pkt_queue_wait_lock);
-		}
 
-		// Keep track of our packet
-		struct packet *pkt = tmp->pkt;
+			registry_perf_inc(perf_thread_active, 1);
+		}
 
 		debug_core("thread %u : Processing packet %p (%u.%06u)", tpriv->thread_id, pkt, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts));
-		pom_mutex_unlock(&tpriv->pkt_queue_lock);
 
 		// Lock the processing lock
 		pom_rwlock_rlock(&core_processing_lock);
@@ -454,12 +952,15 @@ void *core_processing_thread_func(void *priv) {
 		if (core_clock[tpriv->thread_id] < pkt->ts) // Make sure we keep it monotonous
 			core_clock[tpriv->thread_id] = pkt->ts;
 
-		// Process timers
-		if (timers_process() != POM_OK) {
+		// Process the timers of this thread
+		if (timers_process(core_clock[tpriv->thread_id]) != POM_OK) {
 			pom_rwlock_unlock(&core_processing_lock);
 			break;
 		}
 
+		uint64_t process_start = registry_perf_histogram_start();
+		registry_perf_histogram_record(perf_pkt_queue_wait, process_start - queued);
+
 		//pomlog(POMLOG_DEBUG "Thread %u processing ...", pthread_self());
 		if (core_process_packet(pkt) == POM_ERR) {
 			core_run = 0;
@@ -467,6 +968,8 @@ void *core_processing_thread_func(void *priv) {
 			break;
 		}
 
+		registry_perf_histogram_stop(perf_pkt_process_time, process_start);
+
 		pom_rwlock_unlock(&core_processing_lock);
 
 		debug_core("thread %u : Processed packet %p (%u.%06u)", tpriv->thread_id, pkt, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts));
@@ -481,6 +984,10 @@ void *core_processing_thread_func(void *priv) {
 end:
 	packet_info_pool_cleanup();
 	pload_thread_cleanup();
+	packet_cache_thread_cleanup();
+	timers_thread_cleanup();
+	conntrack_thread_cleanup();
+	registry_perf_thread_cleanup();
 
 	return NULL;
 }
@@ -672,6 +1179,20 @@ void core_stack_release(struct proto_process_stack *stack) {
 	free(stack);
 }
 
+uint64_t core_perf_layer_start() {
+
+	if (!*PTYPE_BOOL_GETVAL(core_param_perf_layer_latency))
+		return 0;
+
+	return registry_perf_histogram_start();
+}
+
+void core_perf_layer_stop(struct registry_perf *p, uint64_t start) {
+
+	if (start)
+		registry_perf_histogram_stop(p, start);
+}
+
 ptime core_get_clock() {
 
 	ptime now = core_clock[0];
@@ -731,6 +1252,9 @@ static int core_processing_start() {
 
 	core_pause_processing();
 
+	// Protocols may have been loaded since the last start
+	core_flow_resolve_protos();
+
 	if (*PTYPE_BOOL_GETVAL(core_param_offline_dns) && dns_core_init() != POM_OK) {
 		core_resume_processing();
 		return POM_ERR;
@@ -810,17 +1334,8 @@ int core_set_state(enum core_state state) {
 	} else if (state == core_state_finishing) {
 		// Signal all the threads
 		unsigned int i;
-		for (i = 0; i < core_num_threads; i++) {
-			struct core_processing_thread *t = core_processing_threads[i];
-
-			pom_mutex_lock(&t->pkt_queue_lock);
-			int res = pthread_cond_broadcast(&t->pkt_queue_cond);
-			pom_mutex_unlock(&t->pkt_queue_lock);
-			if (res) {
-				pomlog(POMLOG_ERR "Error while broadcasting restart condition after set state");
-				abort();
-			}
-		}
+		for (i = 0; i < core_num_threads; i++)
+			core_wait_wake(&core_processing_threads[i]->wait);
 	}
 	return res;
 }
@@ -862,6 +1377,12 @@ struct registry_perf *core_add_perf(const char *name, enum registry_perf_type ty
 	return registry_class_add_perf(core_registry_class, name, type, description, unit);
 }
 
+// Id of the processing thread calling this, -1 for the other threads
+int core_get_thread_id() {
+
+	return core_thread_id;
+}
+
 unsigned int core_get_num_threads() {
 	return core_num_threads;
 }
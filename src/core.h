@@ -32,8 +32,14 @@
 #define CORE_PROCESS_THREAD_MAX		64
 #define CORE_PROCESS_THREAD_DEFAULT	1
 
-#define CORE_THREAD_PKT_QUEUE_MIN	5
-#define CORE_THREAD_PKT_QUEUE_MAX	512
+#define CORE_THREAD_PKT_QUEUE_MIN	8
+#define CORE_THREAD_PKT_QUEUE_MAX	65536
+
+#define CORE_THREAD_SPIN_COUNT		1024
+
+#define CORE_FLOW_IPV6_MAX_EXT_HDR	8
+
+#define CORE_CACHE_LINE_SIZE		64
 
 #define CORE_REGISTRY "core"
 enum core_state {
@@ -42,19 +48,48 @@ enum core_state {
 	core_state_finishing, // There are still packets in the input
 };
 
-struct core_packet_queue {
-	struct packet *pkt;
-	struct core_packet_queue *next;
+// Wait on an event counter, spinning is handled by the callers
+struct core_wait {
+	volatile unsigned int seq;
+	volatile unsigned int waiting;
+#ifndef HAVE_LINUX_FUTEX_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+};
+
+// Single producer, single consumer ring buffer
+struct core_pkt_ring {
+
+	// Consumer side
+	volatile unsigned int head __attribute__ ((aligned (CORE_CACHE_LINE_SIZE)));
+	unsigned int tail_cache;
+
+	// Producer side
+	volatile unsigned int tail __attribute__ ((aligned (CORE_CACHE_LINE_SIZE)));
+	unsigned int head_cache;
+
+	// Read only
+	unsigned int size __attribute__ ((aligned (CORE_CACHE_LINE_SIZE)));
+	unsigned int mask;
+	struct packet **pkts;
+	uint64_t *queued; // When each packet was queued
+};
+
+// A thread queuing packets, it has one ring per processing thread
+struct core_producer {
+	struct core_pkt_ring *rings;
+	unsigned int depth;
+	int in_use;
+	struct core_wait wait;
+	struct core_producer *next;
 };
 
 struct core_processing_thread {
 	pthread_t thread;
 	unsigned int thread_id;
-	unsigned int pkt_count;
-	pthread_mutex_t pkt_queue_lock;
-	pthread_cond_t pkt_queue_cond;
-	struct core_packet_queue *pkt_queue_head, *pkt_queue_tail; // Thread's own queue
-	struct core_packet_queue *pkt_queue_unused;
+	struct core_wait wait;
+	struct core_producer *cur_producer;
 
 };
 
@@ -62,6 +97,7 @@ int core_init(unsigned int num_threads);
 int core_cleanup(int emergency_cleanup);
 
 int core_spawn_reader_thread(struct input *i);
+void core_queue_thread_cleanup();
 void *core_processing_thread_func(void *priv);
 int core_process_dump_pkt_info(struct proto_process_stack *s, struct packet *p, int res);
 int core_process_packet_stack(struct proto_process_stack *s, unsigned int stack_index, struct packet *p);
@@ -75,9 +111,14 @@ void core_pause_processing();
 void core_resume_processing();
 void core_assert_is_paused();
 
+// Measure the time spent in a protocol layer or a listener, start is 0 when disabled
+uint64_t core_perf_layer_start();
+void core_perf_layer_stop(struct registry_perf *p, uint64_t start);
+
 struct registry_perf *core_add_perf(const char *name, enum registry_perf_type type, const char *description, const char *unit);
 
 unsigned int core_get_num_threads();
+int core_get_thread_id();
 
 char *core_get_http_admin_password();
 
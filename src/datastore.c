@@ -1000,6 +1000,68 @@ int datastore_dataset_write(struct dataset_query *dsq) {
 
 }
 
+// Bulk writes let the datastore stream many rows with a single query when it supports it
+// The query must not be used for anything else until datastore_dataset_write_bulk_end() is called
+int datastore_dataset_write_bulk_begin(struct dataset_query *dsq, unsigned int count) {
+
+	struct datastore *d = dsq->ds->dstore;
+
+	if (dsq->bulk) {
+		pomlog(POMLOG_ERR "Bulk write already in progress for dataset %s", dsq->ds->name);
+		return DATASET_QUERY_ERR;
+	}
+
+	if (!count)
+		return DATASET_QUERY_OK;
+
+	if (!dsq->prepared) {
+		if (d->reg->info->dataset_query_prepare) {
+			int res = d->reg->info->dataset_query_prepare(dsq);
+			if (res != DATASET_QUERY_OK)
+				return res;
+		}
+
+		dsq->prepared = 1;
+	}
+
+	if (d->reg->info->dataset_write_bulk_begin) {
+		int res = d->reg->info->dataset_write_bulk_begin(dsq, count);
+		if (res != DATASET_QUERY_OK)
+			return res;
+	}
+
+	dsq->bulk = count;
+
+	return DATASET_QUERY_OK;
+}
+
+int datastore_dataset_write_bulk(struct dataset_query *dsq) {
+
+	struct datastore *d = dsq->ds->dstore;
+
+	// Fallback to one query per row
+	if (!dsq->bulk || !d->reg->info->dataset_write_bulk)
+		return datastore_dataset_write(dsq);
+
+	registry_perf_inc(d->perf_write_queries, 1);
+	return d->reg->info->dataset_write_bulk(dsq);
+}
+
+int datastore_dataset_write_bulk_end(struct dataset_query *dsq, int cancel) {
+
+	struct datastore *d = dsq->ds->dstore;
+
+	if (!dsq->bulk)
+		return DATASET_QUERY_OK;
+
+	dsq->bulk = 0;
+
+	if (!d->reg->info->dataset_write_bulk_end)
+		return DATASET_QUERY_OK;
+
+	return d->reg->info->dataset_write_bulk_end(dsq, cancel);
+}
+
 int datastore_dataset_delete(struct dataset_query *dsq) {
 
 	struct datastore *d = dsq->ds->dstore;
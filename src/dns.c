@@ -18,6 +18,7 @@
  *
  */
 
+
 #include "common.h"
 #include "dns.h"
 #include "core.h"
@@ -26,10 +27,12 @@
 #include <pom-ng/ptype_uint16.h>
 #include <pom-ng/ptype_uint32.h>
 #include <pom-ng/ptype_string.h>
+#include <pom-ng/ptype_ipv4.h>
+#include <pom-ng/ptype_ipv6.h>
 #include <pom-ng/timer.h>
 
 #include <pom-ng/analyzer_dns.h>
-#include <arpa/nameser.h>
+#include <arpa/inet.h>
 
 #define INITVAL 0x4fb9a21b // random value
 
@@ -39,22 +42,19 @@
 #define debug_dns(x ...) pomlog(POMLOG_DEBUG x)
 #else
 #define debug_dns(x ...)
-#define dns_check_cache()
+#define dns_check_cache(x)
 #endif
 
-static struct ptype_reg *ptype_string = NULL;
-
-static pthread_mutex_t dns_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ptype_reg *ptype_string = NULL, *ptype_ipv4 = NULL, *ptype_ipv6 = NULL;
 
 static struct event_reg *dns_record_evt = NULL;
-static struct dns_entry **dns_table;
+static struct dns_entry **dns_table = NULL;
+static struct dns_shard *dns_shards = NULL;
 
 static struct timer *dns_gc_run = NULL;
 
 static int dns_enabled = 0;
 
-#define DNS_CACHE_QUEUE_COUNT	10
-
 #define DNS_ADDITIONAL_TIMEOUT	300
 
 static uint32_t dns_cache_queues_time[DNS_CACHE_QUEUE_COUNT] = {
@@ -72,14 +72,15 @@ static uint32_t dns_cache_queues_time[DNS_CACHE_QUEUE_COUNT] = {
 	(24 * 60 * 60) + DNS_ADDITIONAL_TIMEOUT // 1 day (capped max value)
 };
 
-static struct dns_entry *dns_cache_queues_head[DNS_CACHE_QUEUE_COUNT] = { 0 };
-static struct dns_entry *dns_cache_queues_tail[DNS_CACHE_QUEUE_COUNT] = { 0 };
 static struct registry_perf *dns_perf_cached_records = NULL;
+static struct registry_perf *dns_perf_lookup_hits = NULL;
+static struct registry_perf *dns_perf_lookup_misses = NULL;
+static struct registry_perf *dns_perf_evictions = NULL;
 
 
 #ifdef DEBUG_DNS
 
-static int dns_check_cache() {
+static int dns_check_cache(struct dns_shard *shard) {
 
 	unsigned count = 0, i;
 	uint32_t expiry;
@@ -87,14 +88,14 @@ static int dns_check_cache() {
 	for (i = 0; i < DNS_CACHE_QUEUE_COUNT; i++) {
 		unsigned int queue_count = 0;
 		expiry = 0;
-		if ( (!dns_cache_queues_head[i] && dns_cache_queues_tail[i]) ||
-			(dns_cache_queues_head[i] && !dns_cache_queues_tail[i])) {
+		if ( (!shard->cache_queues_head[i] && shard->cache_queues_tail[i]) ||
+			(shard->cache_queues_head[i] && !shard->cache_queues_tail[i])) {
 			pomlog(POMLOG_ERR "Head/Tail missmatch");
 			goto err;
 		}
 
-		for (tmp = dns_cache_queues_head[i]; tmp; tmp = tmp->cache_next) {
-			if (!tmp->cache_next && dns_cache_queues_tail[i] != tmp) {
+		for (tmp = shard->cache_queues_head[i]; tmp; tmp = tmp->cache_next) {
+			if (!tmp->cache_next && shard->cache_queues_tail[i] != tmp) {
 				pomlog(POMLOG_ERR "Tail doesn't match");
 				goto err;
 			}
@@ -118,7 +119,10 @@ err:
 
 int dns_init() {
 	dns_perf_cached_records = core_add_perf("dns_cached_records", registry_perf_type_gauge, "Number of cached DNS records", "records");
-	if (!dns_perf_cached_records)
+	dns_perf_lookup_hits = core_add_perf("dns_lookup_hits", registry_perf_type_counter, "Number of DNS lookups found in the cache", "lookups");
+	dns_perf_lookup_misses = core_add_perf("dns_lookup_misses", registry_perf_type_counter, "Number of DNS lookups not found in the cache", "lookups");
+	dns_perf_evictions = core_add_perf("dns_evictions", registry_perf_type_counter, "Number of expired DNS records removed from the cache", "records");
+	if (!dns_perf_cached_records || !dns_perf_lookup_hits || !dns_perf_lookup_misses || !dns_perf_evictions)
 		return POM_ERR;
 	return POM_OK;
 }
@@ -127,6 +131,10 @@ int dns_core_init() {
 
 	if (!ptype_string)
 		ptype_string = ptype_get_type("string");
+	if (!ptype_ipv4)
+		ptype_ipv4 = ptype_get_type("ipv4");
+	if (!ptype_ipv6)
+		ptype_ipv6 = ptype_get_type("ipv6");
 
 	if (!ptype_string)
 		return POM_ERR;
@@ -139,7 +147,29 @@ int dns_core_init() {
 		return POM_ERR;
 	}
 	memset(dns_table, 0, dns_table_size);
-	
+
+	size_t dns_shards_size = sizeof(struct dns_shard) * DNS_TABLE_SHARDS;
+	dns_shards = malloc(dns_shards_size);
+	if (!dns_shards) {
+		pom_oom(dns_shards_size);
+		goto err;
+	}
+	memset(dns_shards, 0, dns_shards_size);
+
+	unsigned int i;
+	for (i = 0; i < DNS_TABLE_SHARDS; i++) {
+		int res = pthread_rwlock_init(&dns_shards[i].lock, NULL);
+		if (res) {
+			pomlog(POMLOG_ERR "Error while initializing the DNS table lock : %s", pom_strerror(res));
+			while (i--)
+				pthread_rwlock_destroy(&dns_shards[i].lock);
+			free(dns_shards);
+			dns_shards = NULL;
+			goto err;
+		}
+		dns_shards[i].table = dns_table + (i * DNS_TABLE_SHARD_SIZE);
+	}
+
 	dns_gc_run = timer_alloc(NULL, dns_gc);
 	if (!dns_gc_run)
 		goto err;
@@ -162,13 +192,40 @@ int dns_core_init() {
 	return POM_OK;
 
 err:
+	if (dns_shards) {
+		for (i = 0; i < DNS_TABLE_SHARDS; i++)
+			pthread_rwlock_destroy(&dns_shards[i].lock);
+		free(dns_shards);
+		dns_shards = NULL;
+	}
+
 	free(dns_table);
+	dns_table = NULL;
 
 	if (dns_gc_run)
 		timer_cleanup(dns_gc_run);
 	return POM_ERR;
 }
 
+static void dns_entry_list_cleanup(struct dns_entry_list *lst) {
+
+	while (lst) {
+		struct dns_entry_list *tmp = lst;
+		lst = tmp->next;
+		if (tmp->key.type == dns_key_string)
+			free((char *) tmp->key.str);
+		free(tmp);
+	}
+}
+
+static void dns_entry_cleanup(struct dns_entry *entry) {
+
+	dns_entry_list_cleanup(entry->query);
+	dns_entry_list_cleanup(entry->values);
+	free(entry->record);
+	free(entry);
+	registry_perf_dec(dns_perf_cached_records, 1);
+}
 
 int dns_core_cleanup() {
 
@@ -177,179 +234,292 @@ int dns_core_cleanup() {
 
 	event_listener_unregister(dns_record_evt, dns_table);
 
+	dns_enabled = 0;
+
 	unsigned int i;
 	for (i = 0; i < DNS_TABLE_DEFAULT_SIZE; i++) {
 		while (dns_table[i]) {
 			struct dns_entry *tmp = dns_table[i];
-
-			while (tmp->query) {
-				struct dns_entry_list *lst = tmp->query;
-				tmp->query = lst->next;
-				free(lst);
-			}
-
-			while (tmp->values) {
-				struct dns_entry_list *lst = tmp->values;
-				tmp->values = lst->next;
-				free(lst);
-			}
-
 			dns_table[i] = tmp->next;
-			free(tmp->record);
-			free(tmp);
-			registry_perf_dec(dns_perf_cached_records, 1);
+			dns_entry_cleanup(tmp);
 		}
 	}
 
-	for (i = 0; i < DNS_CACHE_QUEUE_COUNT; i++) {
-		dns_cache_queues_head[i] = NULL;
-		dns_cache_queues_tail[i] = NULL;
-	}
+	for (i = 0; i < DNS_TABLE_SHARDS; i++)
+		pthread_rwlock_destroy(&dns_shards[i].lock);
+
+	free(dns_shards);
+	dns_shards = NULL;
 	free(dns_table);
+	dns_table = NULL;
 
 	timer_cleanup(dns_gc_run);
 
-	dns_enabled = 0;
-
 	return POM_OK;
 }
 
+static inline const void *dns_key_data(const struct dns_key *key) {
 
-uint32_t dns_record_hash(const char *record) {
-	return jhash(record, strlen(record), INITVAL) % DNS_TABLE_DEFAULT_SIZE;
+	if (key->type == dns_key_string)
+		return key->str;
+	return key->addr;
 }
 
-int dns_gc(void *priv, ptime now) {
+static void dns_key_hash(struct dns_key *key) {
 
-	pom_mutex_lock(&dns_table_lock);
+	key->hash = jhash(dns_key_data(key), key->len, INITVAL + key->type);
+}
 
-	int i;
-	for (i = 0; i < DNS_CACHE_QUEUE_COUNT; i++) {
+static inline int dns_key_equal(const struct dns_key *a, const struct dns_key *b) {
 
-		while (dns_cache_queues_head[i] && dns_cache_queues_head[i]->expiry < now) {
+	return a->hash == b->hash && a->type == b->type && a->len == b->len && !memcmp(dns_key_data(a), dns_key_data(b), a->len);
+}
 
-			// Remove the entry from the cache
-			struct dns_entry *entry = dns_cache_queues_head[i];
-			dns_cache_queues_head[i] = entry->cache_next;
-			if (dns_cache_queues_head[i]) {
-				dns_cache_queues_head[i]->cache_prev = NULL;
-			} else {
-				dns_cache_queues_tail[i] = NULL;
-			}
+static inline struct dns_shard *dns_key_shard(const struct dns_key *key) {
 
-			debug_dns("Clearing entry %s. Expiry %"PRIu64" < now %"PRIu64, entry->record, entry->expiry, now);
+	return &dns_shards[key->hash % DNS_TABLE_SHARDS];
+}
 
-			while (entry->query) {
-			
-				struct dns_entry *query = entry->query->entry;
+static inline uint32_t dns_key_bucket(const struct dns_key *key) {
 
-				// Remove references to this value from the queries
-				struct dns_entry_list *tmp_value;
-				for (tmp_value = query->values; tmp_value && tmp_value->entry != entry; tmp_value = tmp_value->next);
-				if (!tmp_value) {
-					pom_mutex_unlock(&dns_table_lock);
-					pomlog(POMLOG_ERR "Value of the query not found");
-					return POM_ERR;
-				}
+	return (key->hash / DNS_TABLE_SHARDS) % DNS_TABLE_SHARD_SIZE;
+}
 
-				if (tmp_value->next)
-					tmp_value->next->prev = tmp_value->prev;
-				
-				if (tmp_value->prev)
-					tmp_value->prev->next = tmp_value->next;
-				else
-					query->values = tmp_value->next;
+// Textual addresses are indexed by their binary value as well
+static void dns_key_from_string(struct dns_key *key, const char *record) {
 
-				free(tmp_value);
+	if (inet_pton(AF_INET, record, key->addr) == 1) {
+		key->type = dns_key_ipv4;
+		key->len = sizeof(struct in_addr);
+	} else if (strchr(record, ':') && inet_pton(AF_INET6, record, key->addr) == 1) {
+		key->type = dns_key_ipv6;
+		key->len = sizeof(struct in6_addr);
+	} else {
+		key->type = dns_key_string;
+		key->str = record;
+		key->len = strlen(record);
+	}
 
+	dns_key_hash(key);
+}
 
-				struct dns_entry_list *tmp = entry->query;
-				entry->query = tmp->next;
-				free(tmp);
-			}
+// The buffer is only used for ptypes which are neither a string nor an address
+static void dns_key_from_ptype(struct dns_key *key, struct ptype *record_pt, char *buff, size_t buff_len) {
+
+	if (record_pt->type == ptype_ipv4 && ptype_ipv4) {
+		key->type = dns_key_ipv4;
+		key->len = sizeof(struct in_addr);
+		memcpy(key->addr, &PTYPE_IPV4_GETADDR(record_pt), sizeof(struct in_addr));
+		dns_key_hash(key);
+	} else if (record_pt->type == ptype_ipv6 && ptype_ipv6) {
+		key->type = dns_key_ipv6;
+		key->len = sizeof(struct in6_addr);
+		memcpy(key->addr, &PTYPE_IPV6_GETADDR(record_pt), sizeof(struct in6_addr));
+		dns_key_hash(key);
+	} else if (record_pt->type == ptype_string) {
+		dns_key_from_string(key, PTYPE_STRING_GETVAL(record_pt));
+	} else {
+		ptype_print_val(record_pt, buff, buff_len, NULL);
+		dns_key_from_string(key, buff);
+	}
+}
 
-			while (entry->values) {
-			
-				struct dns_entry *value = entry->values->entry;
-
-				// Remove references to this query from the values
-				struct dns_entry_list *tmp_query;
-				for (tmp_query = value->query; tmp_query && tmp_query->entry != entry; tmp_query = tmp_query->next);
-				if (!tmp_query) {
-					pom_mutex_unlock(&dns_table_lock);
-					pomlog(POMLOG_ERR "Query of the value not found");
-					return POM_ERR;
-				}
+static int dns_key_print(const struct dns_key *key, char *buff, size_t buff_len) {
 
-				if (tmp_query->next)
-					tmp_query->next->prev = tmp_query->prev;
-				
-				if (tmp_query->prev)
-					tmp_query->prev->next = tmp_query->next;
-				else
-					value->query = tmp_query->next;
+	switch (key->type) {
+		case dns_key_ipv4:
+			return inet_ntop(AF_INET, key->addr, buff, buff_len) ? POM_OK : POM_ERR;
+		case dns_key_ipv6:
+			return inet_ntop(AF_INET6, key->addr, buff, buff_len) ? POM_OK : POM_ERR;
+		case dns_key_string:
+			break;
+	}
 
-				free(tmp_query);
+	if (key->len >= buff_len)
+		return POM_ERR;
+	memcpy(buff, key->str, key->len);
+	buff[key->len] = 0;
+	return POM_OK;
+}
 
+// Copy the key so that it remains valid once the entry or the buffer it comes from is gone
+static int dns_key_copy(struct dns_key *dst, const struct dns_key *src, char *buff, size_t buff_len) {
 
-				struct dns_entry_list *tmp = entry->values;
-				entry->values = tmp->next;
-				free(tmp);
-			}
+	memcpy(dst, src, sizeof(struct dns_key));
+	if (src->type != dns_key_string)
+		return POM_OK;
 
-			// Remove the entry from the hash table
-			if (entry->next)
-				entry->next->prev = entry->prev;
-		
-			if (entry->prev) {
-				entry->prev->next = entry->next;
-			} else {
-				uint32_t hash = dns_record_hash(entry->record);
-				dns_table[hash] = entry->next;
-			}
+	if (buff) {
+		if (src->len >= buff_len)
+			return POM_ERR;
+		memcpy(buff, src->str, src->len);
+		buff[src->len] = 0;
+		dst->str = buff;
+		return POM_OK;
+	}
 
-			// Now cleanup the entry itself
-			free(entry->record);
-			free(entry);
+	dst->str = strdup(src->str);
+	if (!dst->str) {
+		pom_oom(src->len + 1);
+		return POM_ERR;
+	}
 
-			registry_perf_dec(dns_perf_cached_records, 1);
-		}
+	return POM_OK;
+}
+
+static void dns_cache_remove(struct dns_shard *shard, struct dns_entry *entry) {
 
+	if (entry->cache_prev) {
+		entry->cache_prev->cache_next = entry->cache_next;
+	} else {
+		shard->cache_queues_head[entry->cache_queue] = entry->cache_next;
 	}
 
-	dns_check_cache();
+	if (entry->cache_next) {
+		entry->cache_next->cache_prev = entry->cache_prev;
+	} else {
+		shard->cache_queues_tail[entry->cache_queue] = entry->cache_prev;
+	}
+	entry->cache_prev = NULL;
+	entry->cache_next = NULL;
+}
 
-	pom_mutex_unlock(&dns_table_lock);
+// Must be called with the shard locked
+static struct dns_entry *dns_find_entry(struct dns_shard *shard, const struct dns_key *key) {
 
-	// Requeue the timer
-	timer_queue(dns_gc_run, DNS_GARBAGE_COLLECTOR_TIMEOUT);
+	struct dns_entry *entry;
+	for (entry = shard->table[dns_key_bucket(key)]; entry; entry = entry->next) {
+		if (dns_key_equal(&entry->key, key))
+			break;
+	}
 
-	return POM_OK;
+	debug_dns("Entry for %s is %p", entry ? entry->record : "?", entry);
+
+	return entry;
 }
 
-struct dns_entry *dns_find_or_add_entry(struct ptype *record_pt) {
+// Remove the link to link_key from the entry of key if it's still there
+static void dns_remove_link(const struct dns_key *key, const struct dns_key *link_key, int is_value) {
 
-	char *record = NULL;
-	char buff[40] = { 0 };
-	if (record_pt->type == ptype_string) {
-		record = PTYPE_STRING_GETVAL(record_pt);
-	} else {
-		// 40 is the max size of an ipv6 address
-		ptype_print_val(record_pt, buff, sizeof(buff), NULL);
-		record = buff;
+	struct dns_shard *shard = dns_key_shard(key);
+
+	pom_rwlock_wlock(&shard->lock);
+
+	struct dns_entry *entry = dns_find_entry(shard, key);
+	if (entry) {
+		struct dns_entry_list **lst = (is_value ? &entry->values : &entry->query);
+		while (*lst && !dns_key_equal(&(*lst)->key, link_key))
+			lst = &(*lst)->next;
+
+		if (*lst) {
+			struct dns_entry_list *tmp = *lst;
+			*lst = tmp->next;
+			tmp->next = NULL;
+			dns_entry_list_cleanup(tmp);
+		}
 	}
-	uint32_t hash = dns_record_hash(record);
 
-	struct dns_entry *entry;
+	pom_rwlock_unlock(&shard->lock);
+}
 
-	for (entry = dns_table[hash]; entry; entry = entry->next) {
-		if (!strcmp(entry->record, record))
-			break;
+// Remove the links of other entries to this one, it must not be in the table anymore
+static void dns_unlink_entry(struct dns_entry *entry) {
+
+	// Links always go both ways : the values of this entry have it as their query and vice versa
+	struct dns_entry_list *lst;
+	for (lst = entry->values; lst; lst = lst->next)
+		dns_remove_link(&lst->key, &entry->key, 0);
+
+	for (lst = entry->query; lst; lst = lst->next)
+		dns_remove_link(&lst->key, &entry->key, 1);
+}
+
+int dns_gc(void *priv, ptime now) {
+
+	// Handle one shard at a time and release its lock regularly so lookups are never held for long
+	unsigned int s;
+	for (s = 0; s < DNS_TABLE_SHARDS; s++) {
+
+		struct dns_shard *shard = &dns_shards[s];
+		int more = 1;
+
+		while (more) {
+
+			more = 0;
+			unsigned int count = 0;
+			struct dns_entry *removed = NULL;
+
+			pom_rwlock_wlock(&shard->lock);
+
+			int i;
+			for (i = 0; i < DNS_CACHE_QUEUE_COUNT && !more; i++) {
+
+				while (shard->cache_queues_head[i] && shard->cache_queues_head[i]->expiry < now) {
+
+					if (count >= DNS_GARBAGE_COLLECTOR_BATCH) {
+						more = 1;
+						break;
+					}
+
+					// Remove the entry from the cache
+					struct dns_entry *entry = shard->cache_queues_head[i];
+					dns_cache_remove(shard, entry);
+
+					debug_dns("Clearing entry %s. Expiry %"PRIu64" < now %"PRIu64, entry->record, entry->expiry, now);
+
+					// Remove the entry from the hash table
+					if (entry->next)
+						entry->next->prev = entry->prev;
+
+					if (entry->prev)
+						entry->prev->next = entry->next;
+					else
+						shard->table[dns_key_bucket(&entry->key)] = entry->next;
+
+					// The links to this entry are removed once the shard is unlocked
+					entry->prev = NULL;
+					entry->next = removed;
+					removed = entry;
+					count++;
+				}
+			}
+
+			dns_check_cache(shard);
+
+			pom_rwlock_unlock(&shard->lock);
+
+			// Linked entries may live in other shards, only one shard is locked at a time
+			while (removed) {
+				struct dns_entry *entry = removed;
+				removed = entry->next;
+				dns_unlink_entry(entry);
+				dns_entry_cleanup(entry);
+			}
+
+			registry_perf_inc(dns_perf_evictions, count);
+		}
 	}
 
+	// Requeue the timer
+	timer_queue(dns_gc_run, DNS_GARBAGE_COLLECTOR_TIMEOUT);
+
+	return POM_OK;
+}
+
+// Must be called with the shard write locked
+static struct dns_entry *dns_find_or_add_entry(struct dns_shard *shard, const struct dns_key *key) {
+
+	struct dns_entry *entry = dns_find_entry(shard, key);
 	if (entry)
 		return entry;
 
+	char buff[INET6_ADDRSTRLEN + 1];
+	const char *record = buff;
+	if (key->type == dns_key_string)
+		record = key->str;
+	else if (dns_key_print(key, buff, sizeof(buff)) != POM_OK)
+		return NULL;
+
 	entry = malloc(sizeof(struct dns_entry));
 	if (!entry) {
 		pom_oom(sizeof(struct dns_entry));
@@ -363,116 +533,122 @@ struct dns_entry *dns_find_or_add_entry(struct ptype *record_pt) {
 		pom_oom(strlen(record) + 1);
 		return NULL;
 	}
-	entry->next = dns_table[hash];
+
+	memcpy(&entry->key, key, sizeof(struct dns_key));
+	if (key->type == dns_key_string)
+		entry->key.str = entry->record;
+
+	uint32_t bucket = dns_key_bucket(key);
+	entry->next = shard->table[bucket];
 	if (entry->next)
 		entry->next->prev = entry;
-	dns_table[hash] = entry;
+	shard->table[bucket] = entry;
 
 	registry_perf_inc(dns_perf_cached_records, 1);
 
 	return entry;
 }
 
-static int dns_update_expiry(struct dns_entry *a, struct dns_entry *b, uint32_t ttl) {
-
-	ptime now = core_get_clock(&now);
-
-	ptime expiry = now + ((ttl + DNS_ADDITIONAL_TIMEOUT) * 1000000UL);
-
-	if (a->expiry >= expiry) {
-		a = NULL;
-	}
-
-	if (b->expiry >= expiry) {
-		b = NULL;
-	} else if (!a) {
-		a = b;
-		b = NULL;
-	}
+// Must be called with the shard write locked
+static void dns_update_expiry(struct dns_shard *shard, struct dns_entry *entry, uint32_t ttl, ptime expiry) {
 
 	// Find if there is actually something to do
-	if (!a)
-		return POM_OK;
+	if (entry->expiry >= expiry)
+		return;
 
-	// Remove a from the cache
-	if (a->expiry) {
-		if (a->cache_prev) {
-			a->cache_prev->cache_next = a->cache_next;
-		} else {
-			dns_cache_queues_head[a->cache_queue] = a->cache_next;
-		}
-
-		if (a->cache_next) {
-			a->cache_next->cache_prev = a->cache_prev;
-		} else {
-			dns_cache_queues_tail[a->cache_queue] = a->cache_prev;
-		}
-		a->cache_prev = NULL;
-		a->cache_next = NULL;
-	}
-
-	// Remove b from the cache
-	if (b && b->expiry) {
-		if (b->cache_prev) {
-			b->cache_prev->cache_next = b->cache_next;
-		} else {
-			dns_cache_queues_head[b->cache_queue] = b->cache_next;
-		}
-
-		if (b->cache_next) {
-			b->cache_next->cache_prev = b->cache_prev;
-		} else {
-			dns_cache_queues_tail[b->cache_queue] = b->cache_prev;
-		}
-		b->cache_prev = NULL;
-		b->cache_next= NULL;
-	}
+	// Remove the entry from the cache
+	if (entry->expiry)
+		dns_cache_remove(shard, entry);
 
 	// Find in which queue this goes
 	unsigned int q;
 	for (q = 0; q < (DNS_CACHE_QUEUE_COUNT - 1) && dns_cache_queues_time[q] <= ttl; q++);
 
 	// Find where it goes in the queue
-	if (!dns_cache_queues_head[q]) {
-		dns_cache_queues_head[q] = a;
-		dns_cache_queues_tail[q] = a;
+	if (!shard->cache_queues_head[q]) {
+		shard->cache_queues_head[q] = entry;
+		shard->cache_queues_tail[q] = entry;
 	} else {
 		struct dns_entry *tmp;
-		for (tmp = dns_cache_queues_tail[q]; tmp && (tmp->expiry > expiry); tmp = tmp->cache_prev);
+		for (tmp = shard->cache_queues_tail[q]; tmp && (tmp->expiry > expiry); tmp = tmp->cache_prev);
 
 		if (!tmp) { // Reached the begining
-			a->cache_next = dns_cache_queues_head[q];
-			if (a->cache_next)
-				a->cache_next->cache_prev = a;
-			dns_cache_queues_head[q] = a;
+			entry->cache_next = shard->cache_queues_head[q];
+			if (entry->cache_next)
+				entry->cache_next->cache_prev = entry;
+			shard->cache_queues_head[q] = entry;
 		} else { // Stopped somewhere in the list
-			a->cache_prev = tmp;
-			a->cache_next = tmp->cache_next;
-			tmp->cache_next = a;
-			if (a->cache_next)
-				a->cache_next->cache_prev = a;
+			entry->cache_prev = tmp;
+			entry->cache_next = tmp->cache_next;
+			tmp->cache_next = entry;
+			if (entry->cache_next)
+				entry->cache_next->cache_prev = entry;
 			else
-				dns_cache_queues_tail[q] = a;
+				shard->cache_queues_tail[q] = entry;
 		}
 	}
-	a->cache_queue = q;
-	a->expiry = expiry;
-
-	if (b) {
-		// Add b after a
-		b->cache_prev = a;
-		b->cache_next = a->cache_next;
-		a->cache_next = b;
-		
-		if (b->cache_next) {
-			b->cache_next->cache_prev = b;
-		} else {
-			dns_cache_queues_tail[q] = b;
+	entry->cache_queue = q;
+	entry->expiry = expiry;
+}
+
+// Add the entry for the key if needed, refresh its expiry and link it to the other key
+static int dns_link_entry(const struct dns_key *key, const struct dns_key *link_key, int is_value, uint32_t ttl, ptime expiry) {
+
+	struct dns_shard *shard = dns_key_shard(key);
+
+	pom_rwlock_wlock(&shard->lock);
+
+	struct dns_entry *entry = dns_find_or_add_entry(shard, key);
+	if (!entry) {
+		pom_rwlock_unlock(&shard->lock);
+		return POM_ERR;
+	}
+
+	dns_update_expiry(shard, entry, ttl, expiry);
+
+	dns_check_cache(shard);
+
+	struct dns_entry_list **head = (is_value ? &entry->values : &entry->query);
+
+	// Check if the entry is already associated with the other one
+	struct dns_entry_list *lst, **last = NULL;
+	unsigned int count = 0;
+	for (lst = *head; lst && !dns_key_equal(&lst->key, link_key); lst = lst->next) {
+		last = (count ? &(*last)->next : head);
+		count++;
+	}
+
+	if (lst) {
+		pom_rwlock_unlock(&shard->lock);
+		return POM_OK;
+	}
+
+	if (count >= DNS_ENTRY_LINK_MAX) {
+		// Forget the oldest link, lookups only follow the most recent one
+		lst = *last;
+		*last = NULL;
+		if (lst->key.type == dns_key_string)
+			free((char *) lst->key.str);
+	} else {
+		lst = malloc(sizeof(struct dns_entry_list));
+		if (!lst) {
+			pom_rwlock_unlock(&shard->lock);
+			pom_oom(sizeof(struct dns_entry_list));
+			return POM_ERR;
 		}
-		b->cache_queue = q;
-		b->expiry = expiry;
 	}
+	memset(lst, 0, sizeof(struct dns_entry_list));
+
+	if (dns_key_copy(&lst->key, link_key, NULL, 0) != POM_OK) {
+		pom_rwlock_unlock(&shard->lock);
+		free(lst);
+		return POM_ERR;
+	}
+
+	lst->next = *head;
+	*head = lst;
 
+	pom_rwlock_unlock(&shard->lock);
 
 	return POM_OK;
 }
@@ -505,143 +681,100 @@ int dns_process_event(struct event *evt, void *obj) {
 	if (ttl > DNS_TTL_MAX) // Restrict TTL to a maximum value
 		ttl = DNS_TTL_MAX;
 
-	pom_mutex_lock(&dns_table_lock);
+	ptime now = core_get_clock(&now);
+	ptime expiry = now + ((ttl + DNS_ADDITIONAL_TIMEOUT) * 1000000UL);
 
-	struct dns_entry *query = dns_find_or_add_entry(evt_data[analyzer_dns_record_name].value);
-	if (!query) {
-		pom_mutex_unlock(&dns_table_lock);
-		return POM_ERR;
-	}
+	// 40 is the max size of an ipv6 address
+	char query_buff[40] = { 0 }, response_buff[40] = { 0 };
+	struct dns_key query, response;
+	dns_key_from_ptype(&query, evt_data[analyzer_dns_record_name].value, query_buff, sizeof(query_buff));
+	dns_key_from_ptype(&response, record, response_buff, sizeof(response_buff));
 
-	struct dns_entry *response = dns_find_or_add_entry(record);
-	if (!response) {
-		pom_mutex_unlock(&dns_table_lock);
-		return POM_ERR;
-	}
+	debug_dns("Linking %s to %s", query.type == dns_key_string ? query.str : "?", response.type == dns_key_string ? response.str : "?");
 
-	// Update expiration queues with those entries
-	if (dns_update_expiry(query, response, ttl) != POM_OK)
+	// Each side is updated with only its own shard locked
+	if (dns_link_entry(&query, &response, 1, ttl, expiry) != POM_OK)
 		return POM_ERR;
-		
-	dns_check_cache();
 
-	// Check if the response already has this entry
-	
-	struct dns_entry_list *lst;
-	for (lst = response->query; lst; lst = lst->next) {
-		if (!strcmp(lst->entry->record, query->record))
-			break;
-	}
+	return dns_link_entry(&response, &query, 0, ttl, expiry);
+}
 
-	if (lst) { // The response is already associated with the query
-		pom_mutex_unlock(&dns_table_lock);
-		return POM_OK;
-	}
-	
-	debug_dns("Linking %s to %s", query->record, response->record);
-
-	// Link the query and the response
-	struct dns_entry_list *fwd = NULL, *rev = NULL;
-	fwd = malloc(sizeof(struct dns_entry_list));
-	if (!fwd) {
-		pom_mutex_unlock(&dns_table_lock);
-		pom_oom(sizeof(struct dns_entry_list));
-		return POM_ERR;
-	}
-	memset(fwd, 0, sizeof(struct dns_entry_list));
+static char *dns_lookup(const struct dns_key *record_key, int forward) {
 
-	rev = malloc(sizeof(struct dns_entry_list));
-	if (!rev) {
-		pom_mutex_unlock(&dns_table_lock);
-		free(fwd);
-		pom_oom(sizeof(struct dns_entry_list));
-		return POM_ERR;
-	}
-	memset(rev, 0, sizeof(struct dns_entry_list));
-
-	fwd->entry = response;
-	fwd->next = query->values;
-	if (fwd->next)
-		fwd->next->prev = fwd;
-	query->values = fwd;
-
-	rev->entry = query;
-	rev->next = response->query;
-	if (rev->next)
-		rev->next->prev = rev;
-	response->query = rev;
-
-	pom_mutex_unlock(&dns_table_lock);
-	
-	return POM_OK;
-}
+	if (!dns_enabled)
+		return NULL;
 
-static struct dns_entry *dns_find_entry(const char *record) {
+	// Entries are linked by key so only one shard is locked at a time
+	// The keys and the result are copied on the stack while following the chain
+	char key_buff[NS_MAXDNAME], res[NS_MAXDNAME];
+	struct dns_key key;
+	memcpy(&key, record_key, sizeof(struct dns_key));
 
-	uint32_t hash = dns_record_hash(record);
+	int i, found = 0;
+	for (i = 0; i <= DNS_MAX_LOOKUP_DEPTH; i++) {
 
-	struct dns_entry *entry = dns_table[hash];
-	
-	for (entry = dns_table[hash]; entry; entry = entry->next) {
-		if (!strcmp(entry->record, record))
-			break;
-	}
+		struct dns_shard *shard = dns_key_shard(&key);
 
-	debug_dns("Entry for %s is %p", record, entry);
+		pom_rwlock_rlock(&shard->lock);
 
-	return entry;
+		struct dns_entry *entry = dns_find_entry(shard, &key);
+		if (!entry) {
+			// The linked entry may have expired already
+			pom_rwlock_unlock(&shard->lock);
+			break;
+		}
 
-}
+		size_t len = strlen(entry->record);
+		if (len >= sizeof(res)) {
+			pom_rwlock_unlock(&shard->lock);
+			break;
+		}
+		memcpy(res, entry->record, len + 1);
+		found = 1;
 
-char* dns_forward_lookup(const char *record) {
+		struct dns_entry_list *next = (forward ? entry->values : entry->query);
+		if (!next || i == DNS_MAX_LOOKUP_DEPTH || dns_key_copy(&key, &next->key, key_buff, sizeof(key_buff)) != POM_OK) {
+			pom_rwlock_unlock(&shard->lock);
+			break;
+		}
 
-	if (!dns_enabled)
-		return NULL;
+		pom_rwlock_unlock(&shard->lock);
+	}
 
-	pom_mutex_lock(&dns_table_lock);
-	
-	struct dns_entry *entry = dns_find_entry(record);
-	
-	if (!entry) {
-		pom_mutex_unlock(&dns_table_lock);
+	if (!found) {
+		registry_perf_inc(dns_perf_lookup_misses, 1);
 		return NULL;
 	}
 
-	int i;
-	for (i = 0; entry && entry->values && i < DNS_MAX_LOOKUP_DEPTH; i++, entry = entry->values->entry);
-
-	char *res = NULL;
-	if (entry)
-		res = strdup(entry->record);
+	registry_perf_inc(dns_perf_lookup_hits, 1);
 
-	pom_mutex_unlock(&dns_table_lock);
+	char *out = strdup(res);
+	if (!out)
+		pom_oom(strlen(res) + 1);
 
-	return res;
+	return out;
 }
-char* dns_reverse_lookup(const char *record) {
+
+char* dns_forward_lookup(const char *record) {
 
 	if (!dns_enabled)
 		return NULL;
 
-	pom_mutex_lock(&dns_table_lock);
+	struct dns_key key;
+	dns_key_from_string(&key, record);
 
-	struct dns_entry *entry = dns_find_entry(record);
-	
-	if (!entry) {
-		pom_mutex_unlock(&dns_table_lock);
-		return NULL;
-	}
+	return dns_lookup(&key, 1);
+}
 
-	int i;
-	for (i = 0; entry && entry->query && i < DNS_MAX_LOOKUP_DEPTH; i++, entry = entry->query->entry);
+char* dns_reverse_lookup(const char *record) {
 
-	char *res = NULL;
-	if (entry)
-		res = strdup(entry->record);
+	if (!dns_enabled)
+		return NULL;
 
-	pom_mutex_unlock(&dns_table_lock);
+	struct dns_key key;
+	dns_key_from_string(&key, record);
 
-	return res;
+	return dns_lookup(&key, 0);
 }
 
 char *dns_forward_lookup_ptype(struct ptype *record_pt) {
@@ -651,14 +784,10 @@ char *dns_forward_lookup_ptype(struct ptype *record_pt) {
 
 	// 40 is the max size of an ipv6 address
 	char buff[40] = { 0 };
-	char *record = NULL;
-	if (record_pt->type == ptype_string) {
-		record = PTYPE_STRING_GETVAL(record_pt);
-	} else {
-		ptype_print_val(record_pt, buff, sizeof(buff), NULL);
-		record = buff;
-	}
-	return dns_forward_lookup(record);
+	struct dns_key key;
+	dns_key_from_ptype(&key, record_pt, buff, sizeof(buff));
+
+	return dns_lookup(&key, 1);
 }
 
 char *dns_reverse_lookup_ptype(struct ptype *record_pt) {
@@ -668,12 +797,8 @@ char *dns_reverse_lookup_ptype(struct ptype *record_pt) {
 
 	// 40 is the max size of an ipv6 address
 	char buff[40] = { 0 };
-	char *record = NULL;
-	if (record_pt->type == ptype_string) {
-		record = PTYPE_STRING_GETVAL(record_pt);
-	} else {
-		ptype_print_val(record_pt, buff, sizeof(buff), NULL);
-		record = buff;
-	}
-	return dns_reverse_lookup(record);
+	struct dns_key key;
+	dns_key_from_ptype(&key, record_pt, buff, sizeof(buff));
+
+	return dns_lookup(&key, 0);
 }
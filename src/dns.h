@@ -24,27 +24,63 @@
 
 #define DNS_TABLE_DEFAULT_SIZE 16384
 
+// Number of parts of the table, each with its own lock and cache queues
+#define DNS_TABLE_SHARDS 64
+
+#define DNS_TABLE_SHARD_SIZE (DNS_TABLE_DEFAULT_SIZE / DNS_TABLE_SHARDS)
+
 #define DNS_GARBAGE_COLLECTOR_TIMEOUT 60
 
+// Maximum number of entries removed by the GC before releasing the shard lock
+#define DNS_GARBAGE_COLLECTOR_BATCH 256
+
+#define DNS_CACHE_QUEUE_COUNT	10
+
 // Maximum lookup depth
 #define DNS_MAX_LOOKUP_DEPTH	16
 
+// Maximum number of links kept per entry and direction
+#define DNS_ENTRY_LINK_MAX	16
+
 // Restrict maximum caching time to one day
 #define DNS_TTL_MAX (60 * 60 * 24)
 
 #include <pom-ng/ptype.h>
 #include <pom-ng/event.h>
 
+#include <arpa/nameser.h>
+
+enum dns_key_type {
+	dns_key_string,
+	dns_key_ipv4,
+	dns_key_ipv6
+};
+
+// Addresses are indexed with their binary value so that looking them up doesn't need to print them
+struct dns_key {
+
+	enum dns_key_type type;
+	uint32_t hash;
+	uint32_t len;
+	union {
+		const char *str;
+		unsigned char addr[16];
+	};
+
+};
+
 struct dns_entry_list {
 
-	struct dns_entry *entry;
-	struct dns_entry_list *prev, *next;
+	// Key of the linked entry, entries may live in different shards
+	struct dns_key key;
+	struct dns_entry_list *next;
 
 };
 
 struct dns_entry {
 
 	char *record;
+	struct dns_key key;
 	ptime expiry;
 
 	// Query for which this record is a value
@@ -62,6 +98,15 @@ struct dns_entry {
 
 };
 
+struct dns_shard {
+
+	pthread_rwlock_t lock;
+	struct dns_entry **table;
+	struct dns_entry *cache_queues_head[DNS_CACHE_QUEUE_COUNT];
+	struct dns_entry *cache_queues_tail[DNS_CACHE_QUEUE_COUNT];
+
+};
+
 int dns_init();
 int dns_core_init();
 int dns_core_cleanup();
@@ -38,6 +38,8 @@ static unsigned int event_pload_listener_ref = 0;
 
 static struct registry_class *event_registry_class = NULL;
 
+static void event_listener_async_stop(struct event_listener_async *async);
+
 int event_init() {
 
 	event_registry_class = registry_add_class(EVENT_REGISTRY);
@@ -110,7 +112,11 @@ struct event_reg *event_register(struct event_reg_info *reg_info) {
 	evt->perf_listeners = registry_instance_add_perf(evt->reg_instance, "listeners", registry_perf_type_gauge, "Number of event listeners", "listeners");
 	evt->perf_ongoing = registry_instance_add_perf(evt->reg_instance, "ongoing", registry_perf_type_gauge, "Number of ongoing events", "events");
 	evt->perf_processed = registry_instance_add_perf(evt->reg_instance, "processed", registry_perf_type_counter, "Number of events fully processed", "events");
-	if (!evt->perf_listeners || !evt->perf_ongoing || !evt->perf_processed) {
+	evt->perf_async_queued = registry_instance_add_perf(evt->reg_instance, "async_queued", registry_perf_type_gauge, "Number of events queued for asynchronous listeners", "events");
+	evt->perf_async_dropped = registry_instance_add_perf(evt->reg_instance, "async_dropped", registry_perf_type_counter, "Number of events dropped because the queue of an asynchronous listener was full", "events");
+	evt->perf_async_latency = registry_instance_add_perf(evt->reg_instance, "async_latency", registry_perf_type_counter, "Total time spent by events in the queue of asynchronous listeners", "us");
+	evt->perf_listener_time = registry_instance_add_perf(evt->reg_instance, "listener_time", registry_perf_type_histogram, "Time spent in each call to a listener", NULL);
+	if (!evt->perf_listeners || !evt->perf_ongoing || !evt->perf_processed || !evt->perf_async_queued || !evt->perf_async_dropped || !evt->perf_async_latency || !evt->perf_listener_time) {
 		registry_remove_instance(evt->reg_instance);
 		free(evt);
 		return NULL;
@@ -331,6 +337,10 @@ int event_listener_unregister(struct event_reg *evt_reg, void *obj) {
 		return POM_ERR;
 	}
 
+	// Process what's left in the queue before ending the ongoing events
+	if (lst->async)
+		event_listener_async_stop(lst->async);
+
 	if (lst->process_end) {
 		struct event_reg_events *cur_evt, *tmp_evt;
 
@@ -363,6 +373,193 @@ int event_listener_unregister(struct event_reg *evt_reg, void *obj) {
 	return POM_OK;
 }
 
+static void *event_listener_async_thread(void *arg) {
+
+	struct event_listener_async *async = arg;
+	struct event_listener *lst = async->lst;
+	struct event_reg *evt_reg = async->evt_reg;
+
+	pom_mutex_lock(&async->lock);
+
+	while (1) {
+
+		while (!async->count && async->run) {
+			int res = pthread_cond_wait(&async->cond, &async->lock);
+			if (res) {
+				pomlog(POMLOG_ERR "Error while waiting for the async listener condition : %s", pom_strerror(res));
+				abort();
+			}
+		}
+
+		// Stop only once the queue is empty
+		if (!async->count)
+			break;
+
+		struct event_async_entry entry = async->queue[async->head];
+		async->head = (async->head + 1) % async->size;
+		async->count--;
+		pthread_cond_signal(&async->full_cond);
+
+		pom_mutex_unlock(&async->lock);
+
+		registry_perf_dec(evt_reg->perf_async_queued, 1);
+		registry_perf_inc(evt_reg->perf_async_latency, pom_gettimeofday() - entry.queued);
+
+		uint64_t start = core_perf_layer_start();
+		if (lst->process_end(entry.evt, lst->obj) != POM_OK)
+			pomlog(POMLOG_WARN "An error occured while processing event %s", evt_reg->info->name);
+		core_perf_layer_stop(evt_reg->perf_listener_time, start);
+
+		event_refcount_dec(entry.evt);
+
+		pom_mutex_lock(&async->lock);
+	}
+
+	pom_mutex_unlock(&async->lock);
+
+	registry_perf_thread_cleanup();
+
+	return NULL;
+}
+
+static int event_listener_async_queue(struct event_listener_async *async, struct event *evt) {
+
+	pom_mutex_lock(&async->lock);
+
+	while (async->count >= async->size) {
+		if (async->flags & EVENT_LISTENER_ASYNC_FLAG_DROP) {
+			pom_mutex_unlock(&async->lock);
+			registry_perf_inc(async->evt_reg->perf_async_dropped, 1);
+			return POM_OK;
+		}
+
+		// Wait for the listener to catch up
+		int res = pthread_cond_wait(&async->full_cond, &async->lock);
+		if (res) {
+			pomlog(POMLOG_ERR "Error while waiting for the async listener queue : %s", pom_strerror(res));
+			abort();
+		}
+	}
+
+	// The listener holds a reference until it processed the event
+	event_refcount_inc(evt);
+
+	struct event_async_entry *entry = &async->queue[(async->head + async->count) % async->size];
+	entry->evt = evt;
+	entry->queued = pom_gettimeofday();
+	async->count++;
+
+	pthread_cond_signal(&async->cond);
+	pom_mutex_unlock(&async->lock);
+
+	registry_perf_inc(async->evt_reg->perf_async_queued, 1);
+
+	return POM_OK;
+}
+
+static void event_listener_async_stop(struct event_listener_async *async) {
+
+	pom_mutex_lock(&async->lock);
+	async->run = 0;
+	pthread_cond_signal(&async->cond);
+	pom_mutex_unlock(&async->lock);
+
+	pthread_join(async->thread, NULL);
+
+	async->lst->async = NULL;
+
+	pthread_cond_destroy(&async->full_cond);
+	pthread_cond_destroy(&async->cond);
+	pthread_mutex_destroy(&async->lock);
+	free(async->queue);
+	free(async);
+}
+
+// Process the end of the events in a dedicated thread. Such listeners can only use the event data
+// as the conntrack and the event private data are released once the processing of the event ended.
+int event_listener_set_async(struct event_reg *evt_reg, void *obj, unsigned int queue_size, unsigned int flags) {
+
+	core_assert_is_paused();
+
+	struct event_listener *lst;
+	for (lst = evt_reg->listeners; lst && lst->obj != obj; lst = lst->next);
+
+	if (!lst) {
+		pomlog(POMLOG_ERR "Object %p not found in the listeners list of event %s",  obj, evt_reg->info->name);
+		return POM_ERR;
+	}
+
+	// The stack is only valid while the packet is processed
+	if (lst->process_begin || !lst->process_end) {
+		pomlog(POMLOG_ERR "Only listeners of the end of event %s can be asynchronous", evt_reg->info->name);
+		return POM_ERR;
+	}
+
+	if (lst->async || !queue_size) {
+		pomlog(POMLOG_ERR "Invalid asynchronous settings for listener %p of event %s", obj, evt_reg->info->name);
+		return POM_ERR;
+	}
+
+	struct event_listener_async *async = malloc(sizeof(struct event_listener_async));
+	if (!async) {
+		pom_oom(sizeof(struct event_listener_async));
+		return POM_ERR;
+	}
+	memset(async, 0, sizeof(struct event_listener_async));
+
+	async->queue = malloc(sizeof(struct event_async_entry) * queue_size);
+	if (!async->queue) {
+		pom_oom(sizeof(struct event_async_entry) * queue_size);
+		goto err_async;
+	}
+
+	async->lst = lst;
+	async->evt_reg = evt_reg;
+	async->flags = flags;
+	async->size = queue_size;
+	async->run = 1;
+
+	int res = pthread_mutex_init(&async->lock, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while initializing the async listener lock : %s", pom_strerror(res));
+		goto err_queue;
+	}
+
+	res = pthread_cond_init(&async->cond, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while initializing the async listener condition : %s", pom_strerror(res));
+		goto err_lock;
+	}
+
+	res = pthread_cond_init(&async->full_cond, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while initializing the async listener condition : %s", pom_strerror(res));
+		goto err_cond;
+	}
+
+	if (pthread_create(&async->thread, NULL, event_listener_async_thread, async)) {
+		pomlog(POMLOG_ERR "Error while creating the async listener thread : %s", pom_strerror(errno));
+		goto err_full_cond;
+	}
+
+	lst->async = async;
+
+	return POM_OK;
+
+err_full_cond:
+	pthread_cond_destroy(&async->full_cond);
+err_cond:
+	pthread_cond_destroy(&async->cond);
+err_lock:
+	pthread_mutex_destroy(&async->lock);
+err_queue:
+	free(async->queue);
+err_async:
+	free(async);
+
+	return POM_ERR;
+}
+
 int event_add_listener(struct event *evt, void *obj, int (*process_begin) (struct event *evt, void *obj, struct proto_process_stack *stack, unsigned int stack_index), int (*process_end) (struct event *evt, void *obj)) {
 
 	if (process_begin && process_begin(evt, obj, NULL, 0) != POM_OK)
@@ -417,12 +614,19 @@ int event_process(struct event *evt, struct proto_process_stack *stack, int stac
 		if (lst->filter && event_filter_match(lst->filter, evt) != FILTER_MATCH_YES)
 			continue;
 
+		if (lst->async) {
+			event_listener_async_queue(lst->async, evt);
+			continue;
+		}
+
+		uint64_t start = core_perf_layer_start();
 		if (lst->process_begin && lst->process_begin(evt, lst->obj, stack, stack_index) != POM_OK) {
 			pomlog(POMLOG_WARN "An error occured while processing begining of event %s", evt->reg->info->name);
 		}
 		if (lst->process_end && lst->process_end(evt, lst->obj) != POM_OK) {
 			pomlog(POMLOG_WARN "An error occured while processing event %s", evt->reg->info->name);
 		}
+		core_perf_layer_stop(evt->reg->perf_listener_time, start);
 	}
 
 	for (lst = evt->tmp_listeners; lst; lst = lst->next) {
@@ -477,9 +681,11 @@ int event_process_begin(struct event *evt, struct proto_process_stack *stack, in
 		if (lst->filter && event_filter_match(lst->filter, evt) != FILTER_MATCH_YES)
 			continue;
 
+		uint64_t start = core_perf_layer_start();
 		if (lst->process_begin(evt, lst->obj, stack, stack_index) != POM_OK) {
 			pomlog(POMLOG_WARN "An error occured while processing begining of event %s", evt->reg->info->name);
 		}
+		core_perf_layer_stop(evt->reg->perf_listener_time, start);
 	}
 
 	pom_mutex_lock(&evt->reg->evts_lock);
@@ -531,9 +737,16 @@ int event_process_end(struct event *evt) {
 		if (lst->filter && event_filter_match(lst->filter, evt) != FILTER_MATCH_YES)
 			continue;
 
+		if (lst->async) {
+			event_listener_async_queue(lst->async, evt);
+			continue;
+		}
+
+		uint64_t start = core_perf_layer_start();
 		if (lst->process_end(evt, lst->obj) != POM_OK) {
 			pomlog(POMLOG_WARN "An error occured while processing event %s", evt->reg->info->name);
 		}
+		core_perf_layer_stop(evt->reg->perf_listener_time, start);
 	}
 
 	for (lst = evt->tmp_listeners; lst; lst = lst->next) {
@@ -53,6 +53,10 @@ struct event_reg {
 	struct registry_perf *perf_listeners;
 	struct registry_perf *perf_ongoing;
 	struct registry_perf *perf_processed;
+	struct registry_perf *perf_async_queued;
+	struct registry_perf *perf_async_dropped;
+	struct registry_perf *perf_async_latency;
+	struct registry_perf *perf_listener_time;
 	pthread_mutex_t evts_lock;
 };
 
@@ -62,12 +66,35 @@ struct event_reg_events {
 	UT_hash_handle hh;
 };
 
+struct event_async_entry {
+	struct event *evt;
+	ptime queued;
+};
+
+// Queue of events processed by a dedicated thread for a listener
+struct event_listener_async {
+	struct event_listener *lst;
+	struct event_reg *evt_reg;
+	unsigned int flags;
+
+	struct event_async_entry *queue;
+	unsigned int size, head, count;
+	int run;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // Signaled when an event is queued
+	pthread_cond_t full_cond; // Signaled when an event is dequeued
+};
+
 struct event_listener {
 	void *obj;
 	struct filter *filter;
 	int (*process_begin) (struct event *evt, void *obj, struct proto_process_stack *stack, unsigned int stack_index);
 	int (*process_end) (struct event *evt, void *obj);
 
+	struct event_listener_async *async;
+
 	struct event_listener *prev, *next;
 };
 
@@ -101,6 +101,10 @@ void filter_node_cleanup(struct filter *f, struct filter_node *n) {
 void filter_cleanup(struct filter *f) {
 
 	filter_node_cleanup(f, f->n);
+	if (f->prog)
+		free(f->prog);
+	if (f->slots)
+		free(f->slots);
 	free(f);
 }
 
@@ -513,6 +517,123 @@ int filter_validate(struct filter_node *n) {
 	return POM_OK;
 }
 
+// Get the slot index for an object looked up by the properties
+
+int filter_slot_get(struct filter *f, void *key) {
+
+	unsigned int i;
+	for (i = 0; i < f->slot_count; i++) {
+		if (f->slots[i] == key)
+			return i;
+	}
+
+	void **slots = realloc(f->slots, sizeof(void *) * (f->slot_count + 1));
+	if (!slots) {
+		pom_oom(sizeof(void *) * (f->slot_count + 1));
+		return POM_ERR;
+	}
+	f->slots = slots;
+	f->slots[f->slot_count] = key;
+
+	return f->slot_count++;
+}
+
+// Flatten the node tree into a program
+
+static unsigned int filter_prog_size(struct filter_node *n) {
+
+	if (n->op != FILTER_OP_AND && n->op != FILTER_OP_OR)
+		return 1;
+
+	return filter_prog_size(n->value[0].val.node) + 1 + filter_prog_size(n->value[1].val.node) + (n->not ? 1 : 0);
+}
+
+static int filter_prog_mirror_op(int op) {
+
+	switch (op) {
+		case FILTER_OP_GT:
+			return FILTER_OP_LT;
+		case FILTER_OP_GE:
+			return FILTER_OP_LE;
+		case FILTER_OP_LT:
+			return FILTER_OP_GT;
+		case FILTER_OP_LE:
+			return FILTER_OP_GE;
+	}
+
+	return op;
+}
+
+static void filter_prog_leaf(struct filter_node *n, struct filter_insn *insn) {
+
+	insn->type = filter_insn_node;
+	insn->op = n->op;
+	insn->not = n->not;
+	insn->n = n;
+
+	if (n->op == FILTER_OP_NOP) {
+		if (n->value[0].type == filter_value_type_prop) {
+			insn->type = filter_insn_exists;
+			insn->prop = &n->value[0];
+		}
+		return;
+	}
+
+	// Find out which side is the property and which one is the constant
+	struct filter_value *cst = NULL;
+	if (n->value[0].type == filter_value_type_prop && n->value[1].type != filter_value_type_prop) {
+		insn->prop = &n->value[0];
+		cst = &n->value[1];
+	} else if (n->value[1].type == filter_value_type_prop && n->value[0].type != filter_value_type_prop) {
+		insn->prop = &n->value[1];
+		cst = &n->value[0];
+		insn->op = filter_prog_mirror_op(n->op);
+	} else {
+		return;
+	}
+
+	switch (cst->type) {
+		case filter_value_type_int:
+			insn->type = filter_insn_int;
+			break;
+		case filter_value_type_string:
+			insn->type = filter_insn_string;
+			break;
+		case filter_value_type_ptype:
+			insn->type = filter_insn_ptype;
+			break;
+		default:
+			insn->type = filter_insn_node;
+			insn->op = n->op;
+			insn->prop = NULL;
+			return;
+	}
+
+	insn->cst = cst->val;
+}
+
+static unsigned int filter_prog_emit(struct filter_node *n, struct filter_insn *prog, unsigned int pos) {
+
+	if (n->op != FILTER_OP_AND && n->op != FILTER_OP_OR) {
+		filter_prog_leaf(n, &prog[pos]);
+		return pos + 1;
+	}
+
+	pos = filter_prog_emit(n->value[0].val.node, prog, pos);
+
+	// Short circuit the second value, the jump lands on the NOT if any
+	unsigned int jmp = pos++;
+	prog[jmp].type = (n->op == FILTER_OP_AND ? filter_insn_jmp_no : filter_insn_jmp_yes);
+
+	pos = filter_prog_emit(n->value[1].val.node, prog, pos);
+	prog[jmp].target = pos;
+
+	if (n->not)
+		prog[pos++].type = filter_insn_not;
+
+	return pos;
+}
+
 int filter_compile(char *filter_expr, struct filter *f) {
 
 	if (f->n) {
@@ -528,6 +649,19 @@ int filter_compile(char *filter_expr, struct filter *f) {
 		return POM_ERR;
 	}
 
+	if (!f->n)
+		return POM_OK;
+
+	f->prog_len = filter_prog_size(f->n);
+	f->prog = malloc(sizeof(struct filter_insn) * f->prog_len);
+	if (!f->prog) {
+		pom_oom(sizeof(struct filter_insn) * f->prog_len);
+		return POM_ERR;
+	}
+	memset(f->prog, 0, sizeof(struct filter_insn) * f->prog_len);
+
+	filter_prog_emit(f->n, f->prog, 0);
+
 	return POM_OK;
 }
 
@@ -673,9 +807,114 @@ int filter_match_node(struct filter *f, struct filter_node *n, void *obj) {
 	return res;
 }
 
+static int filter_match_insn(struct filter *f, struct filter_insn *insn, void *obj) {
+
+	if (insn->type == filter_insn_node)
+		return filter_match_node(f, insn->n, obj);
+
+	struct filter_value value = { 0 };
+	if (f->prop_get_val(insn->prop, &value, obj) != POM_OK)
+		return POM_ERR;
+
+	int res = FILTER_MATCH_NO;
+
+	if (insn->type == filter_insn_exists) {
+		if (value.type == filter_value_type_int)
+			res = FILTER_MATCH_YES;
+		else if (value.type == filter_value_type_string)
+			res = (value.val.string != NULL);
+		else if (value.type == filter_value_type_ptype)
+			res = (value.val.ptype != NULL);
+
+		return (insn->not ? !res : res);
+	}
+
+	// Like filter_match_node(), a missing or different value doesn't match regardless of the inversion
+	switch (insn->type) {
+		case filter_insn_int:
+			if (value.type != filter_value_type_int)
+				return FILTER_MATCH_NO;
+			switch (insn->op) {
+				case FILTER_OP_EQ:
+					res = (value.val.integer == insn->cst.integer);
+					break;
+				case FILTER_OP_GT:
+					res = (value.val.integer > insn->cst.integer);
+					break;
+				case FILTER_OP_GE:
+					res = (value.val.integer >= insn->cst.integer);
+					break;
+				case FILTER_OP_LT:
+					res = (value.val.integer < insn->cst.integer);
+					break;
+				case FILTER_OP_LE:
+					res = (value.val.integer <= insn->cst.integer);
+					break;
+				case FILTER_OP_NEQ:
+					res = (value.val.integer != insn->cst.integer);
+					break;
+			}
+			break;
+
+		case filter_insn_string:
+			if (value.type != filter_value_type_string)
+				return FILTER_MATCH_NO;
+			res = !strcmp(value.val.string, insn->cst.string);
+			if (insn->op == FILTER_OP_NEQ)
+				res = !res;
+			break;
+
+		case filter_insn_ptype:
+			if (value.type != filter_value_type_ptype)
+				return FILTER_MATCH_NO;
+			res = ptype_compare_val(insn->op, value.val.ptype, insn->cst.ptype);
+			break;
+
+		default:
+			pomlog(POMLOG_ERR "Internal error, invalid instruction type");
+			return POM_ERR;
+	}
+
+	return (insn->not ? !res : res);
+}
+
 int filter_match(struct filter *f, void *obj) {
 
-	return filter_match_node(f, f->n, obj);
+	if (!f->prog)
+		return filter_match_node(f, f->n, obj);
+
+	int res = FILTER_MATCH_NO;
+	unsigned int pc = 0;
+
+	while (pc < f->prog_len) {
+		struct filter_insn *insn = &f->prog[pc];
+
+		switch (insn->type) {
+			case filter_insn_jmp_no:
+				if (!res) {
+					pc = insn->target;
+					continue;
+				}
+				break;
+			case filter_insn_jmp_yes:
+				if (res) {
+					pc = insn->target;
+					continue;
+				}
+				break;
+			case filter_insn_not:
+				res = !res;
+				break;
+			default:
+				res = filter_match_insn(f, insn, obj);
+				if (res == POM_ERR)
+					return POM_ERR;
+				break;
+		}
+		pc++;
+	}
+
+	return res;
 
 }
 
@@ -84,6 +84,28 @@ struct filter_node {
 	struct filter_value value[2];
 };
 
+// Instructions of the flattened filter program
+enum filter_insn_type {
+	filter_insn_node, // Generic match of a leaf node
+	filter_insn_exists, // Property is present
+	filter_insn_int, // Property compared to an integer
+	filter_insn_string, // Property compared to a string
+	filter_insn_ptype, // Property compared to a ptype
+	filter_insn_jmp_no, // Jump to target if the result is no (AND)
+	filter_insn_jmp_yes, // Jump to target if the result is yes (OR)
+	filter_insn_not, // Invert the result
+};
+
+struct filter_insn {
+	enum filter_insn_type type;
+	int op;
+	int not;
+	unsigned int target;
+	struct filter_value *prop;
+	struct filter_node *n;
+	union filter_value_u cst;
+};
+
 struct filter {
 
 	struct filter_node *n;
@@ -91,6 +113,13 @@ struct filter {
 	int (*prop_get_val) (struct filter_value *inval, struct filter_value *outval, void *obj);
 	void (*prop_cleanup) (void *prop);
 	void *priv;
+
+	struct filter_insn *prog;
+	unsigned int prog_len;
+
+	// Objects resolved once per match and shared by all the properties (i.e. protocols in the stack)
+	void **slots;
+	unsigned int slot_count;
 };
 
 
@@ -104,6 +133,7 @@ uint64_t filter_ptype_int_get(struct ptype* pt);
 void filter_ptype_to_value(struct filter_value *v, struct ptype *pt);
 
 int filter_parse_expr(struct filter *f, char *expr, unsigned int len, struct filter_node **n);
+int filter_slot_get(struct filter *f, void *key);
 
 int filter_compile(char *filter_expr, struct filter *f);
 
@@ -23,6 +23,7 @@
 #include "httpd.h"
 #include "xmlrpcsrv.h"
 #include "core.h"
+#include "registry.h"
 #include <pom-ng/mime.h>
 
 #include <sys/types.h>
@@ -379,6 +380,18 @@ int httpd_mhd_answer_connection(void *cls, struct MHD_Connection *connection, co
 
 			pom_rwlock_unlock(&httpd_ploads_lock);
 
+		} else if (!strncmp(url, HTTPD_PERF_URL, strlen(HTTPD_PERF_URL))) {
+			char *replystr = httpd_perf_reply(url + strlen(HTTPD_PERF_URL));
+
+			if (!replystr) {
+				replystr = "Performance object not found\n";
+				response = MHD_create_response_from_data(strlen(replystr), (void *) replystr, MHD_NO, MHD_NO);
+				status_code = MHD_HTTP_NOT_FOUND;
+			} else {
+				response = MHD_create_response_from_data(strlen(replystr), (void *) replystr, MHD_YES, MHD_NO);
+			}
+			mime_type = "text/plain";
+
 		} else if (strstr(url, "..")) {
 			// We're not supposed to have .. in a url
 			status_code = MHD_HTTP_NOT_FOUND;
@@ -677,3 +690,83 @@ void httpd_pload_response_callback_free(void *cls) {
 
 	free(priv);
 }
+
+char *httpd_perf_reply(const char *path) {
+
+	// The path is either class/perf or class/instance/perf
+	char *cls_name = strdup(path);
+	if (!cls_name) {
+		pom_oom(strlen(path) + 1);
+		return NULL;
+	}
+
+	char *inst_name = NULL, *perf_name = strchr(cls_name, '/');
+	if (!perf_name) {
+		free(cls_name);
+		return NULL;
+	}
+	*perf_name = 0;
+	perf_name++;
+
+	char *sep = strchr(perf_name, '/');
+	if (sep) {
+		*sep = 0;
+		inst_name = perf_name;
+		perf_name = sep + 1;
+	}
+
+	char *reply = NULL;
+	registry_lock();
+
+	struct registry_perf *perf = NULL;
+	if (inst_name) {
+		struct registry_instance *inst = registry_find_instance(cls_name, inst_name);
+		if (inst)
+			perf = inst->perfs;
+	} else {
+		struct registry_class *cls = registry_find_class(cls_name);
+		if (cls)
+			perf = cls->perfs;
+	}
+
+	for (; perf && strcmp(perf->name, perf_name); perf = perf->next);
+
+	if (!perf)
+		goto end;
+
+	size_t size = strlen(perf->description) + strlen(perf->unit) + 64;
+	if (perf->type == registry_perf_type_histogram)
+		size += REGISTRY_PERF_HISTOGRAM_BUCKETS * 42 + 64;
+
+	reply = malloc(size);
+	if (!reply) {
+		pom_oom(size);
+		goto end;
+	}
+
+	size_t len = snprintf(reply, size, "# %s (%s)\n", perf->description, perf->unit);
+
+	if (perf->type != registry_perf_type_histogram) {
+		snprintf(reply + len, size - len, "value %"PRIu64"\n", registry_perf_getval(perf));
+		goto end;
+	}
+
+	// Output the non empty buckets with the lowest value they hold
+	uint64_t buckets[REGISTRY_PERF_HISTOGRAM_BUCKETS];
+	uint64_t sum = 0;
+	uint64_t count = registry_perf_histogram_getval(perf, buckets, &sum);
+
+	len += snprintf(reply + len, size - len, "count %"PRIu64"\nsum %"PRIu64"\n", count, sum);
+
+	unsigned int i;
+	for (i = 0; i < REGISTRY_PERF_HISTOGRAM_BUCKETS; i++) {
+		if (buckets[i])
+			len += snprintf(reply + len, size - len, "%"PRIu64" %"PRIu64"\n", registry_perf_histogram_bucket_min(i), buckets[i]);
+	}
+
+end:
+	registry_unlock();
+	free(cls_name);
+
+	return reply;
+}
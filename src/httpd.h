@@ -36,6 +36,7 @@
 #define HTTPD_STATUS_URL	"/status.html"
 #define HTTPD_INDEX_PAGE	"index.html"
 #define HTTPD_PLOAD_URL		"/pload/"
+#define HTTPD_PERF_URL		"/perf/"
 
 #define HTTPD_ADMIN_USER	"admin"
 #define HTTPD_REALM		"POM-NG Authentication"
@@ -89,4 +90,6 @@ void httpd_pload_remove(uint64_t id);
 ssize_t httpd_pload_response_callback(void *cls, uint64_t pos, char *buf, size_t max);
 void httpd_pload_response_callback_free(void *cls);
 
+char *httpd_perf_reply(const char *path);
+
 #endif
@@ -430,7 +430,12 @@ void *input_process_thread(void *param) {
 
 	__sync_fetch_and_and(&i->running, ~INPUT_RUN_RUNNING);
 
+	// Let another input reuse our packet queues
+	core_queue_thread_cleanup();
+	packet_cache_thread_cleanup();
+
 	registry_perf_timeticks_stop(i->perf_runtime);
+	registry_perf_thread_cleanup();
 	pomlog("Input %s stopped", i->name);
 
 	return NULL;
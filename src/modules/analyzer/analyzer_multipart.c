@@ -83,18 +83,19 @@ static int analyzer_multipart_pload_open(void *obj, void **priv, struct pload *p
 	}
 	memset(p, 0, sizeof(struct analyzer_multipart_pload_priv));
 
-	p->boundary = malloc(strlen(boundary) + 3);
-	if (!p->boundary) {
+	p->delimiter = malloc(strlen(boundary) + 5);
+	if (!p->delimiter) {
 		free(p);
-		pom_oom(strlen(boundary) + 3);
+		pom_oom(strlen(boundary) + 5);
 		return PLOAD_OPEN_ERR;
 	}
 
-	p->boundary[0] = '-';
-	p->boundary[1] = '-';
-	strcpy(p->boundary + 2, boundary);
+	strcpy(p->delimiter, "\r\n--");
+	strcpy(p->delimiter + 4, boundary);
 		
-	p->boundary_len = strlen(p->boundary);
+	p->delimiter_len = strlen(p->delimiter);
+	p->boundary = p->delimiter + 2;
+	p->boundary_len = p->delimiter_len - 2;
 	p->parent_pload = pload;
 
 	*priv = p;
@@ -210,10 +211,50 @@ static int analyzer_multipart_pload_write(void *obj, void *p, void *data, size_t
 	unsigned int line_len, remaining_len = len;
 
 	while (remaining_len > 0) {
+
+		if (priv->state == analyzer_multipart_pload_state_content && priv->pload && !priv->last_line) {
+			// Inside a part, only the delimiter matters
+			// Skip directly to it instead of processing the content line by line
+			size_t content_len;
+			void *delim = memmem(data, remaining_len, priv->delimiter, priv->delimiter_len);
+			if (delim) {
+				content_len = delim - data;
+			} else {
+				// Leave out the end of the data if it might be the begining of a delimiter
+				content_len = remaining_len;
+				if (remaining_len >= priv->delimiter_len) {
+					void *cr = memchr(data + remaining_len - priv->delimiter_len + 1, '\r', priv->delimiter_len - 1);
+					if (cr)
+						content_len = cr - data;
+				} else {
+					void *cr = memchr(data, '\r', remaining_len);
+					if (cr)
+						content_len = cr - data;
+				}
+			}
+
+			if (content_len) {
+				if (priv->pload_end != data) {
+					if (priv->pload_start && pload_append(priv->pload, priv->pload_start, priv->pload_end - priv->pload_start) != POM_OK)
+						goto err;
+					priv->pload_start = data;
+				}
+				priv->pload_end = data + content_len;
+
+				data += content_len;
+				remaining_len -= content_len;
+				continue;
+			}
+		}
 	
 		// Because of the NOTE in RFC 2046 section 5.1.1, line start at CR 
+		// If a line is pending, a CR at the begining of the data ends it
 
-		void *cr = memchr(data + 1, '\r', remaining_len - 1);
+		void *cr = NULL;
+		if (priv->last_line)
+			cr = memchr(data, '\r', remaining_len);
+		else
+			cr = memchr(data + 1, '\r', remaining_len - 1);
 		if (!cr || priv->last_line) {
 
 			size_t add_len = remaining_len;
@@ -299,8 +340,8 @@ static int analyzer_multipart_pload_close(void *obj, void *p) {
 	if (!priv)
 		return POM_OK;
 
-	if (priv->boundary)
-		free(priv->boundary);
+	if (priv->delimiter)
+		free(priv->delimiter);
 
 	if (priv->pload)
 		pload_end(priv->pload);
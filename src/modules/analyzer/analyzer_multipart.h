@@ -40,7 +40,9 @@ enum analyzer_multipart_pload_state {
 };
 
 struct analyzer_multipart_pload_priv {
-	char *boundary;
+	char *delimiter; // CRLF followed by the boundary
+	size_t delimiter_len;
+	char *boundary; // Points inside delimiter
 	size_t boundary_len;
 	char *last_line;
 	enum analyzer_multipart_pload_state state;
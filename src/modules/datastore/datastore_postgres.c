@@ -81,6 +81,9 @@ static int datastore_postgres_mod_register(struct mod_reg *mod) {
 	datastore_postgres.dataset_read = datastore_postgres_dataset_read;
 	datastore_postgres.dataset_write = datastore_postgres_dataset_write;
 	datastore_postgres.dataset_delete = datastore_postgres_dataset_delete;
+	datastore_postgres.dataset_write_bulk_begin = datastore_postgres_dataset_write_bulk_begin;
+	datastore_postgres.dataset_write_bulk = datastore_postgres_dataset_write_bulk;
+	datastore_postgres.dataset_write_bulk_end = datastore_postgres_dataset_write_bulk_end;
 	datastore_postgres.dataset_query_alloc = datastore_postgres_dataset_query_alloc;
 	datastore_postgres.dataset_query_prepare = datastore_postgres_dataset_query_prepare;
 	datastore_postgres.dataset_query_cleanup = datastore_postgres_dataset_query_cleanup;
@@ -655,6 +658,25 @@ static int datastore_postgres_dataset_alloc(struct dataset *ds) {
 	char query_write_get_id[DATASTORE_POSTGRES_QUERY_BUFF_LEN] = { 0 };
 	snprintf(query_write_get_id, sizeof(query_write_get_id), "SELECT currval('%s_seq');", ds->name);
 
+	// Bulk write queries
+	char query_write_bulk_ids[DATASTORE_POSTGRES_QUERY_BUFF_LEN] = { 0 };
+	snprintf(query_write_bulk_ids, sizeof(query_write_bulk_ids), "SELECT nextval('%s_seq') FROM generate_series(1, $1::integer);", ds->name);
+
+	char query_write_copy[DATASTORE_POSTGRES_QUERY_BUFF_LEN] = { 0 };
+	snprintf(query_write_copy, sizeof(query_write_copy), "COPY %s ( " DATASTORE_POSTGRES_PKID ", ", ds->name);
+	for (i = 0; dt[i].name; i++) {
+		strncat(query_write_copy, dt[i].name, sizeof(query_write_copy) - strlen(query_write_copy) - 1);
+		if (dt[i + 1].name)
+			strncat(query_write_copy, ", ", sizeof(query_write_copy) - strlen(query_write_copy) - 1);
+	}
+	strncat(query_write_copy, " ) FROM STDIN WITH BINARY;", sizeof(query_write_copy) - strlen(query_write_copy) - 1);
+	pomlog(POMLOG_DEBUG "Copy query : %s", query_write_copy);
+
+	if (strlen(query_write_copy) >= sizeof(query_write_copy) - 2) {
+		pomlog(POMLOG_ERR "Read query_write_copy is too long");
+		return POM_ERR;
+	}
+
 
 	struct dataset_postgres_priv *priv = malloc(sizeof(struct dataset_postgres_priv));
 	if (!priv) {
@@ -670,12 +692,16 @@ static int datastore_postgres_dataset_alloc(struct dataset *ds) {
 	priv->query_read_end = strdup(query_read_end);
 	priv->query_write = strdup(query_write);
 	priv->query_write_get_id = strdup(query_write_get_id);
+	priv->query_write_bulk_ids = strdup(query_write_bulk_ids);
+	priv->query_write_copy = strdup(query_write_copy);
 
 	if (!priv->query_read_start ||
 		!priv->query_read ||
 		!priv->query_read_end ||
 		!priv->query_write ||
-		!priv->query_write_get_id) {
+		!priv->query_write_get_id ||
+		!priv->query_write_bulk_ids ||
+		!priv->query_write_copy) {
 
 		pom_oom(strlen(query_read));
 		datastore_postgres_dataset_cleanup(ds);
@@ -702,6 +728,10 @@ static int datastore_postgres_dataset_cleanup(struct dataset *ds) {
 		free(priv->query_write);
 	if (priv->query_write_get_id)
 		free(priv->query_write_get_id);
+	if (priv->query_write_bulk_ids)
+		free(priv->query_write_bulk_ids);
+	if (priv->query_write_copy)
+		free(priv->query_write_copy);
 	free(priv);
 
 	return POM_OK;
@@ -940,6 +970,11 @@ static int datastore_postgres_dataset_query_cleanup(struct dataset_query *dsq) {
 	if (priv->write_query_param_format)
 		free(priv->write_query_param_format);
 
+	if (priv->bulk_ids)
+		free(priv->bulk_ids);
+	if (priv->bulk_buff)
+		free(priv->bulk_buff);
+
 	free(priv);
 	return POM_OK;
 }
@@ -1248,6 +1283,294 @@ end:
 	return res;
 }
 
+static int datastore_postgres_transaction_temp_end(struct datastore_connection *dc, int res) {
+
+	struct datastore_postgres_connection_priv *cpriv = dc->priv;
+
+	if (cpriv->transaction > DATASTORE_POSTGRES_TRANSACTION_TEMP) {
+		cpriv->transaction--;
+	} else if (cpriv->transaction == DATASTORE_POSTGRES_TRANSACTION_TEMP) {
+		if (res == DATASET_QUERY_OK)
+			res = datastore_postgres_exec(dc, "COMMIT;");
+		else
+			datastore_postgres_exec(dc, "ROLLBACK;");
+		cpriv->transaction = DATASTORE_POSTGRES_TRANSACTION_NONE;
+	}
+
+	return res;
+}
+
+static int datastore_postgres_bulk_append(struct dataset_postgres_query_priv *qpriv, size_t *len, void *data, size_t size) {
+
+	if (*len + size > qpriv->bulk_buff_size) {
+		size_t new_size = qpriv->bulk_buff_size * 2;
+		if (new_size < *len + size)
+			new_size = *len + size + DATASTORE_POSTGRES_QUERY_BUFF_LEN;
+		char *new_buff = realloc(qpriv->bulk_buff, new_size);
+		if (!new_buff) {
+			pom_oom(new_size);
+			return POM_ERR;
+		}
+		qpriv->bulk_buff = new_buff;
+		qpriv->bulk_buff_size = new_size;
+	}
+
+	memcpy(qpriv->bulk_buff + *len, data, size);
+	*len += size;
+
+	return POM_OK;
+}
+
+static int datastore_postgres_dataset_write_bulk_begin(struct dataset_query *dsq, unsigned int count) {
+
+	struct dataset_postgres_query_priv *qpriv = dsq->priv;
+	struct datastore_postgres_connection_priv *cpriv = dsq->con->priv;
+	struct dataset_postgres_priv *dspriv = dsq->ds->priv;
+
+	if (count > qpriv->bulk_ids_size) {
+		uint64_t *ids = realloc(qpriv->bulk_ids, sizeof(uint64_t) * count);
+		if (!ids) {
+			pom_oom(sizeof(uint64_t) * count);
+			return DATASET_QUERY_ERR;
+		}
+		qpriv->bulk_ids = ids;
+		qpriv->bulk_ids_size = count;
+	}
+
+	pom_mutex_lock(&cpriv->lock);
+	int res = DATASET_QUERY_OK;
+
+	// The reserved ids and the COPY must be done in the same transaction
+	if (cpriv->transaction == DATASTORE_POSTGRES_TRANSACTION_NONE) {
+		res = datastore_postgres_exec(dsq->con, "BEGIN;");
+		if (res != DATASET_QUERY_OK) {
+			pom_mutex_unlock(&cpriv->lock);
+			return res;
+		}
+		cpriv->transaction = DATASTORE_POSTGRES_TRANSACTION_TEMP;
+	} else if (cpriv->transaction >= DATASTORE_POSTGRES_TRANSACTION_TEMP) {
+		cpriv->transaction++;
+	}
+
+	// Reserve all the primary keys with a single query
+	char count_str[16];
+	snprintf(count_str, sizeof(count_str), "%u", count);
+	const char *params[1] = { count_str };
+
+	PGresult *pgres = PQexecParams(cpriv->db, dspriv->query_write_bulk_ids, 1, NULL, params, NULL, NULL, 1);
+	if (PQresultStatus(pgres) != PGRES_TUPLES_OK || (unsigned int) PQntuples(pgres) != count) {
+		pomlog(POMLOG_ERR "Failed to reserve the ids for the dataset \"%s\" : %s", dsq->ds->name, PQresultErrorMessage(pgres));
+		res = datastore_postgres_get_ds_state_error(pgres);
+		PQclear(pgres);
+		goto err;
+	}
+
+	unsigned int i;
+	for (i = 0; i < count; i++)
+		qpriv->bulk_ids[i] = ntohll(*(uint64_t*) PQgetvalue(pgres, i, 0));
+	PQclear(pgres);
+
+	pgres = PQexec(cpriv->db, dspriv->query_write_copy);
+	if (PQresultStatus(pgres) != PGRES_COPY_IN) {
+		pomlog(POMLOG_ERR "Failed to start the copy to the dataset \"%s\" : %s", dsq->ds->name, PQresultErrorMessage(pgres));
+		res = datastore_postgres_get_ds_state_error(pgres);
+		PQclear(pgres);
+		goto err;
+	}
+	PQclear(pgres);
+
+	// Binary copy header : signature, flags and header extension length
+	static const char header[] = { 'P', 'G', 'C', 'O', 'P', 'Y', '\n', '\377', '\r', '\n', '\0', 0, 0, 0, 0, 0, 0, 0, 0 };
+	if (PQputCopyData(cpriv->db, header, sizeof(header)) != 1) {
+		pomlog(POMLOG_ERR "Failed to send the copy header : %s", PQerrorMessage(cpriv->db));
+		PQputCopyEnd(cpriv->db, "header error");
+		while ((pgres = PQgetResult(cpriv->db)))
+			PQclear(pgres);
+		res = DATASET_QUERY_DATASTORE_ERR;
+		goto err;
+	}
+
+	qpriv->bulk_count = count;
+	qpriv->bulk_cur = 0;
+
+	pom_mutex_unlock(&cpriv->lock);
+
+	return DATASET_QUERY_OK;
+
+err:
+	datastore_postgres_transaction_temp_end(dsq->con, res);
+	pom_mutex_unlock(&cpriv->lock);
+
+	return res;
+}
+
+static int datastore_postgres_dataset_write_bulk(struct dataset_query *dsq) {
+
+	struct datastore_postgres_priv *dpriv = dsq->ds->dstore->priv;
+	struct datavalue *dv = dsq->values;
+	struct dataset_postgres_query_priv *qpriv = dsq->priv;
+	struct datavalue_template *dt = dsq->ds->data_template;
+	struct datastore_postgres_connection_priv *cpriv = dsq->con->priv;
+	struct dataset_postgres_priv *dspriv = dsq->ds->priv;
+
+	if (qpriv->bulk_cur >= qpriv->bulk_count) {
+		pomlog(POMLOG_ERR "More rows written than announced for the dataset \"%s\"", dsq->ds->name);
+		return DATASET_QUERY_ERR;
+	}
+
+	// Each tuple has the field count followed by the length and the value of each field
+	size_t len = 0;
+	uint16_t fields = htons(dspriv->num_fields + 1);
+	uint32_t field_len = htonl(sizeof(uint64_t));
+	uint64_t pkid = htonll(qpriv->bulk_ids[qpriv->bulk_cur]);
+
+	if (datastore_postgres_bulk_append(qpriv, &len, &fields, sizeof(fields)) != POM_OK ||
+		datastore_postgres_bulk_append(qpriv, &len, &field_len, sizeof(field_len)) != POM_OK ||
+		datastore_postgres_bulk_append(qpriv, &len, &pkid, sizeof(pkid)) != POM_OK)
+		return DATASET_QUERY_ERR;
+
+	int i;
+	for (i = 0; dt[i].name; i++) {
+
+		union datastore_postgres_data data;
+		void *value = &data;
+		size_t size = 0;
+		char *alloc_value = NULL;
+
+		if (dv[i].is_null) {
+			field_len = htonl(-1);
+			if (datastore_postgres_bulk_append(qpriv, &len, &field_len, sizeof(field_len)) != POM_OK)
+				return DATASET_QUERY_ERR;
+			continue;
+		}
+
+		switch (dt[i].native_type) {
+			case DATASTORE_POSTGRES_PTYPE_BOOL:
+				data.uint8 = *PTYPE_BOOL_GETVAL(dv[i].value);
+				size = sizeof(uint8_t);
+				break;
+			case DATASTORE_POSTGRES_PTYPE_UINT8:
+				data.uint16 = htons(*PTYPE_UINT8_GETVAL(dv[i].value));
+				size = sizeof(uint16_t);
+				break;
+			case DATASTORE_POSTGRES_PTYPE_UINT16:
+				data.uint16 = htons(*PTYPE_UINT16_GETVAL(dv[i].value));
+				size = sizeof(uint16_t);
+				break;
+			case DATASTORE_POSTGRES_PTYPE_UINT32:
+				data.uint32 = htonl(*PTYPE_UINT32_GETVAL(dv[i].value));
+				size = sizeof(uint32_t);
+				break;
+			case DATASTORE_POSTGRES_PTYPE_UINT64:
+				data.uint64 = htonll(*PTYPE_UINT64_GETVAL(dv[i].value));
+				size = sizeof(uint64_t);
+				break;
+			case DATASTORE_POSTGRES_PTYPE_TIMESTAMP: {
+				ptime *ts = PTYPE_TIMESTAMP_GETVAL(dv[i].value);
+
+				uint64_t sec = pom_ptime_sec(*ts);
+				uint64_t usec = pom_ptime_usec(*ts);
+
+				sec -= timezone;
+				if (daylight)
+					sec += 3600;
+
+				if (dpriv->integer_datetimes) {
+					uint64_t my_time = sec - ((POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY);
+					my_time *= 1000000;
+					my_time += usec;
+					data.int64 = (int64_t) htonll(my_time);
+				} else {
+					double my_time = (double)(sec - ((POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY)) + (double)usec / 1000000.0;
+					memcpy(&data.uint64, &my_time, sizeof(double));
+					data.uint64 = htonll(data.uint64);
+				}
+				size = sizeof(int64_t);
+				break;
+			}
+			case DATASTORE_POSTGRES_PTYPE_STRING: {
+				value = PTYPE_STRING_GETVAL(dv[i].value);
+				if (value)
+					size = strlen(value);
+				break;
+			}
+			default: {
+				alloc_value = ptype_print_val_alloc(dv[i].value, NULL);
+				if (!alloc_value)
+					return DATASET_QUERY_ERR;
+				value = alloc_value;
+				size = strlen(alloc_value);
+				break;
+			}
+		}
+
+		field_len = htonl(size);
+		int res = datastore_postgres_bulk_append(qpriv, &len, &field_len, sizeof(field_len));
+		if (res == POM_OK && size)
+			res = datastore_postgres_bulk_append(qpriv, &len, value, size);
+
+		if (alloc_value)
+			free(alloc_value);
+
+		if (res != POM_OK)
+			return DATASET_QUERY_ERR;
+	}
+
+	pom_mutex_lock(&cpriv->lock);
+	int res = PQputCopyData(cpriv->db, qpriv->bulk_buff, len);
+	pom_mutex_unlock(&cpriv->lock);
+
+	if (res != 1) {
+		pomlog(POMLOG_ERR "Failed to copy data to the dataset \"%s\" : %s", dsq->ds->name, PQerrorMessage(cpriv->db));
+		return DATASET_QUERY_DATASTORE_ERR;
+	}
+
+	dsq->data_id = qpriv->bulk_ids[qpriv->bulk_cur];
+	qpriv->bulk_cur++;
+
+	return DATASET_QUERY_OK;
+}
+
+static int datastore_postgres_dataset_write_bulk_end(struct dataset_query *dsq, int cancel) {
+
+	struct dataset_postgres_query_priv *qpriv = dsq->priv;
+	struct datastore_postgres_connection_priv *cpriv = dsq->con->priv;
+
+	int res = DATASET_QUERY_OK;
+
+	pom_mutex_lock(&cpriv->lock);
+
+	if (cancel) {
+		PQputCopyEnd(cpriv->db, "bulk write cancelled");
+		res = DATASET_QUERY_ERR;
+	} else {
+		// File trailer
+		uint16_t trailer = htons(-1);
+		if (PQputCopyData(cpriv->db, (char *) &trailer, sizeof(trailer)) != 1 || PQputCopyEnd(cpriv->db, NULL) != 1) {
+			pomlog(POMLOG_ERR "Failed to end the copy to the dataset \"%s\" : %s", dsq->ds->name, PQerrorMessage(cpriv->db));
+			res = DATASET_QUERY_DATASTORE_ERR;
+		}
+	}
+
+	PGresult *pgres;
+	while ((pgres = PQgetResult(cpriv->db))) {
+		if (res == DATASET_QUERY_OK && PQresultStatus(pgres) != PGRES_COMMAND_OK) {
+			pomlog(POMLOG_ERR "Failed to copy data to the dataset \"%s\" : %s", dsq->ds->name, PQresultErrorMessage(pgres));
+			res = datastore_postgres_get_ds_state_error(pgres);
+		}
+		PQclear(pgres);
+	}
+
+	qpriv->bulk_count = 0;
+	qpriv->bulk_cur = 0;
+
+	res = datastore_postgres_transaction_temp_end(dsq->con, res);
+
+	pom_mutex_unlock(&cpriv->lock);
+
+	return res;
+}
+
 static int datastore_postgres_dataset_delete(struct dataset_query *dsq) {
 
 	struct dataset_postgres_query_priv *qpriv = dsq->priv;
@@ -59,6 +59,8 @@ struct dataset_postgres_priv {
 	char *query_read_end;
 	char *query_write;
 	char *query_write_get_id;
+	char *query_write_bulk_ids;
+	char *query_write_copy;
 	int num_fields;
 };
 
@@ -86,6 +88,11 @@ struct dataset_postgres_query_priv {
 	int *write_query_param_len;
 	int *write_query_param_format;
 
+	uint64_t *bulk_ids; // Primary keys reserved for the rows of the COPY
+	unsigned int bulk_ids_size, bulk_count, bulk_cur;
+	char *bulk_buff; // Binary tuple being sent
+	size_t bulk_buff_size;
+
 };
 
 static int datastore_postgres_mod_register(struct mod_reg *mod);
@@ -108,6 +115,10 @@ static int datastore_postgres_dataset_read(struct dataset_query *dsq);
 static int datastore_postgres_dataset_write(struct dataset_query *dsq);
 static int datastore_postgres_dataset_delete(struct dataset_query *dsq);
 
+static int datastore_postgres_dataset_write_bulk_begin(struct dataset_query *dsq, unsigned int count);
+static int datastore_postgres_dataset_write_bulk(struct dataset_query *dsq);
+static int datastore_postgres_dataset_write_bulk_end(struct dataset_query *dsq, int cancel);
+
 static int datastore_postgres_dataset_query_alloc(struct dataset_query *dsq);
 static int datastore_postgres_dataset_query_prepare(struct dataset_query *dsq);
 static int datastore_postgres_dataset_query_cleanup(struct dataset_query *dsq);
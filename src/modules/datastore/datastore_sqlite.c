@@ -164,13 +164,20 @@ static int datastore_sqlite_connect(struct datastore_connection *dc) {
 		wordfree(&exp);
 		return POM_ERR;
 	}
-	memset(cpriv, 0, sizeof(struct datastore_sqlite_priv));
+	memset(cpriv, 0, sizeof(struct datastore_sqlite_connection_priv));
+
+	if (pom_mutex_init_type(&cpriv->write_lock, PTHREAD_MUTEX_ERRORCHECK) != POM_OK) {
+		free(cpriv);
+		wordfree(&exp);
+		return POM_ERR;
+	}
 	
 	if (sqlite3_open_v2(exp.we_wordv[0], &cpriv->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL)) {
 		pomlog(POMLOG_ERR "Connection to database %s failed : %s", exp.we_wordv[0], sqlite3_errmsg(cpriv->db));
 		if (cpriv->db)
 			if (sqlite3_close(cpriv->db) != SQLITE_OK)
 				pomlog(POMLOG_WARN "Warning, sqlite3_close() failed.");
+		pthread_mutex_destroy(&cpriv->write_lock);
 		free(cpriv);
 		wordfree(&exp);
 		return POM_ERR;
@@ -196,6 +203,7 @@ static int datastore_sqlite_disconnect(struct datastore_connection *dc) {
 
 	if (sqlite3_close(cpriv->db) != SQLITE_OK)
 		pomlog(POMLOG_WARN "Warning, sqlite3_close() failed.");
+	pthread_mutex_destroy(&cpriv->write_lock);
 	free(cpriv);
 	pomlog(POMLOG_DEBUG "Connection to the database closed");
 
@@ -691,23 +699,21 @@ static int datastore_sqlite_dataset_write(struct dataset_query *dsq) {
 	}
 
 
-	// We need to make sure we write and retrieve the last row id in an atomic way on a db level
-	
-	static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
-
-	pom_mutex_lock(&write_lock);
+	// The last row id is tracked per sqlite connection so we only need to
+	// serialize the threads sharing this connection
+	pom_mutex_lock(&cpriv->write_lock);
 
 	res = sqlite3_step(qpriv->write_stmt);
 	if (res != SQLITE_DONE) {
 		pomlog(POMLOG_ERR "Error while executing the write query : %s", sqlite3_errmsg(cpriv->db));
-		pom_mutex_unlock(&write_lock);
+		pom_mutex_unlock(&cpriv->write_lock);
 		sqlite3_reset(qpriv->write_stmt);
 		return datastore_sqlite_get_ds_state_error(res);
 	}
 	
 	dsq->data_id = sqlite3_last_insert_rowid(cpriv->db);
 
-	pom_mutex_unlock(&write_lock);
+	pom_mutex_unlock(&cpriv->write_lock);
 
 	sqlite3_reset(qpriv->write_stmt);
 	sqlite3_clear_bindings(qpriv->write_stmt);
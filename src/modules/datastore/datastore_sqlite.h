@@ -36,6 +36,7 @@ struct datastore_sqlite_priv {
 struct datastore_sqlite_connection_priv {
 
 	sqlite3 *db;
+	pthread_mutex_t write_lock;
 };
 
 struct dataset_sqlite_priv {
@@ -33,8 +33,29 @@ struct mod_reg_info *decoder_base64_reg_info() {
 
 }
 
+static unsigned char decoder_base64_table[256];
+
 static int decoder_base64_mod_register(struct mod_reg *mod) {
 
+	// Build the lookup table
+	memset(decoder_base64_table, DECODER_BASE64_INVALID, sizeof(decoder_base64_table));
+	int i;
+	for (i = 0; i < 26; i++) {
+		decoder_base64_table['A' + i] = i;
+		decoder_base64_table['a' + i] = i + 26;
+	}
+	for (i = 0; i < 10; i++)
+		decoder_base64_table['0' + i] = i + 52;
+	decoder_base64_table['+'] = 62;
+	decoder_base64_table['/'] = 63;
+	decoder_base64_table['='] = DECODER_BASE64_PAD;
+
+	// Line breaks are mandatory in MIME bodies
+	decoder_base64_table['\r'] = DECODER_BASE64_SKIP;
+	decoder_base64_table['\n'] = DECODER_BASE64_SKIP;
+	decoder_base64_table[' '] = DECODER_BASE64_SKIP;
+	decoder_base64_table['\t'] = DECODER_BASE64_SKIP;
+
 	static struct decoder_reg_info dec_base64 = { 0 };
 	dec_base64.mod = mod;
 	dec_base64.alloc = decoder_base64_alloc;
@@ -80,111 +101,102 @@ static size_t decoder_base64_estimate_size(size_t encoded_size) {
 
 int decoder_base64_decode(struct decoder *dec) {
 
-
 	struct decoder_base64_priv *priv = dec->priv;
 
-	if (dec->priv && priv->buff_len) {
-		int i;
-		for (i = 0; i < (4 - priv->buff_len) && i < dec->avail_in; i++) {
-			priv->buff[priv->buff_len + i] = dec->next_in[i];
-		}
-		priv->buff_len += i;
-		dec->avail_in -= i;
-		dec->next_in += i;
-
-		if (priv->buff_len < 4)
-			return DEC_OK;
-
-		// Setup a temporary struct decoder to decode these 3 bytes
-		struct decoder tmp_dec = { 0 };
-		tmp_dec.avail_in = 4;
-		tmp_dec.next_in = priv->buff;
-		tmp_dec.avail_out = dec->avail_out;
-		tmp_dec.next_out = dec->next_out;
-
-		int res = decoder_base64_decode(&tmp_dec);
-		dec->avail_out = tmp_dec.avail_out;
-		dec->next_out = tmp_dec.next_out;
-
-		if (res != DEC_OK)
-			return res;
-
-
-		// Discard our buffer
-		priv->buff_len = 0;
-
+	if (priv->end) {
+		// Discard anything after the padding
+		dec->next_in += dec->avail_in;
+		dec->avail_in = 0;
+		return DEC_END;
 	}
 
-	char value[4];
+	unsigned char *in = (unsigned char *)dec->next_in;
+	unsigned char *in_end = in + dec->avail_in;
+	unsigned char *out = (unsigned char *)dec->next_out;
+	unsigned char *out_end = out + dec->avail_out;
+
+	uint32_t bits = priv->bits;
+	unsigned int count = priv->count;
 	int res = DEC_OK;
 
-	while (dec->avail_in >= 4 && dec->avail_out >= 4) {
-		char *block = dec->next_in;
-		int i;
-		for (i = 0; i < 4; i++) {
-			if (block[i] >= 'A' && block[i] <= 'Z') {
-				value[i] = block[i] - 'A';
-			} else if (block[i] >= 'a' && block[i] <= 'z') {
-				value[i] = block[i] - 'a' + 26;
-			} else if (block[i] >= '0' && block[i] <= '9') {
-				value[i] = block[i] - '0' + 52;
-			} else if (block[i] == '+') {
-				value[i] = 62;
-			} else if (block[i] == '/') {
-				value[i] = 63;
-			} else if (block[i] == '=') {
-				value[i] = 0;
-			} else {
-				pomlog(POMLOG_DEBUG "Invalid character in base64 string");
-				return DEC_ERR;
+	while (in < in_end) {
+
+		// Decode full blocks as long as they don't contain anything special
+		if (!count) {
+			while (in_end - in >= 4 && out_end - out >= 3) {
+				uint32_t v0 = decoder_base64_table[in[0]], v1 = decoder_base64_table[in[1]];
+				uint32_t v2 = decoder_base64_table[in[2]], v3 = decoder_base64_table[in[3]];
+				if ((v0 | v1 | v2 | v3) & 0xc0)
+					break;
+				uint32_t block = (v0 << 18) | (v1 << 12) | (v2 << 6) | v3;
+				out[0] = block >> 16;
+				out[1] = block >> 8;
+				out[2] = block;
+				in += 4;
+				out += 3;
 			}
-		}
-		
-		char *output = dec->next_out;
-		if (block[1] == '=') {
-			res = DEC_END;
-			break;
-		}
-		output[0] = ((value[0] << 2) | (0x3 & (value[1] >> 4)));
-		dec->avail_out--;
-		dec->next_out++;
 
-		if (block[2] == '=') {
-			res = DEC_END;
-			break;
+			if (in == in_end)
+				break;
 		}
-		output[1] = ((value[1] << 4) | (0xf & (value[2] >> 2)));
-		dec->avail_out--;
-		dec->next_out++;
 
-		if (block[3] == '=') {
+		unsigned char v = decoder_base64_table[*in];
+
+		if (v < 64) {
+			if (count == 3 && out_end - out < 3) {
+				res = DEC_MORE;
+				break;
+			}
+			bits = (bits << 6) | v;
+			count++;
+			in++;
+			if (count == 4) {
+				out[0] = bits >> 16;
+				out[1] = bits >> 8;
+				out[2] = bits;
+				out += 3;
+				bits = 0;
+				count = 0;
+			}
+		} else if (v == DECODER_BASE64_SKIP) {
+			in++;
+		} else if (v == DECODER_BASE64_PAD) {
+			// Output what's left of the incomplete block
+			if (count >= 2 && out_end - out < count - 1) {
+				res = DEC_MORE;
+				break;
+			}
+			if (count == 2) {
+				out[0] = bits >> 4;
+				out++;
+			} else if (count == 3) {
+				out[0] = bits >> 10;
+				out[1] = bits >> 2;
+				out += 2;
+			}
+			bits = 0;
+			count = 0;
+			priv->end = 1;
+			in = in_end;
 			res = DEC_END;
 			break;
+		} else {
+			pomlog(POMLOG_DEBUG "Invalid character in base64 string");
+			res = DEC_ERR;
+			break;
 		}
-		output[2] = ((value[2] << 6) | value[3]);
-		dec->avail_out--;
-		dec->next_out++;
+	}
 
-		dec->next_in += 4;
-		dec->avail_in -= 4;
+	priv->bits = bits;
+	priv->count = count;
 
-	}
+	dec->avail_in = in_end - in;
+	dec->next_in = (char *)in;
+	dec->avail_out = out_end - out;
+	dec->next_out = (char *)out;
 
 	if (dec->avail_out > 0)
 		*dec->next_out = 0;
 
-	if (dec->avail_in > 0) {
-		memcpy(priv->buff, dec->next_in, dec->avail_in);
-		priv->buff[dec->avail_in] = 0;
-		priv->buff_len = dec->avail_in;
-		dec->next_in += dec->avail_in;
-		dec->avail_in = 0;
-	}
-
-	if (res == DEC_END && dec->avail_in >= 4) {
-		dec->next_in += 4;
-		dec->avail_in -= 4;
-	}
-
 	return res;
 }
@@ -24,9 +24,15 @@
 
 #include <pom-ng/decoder.h>
 
+// Values of the lookup table other than the 6 bits ones
+#define DECODER_BASE64_PAD	0x40
+#define DECODER_BASE64_SKIP	0x80
+#define DECODER_BASE64_INVALID	0xff
+
 struct decoder_base64_priv {
-	char buff[5];
-	int buff_len;
+	uint32_t bits; // Bits of the incomplete block
+	unsigned int count; // Number of characters in the incomplete block
+	int end;
 };
 
 struct mod_reg_info *decoder_base64_reg_info();
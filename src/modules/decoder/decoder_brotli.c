@@ -0,0 +1,158 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "decoder_brotli.h"
+#include <brotli/decode.h>
+
+#define DECODER_BROTLI_DEFAULT_SIZE 4096
+
+// Room kept in front of each allocation to remember its size, large enough to keep the alignment of malloc()
+#define DECODER_BROTLI_ALLOC_HDR 16
+
+struct mod_reg_info *decoder_brotli_reg_info() {
+
+	static struct mod_reg_info reg_info;
+	memset(&reg_info, 0, sizeof(struct mod_reg_info));
+	reg_info.api_ver = MOD_API_VER;
+	reg_info.register_func = decoder_brotli_mod_register;
+	reg_info.unregister_func = decoder_brotli_mod_unregister;
+	reg_info.dependencies = "";
+
+	return &reg_info;
+
+}
+
+static int decoder_brotli_mod_register(struct mod_reg *mod) {
+
+	static struct decoder_reg_info dec_brotli = { 0 };
+	dec_brotli.mod = mod;
+	dec_brotli.alloc = decoder_brotli_alloc;
+	dec_brotli.cleanup = decoder_brotli_cleanup;
+	dec_brotli.estimate_size = decoder_brotli_estimate_size;
+	dec_brotli.decode = decoder_brotli_decode;
+
+	if (decoder_register("br", &dec_brotli) != POM_OK)
+		return POM_ERR;
+
+	return POM_OK;
+}
+
+static int decoder_brotli_mod_unregister() {
+
+	return decoder_unregister("br");
+}
+
+// Allocations are tracked so the ring buffer, up to 16MB, shows in the decoder state size
+static void *decoder_brotli_mem_alloc(void *opaque, size_t size) {
+
+	struct decoder *dec = opaque;
+	char *mem = malloc(DECODER_BROTLI_ALLOC_HDR + size);
+	if (!mem) {
+		pom_oom(DECODER_BROTLI_ALLOC_HDR + size);
+		return NULL;
+	}
+
+	*(size_t *) mem = size;
+	dec->state_size += size;
+
+	return mem + DECODER_BROTLI_ALLOC_HDR;
+}
+
+static void decoder_brotli_mem_free(void *opaque, void *address) {
+
+	if (!address)
+		return;
+
+	struct decoder *dec = opaque;
+	char *mem = (char *) address - DECODER_BROTLI_ALLOC_HDR;
+	dec->state_size -= *(size_t *) mem;
+	free(mem);
+}
+
+static int decoder_brotli_alloc(struct decoder *dec) {
+
+	BrotliDecoderState *state = BrotliDecoderCreateInstance(decoder_brotli_mem_alloc, decoder_brotli_mem_free, dec);
+	if (!state) {
+		pomlog(POMLOG_ERR "Unable to init the brotli decoder");
+		return POM_ERR;
+	}
+
+	// Keep the window within the 16MB allowed by RFC 7932
+	if (!BrotliDecoderSetParameter(state, BROTLI_DECODER_PARAM_LARGE_WINDOW, 0)) {
+		pomlog(POMLOG_ERR "Unable to limit the brotli window size");
+		BrotliDecoderDestroyInstance(state);
+		return POM_ERR;
+	}
+
+	dec->priv = state;
+
+	return POM_OK;
+}
+
+static int decoder_brotli_cleanup(struct decoder *dec) {
+
+	if (!dec->priv)
+		return POM_OK;
+
+	BrotliDecoderDestroyInstance(dec->priv);
+
+	return POM_OK;
+}
+
+static size_t decoder_brotli_estimate_size(size_t encoded_size) {
+
+	long pagesize = sysconf(_SC_PAGESIZE);
+	
+	if (pagesize)
+		return pagesize;
+
+	return DECODER_BROTLI_DEFAULT_SIZE;
+}
+
+static int decoder_brotli_decode(struct decoder *dec) {
+	
+	if (!dec->priv)
+		return DEC_ERR;
+
+	BrotliDecoderState *state = dec->priv;
+
+	size_t avail_in = dec->avail_in;
+	const uint8_t *next_in = (const uint8_t *)dec->next_in;
+	size_t avail_out = dec->avail_out;
+	uint8_t *next_out = (uint8_t *)dec->next_out;
+
+	int res = DEC_OK;
+	BrotliDecoderResult bres = BrotliDecoderDecompressStream(state, &avail_in, &next_in, &avail_out, &next_out, NULL);
+	if (bres == BROTLI_DECODER_RESULT_ERROR) {
+		pomlog(POMLOG_DEBUG "Error while decompressing brotli content : %s", BrotliDecoderErrorString(BrotliDecoderGetErrorCode(state)));
+		res = DEC_ERR;
+	} else if (bres == BROTLI_DECODER_RESULT_SUCCESS) {
+		res = DEC_END;
+	} else if (bres == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT) {
+		res = DEC_MORE;
+	}
+
+	dec->next_in = (char *)next_in;
+	dec->avail_in = avail_in;
+	dec->next_out = (char *)next_out;
+	dec->avail_out = avail_out;
+
+	return res;
+}
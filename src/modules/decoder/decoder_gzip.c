@@ -127,7 +127,8 @@ static int decoder_gzip_decode(struct decoder *dec) {
 
 	int res = DEC_OK;
 	int zres = inflate(zbuff, Z_SYNC_FLUSH);
-	if (zres != Z_OK && zres != Z_STREAM_END) {
+	// Z_BUF_ERROR only means that no progress was possible with the provided buffers
+	if (zres != Z_OK && zres != Z_STREAM_END && zres != Z_BUF_ERROR) {
 		char *msg = zbuff->msg;
 		if (!msg)
 			msg = "Unknown error";
@@ -33,8 +33,21 @@ struct mod_reg_info *decoder_quoted_printable_reg_info() {
 
 }
 
+static unsigned char decoder_quoted_printable_hex[256];
+
 static int decoder_quoted_printable_mod_register(struct mod_reg *mod) {
 
+	// Build the lookup table
+	memset(decoder_quoted_printable_hex, DECODER_QP_INVALID, sizeof(decoder_quoted_printable_hex));
+	int i;
+	for (i = 0; i < 10; i++)
+		decoder_quoted_printable_hex['0' + i] = i;
+	for (i = 0; i < 6; i++) {
+		decoder_quoted_printable_hex['A' + i] = 0xA + i;
+		// Invalid but RFC 2045 says that a robust implem must handle this
+		decoder_quoted_printable_hex['a' + i] = 0xa + i;
+	}
+
 	static struct decoder_reg_info dec_quoted_printable = { 0 };
 	dec_quoted_printable.mod = mod;
 	dec_quoted_printable.alloc = decoder_quoted_printable_alloc;
@@ -78,42 +91,80 @@ static size_t decoder_quoted_printable_estimate_size(size_t encoded_size) {
 	return encoded_size + 1;
 }
 
-int decoder_quoted_printable_decode(struct decoder *dec) {
+// Decode the sequence starting at in, return the byte value or DECODER_QP_*
+static int decoder_quoted_printable_escape(unsigned char *in, size_t len, size_t *used) {
 
-	struct decoder_quoted_printable_priv *priv = dec->priv;
+	*used = 1;
+	if (in[0] != '=')
+		return in[0];
 
-	if (dec->priv && priv->buff_len) {
-		int i;
-		for (i = 0; i < (3 - priv->buff_len) && i < dec->avail_in; i++) {
-			priv->buff[priv->buff_len + i] = dec->next_in[i];
-		}
-		priv->buff_len += i;
-		dec->avail_in -= i;
-		dec->next_in += i;
+	if (len < 2)
+		return DECODER_QP_NEED_MORE;
 
-		if (priv->buff_len < 3)
-			return DEC_OK;
+	if (in[1] == '\n') {
+		// Soft line break without CR
+		*used = 2;
+		return DECODER_QP_SOFT_BREAK;
+	}
 
-		// Setup a temporary struct decoder to decode these 3 bytes
-		struct decoder tmp_dec = { 0 };
-		tmp_dec.avail_in = 3;
-		tmp_dec.next_in = priv->buff;
-		tmp_dec.avail_out = dec->avail_out;
-		tmp_dec.next_out = dec->next_out;
+	if (len < 3)
+		return DECODER_QP_NEED_MORE;
 
-		int res = decoder_quoted_printable_decode(&tmp_dec);
-		dec->avail_out = tmp_dec.avail_out;
-		dec->next_out = tmp_dec.next_out;
+	if (in[1] == '\r' && in[2] == '\n') {
+		*used = 3;
+		return DECODER_QP_SOFT_BREAK;
+	}
 
-		if (res != DEC_OK)
-			return res;
+	unsigned char hi = decoder_quoted_printable_hex[in[1]], lo = decoder_quoted_printable_hex[in[2]];
+	if (hi == DECODER_QP_INVALID || lo == DECODER_QP_INVALID) {
+		// Invalid, just copy the raw content
+		return '=';
+	}
 
+	*used = 3;
+	return (hi << 4) | lo;
+}
 
-		// Discard our buffer
-		priv->buff_len = 0;
+int decoder_quoted_printable_decode(struct decoder *dec) {
 
-	}
+	struct decoder_quoted_printable_priv *priv = dec->priv;
 
+	// Finish the escape sequence left from the previous call
+	while (priv->buff_len) {
+
+		unsigned char win[3];
+		size_t len = priv->buff_len, from_in = 0;
+		memcpy(win, priv->buff, len);
+		while (len < 3 && from_in < dec->avail_in)
+			win[len++] = dec->next_in[from_in++];
+
+		size_t used = 0;
+		int c = decoder_quoted_printable_escape(win, len, &used);
+		if (c == DECODER_QP_NEED_MORE) {
+			memcpy(priv->buff, win, len);
+			priv->buff_len = len;
+			dec->next_in += from_in;
+			dec->avail_in -= from_in;
+			return DEC_OK;
+		}
+
+		if (c >= 0) {
+			if (!dec->avail_out)
+				return DEC_MORE;
+			*dec->next_out = c;
+			dec->next_out++;
+			dec->avail_out--;
+		}
+
+		if (used >= priv->buff_len) {
+			dec->next_in += used - priv->buff_len;
+			dec->avail_in -= used - priv->buff_len;
+			priv->buff_len = 0;
+		} else {
+			memmove(priv->buff, priv->buff + used, priv->buff_len - used);
+			priv->buff_len -= used;
+		}
+	}
 
 	while (dec->avail_in && dec->avail_out) {
 
@@ -125,7 +176,7 @@ int decoder_quoted_printable_decode(struct decoder *dec) {
 		if (eq)
 			len = eq - dec->next_in;
 		if (dec->avail_out < len)
-			return DEC_MORE;
+			len = dec->avail_out;
 
 		memcpy(dec->next_out, dec->next_in, len);
 		dec->next_out += len;
@@ -133,68 +184,36 @@ int decoder_quoted_printable_decode(struct decoder *dec) {
 		dec->next_in += len;
 		dec->avail_in -= len;
 
-		if (eq) {
-			if (dec->avail_out < 1)
+		if (dec->next_in != eq)
+			continue;
+
+		size_t used = 0;
+		int c = decoder_quoted_printable_escape((unsigned char *)dec->next_in, dec->avail_in, &used);
+		if (c == DECODER_QP_NEED_MORE) {
+			memcpy(priv->buff, dec->next_in, dec->avail_in);
+			priv->buff_len = dec->avail_in;
+			dec->next_in += dec->avail_in;
+			dec->avail_in = 0;
+			break;
+		}
+
+		if (c >= 0) {
+			if (!dec->avail_out)
 				return DEC_MORE;
-			
-			if (dec->avail_in < 3) {
-				memcpy(priv->buff, dec->next_in, dec->avail_in);
-				priv->buff[dec->avail_in] = 0;
-				priv->buff_len = dec->avail_in;
-				dec->next_in += dec->avail_in;
-				dec->avail_in = 0;
-				return DEC_OK;
-			}
-
-			dec->next_in++;
-			dec->avail_in--;
-
-			char *in = dec->next_in;
-			char *out = dec->next_out;
-			*out = 0;
-
-
-			int i, advance = 1;
-			for (i = 0; i < 2; i++) {
-				dec->next_in++;
-				dec->avail_in--;
-				if ((in[i] >= '0' && in[i] <= '9')) {
-					*out += (in[i] - '0') << (4 * (1 - i));
-				} else if (in[i] >= 'A' && in[i] <= 'F') {
-					*out += (in[i] - 'A' + 0xA) << (4 * (1 - i));
-				} else if (in[i] == '\r' || in[i] == '\n') {
-					// Soft line breaks, skip
-					advance = 0;
-					continue;
-				} else if (in[i] >= 'a' && in[i] <= 'f') {
-					// Invalid but RFC 2045 says that a robust implem must handle this
-					*out += (in[i] - 'a' + 0xa) << (4 * (1 - i));
-				} else {
-					// Invalid, just copy the raw content
-					out[0] = '=';
-					if (dec->avail_out > i + 1) {
-						out[1] = in[0];
-						if (i > 0) {
-							out[2] = in[1];
-						}
-						dec->avail_out -= i + 1;
-						dec->next_out += i + 1;
-					}
-					break;
-				}
-			}
-			
-			if (advance) {
-				dec->next_out++;
-				dec->avail_out--;
-			}
+			*dec->next_out = c;
+			dec->next_out++;
+			dec->avail_out--;
 		}
+
+		dec->next_in += used;
+		dec->avail_in -= used;
 	}
 
+	if (dec->avail_in)
+		return DEC_MORE;
+
 	if (dec->avail_out > 0)
 		*dec->next_out = 0;
 
 	return DEC_OK;
 }
-
-
@@ -24,9 +24,15 @@
 
 #include <pom-ng/decoder.h>
 
+#define DECODER_QP_INVALID	0xff
+
+// Results of decoder_quoted_printable_escape() other than a byte value
+#define DECODER_QP_SOFT_BREAK	-1
+#define DECODER_QP_NEED_MORE	-2
+
 struct decoder_quoted_printable_priv {
-	char buff[4];
-	int buff_len;
+	unsigned char buff[3]; // Incomplete escape sequence
+	unsigned int buff_len;
 };
 
 struct mod_reg_info *decoder_quoted_printable_reg_info();
@@ -0,0 +1,141 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include "decoder_zstd.h"
+#include <zstd.h>
+
+#define DECODER_ZSTD_DEFAULT_SIZE 4096
+
+// Frames requiring a larger window are refused, the default limit would let each stream use 128MB
+#define DECODER_ZSTD_WINDOW_LOG_MAX 23
+
+struct mod_reg_info *decoder_zstd_reg_info() {
+
+	static struct mod_reg_info reg_info;
+	memset(&reg_info, 0, sizeof(struct mod_reg_info));
+	reg_info.api_ver = MOD_API_VER;
+	reg_info.register_func = decoder_zstd_mod_register;
+	reg_info.unregister_func = decoder_zstd_mod_unregister;
+	reg_info.dependencies = "";
+
+	return &reg_info;
+
+}
+
+static int decoder_zstd_mod_register(struct mod_reg *mod) {
+
+	static struct decoder_reg_info dec_zstd = { 0 };
+	dec_zstd.mod = mod;
+	dec_zstd.alloc = decoder_zstd_alloc;
+	dec_zstd.cleanup = decoder_zstd_cleanup;
+	dec_zstd.estimate_size = decoder_zstd_estimate_size;
+	dec_zstd.decode = decoder_zstd_decode;
+
+	if (decoder_register("zstd", &dec_zstd) != POM_OK)
+		return POM_ERR;
+
+	return POM_OK;
+}
+
+static int decoder_zstd_mod_unregister() {
+
+	return decoder_unregister("zstd");
+}
+
+static int decoder_zstd_alloc(struct decoder *dec) {
+
+	ZSTD_DStream *zds = ZSTD_createDStream();
+	if (!zds) {
+		pomlog(POMLOG_ERR "Unable to create the zstd stream");
+		return POM_ERR;
+	}
+
+	size_t zres = ZSTD_initDStream(zds);
+	if (ZSTD_isError(zres)) {
+		pomlog(POMLOG_ERR "Unable to init the zstd stream : %s", ZSTD_getErrorName(zres));
+		ZSTD_freeDStream(zds);
+		return POM_ERR;
+	}
+
+	zres = ZSTD_DCtx_setParameter(zds, ZSTD_d_windowLogMax, DECODER_ZSTD_WINDOW_LOG_MAX);
+	if (ZSTD_isError(zres)) {
+		pomlog(POMLOG_ERR "Unable to limit the zstd window size : %s", ZSTD_getErrorName(zres));
+		ZSTD_freeDStream(zds);
+		return POM_ERR;
+	}
+
+	dec->priv = zds;
+	dec->state_size = ZSTD_sizeof_DStream(zds);
+
+	return POM_OK;
+}
+
+static int decoder_zstd_cleanup(struct decoder *dec) {
+
+	if (!dec->priv)
+		return POM_OK;
+
+	ZSTD_freeDStream(dec->priv);
+
+	return POM_OK;
+}
+
+static size_t decoder_zstd_estimate_size(size_t encoded_size) {
+
+	long pagesize = sysconf(_SC_PAGESIZE);
+	
+	if (pagesize)
+		return pagesize;
+
+	return DECODER_ZSTD_DEFAULT_SIZE;
+}
+
+static int decoder_zstd_decode(struct decoder *dec) {
+	
+	if (!dec->priv)
+		return DEC_ERR;
+
+	ZSTD_DStream *zds = dec->priv;
+
+	ZSTD_inBuffer in = { dec->next_in, dec->avail_in, 0 };
+	ZSTD_outBuffer out = { dec->next_out, dec->avail_out, 0 };
+
+	int res = DEC_OK;
+	size_t zres = ZSTD_decompressStream(zds, &out, &in);
+	if (ZSTD_isError(zres)) {
+		pomlog(POMLOG_DEBUG "Error while decompressing zstd content : %s", ZSTD_getErrorName(zres));
+		res = DEC_ERR;
+	} else if (!zres) {
+		// The frame was fully decoded and flushed
+		res = DEC_END;
+	} else if (out.pos == out.size) {
+		res = DEC_MORE;
+	}
+
+	// The window is allocated once the frame header is known
+	dec->state_size = ZSTD_sizeof_DStream(zds);
+
+	dec->next_in += in.pos;
+	dec->avail_in -= in.pos;
+	dec->next_out += out.pos;
+	dec->avail_out -= out.pos;
+
+	return res;
+}
@@ -1002,48 +1002,79 @@ static int input_dvb_read(struct input *i) {
 
 	ptime now = pom_gettimeofday();
 
-	int j;
-	for (j = 0; j < pkt_count; j++) {
+	// Packets are queued to the core in bursts
+	struct packet *pkts[INPUT_DVB_BURST];
+	unsigned int pids[INPUT_DVB_BURST];
+	unsigned int count = 0;
+	int res = POM_OK;
+
+	unsigned int j = 0;
+	while (j < pkt_count) {
 
 		unsigned char *pload = buff + (j * MPEG_TS_LEN);
 
 		// Check sync byte
 		if (pload[0] != 0x47) {
 			pomlog(POMLOG_ERR "Error, stream out of sync !");
-			return POM_ERR;
+			res = POM_ERR;
+			break;
 		}
 
 		uint16_t pid = ((pload[1] & 0x1F) << 8) | pload[2];
 		if (filter_null_pid && pid == 0x1FFF) { // 0x1FFF is the NULL PID
 			registry_perf_inc(p->perf_null_discarded, 1);
+			j++;
 			continue;
 		}
 
+		// Group the following cells of the same PID in a single packet
+		unsigned int cells = 1;
+		while (j + cells < pkt_count && cells < INPUT_DVB_PKT_MAX_CELLS) {
+			unsigned char *next = pload + (cells * MPEG_TS_LEN);
+			if (next[0] != 0x47 || (((next[1] & 0x1F) << 8) | next[2]) != pid)
+				break;
+			cells++;
+		}
 
 		// Get a new place holder for our packet
 		struct packet *pkt = packet_alloc();
 
-		if (!pkt)
-			return POM_ERR;
+		if (!pkt) {
+			res = POM_ERR;
+			break;
+		}
 
-		if (packet_buffer_alloc(pkt, MPEG_TS_LEN, 0) != POM_OK) {
+		if (packet_buffer_alloc(pkt, cells * MPEG_TS_LEN, 0) != POM_OK) {
 			packet_release(pkt);
-			return POM_ERR;
+			res = POM_ERR;
+			break;
 		}
 
 		pkt->input = i;
 		pkt->datalink = p->link_proto;
 		pkt->ts = now + j;
 
-		memcpy(pkt->buff, pload, MPEG_TS_LEN);
+		memcpy(pkt->buff, pload, cells * MPEG_TS_LEN);
+		j += cells;
 
+		pkts[count] = pkt;
+		pids[count] = pid;
+		count++;
 
-		if (core_queue_packet(pkt, CORE_QUEUE_HAS_THREAD_AFFINITY | CORE_QUEUE_DROP_IF_FULL, pid) != POM_OK)
-			return POM_ERR;
+		if (count >= INPUT_DVB_BURST) {
+			res = core_queue_packets(pkts, count, CORE_QUEUE_HAS_THREAD_AFFINITY | CORE_QUEUE_DROP_IF_FULL, pids);
+			count = 0;
+			if (res != POM_OK)
+				return POM_ERR;
+		}
 
 	}
 
-	return POM_OK;
+	// Queue what's left even if we hit an error
+	if (count && core_queue_packets(pkts, count, CORE_QUEUE_HAS_THREAD_AFFINITY | CORE_QUEUE_DROP_IF_FULL, pids) != POM_OK)
+		return POM_ERR;
+
+	return res;
 
 }
 
@@ -24,6 +24,9 @@
 #define INPUT_DVB_STATUS_DATA_COUNT		5
 #define INPUT_DVB_DOCSIS_STREAM_DATA_COUNT	6
 
+#define INPUT_DVB_BURST				64 // Packets queued to the core at once
+#define INPUT_DVB_PKT_MAX_CELLS			64 // Consecutive MPEG cells of the same PID grouped in one packet
+
 #define INPUT_DVB_DOCSIS_PID			0x1FFE
 #define INPUT_DVB_DOCSIS_EHDR_MAX_LEN		240
 #define INPUT_DVB_DOCSIS_EURO_SYMBOLRATE	6952000
@@ -18,6 +18,8 @@
  *
  */
 
+#include "../../../config.h"
+
 #include <pom-ng/input.h>
 #include <pom-ng/ptype_string.h>
 #include <pom-ng/ptype_bool.h>
@@ -36,6 +38,20 @@
 #include <regex.h>
 #include <stddef.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef INPUT_PCAP_HAVE_RING
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#endif
 
 struct mod_reg_info* input_pcap_reg_info() {
 	static struct mod_reg_info reg_info;
@@ -166,6 +182,20 @@ static int input_pcap_set_filter(pcap_t *p, char *filter) {
 	return POM_OK;
 }
 
+static int input_pcap_mmap_set_filter(pcap_t *p, struct input_pcap_mmap *m, char *filter) {
+
+	if (strlen(filter) <= 0)
+		return POM_OK;
+
+	if (pcap_compile(p, &m->filter, filter, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+		pomlog(POMLOG_ERR "Unable to compile BPF filter \"%s\" : %s", filter, pcap_geterr(p));
+		return POM_ERR;
+	}
+	m->has_filter = 1;
+
+	return POM_OK;
+}
+
 static int input_pcap_common_open(struct input *i) {
 
 	struct input_pcap_priv *priv = i->priv;
@@ -229,7 +259,13 @@ static int input_pcap_common_open(struct input *i) {
 	}
 
 
-	if (input_pcap_set_filter(priv->p, PTYPE_STRING_GETVAL(priv->p_filter)) != POM_OK) {
+	if (priv->type == input_pcap_type_file && priv->tpriv.file.map) {
+		// Mapped files are filtered while parsing them
+		if (input_pcap_mmap_set_filter(priv->p, priv->tpriv.file.map, PTYPE_STRING_GETVAL(priv->p_filter)) != POM_OK) {
+			input_pcap_close(i);
+			return POM_ERR;
+		}
+	} else if (input_pcap_set_filter(priv->p, PTYPE_STRING_GETVAL(priv->p_filter)) != POM_OK) {
 		input_pcap_close(i);
 		return POM_ERR;
 	}
@@ -246,6 +282,19 @@ static int input_pcap_interface_perf_dropped(uint64_t *value, void *priv) {
 
 	struct input_pcap_priv *p = priv;
 
+#ifdef INPUT_PCAP_HAVE_RING
+	struct input_pcap_ring *r = p ? p->tpriv.iface.ring : NULL;
+	if (r) {
+		// The kernel resets the counters each time they are read
+		struct tpacket_stats_v3 st;
+		socklen_t len = sizeof(st);
+		if (!getsockopt(r->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len))
+			r->dropped += st.tp_drops;
+		*value = r->dropped;
+		return POM_OK;
+	}
+#endif
+
 	if (!p || !p->p) {
 		*value = 0;
 		return POM_OK;
@@ -273,6 +322,12 @@ static int input_pcap_interface_init(struct input *i) {
 	if (!priv->tpriv.iface.p_interface || !priv->tpriv.iface.p_promisc || !priv->tpriv.iface.p_buff_size)
 		goto err;
 
+#ifdef INPUT_PCAP_HAVE_RING
+	priv->tpriv.iface.p_zero_copy = ptype_alloc("bool");
+	if (!priv->tpriv.iface.p_zero_copy)
+		goto err;
+#endif
+
 	priv->tpriv.iface.perf_dropped = registry_instance_add_perf(i->reg_instance, "dropped_pkt", registry_perf_type_counter, "Dropped packets", "pkts");
 	if (!priv->tpriv.iface.perf_dropped)
 		goto err;
@@ -313,6 +368,12 @@ static int input_pcap_interface_init(struct input *i) {
 	if (input_add_param(i, p) != POM_OK)
 		goto err;
 
+#ifdef INPUT_PCAP_HAVE_RING
+	p = registry_new_param("zero_copy", "no", priv->tpriv.iface.p_zero_copy, "Process packets directly from the kernel ring buffer instead of using libpcap (ethernet only)", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+#endif
+
 	priv->type = input_pcap_type_interface;
 
 	return POM_OK;
@@ -328,6 +389,11 @@ err:
 	if (priv->tpriv.iface.p_buff_size)
 		ptype_cleanup(priv->tpriv.iface.p_buff_size);
 
+#ifdef INPUT_PCAP_HAVE_RING
+	if (priv->tpriv.iface.p_zero_copy)
+		ptype_cleanup(priv->tpriv.iface.p_zero_copy);
+#endif
+
 	if (p)
 		registry_cleanup_param(p);
 
@@ -342,6 +408,11 @@ static int input_pcap_interface_open(struct input *i) {
 	struct input_pcap_priv *p = i->priv;
 	char errbuf[PCAP_ERRBUF_SIZE + 1] = { 0 };
 
+#ifdef INPUT_PCAP_HAVE_RING
+	if (*PTYPE_BOOL_GETVAL(p->tpriv.iface.p_zero_copy))
+		return input_pcap_ring_open(i);
+#endif
+
 	char *interface = PTYPE_STRING_GETVAL(p->tpriv.iface.p_interface);
 
 	p->p = pcap_create(interface, errbuf);
@@ -388,13 +459,18 @@ static int input_pcap_file_init(struct input *i) {
 	struct registry_param *p = NULL;
 
 	priv->tpriv.file.p_file = ptype_alloc("string");
-	if (!priv->tpriv.file.p_file)
+	priv->tpriv.file.p_mmap = ptype_alloc("bool");
+	if (!priv->tpriv.file.p_file || !priv->tpriv.file.p_mmap)
 		goto err;
 
 	p = registry_new_param("filename", "dump.cap", priv->tpriv.file.p_file, "File in PCAP format", 0);
 	if (input_add_param(i, p) != POM_OK)
 		goto err;
 
+	p = registry_new_param("mmap", "no", priv->tpriv.file.p_mmap, "Map the file in memory and parse it directly instead of using libpcap", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
 	priv->type = input_pcap_type_file;
 
 	return POM_OK;
@@ -404,6 +480,9 @@ err:
 	if (priv->tpriv.file.p_file)
 		ptype_cleanup(priv->tpriv.file.p_file);
 
+	if (priv->tpriv.file.p_mmap)
+		ptype_cleanup(priv->tpriv.file.p_mmap);
+
 	if (p)
 		registry_cleanup_param(p);
 
@@ -417,6 +496,14 @@ static int input_pcap_file_open(struct input *i) {
 	struct input_pcap_priv *p = i->priv;
 	char errbuf[PCAP_ERRBUF_SIZE + 1] = { 0 };
 
+	if (*PTYPE_BOOL_GETVAL(p->tpriv.file.p_mmap)) {
+		if (input_pcap_mmap_open(i) != POM_OK)
+			return POM_ERR;
+		if (p->tpriv.file.map)
+			return input_pcap_common_open(i);
+		// Not a format we can parse ourselves, use libpcap
+	}
+
 	char *filename = PTYPE_STRING_GETVAL(p->tpriv.file.p_file);
 	p->p = pcap_open_offline(filename, errbuf);
 	if (!p->p) {
@@ -428,6 +515,189 @@ static int input_pcap_file_open(struct input *i) {
 
 }
 
+static int input_pcap_mmap_open(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+	char *filename = PTYPE_STRING_GETVAL(p->tpriv.file.p_file);
+
+	struct input_pcap_mmap *m = malloc(sizeof(struct input_pcap_mmap));
+	if (!m) {
+		pom_oom(sizeof(struct input_pcap_mmap));
+		return POM_ERR;
+	}
+	memset(m, 0, sizeof(struct input_pcap_mmap));
+	m->map = MAP_FAILED;
+
+	m->fd = open(filename, O_RDONLY);
+	if (m->fd == -1) {
+		pomlog(POMLOG_ERR "Error opening file %s for reading : %s", filename, pom_strerror(errno));
+		goto err;
+	}
+
+	struct stat st;
+	if (fstat(m->fd, &st)) {
+		pomlog(POMLOG_ERR "Error while getting the size of file %s : %s", filename, pom_strerror(errno));
+		goto err;
+	}
+
+	// The global header is made of 6 32 bits values
+	m->len = st.st_size;
+	if (m->len < sizeof(uint32_t) * 6) {
+		pomlog(POMLOG_ERR "File %s is too short to be a pcap file", filename);
+		goto err;
+	}
+
+	m->map = mmap(NULL, m->len, PROT_READ, MAP_SHARED, m->fd, 0);
+	if (m->map == MAP_FAILED) {
+		pomlog(POMLOG_ERR "Error while mapping file %s : %s", filename, pom_strerror(errno));
+		goto err;
+	}
+
+	// Let the kernel read ahead and drop the pages we went through
+	madvise(m->map, m->len, MADV_SEQUENTIAL);
+
+	uint32_t ghdr[6];
+	memcpy(ghdr, m->map, sizeof(ghdr));
+
+	switch (ghdr[0]) {
+		case INPUT_PCAP_MAGIC_USEC:
+			break;
+		case INPUT_PCAP_MAGIC_NSEC:
+			m->nsec = 1;
+			break;
+		case __builtin_bswap32(INPUT_PCAP_MAGIC_USEC):
+			m->swapped = 1;
+			break;
+		case __builtin_bswap32(INPUT_PCAP_MAGIC_NSEC):
+			m->swapped = 1;
+			m->nsec = 1;
+			break;
+		default:
+			pomlog(POMLOG_WARN "File %s is not in the classic pcap format, reading it with libpcap", filename);
+			input_pcap_mmap_close(m);
+			return POM_OK;
+	}
+
+	uint32_t snaplen = (m->swapped ? __builtin_bswap32(ghdr[4]) : ghdr[4]);
+	int linktype = (m->swapped ? __builtin_bswap32(ghdr[5]) : ghdr[5]) & INPUT_PCAP_LINKTYPE_MASK;
+
+	// Link types and DLT values are the same except for raw IP
+	if (linktype == INPUT_PCAP_LINKTYPE_RAW)
+		linktype = DLT_RAW;
+
+	if (!snaplen || snaplen > INPUT_PCAP_SNAPLEN_MAX)
+		snaplen = INPUT_PCAP_SNAPLEN_MAX;
+
+	// Only used to find out the datalink and compile the filter
+	p->p = pcap_open_dead(linktype, snaplen);
+	if (!p->p) {
+		pomlog(POMLOG_ERR "Error while opening file %s", filename);
+		goto err;
+	}
+
+	m->pos = sizeof(ghdr);
+	p->tpriv.file.map = m;
+
+	pomlog(POMLOG_DEBUG "File %s mapped in memory (%zu bytes)", filename, m->len);
+
+	return POM_OK;
+
+err:
+	input_pcap_mmap_close(m);
+	return POM_ERR;
+}
+
+static int input_pcap_mmap_next(struct input_pcap_mmap *m, struct pcap_pkthdr **phdr, const u_char **data) {
+
+	while (1) {
+
+		// Each packet starts with 4 32 bits values
+		uint32_t rec[4];
+
+		if (m->pos + sizeof(rec) > m->len) {
+			if (m->pos != m->len)
+				pomlog(POMLOG_WARN "Truncated packet header at the end of the file");
+			return -2;
+		}
+
+		// Ask the kernel for the next part of the file before we reach it
+		if (m->prefetched < m->len && m->pos + (INPUT_PCAP_MMAP_PREFETCH / 2) >= m->prefetched) {
+			size_t len = m->len - m->prefetched;
+			if (len > INPUT_PCAP_MMAP_PREFETCH)
+				len = INPUT_PCAP_MMAP_PREFETCH;
+			madvise(m->map + m->prefetched, len, MADV_WILLNEED);
+			m->prefetched += len;
+		}
+
+		memcpy(rec, m->map + m->pos, sizeof(rec));
+		if (m->swapped) {
+			unsigned int j;
+			for (j = 0; j < 4; j++)
+				rec[j] = __builtin_bswap32(rec[j]);
+		}
+
+		if (rec[2] > INPUT_PCAP_SNAPLEN_MAX * 4) {
+			pomlog(POMLOG_ERR "Invalid packet length %u in pcap file", rec[2]);
+			return -1;
+		}
+
+		if (m->pos + sizeof(rec) + rec[2] > m->len) {
+			pomlog(POMLOG_WARN "Truncated packet at the end of the file");
+			return -2;
+		}
+
+		const u_char *pkt = m->map + m->pos + sizeof(rec);
+		m->pos += sizeof(rec) + rec[2];
+
+		m->hdr.ts.tv_sec = rec[0];
+		m->hdr.ts.tv_usec = (m->nsec ? rec[1] / 1000 : rec[1]);
+		m->hdr.caplen = rec[2];
+		m->hdr.len = rec[3];
+
+		if (m->has_filter && !bpf_filter(m->filter.bf_insns, pkt, m->hdr.len, m->hdr.caplen))
+			continue;
+
+		*phdr = &m->hdr;
+		*data = pkt;
+
+		return 1;
+	}
+
+	return -1;
+}
+
+static int input_pcap_mmap_dispatch(struct input_pcap_mmap *m, int cnt, pcap_handler callback, u_char *user) {
+
+	// Same return values as pcap_dispatch()
+	int n;
+	for (n = 0; n < cnt; n++) {
+		struct pcap_pkthdr *phdr;
+		const u_char *data;
+		int res = input_pcap_mmap_next(m, &phdr, &data);
+		if (res == -2) // EOF
+			break;
+		if (res < 0)
+			return -1;
+		callback(user, phdr, data);
+	}
+
+	return n;
+}
+
+static void input_pcap_mmap_close(struct input_pcap_mmap *m) {
+
+	if (m->has_filter)
+		pcap_freecode(&m->filter);
+
+	if (m->map != MAP_FAILED)
+		munmap(m->map, m->len);
+
+	if (m->fd != -1)
+		close(m->fd);
+
+	free(m);
+}
+
 /*
  * input pcap type dir
  */
@@ -442,7 +712,8 @@ static int input_pcap_dir_init(struct input *i) {
 	struct registry_param *p = NULL;
 	priv->tpriv.dir.p_dir = ptype_alloc("string");
 	priv->tpriv.dir.p_match = ptype_alloc("string");
-	if (!priv->tpriv.dir.p_dir || !priv->tpriv.dir.p_match)
+	priv->tpriv.dir.p_readers = ptype_alloc("uint32");
+	if (!priv->tpriv.dir.p_dir || !priv->tpriv.dir.p_match || !priv->tpriv.dir.p_readers)
 		goto err;
 
 	p = registry_new_param("directory", "/tmp", priv->tpriv.dir.p_dir, "Directory containing pcap files", 0);
@@ -453,6 +724,17 @@ static int input_pcap_dir_init(struct input *i) {
 	if (input_add_param(i, p) != POM_OK)
 		goto err;
 
+	p = registry_new_param("readers", "1", priv->tpriv.dir.p_readers, "Number of files decoded in parallel and merged by packet time", 0);
+	if (input_add_param(i, p) != POM_OK)
+		goto err;
+
+	p = NULL;
+
+	if (pthread_mutex_init(&priv->tpriv.dir.lock, NULL)) {
+		pomlog(POMLOG_ERR "Error while initializing the pcap_dir lock : %s", pom_strerror(errno));
+		goto err;
+	}
+
 	priv->type = input_pcap_type_dir;
 	
 	return POM_OK;
@@ -462,6 +744,12 @@ err:
 	if (priv->tpriv.dir.p_dir)
 		ptype_cleanup(priv->tpriv.dir.p_dir);
 
+	if (priv->tpriv.dir.p_match)
+		ptype_cleanup(priv->tpriv.dir.p_match);
+
+	if (priv->tpriv.dir.p_readers)
+		ptype_cleanup(priv->tpriv.dir.p_readers);
+
 	if (p)
 		registry_cleanup_param(p);
 
@@ -511,7 +799,13 @@ static int input_pcap_dir_open(struct input *i) {
 
 	pomlog("Reading file %s", dp->cur_file->filename);
 
-	return input_pcap_common_open(i);
+	if (input_pcap_common_open(i) != POM_OK)
+		return POM_ERR;
+
+	if (*PTYPE_UINT32_GETVAL(dp->p_readers) > 1)
+		return input_pcap_dir_readers_start(i);
+
+	return POM_OK;
 }
 
 static int input_pcap_dir_browse(struct input_pcap_priv *priv) {
@@ -618,10 +912,11 @@ static int input_pcap_dir_browse(struct input_pcap_priv *priv) {
 			continue;
 		}
 	
-		if (input_pcap_set_filter(priv->p, PTYPE_STRING_GETVAL(priv->p_filter)) != POM_OK) {
+		if (input_pcap_set_filter(p, PTYPE_STRING_GETVAL(priv->p_filter)) != POM_OK) {
 			cur->next = priv->tpriv.dir.files;
 			priv->tpriv.dir.files = cur; // Add at the begning in order not to process it again
 			pomlog(POMLOG_WARN "Could not set filter on file %s", cur->full_path);
+			pcap_close(p);
 			continue;
 		}
 
@@ -685,10 +980,16 @@ static int input_pcap_dir_browse(struct input_pcap_priv *priv) {
 
 }
 
-static int input_pcap_dir_open_next(struct input_pcap_priv *p) {
+static int input_pcap_dir_open_next(struct input_pcap_priv *p, pcap_t **pcap) {
 
 	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
 
+	*pcap = NULL;
+
+	// Another reader already went through all the files
+	if (!dp->cur_file)
+		return POM_OK;
+
 	int rescanned = 0;
 	do {
 		if (!dp->cur_file->next) { // No more file
@@ -715,23 +1016,25 @@ static int input_pcap_dir_open_next(struct input_pcap_priv *p) {
 
 
 		char errbuf[PCAP_ERRBUF_SIZE + 1] = { 0 };
-		p->p = pcap_open_offline(dp->cur_file->full_path, errbuf);
-		if (!p->p || input_pcap_set_filter(p->p, PTYPE_STRING_GETVAL(p->p_filter)) != POM_OK) {
+		*pcap = pcap_open_offline(dp->cur_file->full_path, errbuf);
+		if (!*pcap) {
 			pomlog(POMLOG_ERR "Error while opening next file %s in the directory : %s. Skipping", dp->cur_file->filename, errbuf);
 			continue;
 		}
 
-		if (input_pcap_set_filter(p->p, PTYPE_STRING_GETVAL(p->p_filter)) != POM_OK) {
+		if (input_pcap_set_filter(*pcap, PTYPE_STRING_GETVAL(p->p_filter)) != POM_OK) {
 			pomlog(POMLOG_ERR "Error while setting filter on file %s", dp->cur_file->filename);
+			pcap_close(*pcap);
+			*pcap = NULL;
 			continue;
 		}
 
 		// Make sure this file has the same datalink as the previous one
-		if (pcap_datalink(p->p) == p->datalink_type)
+		if (pcap_datalink(*pcap) == p->datalink_type)
 			break;
 
-		pcap_close(p->p);
-		p->p = NULL;
+		pcap_close(*pcap);
+		*pcap = NULL;
 		pomlog(POMLOG_WARN "Skipping file %s as it doesn't have the same datalink type as the previous ones", dp->cur_file->filename);
 
 	} while (1);
@@ -742,73 +1045,664 @@ static int input_pcap_dir_open_next(struct input_pcap_priv *p) {
 }
 
 /*
- * common input pcap functions
+ * parallel readers of the pcap_dir input
+ *
+ * Each reader thread decodes a file at a time into its own queue. The input
+ * thread keeps the readers in a min-heap ordered by the time of their oldest
+ * packet and always queues the oldest packet of all.
  */
 
-static int input_pcap_read(struct input *i) {
+static int input_pcap_dir_reader_push(struct input_pcap_dir_priv *dp, struct input_pcap_dir_reader *r, struct packet *pkt) {
 
-	struct input_pcap_priv *p = i->priv;
+	unsigned int head = r->head;
 
-	if (p->type == input_pcap_type_dir && !p->tpriv.dir.files) {
-		if (input_pcap_dir_open(i) != POM_OK) {
-			// Don't error out if the scan was interrupted
-			if (p->tpriv.dir.interrupt_scan)
-				return POM_OK;
+	while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= INPUT_PCAP_DIR_READER_QUEUE) {
+		// The queue is full, wait for the input to merge some packets
+		pom_mutex_lock(&r->lock);
+		__atomic_store_n(&r->reader_waiting, 1, __ATOMIC_SEQ_CST);
+		while (head - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) >= INPUT_PCAP_DIR_READER_QUEUE && !dp->interrupt_scan)
+			pthread_cond_wait(&r->cond, &r->lock);
+		__atomic_store_n(&r->reader_waiting, 0, __ATOMIC_RELAXED);
+		pom_mutex_unlock(&r->lock);
+
+		if (dp->interrupt_scan)
 			return POM_ERR;
-		}
 	}
 
-	struct pcap_pkthdr *phdr;
-	const u_char *data;
-	int result = pcap_next_ex(p->p, &phdr, &data);
-	if (phdr->len > phdr->caplen && !p->warning) {
-		pomlog(POMLOG_WARN "Warning, some packets were truncated at capture time on input %s", i->name);
-		p->warning = 1;
+	r->queue[head & (INPUT_PCAP_DIR_READER_QUEUE - 1)] = pkt;
+
+	// Either we see the input waiting or it sees the new packet
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->input_waiting, __ATOMIC_SEQ_CST)) {
+		pom_mutex_lock(&r->lock);
+		pthread_cond_signal(&r->cond);
+		pom_mutex_unlock(&r->lock);
 	}
 
-	if (result < 0) { // End of file or error 
+	return POM_OK;
+}
 
-		if (p->type == input_pcap_type_dir) {
+static int input_pcap_dir_reader_pop(struct input_pcap_dir_priv *dp, struct input_pcap_dir_reader *r, struct packet **pkt) {
 
-			if (result != -2)
-				pomlog(POMLOG_WARN "Error while reading packet from file : %s. Moving on the next file ...", pcap_geterr(p->p), p->tpriv.dir.cur_file->filename);
-			
-			pcap_close(p->p);
-			p->p = NULL;
-			p->warning = 0;
+	*pkt = NULL;
 
-			if (input_pcap_dir_open_next(p) != POM_OK)
-				return POM_ERR;
+	unsigned int tail = r->tail;
+
+	while (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+		// Nothing decoded yet, wait for the reader
+		pom_mutex_lock(&r->lock);
+		__atomic_store_n(&r->input_waiting, 1, __ATOMIC_SEQ_CST);
+		while (tail == __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) && !r->done && !dp->interrupt_scan)
+			pthread_cond_wait(&r->cond, &r->lock);
+		__atomic_store_n(&r->input_waiting, 0, __ATOMIC_RELAXED);
+		int empty = (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE));
+		pom_mutex_unlock(&r->lock);
 
-			if (!p->tpriv.dir.cur_file) {
-				// No more file
-				return input_stop(i);
+		if (empty) // The reader is done or we got interrupted
+			return (r->error ? POM_ERR : POM_OK);
+	}
+
+	*pkt = r->queue[tail & (INPUT_PCAP_DIR_READER_QUEUE - 1)];
+
+	// Either we see the reader waiting or it sees the free slot
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->reader_waiting, __ATOMIC_SEQ_CST)) {
+		pom_mutex_lock(&r->lock);
+		pthread_cond_signal(&r->cond);
+		pom_mutex_unlock(&r->lock);
+	}
+
+	return POM_OK;
+}
+
+static void *input_pcap_dir_reader_thread(void *arg) {
+
+	struct input_pcap_dir_reader *r = arg;
+	struct input_pcap_priv *p = r->input->priv;
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+
+	while (!dp->interrupt_scan) {
+
+		if (!r->p) {
+			// Take the next file of the list
+			pom_mutex_lock(&dp->lock);
+			int res = input_pcap_dir_open_next(p, &r->p);
+			r->file = dp->cur_file;
+			pom_mutex_unlock(&dp->lock);
+
+			if (res != POM_OK) {
+				r->error = 1;
+				break;
 			}
 
-			result = pcap_next_ex(p->p, &phdr, &data);
-			if (result < 0) {
-				pomlog(POMLOG_ERR "Error while reading first packet of new file");
+			if (!r->p) // No more file
+				break;
+		}
+
+		struct pcap_pkthdr *phdr;
+		const u_char *data;
+		int result = pcap_next_ex(r->p, &phdr, &data);
+
+		if (result < 0) {
+			if (result != -2)
+				pomlog(POMLOG_WARN "Error while reading packet from file %s : %s. Moving on the next file ...", r->file->filename, pcap_geterr(r->p));
+			pcap_close(r->p);
+			r->p = NULL;
+			continue;
+		}
+
+		if (result == 0)
+			continue;
+
+		struct packet *pkt = input_pcap_packet_alloc(r->input, phdr, data);
+		if (!pkt) {
+			r->error = 1;
+			break;
+		}
+
+		if (input_pcap_dir_reader_push(dp, r, pkt) != POM_OK) {
+			packet_release(pkt);
+			break;
+		}
+	}
+
+	pom_mutex_lock(&r->lock);
+	r->done = 1;
+	pthread_cond_signal(&r->cond);
+	pom_mutex_unlock(&r->lock);
+
+	packet_cache_thread_cleanup();
+	registry_perf_thread_cleanup();
+
+	return NULL;
+}
+
+static void input_pcap_dir_heap_down(struct input_pcap_dir_priv *dp, unsigned int pos) {
+
+	struct input_pcap_dir_reader **heap = dp->heap;
+	struct input_pcap_dir_reader *r = heap[pos];
+
+	while (1) {
+		unsigned int child = pos * 2 + 1;
+		if (child >= dp->heap_count)
+			break;
+
+		if (child + 1 < dp->heap_count && heap[child + 1]->next_pkt->ts < heap[child]->next_pkt->ts)
+			child++;
+
+		if (heap[child]->next_pkt->ts >= r->next_pkt->ts)
+			break;
+
+		heap[pos] = heap[child];
+		pos = child;
+	}
+
+	heap[pos] = r;
+}
+
+static int input_pcap_dir_readers_start(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+
+	unsigned int count = *PTYPE_UINT32_GETVAL(dp->p_readers);
+
+	struct input_pcap_dir_reader *readers = malloc(sizeof(struct input_pcap_dir_reader) * count);
+	if (!readers) {
+		pom_oom(sizeof(struct input_pcap_dir_reader) * count);
+		return POM_ERR;
+	}
+	memset(readers, 0, sizeof(struct input_pcap_dir_reader) * count);
+
+	dp->heap = malloc(sizeof(struct input_pcap_dir_reader *) * count);
+	if (!dp->heap) {
+		free(readers);
+		pom_oom(sizeof(struct input_pcap_dir_reader *) * count);
+		return POM_ERR;
+	}
+	dp->heap_count = 0;
+
+	// The first reader continues with the file opened to find out the datalink
+	readers[0].p = p->p;
+	readers[0].file = dp->cur_file;
+	p->p = NULL;
+
+	pom_mutex_lock(&dp->lock);
+	dp->readers = readers;
+
+	unsigned int j;
+	for (j = 0; j < count; j++) {
+		struct input_pcap_dir_reader *r = &readers[j];
+		r->input = i;
+
+		if (pthread_mutex_init(&r->lock, NULL)) {
+			pomlog(POMLOG_ERR "Error while initializing the reader lock : %s", pom_strerror(errno));
+			break;
+		}
+
+		if (pthread_cond_init(&r->cond, NULL)) {
+			pomlog(POMLOG_ERR "Error while initializing the reader condition : %s", pom_strerror(errno));
+			pthread_mutex_destroy(&r->lock);
+			break;
+		}
+
+		if (pthread_create(&r->thread, NULL, input_pcap_dir_reader_thread, r)) {
+			pomlog(POMLOG_ERR "Error while starting a pcap reader thread : %s", pom_strerror(errno));
+			pthread_cond_destroy(&r->cond);
+			pthread_mutex_destroy(&r->lock);
+			break;
+		}
+
+		dp->reader_count++;
+	}
+	pom_mutex_unlock(&dp->lock);
+
+	if (dp->reader_count < count) {
+		if (!dp->reader_count && readers[0].p) {
+			pcap_close(readers[0].p);
+			readers[0].p = NULL;
+		}
+		return POM_ERR;
+	}
+
+	pomlog(POMLOG_INFO "Reading files with %u parallel readers", count);
+
+	// Get the first packet of each reader
+	for (j = 0; j < count; j++) {
+		struct input_pcap_dir_reader *r = &readers[j];
+		if (input_pcap_dir_reader_pop(dp, r, &r->next_pkt) != POM_OK)
+			return POM_ERR;
+		if (r->next_pkt)
+			dp->heap[dp->heap_count++] = r;
+	}
+
+	for (j = dp->heap_count / 2; j-- > 0; )
+		input_pcap_dir_heap_down(dp, j);
+
+	return POM_OK;
+}
+
+static int input_pcap_dir_readers_read(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+
+	if (dp->interrupt_scan)
+		return POM_OK;
+
+	if (!dp->heap_count) {
+		// All the readers are done
+		unsigned int j;
+		for (j = 0; j < dp->reader_count; j++) {
+			if (dp->readers[j].error)
 				return POM_ERR;
-			}
-		} else {
-			if (result == -2) // EOF
-				return input_stop(i);
+		}
+		return input_stop(i);
+	}
 
-			pomlog(POMLOG_ERR "Error while reading file : %s", pcap_geterr(p->p));
+	struct packet *pkts[INPUT_PCAP_BURST];
+	unsigned int count = 0;
+
+	while (count < INPUT_PCAP_BURST && dp->heap_count) {
+
+		struct input_pcap_dir_reader *r = dp->heap[0];
+		pkts[count++] = r->next_pkt;
+
+		// Replace it with the next packet from the same reader
+		if (input_pcap_dir_reader_pop(dp, r, &r->next_pkt) != POM_OK) {
+			r->next_pkt = NULL;
+			input_pcap_burst_queue(p, pkts, count);
 			return POM_ERR;
 		}
+
+		if (!r->next_pkt) // Nothing more from this reader
+			dp->heap[0] = dp->heap[--dp->heap_count];
+
+		if (dp->heap_count)
+			input_pcap_dir_heap_down(dp, 0);
+	}
+
+	return input_pcap_burst_queue(p, pkts, count);
+}
+
+static void input_pcap_dir_readers_wakeup(struct input_pcap_dir_priv *dp) {
+
+	pom_mutex_lock(&dp->lock);
+	unsigned int j;
+	for (j = 0; j < dp->reader_count; j++) {
+		struct input_pcap_dir_reader *r = &dp->readers[j];
+		pom_mutex_lock(&r->lock);
+		pthread_cond_broadcast(&r->cond);
+		pom_mutex_unlock(&r->lock);
+	}
+	pom_mutex_unlock(&dp->lock);
+}
+
+static void input_pcap_dir_readers_stop(struct input_pcap_priv *p) {
+
+	struct input_pcap_dir_priv *dp = &p->tpriv.dir;
+
+	if (!dp->readers)
+		return;
+
+	dp->interrupt_scan = 1;
+	input_pcap_dir_readers_wakeup(dp);
+
+	// Detach the readers so input_pcap_interrupt() doesn't use them anymore
+	pom_mutex_lock(&dp->lock);
+	struct input_pcap_dir_reader *readers = dp->readers;
+	unsigned int count = dp->reader_count;
+	dp->readers = NULL;
+	dp->reader_count = 0;
+	pom_mutex_unlock(&dp->lock);
+
+	unsigned int j;
+	for (j = 0; j < count; j++) {
+		struct input_pcap_dir_reader *r = &readers[j];
+		if (pthread_join(r->thread, NULL))
+			pomlog(POMLOG_WARN "Error while joining a pcap reader thread");
+
+		while (r->tail != r->head) {
+			packet_release(r->queue[r->tail & (INPUT_PCAP_DIR_READER_QUEUE - 1)]);
+			r->tail++;
+		}
+
+		if (r->next_pkt)
+			packet_release(r->next_pkt);
+
+		if (r->p)
+			pcap_close(r->p);
+
+		pthread_cond_destroy(&r->cond);
+		pthread_mutex_destroy(&r->lock);
+	}
+
+	free(readers);
+	free(dp->heap);
+	dp->heap = NULL;
+	dp->heap_count = 0;
+}
+
+/*
+ * input pcap type interface using the kernel ring buffer directly
+ */
+
+#ifdef INPUT_PCAP_HAVE_RING
+
+static void input_pcap_ring_destroy(struct input_pcap_ring *r) {
+
+	if (r->map != MAP_FAILED)
+		munmap(r->map, r->map_len);
+
+	if (r->fd != -1)
+		close(r->fd);
+
+	if (r->blocks) {
+		unsigned int i;
+		for (i = 0; i < r->block_count; i++) {
+			if (r->blocks[i].pb)
+				packet_buffer_external_cleanup(r->blocks[i].pb);
+		}
+		free(r->blocks);
 	}
 
-	if (result == 0) // Timeout
+	free(r);
+}
+
+static void input_pcap_ring_unref(struct input_pcap_ring *r) {
+
+	if (!__sync_sub_and_fetch(&r->refcount, 1))
+		input_pcap_ring_destroy(r);
+}
+
+static void input_pcap_ring_block_release(void *priv) {
+
+	struct input_pcap_ring_block *b = priv;
+
+	if (__sync_sub_and_fetch(&b->refcount, 1))
+		return;
+
+	// All the packets are released, give the block back to the kernel
+	__sync_synchronize();
+	b->desc->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+	// Only now the reader may look at this block again
+	struct input_pcap_ring *r = b->ring;
+	__atomic_store_n(&b->owned, 0, __ATOMIC_RELEASE);
+
+	input_pcap_ring_unref(r);
+}
+
+static int input_pcap_ring_set_filter(int fd, char *filter) {
+
+	if (strlen(filter) <= 0)
 		return POM_OK;
 
+	pcap_t *p = pcap_open_dead(DLT_EN10MB, INPUT_PCAP_SNAPLEN_MAX);
+	if (!p) {
+		pomlog(POMLOG_ERR "Unable to compile BPF filter \"%s\"", filter);
+		return POM_ERR;
+	}
+
+	struct bpf_program fp;
+	if (pcap_compile(p, &fp, filter, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+		pomlog(POMLOG_ERR "Unable to compile BPF filter \"%s\" : %s", filter, pcap_geterr(p));
+		pcap_close(p);
+		return POM_ERR;
+	}
+	pcap_close(p);
+
+	struct sock_fprog fprog;
+	memset(&fprog, 0, sizeof(struct sock_fprog));
+	fprog.len = fp.bf_len;
+	fprog.filter = (struct sock_filter *) fp.bf_insns;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog))) {
+		pomlog(POMLOG_ERR "Unable to set the BPF filter \"%s\" : %s", filter, pom_strerror(errno));
+		pcap_freecode(&fp);
+		return POM_ERR;
+	}
+
+	pcap_freecode(&fp);
+
+	return POM_OK;
+}
+
+static int input_pcap_ring_open(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+	char *interface = PTYPE_STRING_GETVAL(p->tpriv.iface.p_interface);
+
+	p->datalink_proto = proto_get("ethernet");
+	if (!p->datalink_proto) {
+		pomlog(POMLOG_ERR "Cannot open input pcap : protocol ethernet not registered");
+		return POM_ERR;
+	}
+	p->datalink_type = DLT_EN10MB;
+
+	struct input_pcap_ring *r = malloc(sizeof(struct input_pcap_ring));
+	if (!r) {
+		pom_oom(sizeof(struct input_pcap_ring));
+		return POM_ERR;
+	}
+	memset(r, 0, sizeof(struct input_pcap_ring));
+	r->map = MAP_FAILED;
+	r->refcount = 1;
+
+	r->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (r->fd == -1) {
+		pomlog(POMLOG_ERR "Error while opening packet socket : %s", pom_strerror(errno));
+		goto err;
+	}
+
+	int version = TPACKET_V3;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))) {
+		pomlog(POMLOG_ERR "Error while setting TPACKET_V3 on the packet socket : %s", pom_strerror(errno));
+		goto err;
+	}
+
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(struct ifreq));
+	strncpy(ifr.ifr_name, interface, IFNAMSIZ - 1);
+	if (ioctl(r->fd, SIOCGIFINDEX, &ifr)) {
+		pomlog(POMLOG_ERR "Error while getting the index of interface %s : %s", interface, pom_strerror(errno));
+		goto err;
+	}
+	int ifindex = ifr.ifr_ifindex;
+
+	if (ioctl(r->fd, SIOCGIFHWADDR, &ifr)) {
+		pomlog(POMLOG_ERR "Error while getting the type of interface %s : %s", interface, pom_strerror(errno));
+		goto err;
+	}
+
+	if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+		pomlog(POMLOG_ERR "Interface %s is not an ethernet interface, zero copy capture is not supported", interface);
+		goto err;
+	}
+
+	if (input_pcap_ring_set_filter(r->fd, PTYPE_STRING_GETVAL(p->p_filter)) != POM_OK)
+		goto err;
+
+	uint32_t buff_size = *PTYPE_UINT32_GETVAL(p->tpriv.iface.p_buff_size);
+
+	struct tpacket_req3 req;
+	memset(&req, 0, sizeof(struct tpacket_req3));
+	req.tp_block_size = INPUT_PCAP_RING_BLOCK_SIZE;
+	req.tp_block_nr = buff_size / INPUT_PCAP_RING_BLOCK_SIZE;
+	if (req.tp_block_nr < 2)
+		req.tp_block_nr = 2;
+	req.tp_frame_size = INPUT_PCAP_RING_FRAME_SIZE;
+	req.tp_frame_nr = (req.tp_block_size * req.tp_block_nr) / req.tp_frame_size;
+	req.tp_retire_blk_tov = INPUT_PCAP_RING_BLOCK_TIMEOUT;
+
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+		pomlog(POMLOG_ERR "Error while setting up the packet ring : %s", pom_strerror(errno));
+		goto err;
+	}
+
+	r->block_count = req.tp_block_nr;
+	r->map_len = (size_t) req.tp_block_size * req.tp_block_nr;
+	r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+	if (r->map == MAP_FAILED) {
+		pomlog(POMLOG_ERR "Error while mapping the packet ring : %s", pom_strerror(errno));
+		goto err;
+	}
+
+	r->blocks = malloc(sizeof(struct input_pcap_ring_block) * r->block_count);
+	if (!r->blocks) {
+		pom_oom(sizeof(struct input_pcap_ring_block) * r->block_count);
+		goto err;
+	}
+	memset(r->blocks, 0, sizeof(struct input_pcap_ring_block) * r->block_count);
+
+	unsigned int j;
+	for (j = 0; j < r->block_count; j++) {
+		struct input_pcap_ring_block *b = &r->blocks[j];
+		b->desc = r->map + ((size_t) j * req.tp_block_size);
+		b->ring = r;
+		b->pb = packet_buffer_external_alloc(input_pcap_ring_block_release, b);
+		if (!b->pb)
+			goto err;
+	}
+
+	if (*PTYPE_BOOL_GETVAL(p->tpriv.iface.p_promisc)) {
+		struct packet_mreq mr;
+		memset(&mr, 0, sizeof(struct packet_mreq));
+		mr.mr_ifindex = ifindex;
+		mr.mr_type = PACKET_MR_PROMISC;
+		if (setsockopt(r->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)))
+			pomlog(POMLOG_WARN "Error while setting promisc mode : %s", pom_strerror(errno));
+	}
+
+	struct sockaddr_ll sll;
+	memset(&sll, 0, sizeof(struct sockaddr_ll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(r->fd, (struct sockaddr *) &sll, sizeof(sll))) {
+		pomlog(POMLOG_ERR "Error while binding to interface %s : %s", interface, pom_strerror(errno));
+		goto err;
+	}
+
+	p->tpriv.iface.ring = r;
+
+	pomlog(POMLOG_INFO "Capturing from interface %s using a zero copy ring of %u blocks", interface, r->block_count);
+
+	return POM_OK;
+
+err:
+	input_pcap_ring_destroy(r);
+	p->datalink_proto = NULL;
+	return POM_ERR;
+}
+
+static int input_pcap_ring_read(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+	struct input_pcap_ring *r = p->tpriv.iface.ring;
+	struct input_pcap_ring_block *b = &r->blocks[r->cur_block];
+
+	if (__atomic_load_n(&b->owned, __ATOMIC_ACQUIRE)) {
+		// We went around the ring and this block is still in use
+		usleep(INPUT_PCAP_RING_BLOCK_TIMEOUT * 1000);
+		return POM_OK;
+	}
+
+	if (!(b->desc->hdr.bh1.block_status & TP_STATUS_USER)) {
+		struct pollfd pfd;
+		memset(&pfd, 0, sizeof(struct pollfd));
+		pfd.fd = r->fd;
+		pfd.events = POLLIN | POLLERR;
+		if (poll(&pfd, 1, INPUT_PCAP_RING_POLL_TIMEOUT) == -1 && errno != EINTR) {
+			pomlog(POMLOG_ERR "Error while polling the packet socket : %s", pom_strerror(errno));
+			return POM_ERR;
+		}
+		return POM_OK;
+	}
+
+	// Make sure we read the content of the block after its status
+	__sync_synchronize();
+
+	// Hold a reference on the block while queuing its packets
+	b->owned = 1;
+	b->refcount = 1;
+	__sync_fetch_and_add(&r->refcount, 1);
+
+	r->cur_block++;
+	if (r->cur_block >= r->block_count)
+		r->cur_block = 0;
+
+	int res = POM_OK;
+
+	unsigned int num_pkts = b->desc->hdr.bh1.num_pkts;
+	struct tpacket3_hdr *hdr = (void *) b->desc + b->desc->hdr.bh1.offset_to_first_pkt;
+
+	struct packet *pkts[INPUT_PCAP_BURST];
+	unsigned int count = 0;
+
+	unsigned int j;
+	for (j = 0; j < num_pkts; j++) {
+
+		if (hdr->tp_len > hdr->tp_snaplen && !p->warning) {
+			pomlog(POMLOG_WARN "Warning, some packets were truncated at capture time on input %s", i->name);
+			p->warning = 1;
+		}
+
+		struct packet *pkt = packet_alloc();
+		if (!pkt) {
+			res = POM_ERR;
+			break;
+		}
+
+		__sync_fetch_and_add(&b->refcount, 1);
+		packet_buffer_external_attach(pkt, b->pb, (void *) hdr + hdr->tp_mac, hdr->tp_snaplen);
+
+		pkt->input = i;
+		pkt->datalink = p->datalink_proto;
+		pkt->ts = ((ptime) hdr->tp_sec * 1000000UL) + (hdr->tp_nsec / 1000);
+
+		pkts[count++] = pkt;
+		if (count >= INPUT_PCAP_BURST) {
+			res = core_queue_packets(pkts, count, CORE_QUEUE_DROP_IF_FULL, NULL);
+			count = 0;
+			if (res != POM_OK)
+				break;
+		}
+
+		hdr = (void *) hdr + hdr->tp_next_offset;
+	}
+
+	if (count && core_queue_packets(pkts, count, CORE_QUEUE_DROP_IF_FULL, NULL) != POM_OK)
+		res = POM_ERR;
+
+	// Release our own reference
+	input_pcap_ring_block_release(b);
+
+	return res;
+}
+
+#endif
+
+/*
+ * common input pcap functions
+ */
+
+static struct packet *input_pcap_packet_alloc(struct input *i, const struct pcap_pkthdr *phdr, const u_char *data) {
+
+	struct input_pcap_priv *p = i->priv;
+
+	if (phdr->len > phdr->caplen && !p->warning) {
+		pomlog(POMLOG_WARN "Warning, some packets were truncated at capture time on input %s", i->name);
+		p->warning = 1;
+	}
+
 	struct packet *pkt = packet_alloc();
 	if (!pkt)
-		return POM_ERR;
+		return NULL;
 
 	if (packet_buffer_alloc(pkt, phdr->caplen - p->skip_offset, p->align_offset) != POM_OK) {
 		packet_release(pkt);
-		return POM_ERR;
+		return NULL;
 	}
 
 	pkt->input = i;
@@ -816,7 +1710,31 @@ static int input_pcap_read(struct input *i) {
 	pkt->ts = pom_timeval_to_ptime(phdr->ts);
 	memcpy(pkt->buff, data + p->skip_offset, phdr->caplen - p->skip_offset);
 
-	unsigned int flags = 0, affinity = 0;
+	return pkt;
+}
+
+static void input_pcap_burst_add(u_char *user, const struct pcap_pkthdr *phdr, const u_char *data) {
+
+	struct input_pcap_burst *b = (struct input_pcap_burst *) user;
+
+	if (b->error)
+		return;
+
+	struct packet *pkt = input_pcap_packet_alloc(b->input, phdr, data);
+	if (!pkt) {
+		b->error = 1;
+		return;
+	}
+
+	b->pkts[b->count++] = pkt;
+}
+
+static int input_pcap_burst_queue(struct input_pcap_priv *p, struct packet **pkts, unsigned int count) {
+
+	if (!count)
+		return POM_OK;
+
+	unsigned int flags = 0;
 
 	if (p->type == input_pcap_type_interface)
 		flags = CORE_QUEUE_DROP_IF_FULL;
@@ -824,12 +1742,96 @@ static int input_pcap_read(struct input *i) {
 #ifdef DLT_MPEG_2_TS
 	if (p->datalink_type == DLT_MPEG_2_TS) {
 		// MPEG2 TS has thread affinity based on the PID
-		flags |= CORE_QUEUE_HAS_THREAD_AFFINITY;
-		affinity = ((((char*)pkt->buff)[1] & 0x1F) << 8) | ((char *)pkt->buff)[2];
+		unsigned int affinity[INPUT_PCAP_BURST];
+		unsigned int j;
+		for (j = 0; j < count; j++) {
+			unsigned char *buff = pkts[j]->buff;
+			affinity[j] = ((buff[1] & 0x1F) << 8) | buff[2];
+		}
+		return core_queue_packets(pkts, count, flags | CORE_QUEUE_HAS_THREAD_AFFINITY, affinity);
 	}
 #endif
 
-	return core_queue_packet(pkt, flags, affinity);
+	return core_queue_packets(pkts, count, flags, NULL);
+}
+
+static int input_pcap_read(struct input *i) {
+
+	struct input_pcap_priv *p = i->priv;
+
+#ifdef INPUT_PCAP_HAVE_RING
+	if (p->type == input_pcap_type_interface && p->tpriv.iface.ring)
+		return input_pcap_ring_read(i);
+#endif
+
+	if (p->type == input_pcap_type_dir && !p->tpriv.dir.files) {
+		if (input_pcap_dir_open(i) != POM_OK) {
+			// Don't error out if the scan was interrupted
+			if (p->tpriv.dir.interrupt_scan)
+				return POM_OK;
+			return POM_ERR;
+		}
+	}
+
+	if (p->type == input_pcap_type_dir && p->tpriv.dir.readers)
+		return input_pcap_dir_readers_read(i);
+
+	struct input_pcap_burst b;
+	b.input = i;
+	b.count = 0;
+	b.error = 0;
+
+	int result;
+	if (p->type == input_pcap_type_file && p->tpriv.file.map)
+		result = input_pcap_mmap_dispatch(p->tpriv.file.map, INPUT_PCAP_BURST, input_pcap_burst_add, (u_char *) &b);
+	else
+		result = pcap_dispatch(p->p, INPUT_PCAP_BURST, input_pcap_burst_add, (u_char *) &b);
+
+	// Queue what we got before handling errors or the end of the file
+	if (input_pcap_burst_queue(p, b.pkts, b.count) != POM_OK || b.error)
+		return POM_ERR;
+
+	if (result > 0)
+		return POM_OK;
+
+	if (result == -2) // Interrupted by pcap_breakloop()
+		return POM_OK;
+
+	if (p->type == input_pcap_type_interface) {
+		if (!result) // Timeout
+			return POM_OK;
+		pomlog(POMLOG_ERR "Error while reading from interface : %s", pcap_geterr(p->p));
+		return POM_ERR;
+	}
+
+	// End of file or error
+	if (p->type == input_pcap_type_dir) {
+
+		if (result < 0)
+			pomlog(POMLOG_WARN "Error while reading packet from file %s : %s. Moving on the next file ...", p->tpriv.dir.cur_file->filename, pcap_geterr(p->p));
+
+		pcap_close(p->p);
+		p->p = NULL;
+		p->warning = 0;
+
+		if (input_pcap_dir_open_next(p, &p->p) != POM_OK)
+			return POM_ERR;
+
+		if (!p->tpriv.dir.cur_file) {
+			// No more file
+			return input_stop(i);
+		}
+
+		return POM_OK;
+	}
+
+	if (!result) // EOF
+		return input_stop(i);
+
+	if (!p->tpriv.file.map) // Already reported otherwise
+		pomlog(POMLOG_ERR "Error while reading file : %s", pcap_geterr(p->p));
+
+	return POM_ERR;
 }
 
 static int input_pcap_close(struct input *i) {
@@ -838,18 +1840,41 @@ static int input_pcap_close(struct input *i) {
 
 
 	if (priv->type == input_pcap_type_interface) {
-		struct pcap_stat ps;
 		char *iface = PTYPE_STRING_GETVAL(priv->tpriv.iface.p_interface);
-		if (!pcap_stats(priv->p, &ps)) {
+#ifdef INPUT_PCAP_HAVE_RING
+		struct input_pcap_ring *r = priv->tpriv.iface.ring;
+		if (r) {
+			struct tpacket_stats_v3 st;
+			socklen_t len = sizeof(st);
+			if (!getsockopt(r->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len)) {
+				r->dropped += st.tp_drops;
+				pomlog(POMLOG_INFO "interface %s stats : %"PRIu64" pkts dropped by the kernel", iface, r->dropped);
+			}
+
+			// The ring will be freed once all its packets are released
+			priv->tpriv.iface.ring = NULL;
+			input_pcap_ring_unref(r);
+		}
+#endif
+		struct pcap_stat ps;
+		if (priv->p && !pcap_stats(priv->p, &ps)) {
 			pomlog(POMLOG_INFO "interface %s stats : %u pkts received, %u pkts dropped by pcap, %u pkts dropped by the interface", iface, ps.ps_recv, ps.ps_drop, ps.ps_ifdrop);
 		}
 	}
 
+	if (priv->type == input_pcap_type_dir)
+		input_pcap_dir_readers_stop(priv);
+
 	if (priv->p) {
 		pcap_close(priv->p);
 		priv->p = NULL;
 	}
 
+	if (priv->type == input_pcap_type_file && priv->tpriv.file.map) {
+		input_pcap_mmap_close(priv->tpriv.file.map);
+		priv->tpriv.file.map = NULL;
+	}
+
 	priv->datalink_proto = NULL;
 	priv->align_offset = 0;
 	priv->skip_offset = 0;
@@ -878,13 +1903,19 @@ static int input_pcap_cleanup(struct input *i) {
 			ptype_cleanup(priv->tpriv.iface.p_interface);
 			ptype_cleanup(priv->tpriv.iface.p_promisc);
 			ptype_cleanup(priv->tpriv.iface.p_buff_size);
+#ifdef INPUT_PCAP_HAVE_RING
+			ptype_cleanup(priv->tpriv.iface.p_zero_copy);
+#endif
 			break;
 		case input_pcap_type_file:
 			ptype_cleanup(priv->tpriv.file.p_file);
+			ptype_cleanup(priv->tpriv.file.p_mmap);
 			break;
 		case input_pcap_type_dir:
 			ptype_cleanup(priv->tpriv.dir.p_dir);
 			ptype_cleanup(priv->tpriv.dir.p_match);
+			ptype_cleanup(priv->tpriv.dir.p_readers);
+			pthread_mutex_destroy(&priv->tpriv.dir.lock);
 			break;
 
 	}
@@ -898,8 +1929,10 @@ static int input_pcap_cleanup(struct input *i) {
 static int input_pcap_interrupt(struct input *i) {
 
 	struct input_pcap_priv *priv = i->priv;
-	if (priv->type == input_pcap_type_dir)
+	if (priv->type == input_pcap_type_dir) {
 		priv->tpriv.dir.interrupt_scan = 1;
+		input_pcap_dir_readers_wakeup(&priv->tpriv.dir);
+	}
 
 	if (priv->p)
 		pcap_breakloop(priv->p);
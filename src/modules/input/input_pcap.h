@@ -23,8 +23,32 @@
 
 #include <pcap.h>
 
+#ifdef HAVE_LINUX_IF_PACKET_H
+#include <linux/if_packet.h>
+#ifdef TPACKET3_HDRLEN
+#define INPUT_PCAP_HAVE_RING
+#endif
+#endif
+
 #define INPUT_PCAP_SNAPLEN_MAX 65535
 
+#define INPUT_PCAP_BURST		64 // Packets queued to the core at once
+
+#define INPUT_PCAP_RING_BLOCK_SIZE	(1 << 20)
+#define INPUT_PCAP_RING_FRAME_SIZE	2048
+#define INPUT_PCAP_RING_BLOCK_TIMEOUT	50 // ms
+#define INPUT_PCAP_RING_POLL_TIMEOUT	500 // ms
+
+#define INPUT_PCAP_DIR_READER_QUEUE	512 // Packets decoded in advance by each reader, must be a power of 2
+
+#define INPUT_PCAP_MMAP_PREFETCH	(8 << 20) // Bytes of a mapped file to prefetch ahead of the reading position
+
+// Values from the pcap file format
+#define INPUT_PCAP_MAGIC_USEC		0xa1b2c3d4
+#define INPUT_PCAP_MAGIC_NSEC		0xa1b23c4d
+#define INPUT_PCAP_LINKTYPE_RAW		101
+#define INPUT_PCAP_LINKTYPE_MASK	0x03ffffff
+
 enum input_pcap_type {
 	input_pcap_type_interface,
 	input_pcap_type_file,
@@ -32,15 +56,66 @@ enum input_pcap_type {
 
 };
 
+#ifdef INPUT_PCAP_HAVE_RING
+
+struct input_pcap_ring;
+
+struct input_pcap_ring_block {
+	struct tpacket_block_desc *desc;
+	struct packet_buffer *pb; // Shared by all the packets of this block
+	struct input_pcap_ring *ring;
+	unsigned int refcount; // Packets of this block still in use
+	int owned; // Set until the block is given back to the kernel
+};
+
+struct input_pcap_ring {
+	int fd;
+	void *map;
+	size_t map_len;
+	unsigned int block_count;
+	unsigned int cur_block;
+	struct input_pcap_ring_block *blocks;
+	unsigned int refcount; // One for the input and one per block in use
+	uint64_t dropped;
+};
+
+#endif
+
+// Packets read by a single pcap_dispatch() call
+struct input_pcap_burst {
+	struct input *input;
+	struct packet *pkts[INPUT_PCAP_BURST];
+	unsigned int count;
+	int error;
+};
+
 struct input_pcap_interface_priv {
 	struct ptype *p_interface;
 	struct ptype *p_promisc;
 	struct ptype *p_buff_size;
 	struct registry_perf *perf_dropped;
+#ifdef INPUT_PCAP_HAVE_RING
+	struct ptype *p_zero_copy;
+	struct input_pcap_ring *ring;
+#endif
+};
+
+// Pcap file mapped in memory and parsed without libpcap
+struct input_pcap_mmap {
+	int fd;
+	unsigned char *map;
+	size_t len, pos;
+	size_t prefetched; // Everything before this offset was already prefetched
+	int swapped, nsec;
+	struct bpf_program filter;
+	int has_filter;
+	struct pcap_pkthdr hdr;
 };
 
 struct input_pcap_file_priv {
 	struct ptype *p_file;
+	struct ptype *p_mmap;
+	struct input_pcap_mmap *map;
 };
 
 
@@ -50,12 +125,38 @@ struct input_pcap_dir_file {
 	struct input_pcap_dir_file *prev, *next;
 };
 
+// Thread decoding files in parallel with the others
+struct input_pcap_dir_reader {
+	pthread_t thread;
+	struct input *input;
+	pcap_t *p;
+	struct input_pcap_dir_file *file;
+
+	// Packets decoded by this reader and not merged yet
+	struct packet *queue[INPUT_PCAP_DIR_READER_QUEUE];
+	unsigned int head, tail;
+	int reader_waiting, input_waiting;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done, error;
+
+	struct packet *next_pkt; // Packet competing in the merge heap
+};
+
 struct input_pcap_dir_priv {
 	struct ptype *p_dir;
 	struct ptype *p_match;
+	struct ptype *p_readers;
 	struct input_pcap_dir_file *files;
 	struct input_pcap_dir_file *cur_file;
-	unsigned int interrupt_scan;
+	volatile unsigned int interrupt_scan;
+
+	// Parallel readers merged by packet time
+	pthread_mutex_t lock; // Protects the file list once the readers are started
+	struct input_pcap_dir_reader *readers;
+	unsigned int reader_count;
+	struct input_pcap_dir_reader **heap;
+	unsigned int heap_count;
 };
 
 struct input_pcap_priv {
@@ -86,14 +187,32 @@ static int input_pcap_interface_perf_dropped(uint64_t *value, void *priv);
 static int input_pcap_interface_init(struct input *i);
 static int input_pcap_interface_open(struct input *i);
 
+#ifdef INPUT_PCAP_HAVE_RING
+static int input_pcap_ring_open(struct input *i);
+static int input_pcap_ring_read(struct input *i);
+static void input_pcap_ring_unref(struct input_pcap_ring *r);
+#endif
+
 static int input_pcap_file_init(struct input *i);
 static int input_pcap_file_open(struct input *i);
+static int input_pcap_mmap_open(struct input *i);
+static int input_pcap_mmap_next(struct input_pcap_mmap *m, struct pcap_pkthdr **phdr, const u_char **data);
+static int input_pcap_mmap_dispatch(struct input_pcap_mmap *m, int cnt, pcap_handler callback, u_char *user);
+static void input_pcap_mmap_close(struct input_pcap_mmap *m);
+static int input_pcap_mmap_set_filter(pcap_t *p, struct input_pcap_mmap *m, char *filter);
 
 static int input_pcap_dir_init(struct input *i);
 static int input_pcap_dir_open(struct input *i);
 static int input_pcap_dir_browse(struct input_pcap_priv *priv);
-static int input_pcap_dir_open_next(struct input_pcap_priv *p);
-
+static int input_pcap_dir_open_next(struct input_pcap_priv *p, pcap_t **pcap);
+static int input_pcap_dir_readers_start(struct input *i);
+static int input_pcap_dir_readers_read(struct input *i);
+static void input_pcap_dir_readers_wakeup(struct input_pcap_dir_priv *dp);
+static void input_pcap_dir_readers_stop(struct input_pcap_priv *p);
+
+static struct packet *input_pcap_packet_alloc(struct input *i, const struct pcap_pkthdr *phdr, const u_char *data);
+static void input_pcap_burst_add(u_char *user, const struct pcap_pkthdr *phdr, const u_char *data);
+static int input_pcap_burst_queue(struct input_pcap_priv *p, struct packet **pkts, unsigned int count);
 static int input_pcap_read(struct input *i);
 static int input_pcap_close(struct input *i);
 static int input_pcap_cleanup(struct input *i);
@@ -0,0 +1,593 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+
+#include "output_datastore.h"
+
+#include <pom-ng/ptype_bool.h>
+#include <pom-ng/ptype_string.h>
+#include <pom-ng/ptype_uint32.h>
+#include <pom-ng/ptype_timestamp.h>
+
+#include <sys/time.h>
+
+
+struct mod_reg_info* output_datastore_reg_info() {
+
+	static struct mod_reg_info reg_info;
+	memset(&reg_info, 0, sizeof(struct mod_reg_info));
+	reg_info.api_ver = MOD_API_VER;
+	reg_info.register_func = output_datastore_mod_register;
+	reg_info.unregister_func = output_datastore_mod_unregister;
+	reg_info.dependencies = "ptype_bool, ptype_string, ptype_uint32, ptype_timestamp";
+
+	return &reg_info;
+
+}
+
+int output_datastore_mod_register(struct mod_reg *mod) {
+
+	static struct output_reg_info output_datastore = { 0 };
+	output_datastore.name = "datastore";
+	output_datastore.description = "Save events in a datastore";
+	output_datastore.mod = mod;
+
+	output_datastore.init = output_datastore_init;
+	output_datastore.open = output_datastore_open;
+	output_datastore.close = output_datastore_close;
+	output_datastore.cleanup = output_datastore_cleanup;
+
+	return output_register(&output_datastore);
+}
+
+int output_datastore_mod_unregister() {
+
+	return output_unregister("datastore");
+}
+
+int output_datastore_init(struct output *o) {
+
+	struct output_datastore_priv *priv = malloc(sizeof(struct output_datastore_priv));
+	if (!priv) {
+		pom_oom(sizeof(struct output_datastore_priv));
+		return POM_ERR;
+	}
+	memset(priv, 0, sizeof(struct output_datastore_priv));
+
+	output_set_priv(o, priv);
+
+	priv->p_datastore = ptype_alloc("string");
+	priv->p_source = ptype_alloc("string");
+	priv->p_batch_size = ptype_alloc_unit("uint32", "rows");
+	priv->p_batch_timeout = ptype_alloc_unit("uint32", "milliseconds");
+	priv->p_queue_size = ptype_alloc_unit("uint32", "rows");
+	priv->p_drop = ptype_alloc("bool");
+
+	if (!priv->p_datastore || !priv->p_source || !priv->p_batch_size || !priv->p_batch_timeout || !priv->p_queue_size || !priv->p_drop)
+		goto err;
+
+	struct registry_instance *inst = output_get_reg_instance(o);
+	priv->perf_rows_queued = registry_instance_add_perf(inst, "rows_queued", registry_perf_type_gauge, "Number of rows waiting to be written", "rows");
+	priv->perf_rows_written = registry_instance_add_perf(inst, "rows_written", registry_perf_type_counter, "Number of rows written", "rows");
+	priv->perf_rows_dropped = registry_instance_add_perf(inst, "rows_dropped", registry_perf_type_counter, "Number of rows dropped because the queue was full", "rows");
+	priv->perf_transactions = registry_instance_add_perf(inst, "transactions", registry_perf_type_counter, "Number of transactions committed", "transactions");
+	priv->perf_write_errors = registry_instance_add_perf(inst, "write_errors", registry_perf_type_counter, "Number of rows lost because of a datastore error", "rows");
+
+	if (!priv->perf_rows_queued || !priv->perf_rows_written || !priv->perf_rows_dropped || !priv->perf_transactions || !priv->perf_write_errors)
+		goto err;
+
+	struct registry_param *p = registry_new_param("datastore", "", priv->p_datastore, "Datastore where to save the events", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("source", "", priv->p_source, "Events to save, each in its own dataset", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("batch_size", "1000", priv->p_batch_size, "Maximum number of rows written in a single transaction", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("batch_timeout", "1000", priv->p_batch_timeout, "Maximum time rows are queued before being written", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("queue_size", "65536", priv->p_queue_size, "Maximum number of rows waiting to be written", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("drop", "yes", priv->p_drop, "Drop the events when the queue is full instead of waiting", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	return POM_OK;
+
+err:
+	output_datastore_cleanup(priv);
+	return POM_ERR;
+}
+
+int output_datastore_cleanup(void *output_priv) {
+
+	struct output_datastore_priv *priv = output_priv;
+	if (!priv)
+		return POM_OK;
+
+	if (priv->p_datastore)
+		ptype_cleanup(priv->p_datastore);
+	if (priv->p_source)
+		ptype_cleanup(priv->p_source);
+	if (priv->p_batch_size)
+		ptype_cleanup(priv->p_batch_size);
+	if (priv->p_batch_timeout)
+		ptype_cleanup(priv->p_batch_timeout);
+	if (priv->p_queue_size)
+		ptype_cleanup(priv->p_queue_size);
+	if (priv->p_drop)
+		ptype_cleanup(priv->p_drop);
+
+	free(priv);
+
+	return POM_OK;
+}
+
+static struct output_datastore_evt *output_datastore_evt_open(struct output_datastore_priv *priv, struct datastore *d, struct event_reg *evt) {
+
+	struct event_reg_info *info = event_reg_get_info(evt);
+	struct data_reg *dreg = info->data_reg;
+
+	struct output_datastore_evt *dse = malloc(sizeof(struct output_datastore_evt));
+	if (!dse) {
+		pom_oom(sizeof(struct output_datastore_evt));
+		return NULL;
+	}
+	memset(dse, 0, sizeof(struct output_datastore_evt));
+	dse->evt = evt;
+	dse->priv = priv;
+
+	size_t size = sizeof(struct datavalue_template) * (dreg->data_count + 2);
+	struct datavalue_template *dt = malloc(size);
+	if (!dt) {
+		pom_oom(size);
+		goto err;
+	}
+	memset(dt, 0, size);
+
+	if (dreg->data_count) {
+		dse->fields = malloc(sizeof(int) * dreg->data_count);
+		if (!dse->fields) {
+			pom_oom(sizeof(int) * dreg->data_count);
+			goto err;
+		}
+	}
+
+	dt[0].name = OUTPUT_DATASTORE_TIMESTAMP_FIELD;
+	dt[0].type = "timestamp";
+
+	// Lists don't map to a single column, only plain values are saved
+	int i;
+	for (i = 0; i < dreg->data_count; i++) {
+		struct data_item_reg *item = &dreg->items[i];
+		if (item->flags & DATA_REG_FLAG_LIST || !item->value_type)
+			continue;
+
+		struct ptype *tmp = ptype_alloc_from_type(item->value_type);
+		if (!tmp)
+			goto err;
+
+		dt[dse->field_count + 1].name = item->name;
+		dt[dse->field_count + 1].type = ptype_get_name(tmp);
+		ptype_cleanup(tmp);
+
+		dse->fields[dse->field_count] = i;
+		dse->field_count++;
+	}
+
+	dse->dsq = datastore_dataset_query_open(d, info->name, dt, priv->dc);
+	if (!dse->dsq) {
+		pomlog(POMLOG_ERR "Unable to open the dataset for event %s", info->name);
+		goto err;
+	}
+
+	free(dt);
+
+	return dse;
+
+err:
+	if (dt)
+		free(dt);
+	if (dse->fields)
+		free(dse->fields);
+	free(dse);
+
+	return NULL;
+}
+
+static void output_datastore_evt_close(struct output_datastore_evt *dse) {
+
+	if (dse->dsq)
+		datastore_dataset_query_cleanup(dse->dsq);
+	if (dse->fields)
+		free(dse->fields);
+	free(dse);
+}
+
+static int output_datastore_write_row(struct output_datastore_evt *dse, struct event *evt) {
+
+	struct dataset_query *dsq = dse->dsq;
+	struct data *evt_data = event_get_data(evt);
+
+	PTYPE_TIMESTAMP_SETVAL(dsq->values[0].value, event_get_timestamp(evt));
+	dsq->values[0].is_null = 0;
+
+	unsigned int i;
+	for (i = 0; i < dse->field_count; i++) {
+		struct data *data = &evt_data[dse->fields[i]];
+		struct datavalue *dv = &dsq->values[i + 1];
+
+		if (!data_is_set(*data) || !data->value) {
+			dv->is_null = 1;
+			continue;
+		}
+
+		if (ptype_copy(dv->value, data->value) != POM_OK)
+			return DATASET_QUERY_ERR;
+		dv->is_null = 0;
+	}
+
+	return datastore_dataset_write_bulk(dsq);
+}
+
+static int output_datastore_write_batch(struct output_datastore_priv *priv, unsigned int count) {
+
+	unsigned int i, written = 0;
+
+	int res = datastore_transaction_begin(priv->dc);
+
+	// Rows are grouped per dataset so that each one is sent with a single bulk query
+	struct output_datastore_evt *dse;
+	for (dse = priv->evt_lst; dse && res == POM_OK; dse = dse->next) {
+
+		unsigned int rows = 0;
+		for (i = 0; i < count; i++) {
+			if (priv->batch[i].dse == dse)
+				rows++;
+		}
+
+		if (!rows)
+			continue;
+
+		res = datastore_dataset_write_bulk_begin(dse->dsq, rows);
+		if (res != DATASET_QUERY_OK)
+			break;
+
+		for (i = 0; i < count && res == DATASET_QUERY_OK; i++) {
+			if (priv->batch[i].dse != dse)
+				continue;
+			res = output_datastore_write_row(dse, priv->batch[i].evt);
+		}
+
+		int end_res = datastore_dataset_write_bulk_end(dse->dsq, res != DATASET_QUERY_OK);
+		if (res == DATASET_QUERY_OK)
+			res = end_res;
+
+		if (res == DATASET_QUERY_OK)
+			written += rows;
+	}
+
+	if (res == POM_OK) {
+		res = datastore_transaction_commit(priv->dc);
+	} else {
+		pomlog(POMLOG_ERR "Error while writing events to the datastore, %u rows lost", count);
+		datastore_transaction_rollback(priv->dc);
+	}
+
+	if (res == POM_OK) {
+		registry_perf_inc(priv->perf_rows_written, written);
+		registry_perf_inc(priv->perf_transactions, 1);
+	} else {
+		registry_perf_inc(priv->perf_write_errors, count);
+	}
+
+	for (i = 0; i < count; i++)
+		event_refcount_dec(priv->batch[i].evt);
+
+	registry_perf_dec(priv->perf_rows_queued, count);
+
+	return res;
+}
+
+static void *output_datastore_writer_thread(void *arg) {
+
+	struct output_datastore_priv *priv = arg;
+
+	pom_mutex_lock(&priv->lock);
+
+	while (1) {
+
+		// Wait for a full batch or for the oldest row to be there long enough
+		while (priv->count < priv->batch_size && priv->run) {
+
+			int res = 0;
+			if (!priv->count) {
+				res = pthread_cond_wait(&priv->cond, &priv->lock);
+			} else {
+				ptime deadline = priv->first_queued + priv->batch_timeout;
+				if (pom_gettimeofday() >= deadline)
+					break;
+
+				struct timespec then = { 0 };
+				then.tv_sec = pom_ptime_sec(deadline);
+				then.tv_nsec = pom_ptime_usec(deadline) * 1000;
+				res = pthread_cond_timedwait(&priv->cond, &priv->lock, &then);
+			}
+
+			if (res && res != ETIMEDOUT) {
+				pomlog(POMLOG_ERR "Error while waiting for the writer condition : %s", pom_strerror(res));
+				abort();
+			}
+		}
+
+		// Stop only once the queue is empty
+		if (!priv->count)
+			break;
+
+		unsigned int i, count = priv->count;
+		if (count > priv->batch_size)
+			count = priv->batch_size;
+
+		for (i = 0; i < count; i++)
+			priv->batch[i] = priv->queue[(priv->head + i) % priv->queue_size];
+
+		priv->head = (priv->head + count) % priv->queue_size;
+		priv->count -= count;
+		priv->first_queued = pom_gettimeofday();
+		pthread_cond_broadcast(&priv->full_cond);
+
+		pom_mutex_unlock(&priv->lock);
+
+		output_datastore_write_batch(priv, count);
+
+		pom_mutex_lock(&priv->lock);
+	}
+
+	pom_mutex_unlock(&priv->lock);
+
+	registry_perf_thread_cleanup();
+
+	return NULL;
+}
+
+int output_datastore_open(void *output_priv) {
+
+	struct output_datastore_priv *priv = output_priv;
+
+	char *dstore_name = PTYPE_STRING_GETVAL(priv->p_datastore);
+	struct datastore *d = datastore_instance_get(dstore_name);
+	if (!d) {
+		pomlog(POMLOG_ERR "Datastore \"%s\" does not exists", dstore_name);
+		return POM_ERR;
+	}
+
+	if (!strlen(PTYPE_STRING_GETVAL(priv->p_source))) {
+		pomlog(POMLOG_ERR "You need to specify a source for this output");
+		return POM_ERR;
+	}
+
+	priv->batch_size = *PTYPE_UINT32_GETVAL(priv->p_batch_size);
+	priv->queue_size = *PTYPE_UINT32_GETVAL(priv->p_queue_size);
+	priv->batch_timeout = (ptime) *PTYPE_UINT32_GETVAL(priv->p_batch_timeout) * 1000;
+	priv->drop = *PTYPE_BOOL_GETVAL(priv->p_drop);
+
+	if (!priv->batch_size || !priv->queue_size) {
+		pomlog(POMLOG_ERR "The batch size and the queue size cannot be 0");
+		return POM_ERR;
+	}
+
+	if (priv->batch_size > priv->queue_size)
+		priv->batch_size = priv->queue_size;
+
+	priv->queue = malloc(sizeof(struct output_datastore_row) * priv->queue_size);
+	priv->batch = malloc(sizeof(struct output_datastore_row) * priv->batch_size);
+	if (!priv->queue || !priv->batch) {
+		pom_oom(sizeof(struct output_datastore_row) * priv->queue_size);
+		goto err;
+	}
+	priv->head = 0;
+	priv->count = 0;
+
+	// The writer thread uses its own connection
+	priv->dc = datastore_connection_new(d);
+	if (!priv->dc)
+		goto err;
+
+	char *src = strdup(PTYPE_STRING_GETVAL(priv->p_source));
+	if (!src) {
+		pom_oom(strlen(PTYPE_STRING_GETVAL(priv->p_source)) + 1);
+		goto err;
+	}
+
+	char *token, *saveptr, *str = src;
+	for (; ; str = NULL) {
+		token = strtok_r(str, ", ", &saveptr);
+
+		if (!token)
+			break;
+
+		struct event_reg *evt = event_find(token);
+		if (!evt) {
+			pomlog(POMLOG_WARN "Event \"%s\" does not exists", token);
+			continue;
+		}
+
+		struct output_datastore_evt *dse = output_datastore_evt_open(priv, d, evt);
+		if (!dse) {
+			free(src);
+			goto err;
+		}
+
+		dse->next = priv->evt_lst;
+		priv->evt_lst = dse;
+	}
+
+	free(src);
+
+	if (!priv->evt_lst)
+		goto err;
+
+	if (pom_mutex_init_type(&priv->lock, PTHREAD_MUTEX_ERRORCHECK) != POM_OK)
+		goto err;
+
+	if (pthread_cond_init(&priv->cond, NULL) || pthread_cond_init(&priv->full_cond, NULL)) {
+		pomlog(POMLOG_ERR "Error while initializing the writer conditions : %s", pom_strerror(errno));
+		pthread_mutex_destroy(&priv->lock);
+		goto err;
+	}
+
+	priv->run = 1;
+
+	if (pthread_create(&priv->writer, NULL, output_datastore_writer_thread, priv)) {
+		pomlog(POMLOG_ERR "Error while creating the datastore writer thread : %s", pom_strerror(errno));
+		priv->run = 0;
+		pthread_cond_destroy(&priv->full_cond);
+		pthread_cond_destroy(&priv->cond);
+		pthread_mutex_destroy(&priv->lock);
+		goto err;
+	}
+
+	// Start listening to the events once everything is ready
+	struct output_datastore_evt *dse;
+	for (dse = priv->evt_lst; dse; dse = dse->next) {
+		if (event_listener_register(dse->evt, dse, NULL, output_datastore_process, NULL) != POM_OK) {
+			output_datastore_close(priv);
+			return POM_ERR;
+		}
+	}
+
+	return POM_OK;
+
+err:
+
+	while (priv->evt_lst) {
+		struct output_datastore_evt *dse = priv->evt_lst;
+		priv->evt_lst = dse->next;
+		output_datastore_evt_close(dse);
+	}
+
+	if (priv->dc) {
+		datastore_connection_release(priv->dc);
+		priv->dc = NULL;
+	}
+
+	if (priv->queue) {
+		free(priv->queue);
+		priv->queue = NULL;
+	}
+
+	if (priv->batch) {
+		free(priv->batch);
+		priv->batch = NULL;
+	}
+
+	return POM_ERR;
+}
+
+int output_datastore_close(void *output_priv) {
+
+	struct output_datastore_priv *priv = output_priv;
+
+	struct output_datastore_evt *dse;
+	for (dse = priv->evt_lst; dse; dse = dse->next)
+		event_listener_unregister(dse->evt, dse);
+
+	// Let the writer flush what's left in the queue
+	pom_mutex_lock(&priv->lock);
+	priv->run = 0;
+	pthread_cond_signal(&priv->cond);
+	pom_mutex_unlock(&priv->lock);
+
+	pthread_join(priv->writer, NULL);
+
+	pthread_cond_destroy(&priv->full_cond);
+	pthread_cond_destroy(&priv->cond);
+	pthread_mutex_destroy(&priv->lock);
+
+	while (priv->evt_lst) {
+		dse = priv->evt_lst;
+		priv->evt_lst = dse->next;
+		output_datastore_evt_close(dse);
+	}
+
+	datastore_connection_release(priv->dc);
+	priv->dc = NULL;
+
+	free(priv->queue);
+	priv->queue = NULL;
+	free(priv->batch);
+	priv->batch = NULL;
+
+	return POM_OK;
+}
+
+int output_datastore_process(struct event *evt, void *obj) {
+
+	struct output_datastore_evt *dse = obj;
+	struct output_datastore_priv *priv = dse->priv;
+
+	pom_mutex_lock(&priv->lock);
+
+	while (priv->count >= priv->queue_size) {
+		if (priv->drop) {
+			pom_mutex_unlock(&priv->lock);
+			registry_perf_inc(priv->perf_rows_dropped, 1);
+			return POM_OK;
+		}
+
+		// Wait for the writer to catch up
+		int res = pthread_cond_wait(&priv->full_cond, &priv->lock);
+		if (res) {
+			pomlog(POMLOG_ERR "Error while waiting for the datastore queue : %s", pom_strerror(res));
+			abort();
+		}
+	}
+
+	// The row holds a reference on the event until it's written
+	event_refcount_inc(evt);
+
+	struct output_datastore_row *row = &priv->queue[(priv->head + priv->count) % priv->queue_size];
+	row->evt = evt;
+	row->dse = dse;
+
+	priv->count++;
+
+	// Wake up the writer on the first row so it can track the timeout and when a batch is complete
+	if (priv->count == 1) {
+		priv->first_queued = pom_gettimeofday();
+		pthread_cond_signal(&priv->cond);
+	} else if (priv->count == priv->batch_size) {
+		pthread_cond_signal(&priv->cond);
+	}
+
+	pom_mutex_unlock(&priv->lock);
+
+	registry_perf_inc(priv->perf_rows_queued, 1);
+
+	return POM_OK;
+}
@@ -0,0 +1,93 @@
+/*
+ *  This file is part of pom-ng.
+ *  Copyright (C) 2015 Guy Martin <gmsoft@tuxicoman.be>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#ifndef __OUTPUT_DATASTORE_H__
+#define __OUTPUT_DATASTORE_H__
+
+#include <pom-ng/output.h>
+#include <pom-ng/event.h>
+#include <pom-ng/datastore.h>
+
+// Name of the field holding the timestamp of the event
+#define OUTPUT_DATASTORE_TIMESTAMP_FIELD "event_timestamp"
+
+struct output_datastore_evt {
+
+	struct event_reg *evt;
+	struct output_datastore_priv *priv;
+
+	struct dataset_query *dsq;
+	int *fields; // Id of the event data for each field of the dataset
+	unsigned int field_count;
+
+	struct output_datastore_evt *next;
+};
+
+struct output_datastore_row {
+	struct event *evt;
+	struct output_datastore_evt *dse;
+};
+
+struct output_datastore_priv {
+
+	struct ptype *p_datastore;
+	struct ptype *p_source;
+	struct ptype *p_batch_size;
+	struct ptype *p_batch_timeout;
+	struct ptype *p_queue_size;
+	struct ptype *p_drop;
+
+	struct datastore_connection *dc;
+	struct output_datastore_evt *evt_lst;
+
+	// Rows waiting to be written
+	struct output_datastore_row *queue;
+	unsigned int queue_size, head, count;
+	ptime first_queued;
+
+	struct output_datastore_row *batch;
+	unsigned int batch_size;
+	ptime batch_timeout;
+	int drop;
+
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond, full_cond;
+	int run;
+
+	struct registry_perf *perf_rows_queued;
+	struct registry_perf *perf_rows_written;
+	struct registry_perf *perf_rows_dropped;
+	struct registry_perf *perf_transactions;
+	struct registry_perf *perf_write_errors;
+};
+
+struct mod_reg_info* output_datastore_reg_info();
+int output_datastore_mod_register(struct mod_reg *mod);
+int output_datastore_mod_unregister();
+
+int output_datastore_init(struct output *o);
+int output_datastore_cleanup(void *output_priv);
+int output_datastore_open(void *output_priv);
+int output_datastore_close(void *output_priv);
+
+int output_datastore_process(struct event *evt, void *obj);
+
+#endif
@@ -22,14 +22,18 @@
 #include "output_log_txt.h"
 
 #include <pom-ng/ptype_string.h>
+#include <pom-ng/ptype_uint32.h>
+#include <pom-ng/ptype_bool.h>
 #include <pom-ng/resource.h>
 #include <pom-ng/filter.h>
+#include <pom-ng/timer.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdio.h>
 
+static int output_log_txt_flush_timer(void *priv);
 
 static struct datavalue_template output_log_txt_templates_name[] = {
 	{ .name = "name", .type = "string" },
@@ -76,7 +80,12 @@ int output_log_txt_init(struct output *o) {
 
 	priv->p_prefix = ptype_alloc("string");
 	priv->p_template = ptype_alloc("string");
-	if (!priv->p_prefix || !priv->p_template)
+	priv->p_async_queue = ptype_alloc("uint32");
+	priv->p_async_drop = ptype_alloc("bool");
+	priv->p_flush_size = ptype_alloc("uint32");
+	priv->p_flush_interval = ptype_alloc_unit("uint32", "seconds");
+	priv->p_sync = ptype_alloc("bool");
+	if (!priv->p_prefix || !priv->p_template || !priv->p_async_queue || !priv->p_async_drop || !priv->p_flush_size || !priv->p_flush_interval || !priv->p_sync)
 		goto err;
 
 	struct registry_instance *inst = output_get_reg_instance(o);
@@ -87,6 +96,26 @@ int output_log_txt_init(struct output *o) {
 	p = registry_new_param("prefix", "/tmp/", priv->p_prefix, "Log files prefix", 0);
 	if (output_add_param(o, p) != POM_OK)
 		goto err;
+
+	p = registry_new_param("async_queue", "0", priv->p_async_queue, "Number of events queued to be written by a separate thread (0 to write them directly)", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("async_drop", "no", priv->p_async_drop, "Drop the events when the queue is full instead of waiting", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("flush_size", "0", priv->p_flush_size, "Number of bytes buffered before writing them to the files (0 to write each line directly)", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("flush_interval", "1", priv->p_flush_interval, "Maximum time lines stay buffered", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("sync", "no", priv->p_sync, "Sync the data to the disk after each write", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
 	
 	p = registry_new_param("template", "", priv->p_template, "Log template to use", 0);
 
@@ -141,6 +170,16 @@ int output_log_txt_cleanup(void *output_priv) {
 			ptype_cleanup(priv->p_prefix);
 		if (priv->p_template)
 			ptype_cleanup(priv->p_template);
+		if (priv->p_async_queue)
+			ptype_cleanup(priv->p_async_queue);
+		if (priv->p_async_drop)
+			ptype_cleanup(priv->p_async_drop);
+		if (priv->p_flush_size)
+			ptype_cleanup(priv->p_flush_size);
+		if (priv->p_flush_interval)
+			ptype_cleanup(priv->p_flush_interval);
+		if (priv->p_sync)
+			ptype_cleanup(priv->p_sync);
 		free(priv);
 	}
 
@@ -395,6 +434,9 @@ int output_log_txt_open(void *output_priv) {
 		}
 		memset(file, 0, sizeof(struct output_log_txt_file));
 		file->fd = -1;
+		file->flush_size = *PTYPE_UINT32_GETVAL(priv->p_flush_size);
+		file->flush_interval = pom_sec_ptime(*PTYPE_UINT32_GETVAL(priv->p_flush_interval));
+		file->sync = *PTYPE_BOOL_GETVAL(priv->p_sync);
 
 		char *name = PTYPE_STRING_GETVAL(v[1].value);
 		file->name = strdup(name);
@@ -431,6 +473,14 @@ int output_log_txt_open(void *output_priv) {
 
 	resource_dataset_close(r_files);
 	r_files = NULL;
+
+	// Buffered lines must be written even if no more events come in
+	if (*PTYPE_UINT32_GETVAL(priv->p_flush_size) && *PTYPE_UINT32_GETVAL(priv->p_flush_interval)) {
+		priv->flush_timer = timer_sys_alloc(priv, output_log_txt_flush_timer);
+		if (!priv->flush_timer)
+			goto err;
+		timer_sys_queue(priv->flush_timer, OUTPUT_LOG_TXT_FLUSH_TIMER);
+	}
 		
 
 
@@ -494,6 +544,10 @@ int output_log_txt_open(void *output_priv) {
 		if (event_listener_register(evt, log_evt, NULL, output_log_txt_process, filter) != POM_OK)
 			goto err;
 
+		uint32_t async_queue = *PTYPE_UINT32_GETVAL(priv->p_async_queue);
+		if (async_queue && event_listener_set_async(evt, log_evt, async_queue, (*PTYPE_BOOL_GETVAL(priv->p_async_drop) ? EVENT_LISTENER_ASYNC_FLAG_DROP : 0)) != POM_OK)
+			goto err;
+
 		// Find in which file this event will be saved
 		char *file = PTYPE_STRING_GETVAL(v[4].value);
 		for (log_evt->file = priv->files; log_evt->file && strcmp(log_evt->file->name, file); log_evt->file = log_evt->file->next);
@@ -547,10 +601,73 @@ err:
 	return POM_ERR;
 }
 
+static int output_log_txt_buff_append(struct output_log_txt_file *file, const char *data, size_t len) {
+
+	if (file->buff_len + len > file->buff_size) {
+		size_t size = (file->buff_size ? file->buff_size : OUTPUT_LOG_TXT_BUFF_SIZE);
+		while (size < file->buff_len + len)
+			size *= 2;
+
+		char *buff = realloc(file->buff, size);
+		if (!buff) {
+			pom_oom(size);
+			return POM_ERR;
+		}
+		file->buff = buff;
+		file->buff_size = size;
+	}
+
+	memcpy(file->buff + file->buff_len, data, len);
+	file->buff_len += len;
+
+	return POM_OK;
+}
+
+// Must be called with the file locked
+static int output_log_txt_file_flush(struct output_log_txt_file *file) {
+
+	if (!file->buff_len || file->fd == -1)
+		return POM_OK;
+
+	// Buffered lines are dropped if they can't be written
+	int res = pom_write(file->fd, file->buff, file->buff_len);
+	file->buff_len = 0;
+	file->last_flush = pom_gettimeofday();
+
+	if (res == POM_OK && file->sync && fdatasync(file->fd)) {
+		pomlog(POMLOG_ERR "Error while syncing file \"%s\" : %s", file->path, pom_strerror(errno));
+		res = POM_ERR;
+	}
+
+	return res;
+}
+
+static int output_log_txt_flush_timer(void *priv) {
+
+	struct output_log_txt_priv *p = priv;
+
+	ptime now = pom_gettimeofday();
+
+	struct output_log_txt_file *file;
+	for (file = p->files; file; file = file->next) {
+		pom_mutex_lock(&file->lock);
+		if (file->buff_len && now - file->last_flush >= file->flush_interval && output_log_txt_file_flush(file) != POM_OK)
+			pomlog(POMLOG_ERR "Error while writing to log file : %s", file->path);
+		pom_mutex_unlock(&file->lock);
+	}
+
+	return timer_sys_queue(p->flush_timer, OUTPUT_LOG_TXT_FLUSH_TIMER);
+}
+
 int output_log_txt_close(void *output_priv) {
 	
 	struct output_log_txt_priv *priv = output_priv;
 
+	if (priv->flush_timer) {
+		timer_sys_cleanup(priv->flush_timer);
+		priv->flush_timer = NULL;
+	}
+
 
 	while (priv->events) {
 		struct output_log_txt_event *evt = priv->events;
@@ -582,10 +699,14 @@ int output_log_txt_close(void *output_priv) {
 		priv->files = file->next;
 
 		if (file->fd != -1) {
+			if (output_log_txt_file_flush(file) != POM_OK)
+				pomlog(POMLOG_WARN "Error while writing the buffered lines to log file : %s", file->path);
 			if (close(file->fd) < 0) 
 				pomlog(POMLOG_WARN "Error while closing file : %s", pom_strerror(errno));
 		}
 		
+		if (file->buff)
+			free(file->buff);
 		if (file->name)
 			free(file->name);
 		if (file->path)
@@ -624,10 +745,11 @@ int output_log_txt_process(struct event *evt, void *obj) {
 		file->fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0666);
 
 		if (file->fd == -1) {
-			pomlog(POMLOG_ERR "Error while opening file \"%s\" : %s", pom_strerror(errno));
+			pomlog(POMLOG_ERR "Error while opening file \"%s\" : %s", filename, pom_strerror(errno));
 			pom_mutex_unlock(&file->lock);
 			return POM_ERR;
 		}
+		file->last_flush = pom_gettimeofday();
 	}
 
 	char *format = log_evt->format;
@@ -635,38 +757,37 @@ int output_log_txt_process(struct event *evt, void *obj) {
 	int i;
 	unsigned int format_pos = 0;
 
-	// Write to the log file
+	// Remove what was added for this event in case of error
+	size_t evt_start = file->buff_len;
+
+	// Format the line in the file buffer
 	for (i = 0; log_evt->fields[i].id != -1; i++) {
 	
 		struct output_log_txt_field *field = &log_evt->fields[i];
 		if (format_pos < field->start_off) {
 			unsigned int len = field->start_off - format_pos;
-			if (pom_write(file->fd, format + format_pos, len) != POM_OK)
-				goto write_err;
+			if (output_log_txt_buff_append(file, format + format_pos, len) != POM_OK)
+				goto err;
 		}
 
 		format_pos = field->end_off;
 	
 		char *value = NULL;
 		int allocated = 1;
+		char ts[20] = { 0 };
 
 		if (field->type == output_log_txt_event_property) {
 			// Fetch the property value
 			struct event_reg_info *evt_reg = event_reg_get_info(event_get_reg(evt));
 			switch (field->id) {
 				case output_log_txt_event_property_ts: {
-					value = malloc(20);
-					if (!value) {
-						pom_mutex_unlock(&file->lock);
-						pom_oom(20);
-						return POM_ERR;
-					}
-					memset(value, 0, 20);
 					char *format = "%Y-%m-%d %H:%M:%S";
 					struct tm tmp;
 					time_t sec = pom_ptime_sec(event_get_timestamp(evt));
 					localtime_r(&sec, &tmp);
-					strftime(value, 20, format, &tmp);
+					strftime(ts, sizeof(ts), format, &tmp);
+					value = ts;
+					allocated = 0;
 					break;
 				}
 				case output_log_txt_event_property_name:
@@ -682,8 +803,7 @@ int output_log_txt_process(struct event *evt, void *obj) {
 					allocated = 0;
 					break;
 				default:
-					pom_mutex_unlock(&file->lock);
-					return POM_ERR;
+					goto err;
 			}
 		} else if (field->type == output_log_txt_event_field) {
 
@@ -695,27 +815,25 @@ int output_log_txt_process(struct event *evt, void *obj) {
 					struct data_item *item;
 					for (item = evt_data[field->id].items; item; item = item->next) {
 						value = ptype_print_val_alloc(item->value, field->ptype_format);
-						if (!value) {
-							pom_mutex_unlock(&file->lock);
-							return POM_ERR;
-						}
+						if (!value)
+							goto err;
 
-						if ((pom_write(file->fd, item->key, strlen(item->key)) != POM_OK) || (pom_write(file->fd, ": \"", strlen(": \"")) != POM_OK)) {
+						if ((output_log_txt_buff_append(file, item->key, strlen(item->key)) != POM_OK) || (output_log_txt_buff_append(file, ": \"", strlen(": \"")) != POM_OK)) {
 							free(value);
-							goto write_err;
+							goto err;
 						}
 						char *quote = NULL;
 						char *tmp = value;
 						while ((quote = strchr(tmp, '"'))) {
-							if ((pom_write(file->fd, tmp, quote - tmp) != POM_OK) || (pom_write(file->fd, "\\\"", strlen("\\\"")) != POM_OK)) {
+							if ((output_log_txt_buff_append(file, tmp, quote - tmp) != POM_OK) || (output_log_txt_buff_append(file, "\\\"", strlen("\\\"")) != POM_OK)) {
 								free(value);
-								goto write_err;
+								goto err;
 							}
 							tmp = quote + 1;
 						}
-						if (pom_write(file->fd, tmp, strlen(tmp)) != POM_OK || (pom_write(file->fd, "\"", 1) != POM_OK)) {
+						if (output_log_txt_buff_append(file, tmp, strlen(tmp)) != POM_OK || (output_log_txt_buff_append(file, "\"", 1) != POM_OK)) {
 							free(value);
-							goto write_err;
+							goto err;
 						}
 
 						free(value);
@@ -729,46 +847,51 @@ int output_log_txt_process(struct event *evt, void *obj) {
 				for (item = evt_data[field->id].items; item; item = item->next) {
 					if (!strcasecmp(item->key, field->key)) {
 						value = ptype_print_val_alloc(item->value, field->ptype_format);
-						if (!value) {
-							pom_mutex_unlock(&file->lock);
-							return POM_ERR;
-						}
+						if (!value)
+							goto err;
 						break;
 					}
 				}
 			} else if (data_is_set(evt_data[field->id]) && evt_data[field->id].value) {
 				// Find the value of the field
 				value = ptype_print_val_alloc(evt_data[field->id].value, field->ptype_format);
-				if (!value) {
-					pom_mutex_unlock(&file->lock);
-					return POM_ERR;
-				}
+				if (!value)
+					goto err;
 			}
 		}
 
 		if (value) {
-			if (pom_write(file->fd, value, strlen(value)) != POM_OK) {
+			if (output_log_txt_buff_append(file, value, strlen(value)) != POM_OK) {
 				if (allocated)
 					free(value);
-				goto write_err;
+				goto err;
 			}
 			if (allocated)
 				free(value);
 		} else if (field->type != output_log_txt_dollar) {
-			if (pom_write(file->fd, "-", 1) != POM_OK)
-				goto write_err;
+			if (output_log_txt_buff_append(file, "-", 1) != POM_OK)
+				goto err;
 		}
 	}
 
 	// Write the last part after the last field
 	if (format_pos < strlen(format)) {
 		unsigned int len = strlen(format) - format_pos;
-		if (pom_write(file->fd, format + format_pos, len) != POM_OK)
-			goto write_err;
+		if (output_log_txt_buff_append(file, format + format_pos, len) != POM_OK)
+			goto err;
 	}
 
-	if (pom_write(file->fd, "\n", 1) != POM_OK)
-		goto write_err;
+	if (output_log_txt_buff_append(file, "\n", 1) != POM_OK)
+		goto err;
+
+	// Flush once enough data is buffered or when it's been buffered for too long
+	if (file->buff_len >= file->flush_size || pom_gettimeofday() - file->last_flush >= file->flush_interval) {
+		if (output_log_txt_file_flush(file) != POM_OK) {
+			pom_mutex_unlock(&file->lock);
+			pomlog(POMLOG_ERR "Error while writing to log file : %s", file->path);
+			return POM_ERR;
+		}
+	}
 
 	pom_mutex_unlock(&file->lock);
 
@@ -777,9 +900,9 @@ int output_log_txt_process(struct event *evt, void *obj) {
 
 	return POM_OK;
 
-write_err:
+err:
+	file->buff_len = evt_start;
 	pom_mutex_unlock(&file->lock);
-	pomlog(POMLOG_ERR "Error while writing to log file : %s", file->path);
 	return POM_ERR;
 
 }
@@ -899,10 +1022,18 @@ int addon_log_txt_close(void *addon_priv) {
 
 	struct output_log_txt_file *txt_file = &priv->txt_file;
 	if (txt_file->fd != -1) {
+		output_log_txt_file_flush(txt_file);
 		close(txt_file->fd);
 		txt_file->fd = -1;
 	}
 
+	if (txt_file->buff) {
+		free(txt_file->buff);
+		txt_file->buff = NULL;
+		txt_file->buff_len = 0;
+		txt_file->buff_size = 0;
+	}
+
 	return POM_OK;
 }
 
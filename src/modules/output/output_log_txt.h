@@ -26,6 +26,12 @@
 #define OUTPUT_LOG_TXT_RESOURCE "output_log_txt"
 #define OUTPUT_LOG_TXT_FIELD_KEY_WILDCARD	(void*)-1
 
+// Initial size of the file buffers
+#define OUTPUT_LOG_TXT_BUFF_SIZE	4096
+
+// Interval in seconds at which the files are checked for lines buffered for too long
+#define OUTPUT_LOG_TXT_FLUSH_TIMER	1
+
 enum output_log_txt_field_type {
 	output_log_txt_event_field,
 	output_log_txt_event_property,
@@ -52,6 +58,14 @@ struct output_log_txt_file {
 	char *path;
 	int fd;
 	pthread_mutex_t lock;
+
+	// Lines are buffered until flush_size bytes are pending or flush_interval elapsed
+	char *buff;
+	size_t buff_len, buff_size;
+	size_t flush_size;
+	ptime flush_interval, last_flush;
+	int sync;
+
 	struct output_log_txt_file *prev, *next;
 };
 
@@ -71,9 +85,15 @@ struct output_log_txt_event {
 struct output_log_txt_priv {
 	struct ptype *p_prefix;
 	struct ptype *p_template;
+	struct ptype *p_async_queue;
+	struct ptype *p_async_drop;
+	struct ptype *p_flush_size;
+	struct ptype *p_flush_interval;
+	struct ptype *p_sync;
 
 	struct output_log_txt_file *files;
 	struct output_log_txt_event *events;
+	struct timer_sys *flush_timer;
 
 	struct registry_perf *perf_events;
 };
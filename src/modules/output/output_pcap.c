@@ -28,22 +28,24 @@
 #include <pom-ng/ptype_uint32.h>
 #include <pom-ng/ptype_uint64.h>
 
+#include <fcntl.h>
+
 
 static struct event_reg *output_pcap_flow_evt_file_reg = NULL;
 
 static struct output_pcap_link_type output_pcap_link_types[] = {
-	{ "ethernet", DLT_EN10MB },
-	{ "ipv4", DLT_RAW },
-	{ "80211", DLT_IEEE802_11 },
-	{ "radiotap", DLT_IEEE802_11_RADIO },
-	{ "ppi", DLT_PPI },
+	{ "ethernet", DLT_EN10MB, 1 },
+	{ "ipv4", DLT_RAW, 101 },
+	{ "80211", DLT_IEEE802_11, 105 },
+	{ "radiotap", DLT_IEEE802_11_RADIO, 127 },
+	{ "ppi", DLT_PPI, 192 },
 #ifdef DLT_DOCSIS
-	{ "docsis", DLT_DOCSIS },
+	{ "docsis", DLT_DOCSIS, 143 },
 #endif
 #ifdef DLT_MPEG_2_TS
-	{ "mpeg_ts", DLT_MPEG_2_TS },
+	{ "mpeg_ts", DLT_MPEG_2_TS, 243 },
 #endif
-	{ NULL, 0 }
+	{ NULL, 0, 0 }
 
 };
 
@@ -125,6 +127,7 @@ static int output_pcap_file_init(struct output *o) {
 		return POM_ERR;
 	}
 	memset(priv, 0, sizeof(struct output_pcap_file_priv));
+	priv->fd = -1;
 
 	int res = pthread_mutex_init(&priv->lock, NULL);
 	if (res) {
@@ -142,18 +145,26 @@ static int output_pcap_file_init(struct output *o) {
 	priv->p_link_type = ptype_alloc("string");
 	priv->p_unbuffered = ptype_alloc("bool");
 	priv->p_filter = ptype_alloc("string");
-
-	if (!priv->p_filename || !priv->p_snaplen || !priv->p_link_type || !priv->p_unbuffered || !priv->p_filter)
+	priv->p_format = ptype_alloc("string");
+	priv->p_rotate_size = ptype_alloc_unit("uint64", "bytes");
+	priv->p_rotate_interval = ptype_alloc_unit("uint32", "seconds");
+	priv->p_writer_thread = ptype_alloc("bool");
+	priv->p_buffer_size = ptype_alloc_unit("uint32", "bytes");
+
+	if (!priv->p_filename || !priv->p_snaplen || !priv->p_link_type || !priv->p_unbuffered || !priv->p_filter ||
+		!priv->p_format || !priv->p_rotate_size || !priv->p_rotate_interval || !priv->p_writer_thread || !priv->p_buffer_size)
 		goto err;
 
 	struct registry_instance *inst = output_get_reg_instance(o);
 	priv->perf_pkts_out = registry_instance_add_perf(inst, "pkts_out", registry_perf_type_counter, "Number of packets written", "pkts");
 	priv->perf_bytes_out = registry_instance_add_perf(inst, "bytes_out", registry_perf_type_counter, "Number of packet bytes written", "bytes");
+	priv->perf_pkts_dropped = registry_instance_add_perf(inst, "pkts_dropped", registry_perf_type_counter, "Number of packets dropped because the buffer of the thread was full", "pkts");
+	priv->perf_files = registry_instance_add_perf(inst, "files", registry_perf_type_counter, "Number of files written", "files");
 
-	if (!priv->perf_pkts_out || !priv->perf_bytes_out)
+	if (!priv->perf_pkts_out || !priv->perf_bytes_out || !priv->perf_pkts_dropped || !priv->perf_files)
 		goto err;
 
-	p = registry_new_param("filename", "out.pcap", priv->p_filename, "Output PCAP file", 0);
+	p = registry_new_param("filename", "out.pcap", priv->p_filename, "Output PCAP file, strftime() format is applied with the time of the first packet of each file", 0);
 	if (output_add_param(o, p) != POM_OK)
 		goto err;
 	
@@ -177,6 +188,28 @@ static int output_pcap_file_init(struct output *o) {
 	if (output_add_param(o, p) != POM_OK)
 		goto err;
 
+	p = registry_new_param("format", "pcap", priv->p_format, "File format", 0);
+	if (registry_param_info_add_value(p, "pcap") != POM_OK || registry_param_info_add_value(p, "pcapng") != POM_OK)
+		goto err;
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("rotate_size", "0", priv->p_rotate_size, "Start a new file once this size is reached (0 to disable)", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("rotate_interval", "0", priv->p_rotate_interval, "Start a new file after this amount of time (0 to disable)", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("writer_thread", "no", priv->p_writer_thread, "Queue the packets in a buffer per processing thread and write them from a separate thread", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
+	p = registry_new_param("buffer_size", "4194304", priv->p_buffer_size, "Size of the buffer of each processing thread when using the writer thread", 0);
+	if (output_add_param(o, p) != POM_OK)
+		goto err;
+
 	p = registry_new_param("filter", "", priv->p_filter, "Filter", REGISTRY_PARAM_FLAG_NOT_LOCKED_WHILE_RUNNING);
 	if (output_add_param(o, p) != POM_OK)
 		goto err;
@@ -214,6 +247,16 @@ static int output_pcap_file_cleanup(void *output_priv) {
 		ptype_cleanup(priv->p_unbuffered);
 	if (priv->p_filter)
 		ptype_cleanup(priv->p_filter);
+	if (priv->p_format)
+		ptype_cleanup(priv->p_format);
+	if (priv->p_rotate_size)
+		ptype_cleanup(priv->p_rotate_size);
+	if (priv->p_rotate_interval)
+		ptype_cleanup(priv->p_rotate_interval);
+	if (priv->p_writer_thread)
+		ptype_cleanup(priv->p_writer_thread);
+	if (priv->p_buffer_size)
+		ptype_cleanup(priv->p_buffer_size);
 	
 	free(priv);
 
@@ -221,35 +264,435 @@ static int output_pcap_file_cleanup(void *output_priv) {
 	return POM_OK;
 }
 
+static int output_pcap_file_flush(struct output_pcap_file_priv *priv) {
+
+	if (!priv->wbuff_len)
+		return POM_OK;
+
+	int res = pom_write(priv->fd, priv->wbuff, priv->wbuff_len);
+	priv->wbuff_len = 0;
+
+	return res;
+}
+
+static int output_pcap_file_append(struct output_pcap_file_priv *priv, void *data, size_t len) {
+
+	priv->file_size += len;
+
+	if (priv->wbuff_len + len > OUTPUT_PCAP_FILE_WRITE_BUFF) {
+		if (output_pcap_file_flush(priv) != POM_OK)
+			return POM_ERR;
+
+		if (len > OUTPUT_PCAP_FILE_WRITE_BUFF)
+			return pom_write(priv->fd, data, len);
+	}
+
+	memcpy(priv->wbuff + priv->wbuff_len, data, len);
+	priv->wbuff_len += len;
+
+	return POM_OK;
+}
+
+static int output_pcap_file_close_file(struct output_pcap_file_priv *priv) {
+
+	if (priv->fd == -1)
+		return POM_OK;
+
+	int res = output_pcap_file_flush(priv);
+
+	if (close(priv->fd) < 0) {
+		pomlog(POMLOG_ERR "Error while closing pcap file %s : %s", priv->filename, pom_strerror(errno));
+		res = POM_ERR;
+	}
+	priv->fd = -1;
+
+	return res;
+}
+
+static int output_pcap_file_open_file(struct output_pcap_file_priv *priv, ptime ts) {
+
+	char filename[FILENAME_MAX + 1] = { 0 };
+	char *format = PTYPE_STRING_GETVAL(priv->p_filename);
+
+	struct tm tmp;
+	time_t sec = pom_ptime_sec(ts);
+	localtime_r(&sec, &tmp);
+	if (!strftime(filename, FILENAME_MAX, format, &tmp))
+		strncpy(filename, format, FILENAME_MAX);
+
+	// Only the first file may replace an existing one, rotated files never overwrite anything
+	int flags = O_WRONLY | O_CREAT | (priv->file_num ? O_EXCL : O_TRUNC);
+
+	// Number the files while the name doesn't change
+	if (strcmp(filename, priv->file_base)) {
+		strcpy(priv->file_base, filename);
+		priv->file_base_num = 0;
+	}
+
+	while (1) {
+		if (priv->file_base_num)
+			snprintf(priv->filename, FILENAME_MAX, "%s.%u", filename, priv->file_base_num);
+		else
+			strcpy(priv->filename, filename);
+		priv->file_base_num++;
+
+		priv->fd = open(priv->filename, flags, 0666);
+		if (priv->fd != -1)
+			break;
+
+		if (errno != EEXIST) {
+			pomlog(POMLOG_ERR "Unable to open pcap file %s for writing : %s", priv->filename, pom_strerror(errno));
+			return POM_ERR;
+		}
+	}
+
+	priv->file_num++;
+	priv->file_size = 0;
+	priv->file_start = 0;
+	registry_perf_inc(priv->perf_files, 1);
+
+	if (priv->format == output_pcap_file_format_pcap) {
+		uint32_t hdr[6] = { OUTPUT_PCAP_MAGIC, 0, 0, 0, priv->snaplen, priv->linktype };
+		uint16_t *ver = (uint16_t *) &hdr[1];
+		ver[0] = 2;
+		ver[1] = 4;
+		return output_pcap_file_append(priv, hdr, sizeof(hdr));
+	}
+
+	// Section header block followed by the interface description block
+	uint32_t shb[7] = { OUTPUT_PCAPNG_BLOCK_SHB, sizeof(shb), OUTPUT_PCAPNG_BYTE_ORDER_MAGIC, 0, 0xffffffff, 0xffffffff, sizeof(shb) };
+	uint16_t *ver = (uint16_t *) &shb[3];
+	ver[0] = 1;
+	ver[1] = 0;
+
+	// Link type and reserved field are two 16 bits values
+	uint32_t idb[5] = { OUTPUT_PCAPNG_BLOCK_IDB, sizeof(idb), 0, priv->snaplen, sizeof(idb) };
+	uint16_t *link = (uint16_t *) &idb[2];
+	link[0] = priv->linktype;
+	link[1] = 0;
+
+	if (output_pcap_file_append(priv, shb, sizeof(shb)) != POM_OK || output_pcap_file_append(priv, idb, sizeof(idb)) != POM_OK)
+		return POM_ERR;
+
+	return POM_OK;
+}
+
+// Write a packet to the current file, packets must be written by one thread at a time
+static int output_pcap_file_write(struct output_pcap_file_priv *priv, ptime ts, uint32_t caplen, uint32_t len, void *data) {
+
+	uint64_t rotate_size = *PTYPE_UINT64_GETVAL(priv->p_rotate_size);
+	ptime rotate_interval = pom_sec_ptime(*PTYPE_UINT32_GETVAL(priv->p_rotate_interval));
+
+	if (priv->fd != -1 && priv->file_start &&
+		((rotate_size && priv->file_size + caplen > rotate_size) || (rotate_interval && ts >= priv->file_start + rotate_interval))) {
+		if (output_pcap_file_close_file(priv) != POM_OK)
+			return POM_ERR;
+	}
+
+	if (priv->fd == -1 && output_pcap_file_open_file(priv, ts) != POM_OK)
+		return POM_ERR;
+
+	if (!priv->file_start)
+		priv->file_start = ts;
+
+	if (priv->format == output_pcap_file_format_pcap) {
+		uint32_t hdr[4] = { pom_ptime_sec(ts), pom_ptime_usec(ts), caplen, len };
+		if (output_pcap_file_append(priv, hdr, sizeof(hdr)) != POM_OK || output_pcap_file_append(priv, data, caplen) != POM_OK)
+			return POM_ERR;
+	} else {
+		// Enhanced packet block with the default microsecond resolution
+		uint32_t pad = ((caplen + 3) & ~3) - caplen;
+		uint32_t block_len = 32 + caplen + pad;
+		uint32_t hdr[7] = { OUTPUT_PCAPNG_BLOCK_EPB, block_len, 0, ts >> 32, ts & 0xffffffff, caplen, len };
+		uint32_t trailer[2] = { 0, block_len };
+		if (output_pcap_file_append(priv, hdr, sizeof(hdr)) != POM_OK ||
+			output_pcap_file_append(priv, data, caplen) != POM_OK ||
+			output_pcap_file_append(priv, ((char *) trailer) + 4 - pad, pad + 4) != POM_OK)
+			return POM_ERR;
+	}
+
+	registry_perf_inc(priv->perf_pkts_out, 1);
+	registry_perf_inc(priv->perf_bytes_out, caplen);
+
+	return POM_OK;
+}
+
+static struct output_pcap_file_rec *output_pcap_file_buff_peek(struct output_pcap_file_buff *b) {
+
+	uint64_t tail = __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE);
+
+	while (b->head != tail) {
+		size_t pos = b->head % b->size;
+		size_t contig = b->size - pos;
+
+		// Skip the end of the buffer if the record didn't fit there
+		struct output_pcap_file_rec *rec = (struct output_pcap_file_rec *) (b->data + pos);
+		if (contig < sizeof(struct output_pcap_file_rec) || rec->caplen == OUTPUT_PCAP_FILE_REC_PAD) {
+			__atomic_store_n(&b->head, b->head + contig, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		return rec;
+	}
+
+	return NULL;
+}
+
+static int output_pcap_file_buff_push(struct output_pcap_file_buff *b, ptime ts, uint32_t caplen, uint32_t len, void *data) {
+
+	size_t rec_len = OUTPUT_PCAP_FILE_REC_ALIGN(sizeof(struct output_pcap_file_rec) + caplen);
+	uint64_t head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+
+	size_t pos = b->tail % b->size;
+	size_t contig = b->size - pos;
+	size_t needed = rec_len + (contig < rec_len ? contig : 0);
+
+	if (b->tail + needed - head > b->size)
+		return POM_ERR;
+
+	uint64_t tail = b->tail;
+	if (contig < rec_len) {
+		// Mark the end of the buffer as unused and start over
+		if (contig >= sizeof(struct output_pcap_file_rec))
+			((struct output_pcap_file_rec *) (b->data + pos))->caplen = OUTPUT_PCAP_FILE_REC_PAD;
+		tail += contig;
+		pos = 0;
+	}
+
+	struct output_pcap_file_rec *rec = (struct output_pcap_file_rec *) (b->data + pos);
+	rec->ts = ts;
+	rec->caplen = caplen;
+	rec->len = len;
+	memcpy(rec + 1, data, caplen);
+
+	__atomic_store_n(&b->tail, tail + rec_len, __ATOMIC_RELEASE);
+	__atomic_store_n(&b->last_ts, ts, __ATOMIC_RELEASE);
+
+	// Let the caller wake up the writer when the buffer is getting full
+	if (tail + rec_len - head > b->size / 2)
+		return OUTPUT_PCAP_FILE_BUFF_FILLING;
+
+	return POM_OK;
+}
+
+static struct output_pcap_file_buff *output_pcap_file_buff_get(struct output_pcap_file_priv *priv) {
+
+	pthread_t self = pthread_self();
+
+	struct output_pcap_file_buff *b;
+	for (b = __atomic_load_n(&priv->buffs, __ATOMIC_ACQUIRE); b; b = b->next) {
+		if (pthread_equal(b->thread, self))
+			return b;
+	}
+
+	// First packet of this thread
+	b = malloc(sizeof(struct output_pcap_file_buff));
+	if (!b) {
+		pom_oom(sizeof(struct output_pcap_file_buff));
+		return NULL;
+	}
+	memset(b, 0, sizeof(struct output_pcap_file_buff));
+
+	b->size = OUTPUT_PCAP_FILE_REC_ALIGN(*PTYPE_UINT32_GETVAL(priv->p_buffer_size));
+	b->data = malloc(b->size);
+	if (!b->data) {
+		pom_oom(b->size);
+		free(b);
+		return NULL;
+	}
+	b->thread = self;
+
+	b->next = __atomic_load_n(&priv->buffs, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&priv->buffs, &b->next, b, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+	return b;
+}
+
+static void *output_pcap_file_writer_thread(void *arg) {
+
+	struct output_pcap_file_priv *priv = arg;
+
+	int unbuffered = *PTYPE_BOOL_GETVAL(priv->p_unbuffered);
+
+	while (1) {
+
+		int run = __atomic_load_n(&priv->writer_run, __ATOMIC_ACQUIRE);
+		unsigned int count = 0;
+
+		// Write the queued packets ordered by timestamp
+		while (1) {
+			struct output_pcap_file_buff *b, *min_buff = NULL;
+			struct output_pcap_file_rec *min_rec = NULL;
+			ptime newest = 0;
+			for (b = __atomic_load_n(&priv->buffs, __ATOMIC_ACQUIRE); b; b = b->next) {
+				// Read the last timestamp first, the packets it covers are all visible then
+				ptime last_ts = __atomic_load_n(&b->last_ts, __ATOMIC_ACQUIRE);
+				if (last_ts > newest)
+					newest = last_ts;
+
+				struct output_pcap_file_rec *rec = output_pcap_file_buff_peek(b);
+				if (rec && (!min_rec || rec->ts < min_rec->ts)) {
+					min_rec = rec;
+					min_buff = b;
+				}
+			}
+
+			if (!min_rec)
+				break;
+
+			// A thread with nothing queued may still queue an older packet, unless it's been idle for a while
+			int hold = 0;
+			for (b = __atomic_load_n(&priv->buffs, __ATOMIC_ACQUIRE); run && b && !hold; b = b->next) {
+				ptime last_ts = __atomic_load_n(&b->last_ts, __ATOMIC_ACQUIRE);
+				if (last_ts < min_rec->ts && last_ts + OUTPUT_PCAP_FILE_REORDER_WINDOW > newest && !output_pcap_file_buff_peek(b))
+					hold = 1;
+			}
+
+			if (hold)
+				break;
+
+			if (output_pcap_file_write(priv, min_rec->ts, min_rec->caplen, min_rec->len, min_rec + 1) != POM_OK)
+				pomlog(POMLOG_ERR "Error while writing to pcap file %s", priv->filename);
+
+			__atomic_store_n(&min_buff->head, min_buff->head + OUTPUT_PCAP_FILE_REC_ALIGN(sizeof(struct output_pcap_file_rec) + min_rec->caplen), __ATOMIC_RELEASE);
+			count++;
+		}
+
+		// Write what we have when there is nothing left to do
+		if ((!count || unbuffered) && priv->fd != -1 && output_pcap_file_flush(priv) != POM_OK)
+			pomlog(POMLOG_ERR "Error while writing to pcap file %s", priv->filename);
+
+		// The buffers are drained once we've been asked to stop
+		if (!run)
+			break;
+
+		if (count)
+			continue;
+
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		struct timespec then = { 0 };
+		uint64_t nsec = (uint64_t) now.tv_usec * 1000 + OUTPUT_PCAP_FILE_WRITER_WAIT * 1000000;
+		then.tv_sec = now.tv_sec + nsec / 1000000000;
+		then.tv_nsec = nsec % 1000000000;
+
+		pom_mutex_lock(&priv->writer_lock);
+		if (priv->writer_run) {
+			int res = pthread_cond_timedwait(&priv->writer_cond, &priv->writer_lock, &then);
+			if (res && res != ETIMEDOUT) {
+				pomlog(POMLOG_ERR "Error while waiting for the writer condition : %s", pom_strerror(res));
+				abort();
+			}
+		}
+		pom_mutex_unlock(&priv->writer_lock);
+	}
+
+	registry_perf_thread_cleanup();
+
+	return NULL;
+}
+
+static int output_pcap_file_writer_stop(struct output_pcap_file_priv *priv) {
+
+	pom_mutex_lock(&priv->writer_lock);
+	__atomic_store_n(&priv->writer_run, 0, __ATOMIC_RELEASE);
+	pthread_cond_signal(&priv->writer_cond);
+	pom_mutex_unlock(&priv->writer_lock);
+
+	pthread_join(priv->writer, NULL);
+
+	pthread_cond_destroy(&priv->writer_cond);
+	pthread_mutex_destroy(&priv->writer_lock);
+
+	while (priv->buffs) {
+		struct output_pcap_file_buff *b = priv->buffs;
+		priv->buffs = b->next;
+		free(b->data);
+		free(b);
+	}
+
+	return POM_OK;
+}
+
+static int output_pcap_file_writer_start(struct output_pcap_file_priv *priv) {
+
+	int res = pthread_mutex_init(&priv->writer_lock, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while initializing the writer lock : %s", pom_strerror(res));
+		return POM_ERR;
+	}
+
+	res = pthread_cond_init(&priv->writer_cond, NULL);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while initializing the writer condition : %s", pom_strerror(res));
+		pthread_mutex_destroy(&priv->writer_lock);
+		return POM_ERR;
+	}
+
+	priv->writer_run = 1;
+
+	if (pthread_create(&priv->writer, NULL, output_pcap_file_writer_thread, priv)) {
+		pomlog(POMLOG_ERR "Error while creating the pcap writer thread : %s", pom_strerror(errno));
+		priv->writer_run = 0;
+		pthread_cond_destroy(&priv->writer_cond);
+		pthread_mutex_destroy(&priv->writer_lock);
+		return POM_ERR;
+	}
+
+	return POM_OK;
+}
+
 static int output_pcap_file_open(void *output_priv) {
 
 	struct output_pcap_file_priv *priv = output_priv;
 
-	uint32_t *snaplen = PTYPE_UINT32_GETVAL(priv->p_snaplen);
+	priv->snaplen = *PTYPE_UINT32_GETVAL(priv->p_snaplen);
 
 	char *link_type_str = PTYPE_STRING_GETVAL(priv->p_link_type);
 
-	int link_type = output_pcap_linktype_to_dlt(link_type_str);
+	int i;
+	for (i = 0; output_pcap_link_types[i].name && strcasecmp(link_type_str, output_pcap_link_types[i].name); i++);
+	if (!output_pcap_link_types[i].name) {
+		pomlog(POMLOG_ERR "Link type %s is not supported", link_type_str);
+		return POM_ERR;
+	}
+	priv->linktype = output_pcap_link_types[i].linktype;
 
 	struct proto *proto = proto_get(link_type_str);
 	if (!proto) {
 		pomlog(POMLOG_ERR "Protocol %s not yet implemented", link_type_str);
-		goto err;
+		return POM_ERR;
 	}
 
-	priv->p = pcap_open_dead(link_type, *snaplen);
-	if (!priv->p) {
-		pomlog(POMLOG_ERR "Unable to open pcap");
-		goto err;
+	char *format = PTYPE_STRING_GETVAL(priv->p_format);
+	if (!strcasecmp(format, "pcap")) {
+		priv->format = output_pcap_file_format_pcap;
+	} else if (!strcasecmp(format, "pcapng")) {
+		priv->format = output_pcap_file_format_pcapng;
+	} else {
+		pomlog(POMLOG_ERR "Unknown file format %s", format);
+		return POM_ERR;
 	}
 
-	char *filename = PTYPE_STRING_GETVAL(priv->p_filename);
-	priv->pdump = pcap_dump_open(priv->p, filename);
-	if (!priv->pdump) {
-		pomlog(POMLOG_ERR "Unable to open pcap file %s for writing !", filename);
-		goto err;
+	int writer_thread = *PTYPE_BOOL_GETVAL(priv->p_writer_thread);
+	if (writer_thread && *PTYPE_UINT32_GETVAL(priv->p_buffer_size) < 2 * OUTPUT_PCAP_FILE_REC_ALIGN(sizeof(struct output_pcap_file_rec) + priv->snaplen)) {
+		pomlog(POMLOG_ERR "The buffer size must be able to hold at least two packets of snaplen bytes");
+		return POM_ERR;
+	}
+
+	priv->wbuff = malloc(OUTPUT_PCAP_FILE_WRITE_BUFF);
+	if (!priv->wbuff) {
+		pom_oom(OUTPUT_PCAP_FILE_WRITE_BUFF);
+		return POM_ERR;
 	}
+	priv->wbuff_len = 0;
+	priv->file_num = 0;
+	priv->file_base[0] = 0;
+
+	// The first file is opened with the first packet so that it's named after its timestamp
 
+	if (writer_thread && output_pcap_file_writer_start(priv) != POM_OK)
+		goto err;
 
 	priv->listener = proto_packet_listener_register(proto, 0, priv, output_pcap_file_process, priv->filter);
 	if (!priv->listener) 
@@ -259,15 +702,13 @@ static int output_pcap_file_open(void *output_priv) {
 
 err:
 
-	if (priv->pdump) {
-		pcap_dump_close(priv->pdump);
-		priv->pdump = NULL;
-	}
+	if (priv->writer_run)
+		output_pcap_file_writer_stop(priv);
 
-	if (priv->p) {
-		pcap_close(priv->p);
-		priv->p = NULL;
-	}
+	output_pcap_file_close_file(priv);
+
+	free(priv->wbuff);
+	priv->wbuff = NULL;
 
 	return POM_ERR;
 
@@ -285,14 +726,15 @@ static int output_pcap_file_close(void *output_priv) {
 
 	priv->listener = NULL;
 
-	if (priv->pdump) {
-		pcap_dump_close(priv->pdump);
-		priv->pdump = NULL;
-	}
+	// The writer writes what's left in the buffers before exiting
+	if (priv->writer_run)
+		output_pcap_file_writer_stop(priv);
+
+	output_pcap_file_close_file(priv);
 
-	if (priv->p) {
-		pcap_close(priv->p);
-		priv->p = NULL;
+	if (priv->wbuff) {
+		free(priv->wbuff);
+		priv->wbuff = NULL;
 	}
 
 
@@ -304,32 +746,41 @@ static int output_pcap_file_process(void *obj, struct packet *p, struct proto_pr
 
 	struct output_pcap_file_priv *priv = obj;
 
-	struct pcap_pkthdr phdr = { { 0 } };
+	struct proto_process_stack *stack = &s[stack_index];
 
-	phdr.ts.tv_sec = pom_ptime_sec(p->ts);
-	phdr.ts.tv_usec = pom_ptime_usec(p->ts);
+	uint32_t caplen = stack->plen;
+	if (caplen > priv->snaplen)
+		caplen = priv->snaplen;
 
-	struct proto_process_stack *stack = &s[stack_index];
+	if (priv->writer_run) {
+		struct output_pcap_file_buff *b = output_pcap_file_buff_get(priv);
+		if (!b)
+			return POM_ERR;
 
-	phdr.len = stack->plen;
+		int res = output_pcap_file_buff_push(b, p->ts, caplen, stack->plen, stack->pload);
+		if (res == POM_ERR)
+			registry_perf_inc(priv->perf_pkts_dropped, 1);
 
-	uint32_t *snaplen = PTYPE_UINT32_GETVAL(priv->p_snaplen);
+		if (res != POM_OK) {
+			// Wake up the writer as it's not keeping up
+			pom_mutex_lock(&priv->writer_lock);
+			pthread_cond_signal(&priv->writer_cond);
+			pom_mutex_unlock(&priv->writer_lock);
+		}
 
-	if (*snaplen > stack->plen)
-		phdr.caplen = stack->plen;
-	else
-		phdr.caplen = *snaplen;
+		return POM_OK;
+	}
 
-	registry_perf_inc(priv->perf_pkts_out, 1);
-	registry_perf_inc(priv->perf_bytes_out, phdr.caplen);
-	
 	pom_mutex_lock(&priv->lock);
-	pcap_dump((u_char*)priv->pdump, &phdr, stack->pload);
-	if (PTYPE_BOOL_GETVAL(priv->p_unbuffered))
-		pcap_dump_flush(priv->pdump);
+	int res = output_pcap_file_write(priv, p->ts, caplen, stack->plen, stack->pload);
+	if (res == POM_OK && *PTYPE_BOOL_GETVAL(priv->p_unbuffered))
+		res = output_pcap_file_flush(priv);
 	pom_mutex_unlock(&priv->lock);
 
-	return POM_OK;
+	if (res != POM_OK)
+		pomlog(POMLOG_ERR "Error while writing to pcap file %s", priv->filename);
+
+	return res;
 
 }
 
@@ -666,7 +1117,7 @@ static int output_pcap_flow_process(void *obj, struct packet *p, struct proto_pr
 	pom_mutex_lock(&cpriv->lock);
 
 	pcap_dump((u_char*)cpriv->pdump, &phdr, stack->pload);
-	if (PTYPE_BOOL_GETVAL(priv->p_unbuffered))
+	if (*PTYPE_BOOL_GETVAL(priv->p_unbuffered))
 		pcap_dump_flush(cpriv->pdump);
 
 	pom_mutex_unlock(&cpriv->lock);
@@ -31,10 +31,50 @@
 
 #define OUTPUT_PCAP_FLOW_FILE_DATA_COUNT 5
 
+// Size of the buffer used to write the pcap_file files
+#define OUTPUT_PCAP_FILE_WRITE_BUFF	(256 * 1024)
+// Maximum time the writer thread waits for packets in ms
+#define OUTPUT_PCAP_FILE_WRITER_WAIT	10
+// Packets are held back this long at most, in packet time, for threads which didn't queue anything
+#define OUTPUT_PCAP_FILE_REORDER_WINDOW	1000000
+
+// Returned when queuing a packet in a buffer which is more than half full
+#define OUTPUT_PCAP_FILE_BUFF_FILLING	1
+
+#define OUTPUT_PCAP_FILE_REC_PAD	(uint32_t)-1
+#define OUTPUT_PCAP_FILE_REC_ALIGN(x)	(((x) + 7) & ~7)
+
+#define OUTPUT_PCAP_MAGIC		0xa1b2c3d4
+#define OUTPUT_PCAPNG_BLOCK_SHB		0x0A0D0D0A
+#define OUTPUT_PCAPNG_BLOCK_IDB		0x1
+#define OUTPUT_PCAPNG_BLOCK_EPB		0x6
+#define OUTPUT_PCAPNG_BYTE_ORDER_MAGIC	0x1A2B3C4D
+
+enum output_pcap_file_format {
+	output_pcap_file_format_pcap,
+	output_pcap_file_format_pcapng,
+};
+
+// Packet record in the per thread buffers, followed by the packet data
+struct output_pcap_file_rec {
+	ptime ts;
+	uint32_t caplen, len;
+};
+
+// Packets queued by a processing thread for the writer thread
+struct output_pcap_file_buff {
+	pthread_t thread;
+	unsigned char *data;
+	size_t size;
+	// Positions only grow, the writer owns head and the processing thread owns tail
+	uint64_t head, tail;
+	// Timestamp of the last packet queued, updated after the tail
+	ptime last_ts;
+	struct output_pcap_file_buff *next;
+};
+
 struct output_pcap_file_priv {
 
-	pcap_dumper_t *pdump;
-	pcap_t *p;
 	struct filter *filter;
 
 	struct proto_packet_listener *listener;
@@ -44,11 +84,39 @@ struct output_pcap_file_priv {
 	struct ptype *p_link_type;
 	struct ptype *p_unbuffered;
 	struct ptype *p_filter;
+	struct ptype *p_format;
+	struct ptype *p_rotate_size;
+	struct ptype *p_rotate_interval;
+	struct ptype *p_writer_thread;
+	struct ptype *p_buffer_size;
 
 	pthread_mutex_t lock;
 
+	// Current file
+	int fd;
+	char filename[FILENAME_MAX + 1];
+	char file_base[FILENAME_MAX + 1]; // Last strftime() result
+	unsigned int file_base_num;
+	unsigned int file_num;
+	uint64_t file_size;
+	ptime file_start;
+	enum output_pcap_file_format format;
+	int linktype;
+	uint32_t snaplen;
+	unsigned char *wbuff;
+	size_t wbuff_len;
+
+	// Writer thread and the buffers of each processing thread
+	struct output_pcap_file_buff *buffs;
+	pthread_t writer;
+	int writer_run;
+	pthread_mutex_t writer_lock;
+	pthread_cond_t writer_cond;
+
 	struct registry_perf *perf_pkts_out;
 	struct registry_perf *perf_bytes_out;
+	struct registry_perf *perf_pkts_dropped;
+	struct registry_perf *perf_files;
 
 };
 
@@ -103,6 +171,7 @@ enum {
 struct output_pcap_link_type {
 	char *name;
 	int dlt;
+	int linktype; // Value stored in the files
 };
 
 struct mod_reg_info *output_pcap_reg_info();
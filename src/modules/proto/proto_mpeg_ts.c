@@ -84,14 +84,66 @@ int proto_mpeg_ts_process(void *proto_priv, struct packet *p, struct proto_proce
 	// If MPEG packets are not the link layer, then care should be taken to 
 	// send them in the right order. For example by reoderding RTP or TCP packets containing them
 
-	struct proto_mpeg_ts_priv *ppriv = proto_priv;
+	struct proto_process_stack *s = &stack[stack_index];
+
+	if (s->plen < MPEG_TS_LEN)
+		return PROTO_INVALID;
+
+	struct proto_mpeg_ts_stream *stream = NULL;
+
+	unsigned int cells = s->plen / MPEG_TS_LEN;
+	if (cells == 1)
+		return proto_mpeg_ts_process_cell(proto_priv, p, stack, stack_index, &stream);
+
+	// Inputs group consecutive cells of the same PID in one packet
+	// Process them one by one, the conntrack and the stream are looked up only when the PID changes
+	unsigned char *pload = s->pload;
+	size_t plen = s->plen;
+	unsigned int handled = 0;
+	int res = PROTO_OK;
+	unsigned int i;
+	for (i = 0; i < cells; i++) {
+		s->pload = pload + (i * MPEG_TS_LEN);
+		s->plen = MPEG_TS_LEN;
+		res = proto_mpeg_ts_process_cell(proto_priv, p, stack, stack_index, &stream);
+		if (res == PROTO_ERR)
+			break;
+		if (res != PROTO_INVALID)
+			handled++;
+	}
+
+	// Restore the whole packet for the perfs and the listeners of this layer
+	s->pload = pload;
+	s->plen = plen;
+
+	if (res == PROTO_ERR)
+		return PROTO_ERR;
+
+	// Invalid cells are skipped, the packet is invalid only if none of them was valid
+	if (!handled)
+		return PROTO_INVALID;
+
+	// Each cell's payload was already processed, there is nothing left for the next layer
+	stack[stack_index + 1].proto = NULL;
+
+	return PROTO_STOP;
+}
+
+int proto_mpeg_ts_process_cell(struct proto_mpeg_ts_priv *ppriv, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index, struct proto_mpeg_ts_stream **cur_stream) {
+
 	struct proto_process_stack *s = &stack[stack_index];
 	struct proto_process_stack *s_next = &stack[stack_index + 1];
 	unsigned char *buff = s->pload;
 
+	// Offset of this cell in the packet buffer
+	unsigned int cell_offset = buff - (unsigned char *)p->buff;
+
 	uint16_t pid = ((buff[1] & 0x1F) << 8) | buff[2];
 	unsigned char pusi = buff[1] & 0x40;
 
+	// Check if the previous cell of this packet had the same PID
+	int same_pid = (s->ce && *PTYPE_UINT16_GETVAL(s->pkt_info->fields_value[proto_mpeg_ts_field_pid]) == pid);
+
 	PTYPE_UINT16_SETVAL(s->pkt_info->fields_value[proto_mpeg_ts_field_pid], pid);
 
 	int hdr_len = 4;
@@ -110,6 +162,19 @@ int proto_mpeg_ts_process(void *proto_priv, struct packet *p, struct proto_proce
 
 	// Try to find out what type or payload we are dealing with
 
+	struct proto_mpeg_ts_stream *stream = NULL;
+	if (same_pid && *cur_stream) {
+		stream = *cur_stream;
+		goto stream_found;
+	}
+
+	if (s->ce && !same_pid) {
+		// The conntrack is the one of the previous PID in the packet
+		conntrack_refcount_dec(s->ce);
+		s->ce = NULL;
+	}
+	*cur_stream = NULL;
+
 	if (conntrack_get(stack, stack_index) != POM_OK)
 		return PROTO_ERR;
 	
@@ -131,7 +196,6 @@ int proto_mpeg_ts_process(void *proto_priv, struct packet *p, struct proto_proce
 	unsigned int i;
 	for (i = 0; i < priv->streams_array_size && priv->streams[i].input != p->input; i++);
 
-	struct proto_mpeg_ts_stream *stream = NULL;
 	if (i >= priv->streams_array_size) {
 		// New stream
 		
@@ -179,6 +243,10 @@ int proto_mpeg_ts_process(void *proto_priv, struct packet *p, struct proto_proce
 
 	conntrack_unlock(s->ce);
 
+	*cur_stream = stream;
+
+stream_found:
+
 	// Check for missing packets
 	unsigned int missed = 0;
 	if (afc & 1) // only increment last_seq when AFC has payload
@@ -363,7 +431,7 @@ int proto_mpeg_ts_process(void *proto_priv, struct packet *p, struct proto_proce
 			} else {
 
 				// Add the end of the previous packet
-				if (packet_multipart_add_packet(m, p, stream->pkt_cur_len, pusi_ptr, hdr_len) != POM_OK)
+				if (packet_multipart_add_packet(m, p, stream->pkt_cur_len, pusi_ptr, cell_offset + hdr_len + 1) != POM_OK)
 					return PROTO_ERR;
 				
 				// Process the multipart once we're done with the MPEG packet
@@ -431,7 +499,7 @@ int proto_mpeg_ts_process(void *proto_priv, struct packet *p, struct proto_proce
 #endif
 			if (offset) {
 				struct packet_multipart *tmp = packet_multipart_alloc(s_next->proto, 0, 0);
-				if (packet_multipart_add_packet(tmp, p, 0, pkt_len, pos) != POM_OK) {
+				if (packet_multipart_add_packet(tmp, p, 0, pkt_len, cell_offset + pos) != POM_OK) {
 					packet_multipart_cleanup(tmp);
 					return PROTO_ERR;
 				}
@@ -463,7 +531,7 @@ int proto_mpeg_ts_process(void *proto_priv, struct packet *p, struct proto_proce
 
 	// Some leftover, add to multipart
 	
-	if (packet_multipart_add_packet(stream->multipart, p, stream->pkt_cur_len, MPEG_TS_LEN - pos, pos) != POM_OK) {	
+	if (packet_multipart_add_packet(stream->multipart, p, stream->pkt_cur_len, MPEG_TS_LEN - pos, cell_offset + pos) != POM_OK) {	
 		packet_multipart_cleanup(stream->multipart);
 		stream->multipart = NULL;
 		stream->pkt_cur_len = 0;
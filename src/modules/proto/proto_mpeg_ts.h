@@ -79,6 +79,7 @@ struct proto_mpeg_ts_conntrack_priv {
 
 int proto_mpeg_ts_init(struct proto *proto, struct registry_instance *i);
 int proto_mpeg_ts_process(void *proto_priv, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
+int proto_mpeg_ts_process_cell(struct proto_mpeg_ts_priv *ppriv, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index, struct proto_mpeg_ts_stream **cur_stream);
 int proto_mpeg_ts_process_stream(void *priv, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
 int proto_mpeg_ts_stream_cleanup(void *, ptime now);
 int proto_mpeg_ts_conntrack_cleanup(void *ce_priv);
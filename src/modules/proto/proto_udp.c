@@ -62,6 +62,7 @@ static int proto_udp_mod_register(struct mod_reg *mod) {
 
 	static struct conntrack_info ct_info = { 0 };
 	ct_info.default_table_size = 32768;
+	ct_info.key_size = sizeof(uint16_t);
 	ct_info.fwd_pkt_field_id = proto_udp_field_sport;
 	ct_info.rev_pkt_field_id = proto_udp_field_dport;
 	proto_udp.ct_info = &ct_info;
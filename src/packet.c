@@ -58,6 +58,191 @@ int packet_init() {
 // Packet info pool stuff
 static __thread struct packet_info **packet_info_pool;
 
+// Packet and buffer caches
+static __thread struct packet_cache *packet_thread_cache = NULL;
+static struct packet_cache *packet_caches = NULL;
+static pthread_mutex_t packet_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static const size_t packet_buffer_class_size[PACKET_BUFFER_CLASS_COUNT] = PACKET_BUFFER_CLASS_SIZES;
+
+static struct packet_cache *packet_cache_get() {
+
+	if (packet_thread_cache)
+		return packet_thread_cache;
+
+	pom_mutex_lock(&packet_caches_lock);
+
+	// Reuse the cache of a thread which exited
+	struct packet_cache *c;
+	for (c = packet_caches; c && c->in_use; c = c->next);
+
+	if (!c) {
+		c = malloc(sizeof(struct packet_cache));
+		if (!c) {
+			pom_mutex_unlock(&packet_caches_lock);
+			pom_oom(sizeof(struct packet_cache));
+			return NULL;
+		}
+		memset(c, 0, sizeof(struct packet_cache));
+
+		c->pkts.max = PACKET_CACHE_MAX_FREE;
+		int i;
+		for (i = 0; i < PACKET_BUFFER_CLASS_COUNT; i++) {
+			c->buffs[i].max = PACKET_CACHE_MAX_FREE_BYTES / packet_buffer_class_size[i];
+			if (c->buffs[i].max > PACKET_CACHE_MAX_FREE)
+				c->buffs[i].max = PACKET_CACHE_MAX_FREE;
+		}
+
+		c->next = packet_caches;
+		packet_caches = c;
+	}
+	c->in_use = 1;
+
+	pom_mutex_unlock(&packet_caches_lock);
+
+	packet_thread_cache = c;
+
+	return c;
+}
+
+static void packet_cache_perf_flush(struct packet_cache *c) {
+
+	if (c->perf_pkt_in_use > 0)
+		registry_perf_inc(perf_pkt_in_use, c->perf_pkt_in_use);
+	else if (c->perf_pkt_in_use < 0)
+		registry_perf_dec(perf_pkt_in_use, -c->perf_pkt_in_use);
+
+	if (c->perf_pkt_buff > 0)
+		registry_perf_inc(perf_pkt_buff, c->perf_pkt_buff);
+	else if (c->perf_pkt_buff < 0)
+		registry_perf_dec(perf_pkt_buff, -c->perf_pkt_buff);
+
+	c->perf_pkt_in_use = 0;
+	c->perf_pkt_buff = 0;
+	c->perf_pending = 0;
+}
+
+static void packet_cache_perf_update(int64_t pkts, int64_t bytes) {
+
+	struct packet_cache *c = packet_cache_get();
+	if (!c) {
+		// Update the perfs directly then
+		if (pkts > 0)
+			registry_perf_inc(perf_pkt_in_use, pkts);
+		else if (pkts < 0)
+			registry_perf_dec(perf_pkt_in_use, -pkts);
+		if (bytes > 0)
+			registry_perf_inc(perf_pkt_buff, bytes);
+		else if (bytes < 0)
+			registry_perf_dec(perf_pkt_buff, -bytes);
+		return;
+	}
+
+	c->perf_pkt_in_use += pkts;
+	c->perf_pkt_buff += bytes;
+
+	if (++c->perf_pending >= PACKET_CACHE_PERF_BATCH)
+		packet_cache_perf_flush(c);
+}
+
+static void *packet_cache_list_pop(struct packet_cache_list *l) {
+
+	if (!l->head) {
+		// Take back what the other threads released, free what doesn't fit in the cache
+		struct packet_cache_obj *tmp = __sync_lock_test_and_set(&l->returned, NULL);
+		while (tmp) {
+			struct packet_cache_obj *next = tmp->next;
+			if (l->count < l->max) {
+				tmp->next = l->head;
+				l->head = tmp;
+				l->count++;
+			} else {
+				free(tmp);
+			}
+			tmp = next;
+		}
+	}
+
+	struct packet_cache_obj *obj = l->head;
+	if (!obj)
+		return NULL;
+
+	l->head = obj->next;
+	l->count--;
+
+	return obj;
+}
+
+static void packet_cache_list_push(struct packet_cache *owner, struct packet_cache_list *l, void *ptr) {
+
+	struct packet_cache_obj *obj = ptr;
+
+	if (owner != packet_cache_get()) {
+		// Give it back to the thread which allocated it
+		struct packet_cache_obj *head;
+		do {
+			head = l->returned;
+			obj->next = head;
+		} while (!__sync_bool_compare_and_swap(&l->returned, head, obj));
+		return;
+	}
+
+	if (l->count >= l->max) {
+		free(obj);
+		return;
+	}
+
+	obj->next = l->head;
+	l->head = obj;
+	l->count++;
+}
+
+static void packet_cache_list_cleanup(struct packet_cache_list *l) {
+
+	struct packet_cache_obj *obj;
+	while ((obj = packet_cache_list_pop(l)))
+		free(obj);
+}
+
+void packet_cache_thread_cleanup() {
+
+	struct packet_cache *c = packet_thread_cache;
+	if (!c)
+		return;
+
+	packet_cache_perf_flush(c);
+
+	// Another thread can reuse the cache and what it contains
+	pom_mutex_lock(&packet_caches_lock);
+	c->in_use = 0;
+	pom_mutex_unlock(&packet_caches_lock);
+
+	packet_thread_cache = NULL;
+}
+
+int packet_cleanup() {
+
+	pom_mutex_lock(&packet_caches_lock);
+	while (packet_caches) {
+		struct packet_cache *c = packet_caches;
+		packet_caches = c->next;
+
+		if (c->in_use)
+			pomlog(POMLOG_WARN "Packet cache still in use during cleanup");
+
+		packet_cache_list_cleanup(&c->pkts);
+		int i;
+		for (i = 0; i < PACKET_BUFFER_CLASS_COUNT; i++)
+			packet_cache_list_cleanup(&c->buffs[i]);
+
+		free(c);
+	}
+	pom_mutex_unlock(&packet_caches_lock);
+
+	packet_thread_cache = NULL;
+
+	return POM_OK;
+}
+
 int packet_buffer_alloc(struct packet *pkt, size_t size, size_t align_offset) {
 
 	if (align_offset >= PACKET_BUFFER_ALIGNMENT) {
@@ -65,56 +250,130 @@ int packet_buffer_alloc(struct packet *pkt, size_t size, size_t align_offset) {
 		return POM_ERR;
 	}
 
-	size_t tot_size = size + align_offset + PACKET_BUFFER_ALIGNMENT + sizeof(struct packet_buffer);
+	struct packet_cache *c = packet_cache_get();
+
+	// Find the smallest class this buffer fits in
+	int buff_class;
+	for (buff_class = 0; buff_class < PACKET_BUFFER_CLASS_COUNT && packet_buffer_class_size[buff_class] < size; buff_class++);
+
+	size_t tot_size;
+	struct packet_buffer *pb = NULL;
+
+	if (c && buff_class < PACKET_BUFFER_CLASS_COUNT) {
+		tot_size = packet_buffer_class_size[buff_class] + (2 * PACKET_BUFFER_ALIGNMENT) + sizeof(struct packet_buffer);
+		pb = packet_cache_list_pop(&c->buffs[buff_class]);
+	} else {
+		buff_class = -1;
+		tot_size = size + align_offset + PACKET_BUFFER_ALIGNMENT + sizeof(struct packet_buffer);
+	}
 
-	struct packet_buffer *pb = malloc(tot_size);
 	if (!pb) {
-		pom_oom(tot_size);
-		return POM_ERR;
+		pb = malloc(tot_size);
+		if (!pb) {
+			pom_oom(tot_size);
+			return POM_ERR;
+		}
 	}
-	memset(pb, 0, tot_size);
+
+	// Only the header needs to be initialized, the data will be overwritten
+	memset(pb, 0, sizeof(struct packet_buffer));
 
 	pb->base_buff = (void*)pb + sizeof(struct packet_buffer);
 	pb->aligned_buff = (void*) (((long)pb->base_buff & ~(PACKET_BUFFER_ALIGNMENT - 1)) + PACKET_BUFFER_ALIGNMENT + align_offset);
 	pb->buff_size = tot_size;
+	pb->cache = c;
+	pb->buff_class = buff_class;
 
 	pkt->pkt_buff = pb;
 	pkt->len = size;
 	pkt->buff = pb->aligned_buff;
 
-
-	registry_perf_inc(perf_pkt_buff, tot_size);
+	packet_cache_perf_update(0, tot_size);
 
 	return POM_OK;
 }
 
 void packet_buffer_release(struct packet_buffer *pb) {
 
-	registry_perf_dec(perf_pkt_buff, pb->buff_size);
+	if (pb->release) {
+		// The buffer is not ours, the owner keeps track of its usage
+		pb->release(pb->release_priv);
+		return;
+	}
+
+	packet_cache_perf_update(0, -(int64_t)pb->buff_size);
+
+	if (pb->buff_class < 0) {
+		free(pb);
+		return;
+	}
+
+	packet_cache_list_push(pb->cache, &pb->cache->buffs[pb->buff_class], pb);
+}
+
+struct packet_buffer *packet_buffer_external_alloc(void (*release) (void *priv), void *priv) {
+
+	struct packet_buffer *pb = malloc(sizeof(struct packet_buffer));
+	if (!pb) {
+		pom_oom(sizeof(struct packet_buffer));
+		return NULL;
+	}
+	memset(pb, 0, sizeof(struct packet_buffer));
+
+	pb->buff_class = -1;
+	pb->release = release;
+	pb->release_priv = priv;
+
+	return pb;
+}
+
+void packet_buffer_external_attach(struct packet *pkt, struct packet_buffer *pb, void *buff, size_t len) {
+
+	// The release callback will be called once the packet is released
+	pkt->pkt_buff = pb;
+	pkt->buff = buff;
+	pkt->len = len;
+}
+
+void packet_buffer_external_cleanup(struct packet_buffer *pb) {
+
 	free(pb);
 }
 
 
 struct packet *packet_alloc() {
 
-	struct packet *tmp = malloc(sizeof(struct packet));
-	memset(tmp, 0, sizeof(struct packet));
+	struct packet_cache *c = packet_cache_get();
+	if (!c)
+		return NULL;
+
+	struct packet_cache_pkt *tmp = packet_cache_list_pop(&c->pkts);
+	if (!tmp) {
+		tmp = malloc(sizeof(struct packet_cache_pkt));
+		if (!tmp) {
+			pom_oom(sizeof(struct packet_cache_pkt));
+			return NULL;
+		}
+	}
+	memset(tmp, 0, sizeof(struct packet_cache_pkt));
+	tmp->cache = c;
 
 	// Init the refcount
-	tmp->refcount = 1;
+	tmp->pkt.refcount = 1;
 
-	registry_perf_inc(perf_pkt_in_use, 1);
+	packet_cache_perf_update(1, 0);
 
-	return tmp;
+	return &tmp->pkt;
 }
 
 struct packet *packet_clone(struct packet *src, unsigned int flags) {
 
 	struct packet *dst = NULL;
 
-	if (!(flags & PACKET_FLAG_FORCE_NO_COPY) && !src->pkt_buff) {
+	if (!(flags & PACKET_FLAG_FORCE_NO_COPY) && (!src->pkt_buff || src->pkt_buff->release)) {
 		// If it doesn't have a pkt_buff structure, it means it was not allocated by us
 		// That means that the packet is somewhere probably in a ringbuffer (pcap)
+		// Same thing for external buffers which must be given back to their owner quickly
 		dst = packet_alloc();
 		if (!dst)
 			return NULL;
@@ -156,8 +415,10 @@ int packet_release(struct packet *p) {
 	if (p->pkt_buff)
 		packet_buffer_release(p->pkt_buff);
 
-	registry_perf_dec(perf_pkt_in_use, 1);
-	free(p);
+	packet_cache_perf_update(-1, 0);
+
+	struct packet_cache_pkt *cp = (struct packet_cache_pkt *) p;
+	packet_cache_list_push(cp->cache, &cp->cache->pkts, cp);
 
 	return POM_OK;
 }
@@ -441,6 +702,10 @@ int packet_multipart_process(struct packet_multipart *multipart, struct proto_pr
 		return PROTO_ERR;
 	}
 
+	// Buffers are not zeroed anymore, make sure the gaps are
+	if (multipart->gaps)
+		memset(p->buff, 0, multipart->cur);
+
 	struct packet_multipart_pkt *tmp = multipart->head;
 	for (; tmp; tmp = tmp->next) {
 		if (tmp->offset + tmp->len > multipart->cur) {
@@ -496,6 +761,7 @@ int packet_stream_parser_add_payload(struct packet_stream_parser *sp, void *ploa
 		sp->buff = NULL;
 		sp->buff_len = 0;
 		sp->buff_pos = 0;
+		sp->scanned = 0;
 
 	}
 
@@ -517,6 +783,7 @@ int packet_stream_parser_add_payload(struct packet_stream_parser *sp, void *ploa
 		// No need to buffer anything, let's just process it
 		sp->pload = pload;
 		sp->plen = len;
+		sp->scanned = 0;
 	}
 
 	debug_stream_parser("entry %p, added pload %p with len %u", sp, pload, len);
@@ -531,6 +798,7 @@ int packet_stream_parser_skip_bytes(struct packet_stream_parser *sp, size_t len)
 	
 	sp->pload += len;
 	sp->plen -= len;
+	sp->scanned = (sp->scanned > len ? sp->scanned - len : 0);
 
 	return POM_OK;
 }
@@ -548,6 +816,7 @@ int packet_stream_parser_empty(struct packet_stream_parser *sp) {
 
 	sp->pload = NULL;
 	sp->plen = 0;
+	sp->scanned = 0;
 
 	return POM_OK;
 };
@@ -563,9 +832,12 @@ int packet_stream_parser_get_line(struct packet_stream_parser *sp, char **line,
 	
 	size_t str_len = sp->plen, tmp_len = 0;
 	
-	char *lf = memchr(pload, '\n', sp->plen);
+	// Don't look again at what was searched before more payload was added
+	char *lf = memchr(pload + sp->scanned, '\n', sp->plen - sp->scanned);
 	if (!lf) {
 
+		sp->scanned = sp->plen;
+
 		if (sp->buff) {
 			memmove(sp->buff, sp->pload, sp->plen);
 			sp->buff_pos = sp->plen;
@@ -588,6 +860,8 @@ int packet_stream_parser_get_line(struct packet_stream_parser *sp, char **line,
 	}
 
 
+	sp->scanned = 0;
+
 	tmp_len = lf - pload;
 	str_len = tmp_len + 1;
 	if (lf > pload && *(lf - 1) == '\r')
@@ -645,6 +919,7 @@ int packet_stream_parser_get_bytes(struct packet_stream_parser *sp, size_t len,
 
 	*pload = sp->pload;
 	sp->plen -= len;
+	sp->scanned = (sp->scanned > len ? sp->scanned - len : 0);
 
 	if (sp->plen) {
 		sp->pload += len;
@@ -689,6 +964,11 @@ int packet_filter_prop_compile(struct filter *f, char *prop_str, struct filter_v
 	v->val.prop.priv = prop;
 	prop->proto = proto;
 
+	int slot = filter_slot_get(f, proto);
+	if (slot == POM_ERR)
+		return POM_ERR;
+	prop->slot = slot;
+
 	if (dot) {
 		dot++;
 
@@ -719,16 +999,40 @@ int packet_filter_prop_compile(struct filter *f, char *prop_str, struct filter_v
 	return POM_OK;
 }
 
+static void packet_filter_ctx_resolve(struct packet_filter_ctx *ctx) {
+
+	// Find all the protocols used by the filter in a single pass, the first occurence wins
+	struct filter *f = ctx->f;
+	struct proto_process_stack *stack = ctx->stack;
+	memset(ctx->pos, 0, sizeof(unsigned int) * f->slot_count);
+
+	unsigned int j, k, found = 0;
+	for (j = CORE_PROTO_STACK_START; j <= CORE_PROTO_STACK_MAX && stack[j].proto && found < f->slot_count; j++) {
+		for (k = 0; k < f->slot_count; k++) {
+			if (f->slots[k] == stack[j].proto) {
+				if (!ctx->pos[k]) {
+					ctx->pos[k] = j;
+					found++;
+				}
+				break;
+			}
+		}
+	}
+
+	ctx->resolved = 1;
+}
+
 int packet_filter_prop_get_val(struct filter_value *inval, struct filter_value *outval, void *obj) {
 
-	struct proto_process_stack *stack = obj;
+	struct packet_filter_ctx *ctx = obj;
+	struct proto_process_stack *stack = ctx->stack;
 	struct packet_filter_prop *prop = inval->val.prop.priv;
 
+	if (!ctx->resolved)
+		packet_filter_ctx_resolve(ctx);
 
-	unsigned int j;
-	for (j = CORE_PROTO_STACK_START; j <= CORE_PROTO_STACK_MAX && stack[j].proto && stack[j].proto != prop->proto; j++);
-
-	if (!stack[j].proto)
+	unsigned int j = ctx->pos[prop->slot];
+	if (!j)
 		return POM_OK;
 
 	if (prop->field_id == -1) {
@@ -767,5 +1071,12 @@ struct filter *packet_filter_compile(char *filter_expr) {
 
 int packet_filter_match(struct filter *f, struct proto_process_stack *stack) {
 
-	return filter_match(f, stack);
+	unsigned int pos[f->slot_count + 1];
+
+	struct packet_filter_ctx ctx = { 0 };
+	ctx.f = f;
+	ctx.stack = stack;
+	ctx.pos = pos;
+
+	return filter_match(f, &ctx);
 }
@@ -28,12 +28,61 @@
 
 #define PACKET_BUFFER_ALIGNMENT 4
 
+// Size classes of the buffers kept in the per thread caches
+#define PACKET_BUFFER_CLASS_COUNT	4
+#define PACKET_BUFFER_CLASS_SIZES	{ 128, 2048, 9216, 65535 }
+
+// Maximum number of free objects of each kind a thread keeps
+#define PACKET_CACHE_MAX_FREE		1024
+
+// Maximum amount of memory in free buffers a thread keeps for each size class
+#define PACKET_CACHE_MAX_FREE_BYTES	(2 * 1024 * 1024)
+
+// Perf updates are batched by this amount
+#define PACKET_CACHE_PERF_BATCH		64
+
+struct packet_cache;
+
+// Free objects in the cache start with this
+struct packet_cache_obj {
+	struct packet_cache_obj *next;
+};
+
+struct packet_cache_list {
+	struct packet_cache_obj *head;
+	unsigned int count, max;
+	struct packet_cache_obj * volatile returned; // Released by other threads
+};
+
+struct packet_cache {
+	struct packet_cache_list pkts;
+	struct packet_cache_list buffs[PACKET_BUFFER_CLASS_COUNT];
+	int64_t perf_pkt_in_use, perf_pkt_buff;
+	unsigned int perf_pending;
+	int in_use;
+	struct packet_cache *next;
+};
+
+// Packets are allocated with some extra info
+struct packet_cache_pkt {
+	struct packet pkt; // Must be first
+	struct packet_cache *cache;
+};
+
 struct packet_buffer {
 
 	void *base_buff;
 	void *aligned_buff;
 	size_t buff_size;
 
+	// Cache the buffer belongs to and its size class (-1 if not cached)
+	struct packet_cache *cache;
+	int buff_class;
+
+	// Set for buffers owned by someone else (zero-copy)
+	void (*release) (void *priv);
+	void *release_priv;
+
 	// The actual data will be after this
 	
 };
@@ -45,6 +94,7 @@ struct packet_stream_parser {
 	size_t buff_pos;
 	char *pload;
 	size_t plen;
+	size_t scanned; // Bytes of pload already known not to contain a line return
 	unsigned int flags;
 };
 
@@ -52,9 +102,19 @@ struct packet_filter_prop {
 	struct proto *proto;
 	int field_id;
 	struct ptype_reg *pt_reg;
+	unsigned int slot;
+};
+
+// Position of the filter's protocols in the stack, resolved once per match
+struct packet_filter_ctx {
+	struct filter *f;
+	struct proto_process_stack *stack;
+	unsigned int *pos;
+	int resolved;
 };
 
 int packet_init();
+int packet_cleanup();
 
 void packet_buffer_release(struct packet_buffer *pb);
 
@@ -29,6 +29,7 @@
 #include <pom-ng/ptype_uint32.h>
 
 #include <stdio.h>
+#include <ctype.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -42,19 +43,35 @@ static __thread magic_t magic_cookie = NULL;
 // We require at least 64 bytes to do an analysis with libmagic
 #define PLOAD_BUFFER_MAGIC_MIN_SIZE 64
 
+static struct registry_perf *pload_perf_magic_lookups = NULL;
+
 #endif
 
+// Longest pattern allowed for a signature
+#define PLOAD_SIGNATURE_MAX_LEN 32
+
+// Size of the output window used to decode payloads which are not stored
+#define PLOAD_DECODE_WINDOW_SIZE 65536
+
 
 static struct registry_class *pload_registry_class = NULL;
 static struct ptype *pload_store_path = NULL;
 static struct ptype *pload_store_mmap_block_size = NULL;
 static size_t pload_page_size = 0;
 
+static struct registry_perf *pload_perf_buffer_size = NULL;
+static struct registry_perf *pload_perf_decoders = NULL;
+static struct registry_perf *pload_perf_listener_write_time = NULL;
+
 static struct pload_listener_reg *pload_listeners = NULL;
 
 static struct pload_type *pload_types = NULL;
 static struct pload_mime_type *pload_mime_types_hash = NULL, *pload_mime_types_head = NULL;
 
+// Signatures are indexed by their first byte when it's fixed, the others are in a separate list
+static struct pload_signature *pload_signatures[256] = { 0 };
+static struct pload_signature *pload_signatures_other = NULL;
+
 static char* pload_class_names[]  = {
 	"other",
 	"application",
@@ -80,12 +97,181 @@ static struct datavalue_template mime_types_data_template[] = {
 	{ 0 }
 };
 
+static struct datavalue_template signatures_data_template[] = {
+	{ .name = "mime", .type = "string" },
+	{ .name = "offset", .type = "uint32" },
+	{ .name = "pattern", .type = "string" },
+	{ 0 }
+};
+
 static struct resource_template pload_types_resource_template[] = {
 	{ "payload_types", payload_types_data_template },
 	{ "mime_types", mime_types_data_template },
+	{ "signatures", signatures_data_template },
 	{ 0 }
 };
 
+static struct pload_signature *pload_signature_alloc(char *pattern, unsigned int offset) {
+
+	size_t pattern_len = strlen(pattern);
+	if (!pattern_len || pattern_len % 2 || pattern_len / 2 > PLOAD_SIGNATURE_MAX_LEN) {
+		pomlog(POMLOG_ERR "Invalid signature pattern \"%s\"", pattern);
+		return NULL;
+	}
+
+	unsigned int len = pattern_len / 2;
+	size_t size = sizeof(struct pload_signature) + (len * 2);
+	struct pload_signature *sig = malloc(size);
+	if (!sig) {
+		pom_oom(size);
+		return NULL;
+	}
+	memset(sig, 0, size);
+	sig->offset = offset;
+	sig->len = len;
+	sig->value = (unsigned char *)(sig + 1);
+	sig->mask = sig->value + len;
+
+	unsigned int i;
+	for (i = 0; i < len; i++) {
+		char *hex = pattern + (i * 2);
+
+		// Wildcards leave the mask to 0
+		if (hex[0] == '?' && hex[1] == '?')
+			continue;
+
+		if (!isxdigit(hex[0]) || !isxdigit(hex[1])) {
+			pomlog(POMLOG_ERR "Invalid signature pattern \"%s\"", pattern);
+			free(sig);
+			return NULL;
+		}
+
+		char byte[3] = { hex[0], hex[1], 0 };
+		sig->value[i] = strtoul(byte, NULL, 16);
+		sig->mask[i] = 0xFF;
+	}
+
+	return sig;
+}
+
+static void pload_signature_add(struct pload_signature *sig) {
+
+	struct pload_signature **head = &pload_signatures_other;
+	if (!sig->offset && sig->mask[0])
+		head = &pload_signatures[sig->value[0]];
+
+	// Keep the longest signatures first, they are the most specific ones
+	while (*head && (*head)->len >= sig->len)
+		head = &(*head)->next;
+
+	sig->next = *head;
+	*head = sig;
+}
+
+// Return 1 if the signature matches, 0 if not and -1 if more data is needed
+static int pload_signature_check(struct pload_signature *sig, unsigned char *data, size_t len) {
+
+	unsigned int i;
+	for (i = 0; i < sig->len; i++) {
+		if (sig->offset + i >= len)
+			return -1;
+		if ((data[sig->offset + i] & sig->mask[i]) != sig->value[i])
+			return 0;
+	}
+
+	return 1;
+}
+
+// Find the longest signature matching the data, more is set if longer signatures need more data
+static struct pload_signature *pload_signature_find(unsigned char *data, size_t len, int *more) {
+
+	*more = 0;
+
+	if (!len) {
+		*more = 1;
+		return NULL;
+	}
+
+	struct pload_signature *lists[2] = { pload_signatures[data[0]], pload_signatures_other };
+	struct pload_signature *res = NULL;
+
+	int i;
+	for (i = 0; i < 2; i++) {
+		struct pload_signature *sig;
+		for (sig = lists[i]; sig && (!res || sig->len > res->len); sig = sig->next) {
+			int match = pload_signature_check(sig, data, len);
+			if (match < 0) {
+				*more = 1;
+			} else if (match) {
+				res = sig;
+				break;
+			}
+		}
+	}
+
+	return res;
+}
+
+// Mime types which don't tell anything about the content
+static int pload_mime_type_is_generic(struct mime_type *mime_type) {
+
+	return !mime_type ||
+		!strcmp(mime_type->name, "binary") ||
+		!strcmp(mime_type->name, "application/octet-stream") ||
+		!strcmp(mime_type->name, "application/octetstream") ||
+		!strcmp(mime_type->name, "text/plain");
+}
+
+// Zip archives are also the container of documents which are identified by their first entry
+// Return PLOAD_ZIP_MIMETYPE if the mime type of an ODF document was copied in mime, PLOAD_ZIP_CONTAINER
+// for other known formats, PLOAD_ZIP_PLAIN for a plain zip and -1 if more data is needed
+static int pload_zip_check(unsigned char *data, size_t len, char *mime, size_t mime_len) {
+
+	// The local file header is 30 bytes long and followed by the filename and the extra field
+	if (len < 30)
+		return -1;
+
+	unsigned int method = data[8] | (data[9] << 8);
+	size_t comp_size = data[18] | (data[19] << 8) | (data[20] << 16) | ((size_t) data[21] << 24);
+	size_t name_len = data[26] | (data[27] << 8);
+	size_t extra_len = data[28] | (data[29] << 8);
+
+	if (len < 30 + name_len)
+		return -1;
+
+	char *name = (char *) data + 30;
+
+	// ODF documents start with an uncompressed entry containing their mime type
+	if (name_len == strlen("mimetype") && !memcmp(name, "mimetype", name_len)) {
+		if (method || !comp_size || comp_size >= mime_len)
+			return PLOAD_ZIP_PLAIN;
+		size_t offset = 30 + name_len + extra_len;
+		if (len < offset + comp_size)
+			return -1;
+		memcpy(mime, data + offset, comp_size);
+		mime[comp_size] = 0;
+		return PLOAD_ZIP_MIMETYPE;
+	}
+
+	static char *containers[] = {
+		"[Content_Types].xml", // OOXML
+		"_rels/", // OOXML
+		"docProps/", // OOXML
+		"META-INF/", // JAR
+		"AndroidManifest.xml", // APK
+		NULL
+	};
+
+	int i;
+	for (i = 0; containers[i]; i++) {
+		size_t container_len = strlen(containers[i]);
+		if (name_len >= container_len && !memcmp(name, containers[i], container_len))
+			return PLOAD_ZIP_CONTAINER;
+	}
+
+	return PLOAD_ZIP_PLAIN;
+}
+
 static char *pload_decoders_noop[] = {
 	"7bit",
 	"8bit",
@@ -101,7 +287,7 @@ int pload_init() {
 		return POM_ERR;
 
 	struct resource *r = NULL;
-	struct resource_dataset *pload_types_ds = NULL, *mime_types_ds = NULL;
+	struct resource_dataset *pload_types_ds = NULL, *mime_types_ds = NULL, *signatures_ds = NULL;
 	
 	
 	struct registry_param *p = NULL;
@@ -121,6 +307,17 @@ int pload_init() {
 
 	p = NULL;
 
+	pload_perf_buffer_size = registry_class_add_perf(pload_registry_class, "buffer_size", registry_perf_type_gauge, "Memory used to buffer and decode payloads", "bytes");
+	pload_perf_decoders = registry_class_add_perf(pload_registry_class, "decoders", registry_perf_type_gauge, "Number of payloads being decoded", "ploads");
+	pload_perf_listener_write_time = registry_class_add_perf(pload_registry_class, "listener_write_time", registry_perf_type_histogram, "Time spent in each write to a payload listener", NULL);
+	if (!pload_perf_buffer_size || !pload_perf_decoders || !pload_perf_listener_write_time)
+		goto err;
+
+#ifdef HAVE_LIBMAGIC
+	pload_perf_magic_lookups = registry_class_add_perf(pload_registry_class, "magic_lookups", registry_perf_type_counter, "Number of payloads not identified by their signature and passed to libmagic", "ploads");
+	if (!pload_perf_magic_lookups)
+		goto err;
+#endif
 
 	r = resource_open("payload_types", pload_types_resource_template);
 	if (!r)
@@ -209,8 +406,9 @@ int pload_init() {
 		p = NULL;
 
 		def->perf_analyzed = registry_instance_add_perf(def->reg_instance, "analyzed", registry_perf_type_counter, "Number of payload analyzed", "ploads");
+		def->perf_signature_hits = registry_instance_add_perf(def->reg_instance, "signature_hits", registry_perf_type_counter, "Number of payloads identified by their signature", "ploads");
 
-		if (!def->perf_analyzed) {
+		if (!def->perf_analyzed || !def->perf_signature_hits) {
 			free(def);
 			goto err;
 		}
@@ -275,6 +473,44 @@ int pload_init() {
 	}
 
 	resource_dataset_close(mime_types_ds);
+	mime_types_ds = NULL;
+
+	signatures_ds = resource_dataset_open(r, "signatures");
+	if (!signatures_ds)
+		goto err;
+
+	while (1) {
+		struct datavalue *v = NULL;
+		int res = resource_dataset_read(signatures_ds, &v);
+		if (res == DATASET_QUERY_OK)
+			break;
+
+		if (res < 0) {
+			pomlog(POMLOG_ERR "Error while reading signatures resource");
+			goto err;
+		}
+
+		char *mime = PTYPE_STRING_GETVAL(v[0].value);
+
+		struct pload_mime_type *pmt = NULL;
+		HASH_FIND(hh, pload_mime_types_hash, mime, strlen(mime), pmt);
+		if (!pmt) {
+			pomlog(POMLOG_WARN "Mime type %s not known for signature", mime);
+			continue;
+		}
+
+		char *pattern = PTYPE_STRING_GETVAL(v[2].value);
+		struct pload_signature *sig = pload_signature_alloc(pattern, *PTYPE_UINT32_GETVAL(v[1].value));
+		if (!sig)
+			goto err;
+		sig->pmt = pmt;
+
+		pload_signature_add(sig);
+
+		pomlog(POMLOG_DEBUG "Signature %s registered for mime type %s", pattern, mime);
+	}
+
+	resource_dataset_close(signatures_ds);
 	resource_close(r);
 
 	// Get the page size
@@ -289,6 +525,9 @@ err:
 	if (p)
 		registry_cleanup_param(p);
 
+	if (signatures_ds)
+		resource_dataset_close(signatures_ds);
+
 	if (mime_types_ds)
 		resource_dataset_close(mime_types_ds);
 
@@ -331,6 +570,21 @@ void pload_cleanup() {
 	}
 	HASH_CLEAR(hh, pload_mime_types_hash);
 
+	int i;
+	for (i = 0; i < 256; i++) {
+		while (pload_signatures[i]) {
+			struct pload_signature *tmp = pload_signatures[i];
+			pload_signatures[i] = tmp->next;
+			free(tmp);
+		}
+	}
+
+	while (pload_signatures_other) {
+		struct pload_signature *tmp = pload_signatures_other;
+		pload_signatures_other = tmp->next;
+		free(tmp);
+	}
+
 	while (pload_mime_types_head) {
 		struct pload_mime_type *tmp = pload_mime_types_head;
 		pload_mime_types_head = tmp->next;
@@ -419,11 +673,16 @@ int pload_end(struct pload *pload) {
 	if (pload->store)
 		pload_store_end(pload->store);
 
-	if (pload->decoder)
+	if (pload->decoder) {
+		registry_perf_dec(pload_perf_buffer_size, pload->decoder->state_size);
 		decoder_cleanup(pload->decoder);
+		registry_perf_dec(pload_perf_decoders, 1);
+	}
 	
-	if (pload->buf.data)
+	if (pload->buf.data) {
 		free(pload->buf.data);
+		registry_perf_dec(pload_perf_buffer_size, pload->buf.buf_size);
+	}
 
 	if (pload->analyzer_priv && pload->type && pload->type->analyzer && pload->type->analyzer->cleanup)
 		pload->type->analyzer->cleanup(pload, pload->analyzer_priv);
@@ -538,6 +797,9 @@ int pload_set_encoding(struct pload *p, char *encoding) {
 		return POM_ERR;
 	}
 
+	registry_perf_inc(pload_perf_decoders, 1);
+	registry_perf_inc(pload_perf_buffer_size, p->decoder->state_size);
+
 	return POM_OK;
 }
 
@@ -559,12 +821,124 @@ int pload_buffer_grow(struct pload *p, size_t min_size) {
 		return POM_ERR;
 	}
 
+	registry_perf_inc(pload_perf_buffer_size, new_size - p->buf.buf_size);
+
 	p->buf.data = new_buf;
 	p->buf.buf_size = new_size;
 
 	return POM_OK;
 }
 
+static void pload_buffer_free(struct pload *p) {
+
+	if (!p->buf.data)
+		return;
+
+	free(p->buf.data);
+	registry_perf_dec(pload_perf_buffer_size, p->buf.buf_size);
+	p->buf.data = NULL;
+	p->buf.data_len = 0;
+	p->buf.buf_size = 0;
+}
+
+static void pload_listeners_write(struct pload *p, void *data, size_t len) {
+
+	struct pload_listener *tmp = p->listeners;
+	while (tmp) {
+		
+		uint64_t start = core_perf_layer_start();
+		int res = tmp->reg->write(tmp->reg->obj, tmp->priv, data, len);
+		core_perf_layer_stop(pload_perf_listener_write_time, start);
+
+		if (res != POM_OK) {
+			pomlog(POMLOG_WARN "Error while writing to a pload listener");
+			tmp->reg->close(tmp->reg->obj, tmp->priv);
+
+			struct pload_listener *todel = tmp;
+			tmp = tmp->next;
+
+			if (todel->prev)
+				todel->prev->next = todel->next;
+			else
+				p->listeners = todel->next;
+
+			if (todel->next)
+				todel->next->prev = todel->prev;
+
+			free(todel);
+			continue;
+
+		}
+		tmp = tmp->next;
+	}
+}
+
+// Decode and account for the memory the decoder allocated or released meanwhile
+static int pload_decoder_decode(struct pload *p) {
+
+	struct decoder *d = p->decoder;
+	size_t state_size = d->state_size;
+
+	int res = d->reg->decode(d);
+
+	if (d->state_size > state_size)
+		registry_perf_inc(pload_perf_buffer_size, d->state_size - state_size);
+	else if (d->state_size < state_size)
+		registry_perf_dec(pload_perf_buffer_size, state_size - d->state_size);
+
+	return res;
+}
+
+static int pload_buffer_decode_stream(struct pload *p, void *data, size_t len) {
+
+	// The payload is decoded in a window which is handed to the listeners each time it's full
+	// It's sized for this chunk, capped so the whole decoded payload never needs to be buffered
+	struct decoder *d = p->decoder;
+	size_t window = decoder_estimate_output_size(d, len);
+	if (window < len)
+		window = len;
+	if (window > PLOAD_DECODE_WINDOW_SIZE)
+		window = PLOAD_DECODE_WINDOW_SIZE;
+	else if (window < pload_page_size)
+		window = pload_page_size;
+
+	if (p->buf.buf_size < window) {
+		if (pload_buffer_grow(p, window - p->buf.buf_size) != POM_OK)
+			return POM_ERR;
+	}
+
+	d->next_in = data;
+	d->avail_in = len;
+
+	while (p->listeners) {
+		d->next_out = p->buf.data;
+		d->avail_out = p->buf.buf_size;
+
+		size_t avail_in = d->avail_in;
+		int res = pload_decoder_decode(p);
+		if (res == DEC_ERR) {
+			p->flags |= PLOAD_FLAG_IS_ERR;
+			pload_buffer_free(p);
+			return POM_ERR;
+		}
+
+		size_t out_len = p->buf.buf_size - d->avail_out;
+		if (out_len)
+			pload_listeners_write(p, p->buf.data, out_len);
+
+		if (res == DEC_END)
+			break;
+
+		// The decoder may still have output pending when the window is full
+		if (res != DEC_MORE && (!d->avail_in || (!out_len && d->avail_in == avail_in)))
+			break;
+	}
+
+	pload_buffer_free(p);
+
+	return POM_OK;
+}
+
 int pload_buffer_append(struct pload *p, void *data, size_t len) {
 
 	if (p->decoder) {
@@ -586,7 +960,8 @@ int pload_buffer_append(struct pload *p, void *data, size_t len) {
 		while (1) {
 			d->next_out = p->buf.data + p->buf.data_len;
 
-			int res = decoder_decode(d);
+			// Call the decoder even when all the input was consumed so pending output gets flushed
+			int res = pload_decoder_decode(p);
 
 			if (res == DEC_END) {
 				break;
@@ -690,7 +1065,7 @@ int pload_store_append(struct pload *p, void *data, size_t len) {
 		while (1) {
 			d->next_out = write_map->map + write_map->off_cur;
 
-			int res = decoder_decode(d);
+			int res = pload_decoder_decode(p);
 
 			if (res == DEC_END) {
 				break;
@@ -772,14 +1147,76 @@ int pload_append(struct pload *p, void *data, size_t len) {
 			len = p->buf.data_len;
 		}
 	} else if (!p->store && p->decoder) {
-		// There is no store being used but we still need some space to decode the payload
-		if (pload_buffer_append(p, data, len) != POM_OK)
-			return POM_OK;
-		data = p->buf.data;
-		len = p->buf.data_len;
+		// There is no store being used, decode straight to the listeners
+		if (len)
+			pload_buffer_decode_stream(p, data, len);
+		return POM_OK;
 	}
 
 
+	if (p->flags & PLOAD_FLAG_NEED_MAGIC) {
+
+		// Try the built-in signatures first, libmagic is way slower
+		int more = 0;
+		struct pload_signature *sig = pload_signature_find(data, len, &more);
+
+		if (more && !(p->expected_size && len >= p->expected_size)) {
+			// Not enough data to check all the signatures, buffer stuff if needed
+			if (!p->buf.data_len) // Stuff was not buffered
+				return pload_buffer_append(p, data, len);
+			return POM_OK;
+		}
+
+		if (sig) {
+
+			char *mime_name = sig->pmt->name;
+			struct pload_type *type = sig->pmt->type;
+			char zip_mime[128];
+
+			int zip_res = PLOAD_ZIP_PLAIN;
+			if (!strcmp(mime_name, "application/zip"))
+				zip_res = pload_zip_check(data, len, zip_mime, sizeof(zip_mime));
+
+			if (zip_res < 0 && !(p->expected_size && len >= p->expected_size)) {
+				if (!p->buf.data_len)
+					return pload_buffer_append(p, data, len);
+				return POM_OK;
+			}
+
+			if (zip_res == PLOAD_ZIP_MIMETYPE) {
+				mime_name = zip_mime;
+				struct pload_mime_type *pmt = NULL;
+				HASH_FIND(hh, pload_mime_types_hash, mime_name, strlen(mime_name), pmt);
+				if (pmt)
+					type = pmt->type;
+			}
+
+			if (zip_res == PLOAD_ZIP_CONTAINER) {
+				// The announced mime type tells which kind of document the container holds, else let libmagic find out
+				if (!pload_mime_type_is_generic(p->mime_type))
+					p->flags &= ~PLOAD_FLAG_NEED_MAGIC;
+			} else {
+				// The content wins over the announced mime type
+				registry_perf_inc(type->perf_signature_hits, 1);
+
+				if (!p->mime_type || strcmp(p->mime_type->name, mime_name)) {
+					// Replace the existing mime_type by the one of the signature
+					struct mime_type *mime_type = mime_type_parse(mime_name);
+					if (!mime_type) {
+						p->flags |= PLOAD_FLAG_IS_ERR;
+						return POM_OK;
+					}
+					if (p->mime_type)
+						mime_type_cleanup(p->mime_type);
+					p->mime_type = mime_type;
+				}
+				p->type = type;
+
+				p->flags &= ~PLOAD_FLAG_NEED_MAGIC;
+			}
+		}
+	}
+
 #ifdef HAVE_LIBMAGIC
 	if (p->flags & PLOAD_FLAG_NEED_MAGIC) {
 
@@ -797,6 +1234,8 @@ int pload_append(struct pload *p, void *data, size_t len) {
 			}
 		}
 
+		registry_perf_inc(pload_perf_magic_lookups, 1);
+
 		char *magic_mime_type_name = (char*) magic_buffer(magic_cookie, data, len);
 
 		if (!magic_mime_type_name) {
@@ -816,7 +1255,7 @@ int pload_append(struct pload *p, void *data, size_t len) {
 			if (!strcmp(magic_mime_type->name, p->mime_type->name)) {
 				// Mime types are the same, cleanup the magic one
 				mime_type_cleanup(magic_mime_type);
-			} else if (!strcmp(magic_mime_type->name, "binary") || !strcmp(magic_mime_type->name, "application/octet-stream") || !strcmp(magic_mime_type->name, "text/plain")) {
+			} else if (pload_mime_type_is_generic(magic_mime_type)) {
 				// Irrelevant mime types, keep the original one
 				mime_type_cleanup(magic_mime_type);
 			} else {
@@ -842,6 +1281,9 @@ int pload_append(struct pload *p, void *data, size_t len) {
 		p->flags &= ~PLOAD_FLAG_NEED_MAGIC;
 	}
 
+#else
+	// Nothing else can identify the payload
+	p->flags &= ~PLOAD_FLAG_NEED_MAGIC;
 #endif
 
 	if ((p->flags & PLOAD_FLAG_NEED_ANALYSIS) && (!p->type || !p->type->analyzer)) {
@@ -987,37 +1429,9 @@ int pload_append(struct pload *p, void *data, size_t len) {
 
 	}
 
-	struct pload_listener *tmp = p->listeners;
-	while (tmp) {
-		
-		if (tmp->reg->write(tmp->reg->obj, tmp->priv, data, len) != POM_OK) {
-			pomlog(POMLOG_WARN "Error while writing to a pload listener");
-			tmp->reg->close(tmp->reg->obj, tmp->priv);
-
-			struct pload_listener *todel = tmp;
-			tmp = tmp->next;
-
-			if (todel->prev)
-				todel->prev->next = todel->next;
-			else
-				p->listeners = todel->next;
-
-			if (todel->next)
-				todel->next->prev = todel->prev;
-
-			free(todel);
-
-		}
-		tmp = tmp->next;
-	}
-
+	pload_listeners_write(p, data, len);
 
-	if (p->buf.data) {
-		free(p->buf.data);
-		p->buf.data = NULL;
-		p->buf.data_len = 0;
-		p->buf.buf_size = 0;
-	}
+	pload_buffer_free(p);
 
 
 
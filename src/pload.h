@@ -38,6 +38,19 @@ struct pload_mime_type {
 	struct pload_mime_type *next;
 };
 
+// Result of the inspection of a zip archive
+#define PLOAD_ZIP_PLAIN		0
+#define PLOAD_ZIP_MIMETYPE	1
+#define PLOAD_ZIP_CONTAINER	2
+
+// Signature identifying a payload type from its first bytes
+struct pload_signature {
+	unsigned int offset, len;
+	unsigned char *value, *mask;
+	struct pload_mime_type *pmt;
+	struct pload_signature *next;
+};
+
 struct pload_listener_reg {
 
 	void *obj;
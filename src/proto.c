@@ -115,10 +115,11 @@ int proto_register(struct proto_reg_info *reg_info) {
 
 	proto->perf_pkts = registry_instance_add_perf(proto->reg_instance, "pkts", registry_perf_type_counter, "Number of packets processed", "pkts");
 	proto->perf_bytes = registry_instance_add_perf(proto->reg_instance, "bytes", registry_perf_type_counter, "Number of bytes processed", "bytes");
+	proto->perf_process_time = registry_instance_add_perf(proto->reg_instance, "process_time", registry_perf_type_histogram, "Time spent processing each packet, excluding the layers processed from within this one", NULL);
 	proto->perf_expt_pending = registry_instance_add_perf(proto->reg_instance, "expectations_pending", registry_perf_type_gauge, "Number of expectations pending", "expectations");
 	proto->perf_expt_matched = registry_instance_add_perf(proto->reg_instance, "expectations_matched", registry_perf_type_counter, "Number of expectations matched", "expectations");
 
-	if (!proto->perf_pkts || !proto->perf_bytes || !proto->perf_expt_pending || !proto->perf_expt_matched)
+	if (!proto->perf_pkts || !proto->perf_bytes || !proto->perf_process_time || !proto->perf_expt_pending || !proto->perf_expt_matched)
 		goto err_conntrack;
 
 	if (reg_info->init) {
@@ -154,86 +155,200 @@ err_proto:
 
 }
 
-int proto_process(struct packet *p, struct proto_process_stack *stack, unsigned int stack_index) {
+static uint32_t proto_expectation_hash(struct ptype *fwd_value, struct ptype *rev_value) {
 
-	struct proto_process_stack *s = &stack[stack_index];
+	// The hash is the same for both directions
+	uint32_t hash = 0;
+	if (fwd_value)
+		hash ^= ptype_get_hash(fwd_value);
+	if (rev_value)
+		hash ^= ptype_get_hash(rev_value);
 
-	struct proto *proto = s->proto;
+	return hash;
+}
 
-	if (!proto || !proto->info->process)
-		return PROTO_ERR;
-	int res = proto->info->process(proto->priv, p, stack, stack_index);
+// Find the lists that may contain expectations matching the packet, must be called with the expectation lock held
+static unsigned int proto_expectation_lists(struct proto *proto, struct proto_process_stack *s, struct proto_expectation ***lists) {
 
-	registry_perf_inc(proto->perf_pkts, 1);
-	registry_perf_inc(proto->perf_bytes, s->plen);
+	unsigned int count = 0;
 
-	if (res != PROTO_OK)
-		return res;
+	if (proto->expectations)
+		lists[count++] = &proto->expectations;
 
-	int matched = 0;
+	struct conntrack_info *ct_info = proto->info->ct_info;
+	if (!proto->expectation_table || !ct_info)
+		return count;
 
-	// Process the expectations !
-	pom_rwlock_rlock(&proto->expectation_lock);
-	struct proto_expectation *e = NULL;
-	for (e = proto->expectations; e; e = e->next) {
+	struct ptype *fwd_value = s->pkt_info->fields_value[ct_info->fwd_pkt_field_id];
+	struct ptype *rev_value = (ct_info->rev_pkt_field_id != -1 ? s->pkt_info->fields_value[ct_info->rev_pkt_field_id] : NULL);
 
-		if (e->flags & PROTO_EXPECTATION_FLAG_MATCHED) {
-			// Another thread already matched the expectation, continue
-			continue;
+	struct proto_expectation **table = proto->expectation_table;
+	struct proto_expectation **half = table + PROTO_EXPECTATION_TABLE_SIZE;
+	unsigned int mask = PROTO_EXPECTATION_TABLE_SIZE - 1;
+
+	if (fwd_value && rev_value)
+		lists[count++] = &table[proto_expectation_hash(fwd_value, rev_value) & mask];
+
+	uint32_t fwd_bucket = 0;
+	if (fwd_value) {
+		fwd_bucket = proto_expectation_hash(fwd_value, NULL) & mask;
+		lists[count++] = &half[fwd_bucket];
+	}
+
+	if (rev_value) {
+		uint32_t rev_bucket = proto_expectation_hash(NULL, rev_value) & mask;
+		if (!fwd_value || rev_bucket != fwd_bucket)
+			lists[count++] = &half[rev_bucket];
+	}
+
+	return count;
+}
+
+// Find the list where the expectation belongs, must be called with the expectation lock held
+static struct proto_expectation **proto_expectation_list_get(struct proto *proto, struct proto_expectation *e) {
+
+	struct ptype *fwd_value = e->tail->fields[POM_DIR_FWD];
+	struct ptype *rev_value = e->tail->fields[POM_DIR_REV];
+
+	if ((!fwd_value && !rev_value) || !proto->info->ct_info)
+		return &proto->expectations;
+
+	if (!proto->expectation_table) {
+		size_t size = sizeof(struct proto_expectation *) * PROTO_EXPECTATION_TABLE_SIZE * 2;
+		proto->expectation_table = malloc(size);
+		if (!proto->expectation_table) {
+			pom_oom(size);
+			return NULL;
 		}
-		
-		// Bit one means it matches the forward direction
-		// Bit two means it matches the reverse direction
+		memset(proto->expectation_table, 0, size);
+	}
 
-		int expt_dir = 3;
+	uint32_t bucket = proto_expectation_hash(fwd_value, rev_value) & (PROTO_EXPECTATION_TABLE_SIZE - 1);
 
-		struct proto_expectation_stack *es = e->tail;
-		int stack_index_tmp = stack_index;
-		while (es) {
+	if (fwd_value && rev_value)
+		return &proto->expectation_table[bucket];
 
-			struct proto_process_stack *s_tmp = &stack[stack_index_tmp];
+	return &proto->expectation_table[PROTO_EXPECTATION_TABLE_SIZE + bucket];
+}
 
-			if (s_tmp->proto != es->proto) {
-				expt_dir = 0;
-				break;
-			}
+// Must be called with the expectation write lock held
+static void proto_expectation_unlink(struct proto_expectation *e) {
 
-			if (!es->fields[POM_DIR_FWD] && !es->fields[POM_DIR_REV]) {
-				// Nothing to match for this proto
-				continue;
-			}
+	if (e->next)
+		e->next->prev = e->prev;
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		*e->list = e->next;
 
-			struct ptype *fwd_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->fwd_pkt_field_id];
-			struct ptype *rev_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->rev_pkt_field_id];
+	e->next = NULL;
+	e->prev = NULL;
+	e->list = NULL;
+}
 
-			if (expt_dir & 1) {
-				if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], fwd_value)) ||
-					(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], rev_value))) {
-					expt_dir &= ~1; // It doesn't match in the forward direction
-				}
-			}
+// Returns 1 if the expectation was matched by this packet
+static int proto_expectation_match(struct proto_expectation *e, struct proto_process_stack *stack, unsigned int stack_index) {
 
-			if (expt_dir & 2) {
-				if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], rev_value)) ||
-					(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], fwd_value))) {
-					expt_dir &= ~2;
-				}
-			}
+	if (e->flags & PROTO_EXPECTATION_FLAG_MATCHED) {
+		// Another thread already matched the expectation, continue
+		return 0;
+	}
 
-			if (!expt_dir)
-				break;
+	// Bit one means it matches the forward direction
+	// Bit two means it matches the reverse direction
 
-			es = es->prev;
-			stack_index_tmp--;
+	int expt_dir = 3;
+
+	struct proto_expectation_stack *es;
+	int stack_index_tmp = stack_index;
+	for (es = e->tail; es; es = es->prev, stack_index_tmp--) {
+
+		struct proto_process_stack *s_tmp = &stack[stack_index_tmp];
+
+		if (s_tmp->proto != es->proto)
+			return 0;
+
+		if (!es->fields[POM_DIR_FWD] && !es->fields[POM_DIR_REV]) {
+			// Nothing to match for this proto
+			continue;
+		}
+
+		struct ptype *fwd_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->fwd_pkt_field_id];
+		struct ptype *rev_value = s_tmp->pkt_info->fields_value[s_tmp->proto->info->ct_info->rev_pkt_field_id];
+
+		if (expt_dir & 1) {
+			if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], fwd_value)) ||
+				(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], rev_value))) {
+				expt_dir &= ~1; // It doesn't match in the forward direction
+			}
 		}
 
-		if (expt_dir) {
-			// It matched
-			if (!(__sync_fetch_and_or(&e->flags, PROTO_EXPECTATION_FLAG_MATCHED) & PROTO_EXPECTATION_FLAG_MATCHED)) {
-				// Something matched
-				matched++;
+		if (expt_dir & 2) {
+			if ((es->fields[POM_DIR_FWD] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_FWD], rev_value)) ||
+				(es->fields[POM_DIR_REV] && !ptype_compare_val(PTYPE_OP_EQ, es->fields[POM_DIR_REV], fwd_value))) {
+				expt_dir &= ~2;
 			}
 		}
+
+		if (!expt_dir)
+			return 0;
+	}
+
+	// It matched
+	if (__sync_fetch_and_or(&e->flags, PROTO_EXPECTATION_FLAG_MATCHED) & PROTO_EXPECTATION_FLAG_MATCHED)
+		return 0;
+
+	return 1;
+}
+
+// Time spent in the layers processed from within the current one
+static __thread uint64_t proto_process_nested_time = 0;
+
+int proto_process(struct packet *p, struct proto_process_stack *stack, unsigned int stack_index) {
+
+	struct proto_process_stack *s = &stack[stack_index];
+
+	struct proto *proto = s->proto;
+
+	if (!proto || !proto->info->process)
+		return PROTO_ERR;
+
+	// Some protocols process the next layers themselves, don't account for their time
+	uint64_t nested_time = proto_process_nested_time;
+	proto_process_nested_time = 0;
+
+	uint64_t start = core_perf_layer_start();
+	int res = proto->info->process(proto->priv, p, stack, stack_index);
+	if (start) {
+		uint64_t elapsed = registry_perf_histogram_start() - start;
+		registry_perf_histogram_record(proto->perf_process_time, elapsed - proto_process_nested_time);
+		nested_time += elapsed;
+	}
+	proto_process_nested_time = nested_time;
+
+	registry_perf_inc(proto->perf_pkts, 1);
+	registry_perf_inc(proto->perf_bytes, s->plen);
+
+	if (res != PROTO_OK)
+		return res;
+
+	int matched = 0;
+
+	// Process the expectations !
+	pom_rwlock_rlock(&proto->expectation_lock);
+
+	if (!proto->expectations && !proto->expectation_table) {
+		pom_rwlock_unlock(&proto->expectation_lock);
+		return res;
+	}
+
+	struct proto_expectation **lists[PROTO_EXPECTATION_LISTS];
+	unsigned int i, list_count = proto_expectation_lists(proto, s, lists);
+
+	struct proto_expectation *e = NULL;
+	for (i = 0; i < list_count; i++) {
+		for (e = *lists[i]; e; e = e->next)
+			matched += proto_expectation_match(e, stack, stack_index);
 	}
 	pom_rwlock_unlock(&proto->expectation_lock);
 
@@ -245,65 +360,62 @@ int proto_process(struct packet *p, struct proto_process_stack *stack, unsigned
 
 	// Relock with write access
 	pom_rwlock_wlock(&proto->expectation_lock);
-	e = proto->expectations;
-	while (e) {
+	for (i = 0; i < list_count; i++) {
+		e = *lists[i];
+		while (e) {
 
-		struct proto_expectation *cur = e;
-		e = e->next;
+			struct proto_expectation *cur = e;
+			e = e->next;
 
-		if (!(cur->flags & PROTO_EXPECTATION_FLAG_MATCHED))
-			continue;
+			if (!(cur->flags & PROTO_EXPECTATION_FLAG_MATCHED))
+				continue;
 
-		// Remove the expectation from the conntrack
-		if (cur->next)
-			cur->next->prev = cur->prev;
-		if (cur->prev)
-			cur->prev->next = cur->next;
-		else
-			proto->expectations = cur->next;
+			// Remove the expectation from its list
+			proto_expectation_unlink(cur);
 
-		// Remove matched and queued flags
-		__sync_fetch_and_and(&cur->flags, ~(PROTO_EXPECTATION_FLAG_MATCHED | PROTO_EXPECTATION_FLAG_QUEUED));
+			// Remove matched and queued flags
+			__sync_fetch_and_and(&cur->flags, ~(PROTO_EXPECTATION_FLAG_MATCHED | PROTO_EXPECTATION_FLAG_QUEUED));
 
-		struct proto_process_stack *s_next = &stack[stack_index + 1];
-		s_next->proto = cur->proto;
+			struct proto_process_stack *s_next = &stack[stack_index + 1];
+			s_next->proto = cur->proto;
 
-		if (conntrack_get_unique_from_parent(stack, stack_index + 1) != POM_OK) {
-			proto_expectation_cleanup(cur);
-			continue;
-		}
+			if (conntrack_get_unique_from_parent(stack, stack_index + 1) != POM_OK) {
+				proto_expectation_cleanup(cur);
+				continue;
+			}
 
-		if (!s_next->ce->priv) {
-			s_next->ce->priv = cur->priv;
-			// Prevent cleanup of private data while cleaning the expectation
-			cur->priv = NULL;
-		}
+			if (!s_next->ce->priv) {
+				s_next->ce->priv = cur->priv;
+				// Prevent cleanup of private data while cleaning the expectation
+				cur->priv = NULL;
+			}
 
 
-		if (cur->session) {
-			if (conntrack_session_bind(s_next->ce, cur->session)) {
-				proto_expectation_cleanup(cur);
-				continue;
+			if (cur->session) {
+				if (conntrack_session_bind(s_next->ce, cur->session)) {
+					proto_expectation_cleanup(cur);
+					continue;
+				}
 			}
-		}
 
-		registry_perf_dec(cur->proto->perf_expt_pending, 1);
-		registry_perf_inc(cur->proto->perf_expt_matched, 1);
+			registry_perf_dec(cur->proto->perf_expt_pending, 1);
+			registry_perf_inc(cur->proto->perf_expt_matched, 1);
 
-		if (cur->match_callback) {
-			// Call the callback with the conntrack locked
-			cur->match_callback(cur, cur->callback_priv, s_next->ce);
-			// Nullify callback_priv so it doesn't get cleaned up
-			cur->callback_priv = NULL;
-		}
+			if (cur->match_callback) {
+				// Call the callback with the conntrack locked
+				cur->match_callback(cur, cur->callback_priv, s_next->ce);
+				// Nullify callback_priv so it doesn't get cleaned up
+				cur->callback_priv = NULL;
+			}
 
-		if (cur->expiry) {
-			// The expectation was added using 'add_and_cleanup' function
-			proto_expectation_cleanup(cur);
-		}
+			if (cur->expiry) {
+				// The expectation was added using 'add_and_cleanup' function
+				proto_expectation_cleanup(cur);
+			}
 
-		conntrack_unlock(s_next->ce);
+			conntrack_unlock(s_next->ce);
 
+		}
 	}
 	pom_rwlock_unlock(&proto->expectation_lock);
 
@@ -390,6 +502,9 @@ int proto_unregister(char *name) {
 
 	mod_refcount_dec(proto->info->mod);
 
+	if (proto->expectation_table)
+		free(proto->expectation_table);
+
 	free(proto);
 
 	return POM_OK;
@@ -409,10 +524,16 @@ int proto_finish() {
 
 	// Cleanup the expectations first
 	for (proto = proto_head; proto; proto = proto->next) {
-		while (proto->expectations) {
-			struct proto_expectation *e = proto->expectations;
-			proto->expectations = e->next;
-			proto_expectation_cleanup(e);
+		while (proto->expectations)
+			proto_expectation_cleanup(proto->expectations);
+
+		if (!proto->expectation_table)
+			continue;
+
+		unsigned int i;
+		for (i = 0; i < PROTO_EXPECTATION_TABLE_SIZE * 2; i++) {
+			while (proto->expectation_table[i])
+				proto_expectation_cleanup(proto->expectation_table[i]);
 		}
 	}
 
@@ -436,6 +557,8 @@ int proto_cleanup() {
 		mod_refcount_dec(proto->info->mod);
 	}
 
+	conntrack_readers_cleanup();
+
 	while (proto_head) {
 		proto = proto_head;
 		proto_head = proto->next;
@@ -444,6 +567,8 @@ int proto_cleanup() {
 		if (res)
 			pomlog(POMLOG_ERR "Error while destroying the listners lock : %s", pom_strerror(res));
 
+		if (proto->expectation_table)
+			free(proto->expectation_table);
 
 		free(proto);
 	}
@@ -765,13 +890,22 @@ int proto_expectation_add(struct proto_expectation *e) {
 	struct proto *proto = e->tail->proto;
 	pom_rwlock_wlock(&proto->expectation_lock);
 
+	// The values of the last proto must not be changed while the expectation is queued
+	struct proto_expectation **list = proto_expectation_list_get(proto, e);
+	if (!list) {
+		pom_rwlock_unlock(&proto->expectation_lock);
+		return POM_ERR;
+	}
+
 	__sync_fetch_and_or(&e->flags, PROTO_EXPECTATION_FLAG_QUEUED);
 
-	e->next = proto->expectations;
+	e->list = list;
+	e->prev = NULL;
+	e->next = *list;
 	if (e->next)
 		e->next->prev = e;
 
-	proto->expectations = e;
+	*list = e;
 
 	pom_rwlock_unlock(&proto->expectation_lock);
 
@@ -790,18 +924,13 @@ int proto_expectation_remove(struct proto_expectation *e) {
 		return POM_ERR;
 	}
 
-	if (!e->next && !e->prev && proto->expectations != e) {
+	if (!e->list) {
 		// The expectation is not queued
 		pom_rwlock_unlock(&proto->expectation_lock);
 		return POM_OK;
 	}
 
-	if (e->next)
-		e->next->prev = e->prev;
-	if (e->prev)
-		e->prev->next = e->next;
-	else
-		proto->expectations = e->next;
+	proto_expectation_unlink(e);
 
 	__sync_fetch_and_and(&e->flags, ~PROTO_EXPECTATION_FLAG_QUEUED);
 
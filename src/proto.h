@@ -32,6 +32,12 @@
 #define PROTO_EXPECTATION_FLAG_QUEUED	0x1
 #define PROTO_EXPECTATION_FLAG_MATCHED	0x2
 
+// Number of buckets of each expectation table, must be a power of 2
+#define PROTO_EXPECTATION_TABLE_SIZE	1024
+
+// Lists to look into for each packet : no value, both values and one value in each direction
+#define PROTO_EXPECTATION_LISTS		4
+
 struct proto {
 
 	struct proto_reg_info *info;
@@ -49,12 +55,16 @@ struct proto {
 	struct proto_packet_listener *payload_listeners;
 
 	pthread_rwlock_t expectation_lock;
+	// Expectations without any value to match for this proto
 	struct proto_expectation *expectations;
+	// Expectations with both values followed by the ones with a single value, indexed by their hash
+	struct proto_expectation **expectation_table;
 
 	struct proto_number_class *number_class;
 
 	struct registry_perf *perf_pkts;
 	struct registry_perf *perf_bytes;
+	struct registry_perf *perf_process_time;
 	struct registry_perf *perf_conn_cur;
 	struct registry_perf *perf_conn_tot;
 	struct registry_perf *perf_conn_hash_col;
@@ -87,6 +97,7 @@ struct proto_expectation {
 	struct timer *expiry;
 	struct conntrack_session *session;
 	struct proto_expectation *prev, *next;
+	struct proto_expectation **list;
 	int flags;
 	void (*match_callback) (struct proto_expectation *e, void *callback_priv, struct conntrack_entry *ce);
 };
@@ -58,11 +58,29 @@ static size_t registry_uid_table_size = 0;
 static unsigned int registry_uid_seedp = 0;
 static uint32_t registry_serial = 0, registry_classes_serial = 0, registry_config_serial = 0;
 
+// Counters and gauges are updated in per thread shards and summed when read
+static pthread_mutex_t registry_perf_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct registry_perf_shard *registry_perf_shards = NULL;
+static __thread struct registry_perf_shard *registry_perf_thread_shard = NULL;
+static pthread_key_t registry_perf_shard_key; // Releases the shard of threads which exit without cleaning up
+static unsigned int registry_perf_ids = 0;
+static unsigned int *registry_perf_free_ids = NULL;
+static unsigned int registry_perf_free_ids_count = 0, registry_perf_free_ids_size = 0;
+
+static void registry_perf_cleanup(struct registry_perf *p);
+static void registry_perf_shard_release(void *shard);
+
 int registry_init() {
 
 	if (pom_mutex_init_type(&registry_global_lock, PTHREAD_MUTEX_RECURSIVE) != POM_OK)
 		return POM_ERR;
 
+	int res = pthread_key_create(&registry_perf_shard_key, registry_perf_shard_release);
+	if (res) {
+		pomlog(POMLOG_ERR "Error while creating the perf shard key : %s", pom_strerror(res));
+		return POM_ERR;
+	}
+
 
 	// Init random numbers for UIDs
 	registry_uid_seedp = (unsigned int) time(NULL) + (unsigned int) pthread_self();
@@ -81,6 +99,22 @@ int registry_cleanup() {
 	pthread_mutex_destroy(&registry_global_lock);
 
 	free(registry_uid_table);
+
+	pthread_key_delete(registry_perf_shard_key);
+
+	while (registry_perf_shards) {
+		struct registry_perf_shard *s = registry_perf_shards;
+		registry_perf_shards = s->next;
+		free(s->values);
+		free(s);
+	}
+	registry_perf_thread_shard = NULL;
+
+	free(registry_perf_free_ids);
+	registry_perf_free_ids = NULL;
+	registry_perf_free_ids_count = 0;
+	registry_perf_free_ids_size = 0;
+	registry_perf_ids = 0;
 	
 	return POM_OK;
 }
@@ -189,19 +223,7 @@ int registry_remove_class(struct registry_class *c) {
 	while (c->perfs) {
 		struct registry_perf *p = c->perfs;
 		c->perfs = p->next;
-
-		if (p->update_hook) {
-			int res = pthread_mutex_destroy(&p->hook_lock);
-			if (res) {
-				pomlog(POMLOG_ERR "Error while destroying perf hook lock : %s", pom_strerror(errno));
-				abort();
-			}
-		}
-
-		free(p->name);
-		free(p->description);
-		free(p->unit);
-		free(p);
+		registry_perf_cleanup(p);
 	}
 
 	free(c->name);
@@ -356,19 +378,7 @@ int registry_remove_instance(struct registry_instance *i) {
 	while (i->perfs) {
 		struct registry_perf *p = i->perfs;
 		i->perfs = p->next;
-
-		if (p->update_hook) {
-			int res = pthread_mutex_destroy(&p->hook_lock);
-			if (res) {
-				pomlog(POMLOG_ERR "Error while destroying perf hook lock : %s", pom_strerror(errno));
-				abort();
-			}
-		}
-
-		free(p->name);
-		free(p->description);
-		free(p->unit);
-		free(p);
+		registry_perf_cleanup(p);
 	}
 
 	if (i->prev)
@@ -1482,6 +1492,8 @@ struct registry_perf *registry_perf_alloc(const char *name, enum registry_perf_t
 
 	if (type == registry_perf_type_timeticks)
 		unit = "usec";
+	else if (type == registry_perf_type_histogram)
+		unit = "nsec";
 
 	perf->unit = strdup(unit);
 	if (!perf->unit) {
@@ -1494,9 +1506,196 @@ struct registry_perf *registry_perf_alloc(const char *name, enum registry_perf_t
 
 	perf->type = type;
 
+	if (type == registry_perf_type_histogram) {
+		size_t size = sizeof(uint64_t) * REGISTRY_PERF_HISTOGRAM_SLOTS;
+		perf->offsets = malloc(size);
+		if (!perf->offsets) {
+			free(perf->name);
+			free(perf->description);
+			free(perf->unit);
+			free(perf);
+			pom_oom(size);
+			return NULL;
+		}
+		memset(perf->offsets, 0, size);
+
+		// Histograms need consecutive slots in the thread shards
+		pom_mutex_lock(&registry_perf_shards_lock);
+		perf->id = registry_perf_ids;
+		registry_perf_ids += REGISTRY_PERF_HISTOGRAM_SLOTS;
+		pom_mutex_unlock(&registry_perf_shards_lock);
+
+	} else if (type != registry_perf_type_timeticks) {
+		// Get a slot in the thread shards
+		pom_mutex_lock(&registry_perf_shards_lock);
+		if (registry_perf_free_ids_count)
+			perf->id = registry_perf_free_ids[--registry_perf_free_ids_count];
+		else
+			perf->id = registry_perf_ids++;
+		pom_mutex_unlock(&registry_perf_shards_lock);
+	}
+
 	return perf;
 }
 
+static void registry_perf_free_id(unsigned int id) {
+
+	// Must be called with the shards lock held
+
+	// The next perf using this slot must start from 0
+	struct registry_perf_shard *s;
+	for (s = registry_perf_shards; s; s = s->next) {
+		if (id < s->size)
+			s->values[id] = 0;
+	}
+
+	if (registry_perf_free_ids_count >= registry_perf_free_ids_size) {
+		unsigned int size = (registry_perf_free_ids_size ? registry_perf_free_ids_size * 2 : REGISTRY_PERF_SHARD_MIN_SIZE);
+		unsigned int *ids = realloc(registry_perf_free_ids, sizeof(unsigned int) * size);
+		if (ids) {
+			registry_perf_free_ids = ids;
+			registry_perf_free_ids_size = size;
+		} else {
+			// The slot won't be reused
+			pom_oom(sizeof(unsigned int) * size);
+		}
+	}
+
+	if (registry_perf_free_ids_count < registry_perf_free_ids_size)
+		registry_perf_free_ids[registry_perf_free_ids_count++] = id;
+}
+
+static void registry_perf_cleanup(struct registry_perf *p) {
+
+	if (p->update_hook) {
+		int res = pthread_mutex_destroy(&p->hook_lock);
+		if (res) {
+			pomlog(POMLOG_ERR "Error while destroying perf hook lock : %s", pom_strerror(errno));
+			abort();
+		}
+	}
+
+	if (p->type == registry_perf_type_histogram) {
+		// The slots of histograms are reused one by one by the other perfs
+		pom_mutex_lock(&registry_perf_shards_lock);
+		unsigned int i;
+		for (i = 0; i < REGISTRY_PERF_HISTOGRAM_SLOTS; i++)
+			registry_perf_free_id(p->id + i);
+		pom_mutex_unlock(&registry_perf_shards_lock);
+		free(p->offsets);
+	} else if (p->type != registry_perf_type_timeticks) {
+		pom_mutex_lock(&registry_perf_shards_lock);
+		registry_perf_free_id(p->id);
+		pom_mutex_unlock(&registry_perf_shards_lock);
+	}
+
+	free(p->name);
+	free(p->description);
+	free(p->unit);
+	free(p);
+}
+
+static struct registry_perf_shard *registry_perf_shard_get(unsigned int id) {
+
+	struct registry_perf_shard *s = registry_perf_thread_shard;
+
+	pom_mutex_lock(&registry_perf_shards_lock);
+
+	if (!s) {
+		// Reuse the shard of a thread which exited
+		for (s = registry_perf_shards; s && s->in_use; s = s->next);
+
+		if (!s) {
+			s = malloc(sizeof(struct registry_perf_shard));
+			if (!s) {
+				pom_mutex_unlock(&registry_perf_shards_lock);
+				pom_oom(sizeof(struct registry_perf_shard));
+				return NULL;
+			}
+			memset(s, 0, sizeof(struct registry_perf_shard));
+			s->next = registry_perf_shards;
+			registry_perf_shards = s;
+		}
+
+		s->in_use = 1;
+		registry_perf_thread_shard = s;
+		pthread_setspecific(registry_perf_shard_key, s);
+	}
+
+	if (id >= s->size) {
+		// Readers hold the lock so we can move the values
+		unsigned int size = (s->size ? s->size : REGISTRY_PERF_SHARD_MIN_SIZE);
+		while (size <= id)
+			size <<= 1;
+
+		uint64_t *values = realloc(s->values, sizeof(uint64_t) * size);
+		if (!values) {
+			pom_mutex_unlock(&registry_perf_shards_lock);
+			pom_oom(sizeof(uint64_t) * size);
+			return NULL;
+		}
+		memset(values + s->size, 0, sizeof(uint64_t) * (size - s->size));
+		s->values = values;
+		s->size = size;
+	}
+
+	pom_mutex_unlock(&registry_perf_shards_lock);
+
+	return s;
+}
+
+static inline void registry_perf_add(struct registry_perf *p, uint64_t val) {
+
+	struct registry_perf_shard *s = registry_perf_thread_shard;
+
+	if (!s || p->id >= s->size) {
+		s = registry_perf_shard_get(p->id);
+		if (!s) {
+			__sync_fetch_and_add(&p->value, val);
+			return;
+		}
+	}
+
+	// Only this thread writes to its shard
+	__atomic_store_n(&s->values[p->id], s->values[p->id] + val, __ATOMIC_RELAXED);
+}
+
+static uint64_t registry_perf_shards_sum(struct registry_perf *p) {
+
+	// Must be called with the shards lock held
+	uint64_t value = 0;
+
+	struct registry_perf_shard *s;
+	for (s = registry_perf_shards; s; s = s->next) {
+		if (p->id < s->size)
+			value += __atomic_load_n(&s->values[p->id], __ATOMIC_RELAXED);
+	}
+
+	return value;
+}
+
+static void registry_perf_shard_release(void *shard) {
+
+	struct registry_perf_shard *s = shard;
+
+	// Another thread can continue with the values of this one
+	pom_mutex_lock(&registry_perf_shards_lock);
+	s->in_use = 0;
+	pom_mutex_unlock(&registry_perf_shards_lock);
+}
+
+void registry_perf_thread_cleanup() {
+
+	struct registry_perf_shard *s = registry_perf_thread_shard;
+	if (!s)
+		return;
+
+	registry_perf_shard_release(s);
+	pthread_setspecific(registry_perf_shard_key, NULL);
+
+	registry_perf_thread_shard = NULL;
+}
+
 struct registry_perf *registry_class_add_perf(struct registry_class *c, const char *name, enum registry_perf_type type, const char *description, const char *unit) {
 	
 	struct registry_perf *p = registry_perf_alloc(name, type, description, unit);
@@ -1527,8 +1726,8 @@ struct registry_perf *registry_instance_add_perf(struct registry_instance *i, co
 
 void registry_perf_set_update_hook(struct registry_perf *p, int (*update_hook) (uint64_t *cur_val, void *priv), void *hook_priv) {
 
-	if (p->type == registry_perf_type_timeticks) {
-		pomlog(POMLOG_ERR "Trying to set an update hook on a timeticks perf");
+	if (p->type == registry_perf_type_timeticks || p->type == registry_perf_type_histogram) {
+		pomlog(POMLOG_ERR "Trying to set an update hook on a timeticks or histogram perf");
 		return;
 	}
 
@@ -1560,15 +1759,15 @@ void registry_perf_set_update_hook(struct registry_perf *p, int (*update_hook) (
 
 void registry_perf_inc(struct registry_perf *p, uint64_t val) {
 
-	if (p->type == registry_perf_type_timeticks) {
-		pomlog(POMLOG_ERR "Trying to increase a perf item of type timeticks");
+	if (p->type == registry_perf_type_timeticks || p->type == registry_perf_type_histogram) {
+		pomlog(POMLOG_ERR "Trying to increase a perf item of type timeticks or histogram");
 		return;
 	} else if (p->update_hook) {
 		pomlog(POMLOG_ERR "Trying to increase a perf item with an update hook");
 		return;
 	}
 
-	__sync_fetch_and_add(&p->value, val);
+	registry_perf_add(p, val);
 }
 
 void registry_perf_dec(struct registry_perf *p, uint64_t val) {
@@ -1581,7 +1780,7 @@ void registry_perf_dec(struct registry_perf *p, uint64_t val) {
 		return;
 	}
 
-	__sync_fetch_and_sub(&p->value, val);
+	registry_perf_add(p, -val);
 }
 
 void registry_perf_timeticks_stop(struct registry_perf *p) {
@@ -1623,10 +1822,111 @@ void registry_perf_timeticks_restart(struct registry_perf *p) {
 	p->value = new_val;
 }
 
+static inline unsigned int registry_perf_histogram_bucket(uint64_t val) {
+
+	if (val < (1 << REGISTRY_PERF_HISTOGRAM_SUB_BITS))
+		return val;
+
+	unsigned int msb = 63 - __builtin_clzll(val);
+	if (msb >= REGISTRY_PERF_HISTOGRAM_MAX_BITS)
+		return REGISTRY_PERF_HISTOGRAM_BUCKETS - 1;
+
+	// The group is given by the position of the msb, the bucket within it by the following bits
+	unsigned int shift = msb - REGISTRY_PERF_HISTOGRAM_SUB_BITS;
+	return ((shift + 1) << REGISTRY_PERF_HISTOGRAM_SUB_BITS) + (val >> shift) - (1 << REGISTRY_PERF_HISTOGRAM_SUB_BITS);
+}
+
+uint64_t registry_perf_histogram_bucket_min(unsigned int bucket) {
+
+	if (bucket < (1 << REGISTRY_PERF_HISTOGRAM_SUB_BITS))
+		return bucket;
+
+	unsigned int group = bucket >> REGISTRY_PERF_HISTOGRAM_SUB_BITS;
+	uint64_t sub = bucket & ((1 << REGISTRY_PERF_HISTOGRAM_SUB_BITS) - 1);
+
+	return (sub + (1 << REGISTRY_PERF_HISTOGRAM_SUB_BITS)) << (group - 1);
+}
+
+uint64_t registry_perf_histogram_start() {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000LLU + ts.tv_nsec;
+}
+
+void registry_perf_histogram_stop(struct registry_perf *p, uint64_t start) {
+
+	registry_perf_histogram_record(p, registry_perf_histogram_start() - start);
+}
+
+void registry_perf_histogram_record(struct registry_perf *p, uint64_t val) {
+
+	if (p->type != registry_perf_type_histogram) {
+		pomlog(POMLOG_ERR "Trying to record a value in a perf item which is not a histogram");
+		return;
+	}
+
+	unsigned int last = p->id + REGISTRY_PERF_HISTOGRAM_SLOTS - 1;
+
+	struct registry_perf_shard *s = registry_perf_thread_shard;
+	if (!s || last >= s->size) {
+		s = registry_perf_shard_get(last);
+		if (!s)
+			return;
+	}
+
+	// Only this thread writes to its shard
+	uint64_t *values = s->values + p->id;
+	unsigned int bucket = registry_perf_histogram_bucket(val);
+	__atomic_store_n(&values[bucket], values[bucket] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&values[REGISTRY_PERF_HISTOGRAM_BUCKETS], values[REGISTRY_PERF_HISTOGRAM_BUCKETS] + val, __ATOMIC_RELAXED);
+}
+
+static void registry_perf_histogram_sum(struct registry_perf *p, uint64_t *values) {
+
+	// Must be called with the shards lock held
+	memcpy(values, p->offsets, sizeof(uint64_t) * REGISTRY_PERF_HISTOGRAM_SLOTS);
+
+	struct registry_perf_shard *s;
+	for (s = registry_perf_shards; s; s = s->next) {
+		if (p->id + REGISTRY_PERF_HISTOGRAM_SLOTS > s->size)
+			continue;
+
+		unsigned int i;
+		for (i = 0; i < REGISTRY_PERF_HISTOGRAM_SLOTS; i++)
+			values[i] += __atomic_load_n(&s->values[p->id + i], __ATOMIC_RELAXED);
+	}
+}
+
+uint64_t registry_perf_histogram_getval(struct registry_perf *p, uint64_t *buckets, uint64_t *sum) {
+
+	// Buckets must hold REGISTRY_PERF_HISTOGRAM_BUCKETS values, returns the number of values recorded
+	uint64_t values[REGISTRY_PERF_HISTOGRAM_SLOTS];
+
+	pom_mutex_lock(&registry_perf_shards_lock);
+	registry_perf_histogram_sum(p, values);
+	pom_mutex_unlock(&registry_perf_shards_lock);
+
+	uint64_t count = 0;
+	unsigned int i;
+	for (i = 0; i < REGISTRY_PERF_HISTOGRAM_BUCKETS; i++)
+		count += values[i];
+
+	if (buckets)
+		memcpy(buckets, values, sizeof(uint64_t) * REGISTRY_PERF_HISTOGRAM_BUCKETS);
+
+	if (sum)
+		*sum = values[REGISTRY_PERF_HISTOGRAM_BUCKETS];
+
+	return count;
+}
+
 uint64_t registry_perf_getval(struct registry_perf *p) {
 
-	// Since we have memory barrier for updating the value
-	// I don't think there is the need for one for simply reading it
+	if (p->type == registry_perf_type_histogram)
+		return registry_perf_histogram_getval(p, NULL, NULL);
+
 	if (p->type != registry_perf_type_timeticks) {
 
 		if (p->update_hook) {
@@ -1634,9 +1934,14 @@ uint64_t registry_perf_getval(struct registry_perf *p) {
 			if (p->update_hook((uint64_t*)&p->value, p->hook_priv) != POM_OK)
 				pomlog(POMLOG_WARN "Warning: update of performance %s value failed.", p->name);
 			pom_mutex_unlock(&p->hook_lock);
+			return p->value;
 		}
 
-		return p->value;
+		pom_mutex_lock(&registry_perf_shards_lock);
+		uint64_t value = p->value + registry_perf_shards_sum(p);
+		pom_mutex_unlock(&registry_perf_shards_lock);
+
+		return value;
 
 	}
 
@@ -1658,7 +1963,16 @@ void registry_perf_reset(struct registry_perf *p) {
 		pom_mutex_lock(&p->hook_lock);
 		p->value = 0;
 		pom_mutex_unlock(&p->hook_lock);
-	} if (p->type == registry_perf_type_timeticks) {
+	} if (p->type == registry_perf_type_histogram) {
+		uint64_t values[REGISTRY_PERF_HISTOGRAM_SLOTS];
+		pom_mutex_lock(&registry_perf_shards_lock);
+		memset(p->offsets, 0, sizeof(uint64_t) * REGISTRY_PERF_HISTOGRAM_SLOTS);
+		registry_perf_histogram_sum(p, values);
+		unsigned int i;
+		for (i = 0; i < REGISTRY_PERF_HISTOGRAM_SLOTS; i++)
+			p->offsets[i] = -values[i];
+		pom_mutex_unlock(&registry_perf_shards_lock);
+	} else if (p->type == registry_perf_type_timeticks) {
 		uint64_t running = p->value & REGISTRY_PERF_TIMETICKS_STARTED;
 		if (running) {
 			p->value = pom_gettimeofday() + REGISTRY_PERF_TIMETICKS_STARTED;
@@ -1666,8 +1980,11 @@ void registry_perf_reset(struct registry_perf *p) {
 			p->value = 0;
 		}
 
-	}else {
-		p->value = 0;
+	} else {
+		// The shards belong to their threads, offset their sum instead
+		pom_mutex_lock(&registry_perf_shards_lock);
+		p->value = -registry_perf_shards_sum(p);
+		pom_mutex_unlock(&registry_perf_shards_lock);
 	}
 }
 
@@ -1679,14 +1996,14 @@ void registry_perf_reset_all() {
 		
 		struct registry_perf *p;
 		for (p = ctmp->perfs; p; p = p->next) {
-			if (p->type == registry_perf_type_counter)
+			if (p->type == registry_perf_type_counter || p->type == registry_perf_type_histogram)
 				registry_perf_reset(p);
 		}
 
 		struct registry_instance *inst;
 		for (inst = ctmp->instances; inst; inst = inst->next) {
 			for (p = inst->perfs; p; p = p->next) {
-				if (p->type == registry_perf_type_counter)
+				if (p->type == registry_perf_type_counter || p->type == registry_perf_type_histogram)
 					registry_perf_reset(p);
 			}
 		}
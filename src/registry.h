@@ -32,6 +32,18 @@
 // Use the msb for started/stopped flag
 #define REGISTRY_PERF_TIMETICKS_STARTED (1LLU << 63)
 
+// Initial number of values in each thread's shard
+#define REGISTRY_PERF_SHARD_MIN_SIZE	256
+
+// Histograms use log-linear buckets : each power of 2 is split in (1 << SUB_BITS) linear buckets
+// Values of MAX_BITS bits or more (68 seconds in nsec) are accounted in the last bucket
+#define REGISTRY_PERF_HISTOGRAM_SUB_BITS	3
+#define REGISTRY_PERF_HISTOGRAM_MAX_BITS	36
+#define REGISTRY_PERF_HISTOGRAM_BUCKETS		((REGISTRY_PERF_HISTOGRAM_MAX_BITS - REGISTRY_PERF_HISTOGRAM_SUB_BITS + 1) << REGISTRY_PERF_HISTOGRAM_SUB_BITS)
+
+// Values used in the shards by a histogram, the buckets followed by the sum of the recorded values
+#define REGISTRY_PERF_HISTOGRAM_SLOTS		(REGISTRY_PERF_HISTOGRAM_BUCKETS + 1)
+
 struct registry_perf {
 
 	char *name;
@@ -39,6 +51,8 @@ struct registry_perf {
 	char *unit;
 	enum registry_perf_type type;
 	volatile uint64_t value;
+	unsigned int id; // Index of the value in the thread shards
+	uint64_t *offsets; // Offset of each slot of a histogram when it was reset
 	struct registry_perf *next;
 
 	int (*update_hook) (uint64_t *cur_val, void *priv);
@@ -46,6 +60,14 @@ struct registry_perf {
 	pthread_mutex_t hook_lock;
 };
 
+// Values of the counters and gauges updated by a thread
+struct registry_perf_shard {
+	uint64_t *values; // Indexed by the perf id, gauges wrap around when decreased
+	unsigned int size;
+	int in_use;
+	struct registry_perf_shard *next;
+};
+
 enum registry_param_info_type {
 
 	registry_param_info_type_none = 0,
@@ -180,6 +202,8 @@ int registry_config_load(char *config_name);
 int registry_config_delete(char *config_name);
 
 void registry_perf_reset_all();
+uint64_t registry_perf_histogram_bucket_min(unsigned int bucket);
+uint64_t registry_perf_histogram_getval(struct registry_perf *p, uint64_t *buckets, uint64_t *sum);
 
 uint32_t registry_serial_poll(uint32_t last_serial, struct timespec *timeout);
 
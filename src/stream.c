@@ -30,6 +30,94 @@
 #define debug_stream(x ...)
 #endif
 
+// Unique per thread, used to identify the owner of a stream
+static __thread char stream_thread_token;
+
+// Compare two sequences taking wrap around into account
+static inline int stream_seq_before(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b) < 0;
+}
+
+static void stream_free_packet(struct stream_pkt *p) {
+
+	core_stack_release(p->stack);
+	packet_release(p->pkt);
+	free(p);
+}
+
+static inline struct stream_pkt *stream_queue_peek(struct stream *stream, unsigned int direction) {
+
+	struct stream_queue *q = &stream->queue[direction];
+	if (!q->count)
+		return NULL;
+	return q->pkts[q->first];
+}
+
+static struct stream_pkt *stream_queue_pop(struct stream *stream, unsigned int direction) {
+
+	struct stream_queue *q = &stream->queue[direction];
+	if (!q->count)
+		return NULL;
+
+	struct stream_pkt *p = q->pkts[q->first];
+	q->count--;
+	if (q->count)
+		q->first++;
+	else
+		q->first = 0;
+
+	stream->cur_buff_size -= p->plen;
+
+	return p;
+}
+
+static int stream_queue_insert(struct stream *stream, unsigned int direction, struct stream_pkt *p) {
+
+	struct stream_queue *q = &stream->queue[direction];
+
+	if (q->first + q->count >= q->size) {
+		if (q->first) {
+			// Reclaim the space of the packets already dequeued
+			memmove(q->pkts, q->pkts + q->first, sizeof(struct stream_pkt *) * q->count);
+			q->first = 0;
+		} else {
+			unsigned int new_size = (q->size ? q->size * 2 : STREAM_QUEUE_INITIAL_SIZE);
+			struct stream_pkt **pkts = realloc(q->pkts, sizeof(struct stream_pkt *) * new_size);
+			if (!pkts) {
+				pom_oom(sizeof(struct stream_pkt *) * new_size);
+				return POM_ERR;
+			}
+			q->pkts = pkts;
+			q->size = new_size;
+		}
+	}
+
+	struct stream_pkt **pkts = q->pkts + q->first;
+
+	// Fast path, the packet goes at the end
+	unsigned int pos = q->count;
+	if (q->count && !stream_seq_before(pkts[q->count - 1]->seq, p->seq)) {
+		// Find the first packet which isn't before this one
+		unsigned int low = 0, high = q->count - 1;
+		while (low < high) {
+			unsigned int mid = low + (high - low) / 2;
+			if (stream_seq_before(pkts[mid]->seq, p->seq))
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		pos = low;
+		memmove(pkts + pos + 1, pkts + pos, sizeof(struct stream_pkt *) * (q->count - pos));
+	}
+
+	pkts[pos] = p;
+	q->count++;
+
+	stream->cur_buff_size += p->plen;
+
+	return POM_OK;
+}
+
 struct stream* stream_alloc(uint32_t max_buff_size, struct conntrack_entry *ce, unsigned int flags, int (*handler) (struct conntrack_entry *ce, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index)) {
 	
 	struct stream *res = malloc(sizeof(struct stream));
@@ -76,7 +164,7 @@ int stream_cleanup(struct stream *stream) {
 		return POM_ERR;
 	}
 
-	while (stream->head[0] || stream->head[1]) {
+	while (stream->queue[POM_DIR_FWD].count || stream->queue[POM_DIR_REV].count) {
 		if (stream_force_dequeue(stream) == POM_ERR) {
 			pomlog(POMLOG_ERR "Error while processing remaining packets in the stream");
 			break;
@@ -102,6 +190,14 @@ int stream_cleanup(struct stream *stream) {
 			pomlog(POMLOG_WARN "Error while destroying list condition");
 		free(tmp);
 	}
+
+	int i;
+	for (i = 0; i < POM_DIR_TOT; i++) {
+		struct stream_pkt *p;
+		while ((p = stream_queue_pop(stream, i)))
+			stream_free_packet(p);
+		free(stream->queue[i].pkts);
+	}
 	
 	free(stream);
 
@@ -115,6 +211,13 @@ static void stream_end_process_packet(struct stream *stream) {
 	conntrack_delayed_cleanup(stream->ce, stream->timeout, stream->last_ts);
 
 	pom_mutex_unlock(&stream->lock);
+
+	// Nobody else can be waiting as long as a single thread uses the stream
+	// The barrier pairs with the one in stream_process_packet()
+	__sync_synchronize();
+	if (!__atomic_load_n(&stream->shared, __ATOMIC_RELAXED))
+		return;
+
 	pom_mutex_lock(&stream->wait_lock);
 	if (stream->wait_list_head) {
 		debug_stream("thread %p, entry %p : signaling thread %p", pthread_self(), stream, stream->wait_list_head->thread);
@@ -203,13 +306,6 @@ static int stream_is_packet_next(struct stream *stream, struct stream_pkt *pkt,
 
 }
 
-static void stream_free_packet(struct stream_pkt *p) {
-
-	core_stack_release(p->stack);
-	packet_release(p->pkt);
-	free(p);
-}
-
 int stream_process_packet(struct stream *stream, struct packet *pkt, struct proto_process_stack *stack, unsigned int stack_index, uint32_t seq, uint32_t ack) {
 
 	if (!stream || !pkt || !stack)
@@ -222,6 +318,25 @@ int stream_process_packet(struct stream *stream, struct packet *pkt, struct prot
 
 	int must_wait = 0;
 
+	// Claim the stream if no thread processed it yet
+	void *self = &stream_thread_token;
+	void *owner = __atomic_load_n(&stream->owner, __ATOMIC_ACQUIRE);
+	if (!owner && __sync_bool_compare_and_swap(&stream->owner, NULL, self))
+		owner = self;
+
+	if (owner == self && !__atomic_load_n(&stream->shared, __ATOMIC_ACQUIRE)) {
+		// Only this thread processes the stream, packets are already in order
+		pom_mutex_lock(&stream->lock);
+		goto locked;
+	}
+
+	if (!__atomic_load_n(&stream->shared, __ATOMIC_RELAXED)) {
+		debug_stream("thread %p, entry %p : stream now shared with thread %p", pthread_self(), stream, owner);
+		__atomic_store_n(&stream->shared, 1, __ATOMIC_RELEASE);
+		// Make sure the owner sees the flag before we try to get the lock
+		__sync_synchronize();
+	}
+
 	pom_mutex_lock(&stream->wait_lock);
 
 	int res = pthread_mutex_trylock(&stream->lock);
@@ -336,6 +451,7 @@ int stream_process_packet(struct stream *stream, struct packet *pkt, struct prot
 
 	}
 
+locked:
 	debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : start locked : cur_seq %u, rev_seq %u", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack, stream->cur_seq[direction], stream->cur_seq[POM_DIR_REVERSE(direction)]);
 
 	// Update the stream flags
@@ -468,48 +584,12 @@ int stream_process_packet(struct stream *stream, struct packet *pkt, struct prot
 	p->ack = ack;
 	p->stack_index = stack_index;
 
-
-	if (!stream->tail[direction]) {
-		stream->head[direction] = p;
-		stream->tail[direction] = p;
-	} else { 
-
-		struct stream_pkt *tmp = stream->tail[direction];
-		while ( tmp && 
-			((tmp->seq >= seq && tmp->seq - seq < STREAM_HALF_SEQ)
-			|| (tmp->seq <= seq && seq - tmp->seq > STREAM_HALF_SEQ))) {
-
-			tmp = tmp->prev;
-
-		}
-
-		if (!tmp) {
-			// Packet goes at the begining of the list
-			p->next = stream->head[direction];
-			if (p->next)
-				p->next->prev = p;
-			else
-				stream->tail[direction] = p;
-			stream->head[direction] = p;
-
-		} else {
-			// Insert the packet after the current one
-			p->next = tmp->next;
-			p->prev = tmp;
-
-			if (p->next)
-				p->next->prev = p;
-			else
-				stream->tail[direction] = p;
-
-			tmp->next = p;
-
-		}
+	if (stream_queue_insert(stream, direction, p) != POM_OK) {
+		stream_end_process_packet(stream);
+		stream_free_packet(p);
+		return PROTO_ERR;
 	}
 	
-	stream->cur_buff_size += cur_stack->plen;
-
-	
 	if (stream->cur_buff_size >= stream->max_buff_size) {
 		// Buffer overflow
 		debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : buffer overflow, forced dequeue", pthread_self(), stream, pom_ptime_sec(pkt->ts), pom_ptime_usec(pkt->ts), seq, ack);
@@ -588,20 +668,22 @@ int stream_force_dequeue(struct stream *stream) {
 
 	while (1) {
 
-		if (!stream->head[POM_DIR_FWD] && !stream->head[POM_DIR_REV])
+		struct stream_pkt *head[POM_DIR_TOT] = { stream_queue_peek(stream, POM_DIR_FWD), stream_queue_peek(stream, POM_DIR_REV) };
+
+		if (!head[POM_DIR_FWD] && !head[POM_DIR_REV])
 			return POM_OK;
 
 
-		if (!stream->head[POM_DIR_FWD]) {
+		if (!head[POM_DIR_FWD]) {
 			next_dir = POM_DIR_REV;
-		} else if (!stream->head[POM_DIR_REV]) {
+		} else if (!head[POM_DIR_REV]) {
 			next_dir = POM_DIR_FWD;
 		} else {
 			// We have packets in both direction, lets see which one we'll process first
 			int i;
 			for (i = 0; i < POM_DIR_TOT; i++) {
 				int r = POM_DIR_REVERSE(i);
-				struct stream_pkt *a = stream->head[i], *b = stream->head[r];
+				struct stream_pkt *a = head[i], *b = head[r];
 				uint32_t end_seq = a->seq + a->plen;
 				if ((end_seq <= b->ack && b->ack - end_seq < STREAM_HALF_SEQ) ||
 					(b->ack > end_seq && end_seq - b->ack > STREAM_HALF_SEQ))
@@ -611,26 +693,19 @@ int stream_force_dequeue(struct stream *stream) {
 			if (i == POM_DIR_TOT) {
 				// There is a gap in both direction
 				// Process the first packet received
-				struct packet *a = stream->head[POM_DIR_FWD]->pkt, *b = stream->head[POM_DIR_REV]->pkt;
+				struct packet *a = head[POM_DIR_FWD]->pkt, *b = head[POM_DIR_REV]->pkt;
 				if (a->ts < b->ts) {
 					next_dir = POM_DIR_FWD;
 				} else {
 					next_dir = POM_DIR_REV;
 				}
-				debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : processing next by timestamp", pthread_self(), stream, pom_ptime_sec(stream->head[next_dir]->pkt->ts), pom_ptime_usec(stream->head[next_dir]->pkt->ts), stream->head[next_dir]->seq, stream->head[next_dir]->ack);
+				debug_stream("thread %p, entry %p, packet %u.%06u, seq %u, ack %u : processing next by timestamp", pthread_self(), stream, pom_ptime_sec(head[next_dir]->pkt->ts), pom_ptime_usec(head[next_dir]->pkt->ts), head[next_dir]->seq, head[next_dir]->ack);
 			} else {
 				next_dir = i;
 			}
 		}
 
-		p = stream->head[next_dir];
-		if (p->next)
-			p->next->prev = NULL;
-		else
-			stream->tail[next_dir] = NULL;
-		
-		stream->head[next_dir] = p->next;
-		stream->cur_buff_size -= p->plen;
+		p = stream_queue_pop(stream, next_dir);
 
 
 		if (stream_is_packet_old_dupe(stream, p, next_dir)) {
@@ -743,9 +818,7 @@ struct stream_pkt *stream_get_next(struct stream *stream, unsigned int *directio
 		*direction = dirs[i];
 		cur_dir = *direction;
 
-		while (stream->head[cur_dir]) {
-			
-			res = stream->head[cur_dir];
+		while ((res = stream_queue_peek(stream, cur_dir))) {
 
 			if (!stream_is_packet_next(stream, res, cur_dir)) {
 				res = NULL;
@@ -759,19 +832,7 @@ struct stream_pkt *stream_get_next(struct stream *stream, unsigned int *directio
 
 				if (stream_is_packet_old_dupe(stream, res, cur_dir)) {
 					// Packet is a duplicate, remove it
-					stream->head[cur_dir] = res->next;
-					if (res->next) {
-						res->next->prev = NULL;
-					} else {
-						stream->tail[cur_dir] = NULL;
-					}
-
-					if (res->prev) {
-						pomlog(POMLOG_WARN "Dequeing packet which wasn't the first in the list. This shouldn't happen !");
-						res->prev->next = res->next;
-					}
-					
-					stream->cur_buff_size -= res->plen;
+					stream_queue_pop(stream, cur_dir);
 					stream_free_packet(res);
 					res = NULL;
 
@@ -795,18 +856,7 @@ struct stream_pkt *stream_get_next(struct stream *stream, unsigned int *directio
 		return NULL;
 
 	// Dequeue the packet
-	
-
-	stream->head[cur_dir] = res->next;
-	if (res->next) {
-		res->next->prev = res->prev;
-	} else {
-		stream->tail[cur_dir] = NULL;
-	}
-
-	stream->cur_buff_size -= res->plen;
-
-	return res;
+	return stream_queue_pop(stream, cur_dir);
 }
 
 int stream_increase_seq(struct stream *stream, unsigned int direction, uint32_t inc) {
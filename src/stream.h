@@ -37,6 +37,8 @@
 
 #define STREAM_GAP_STEP_MAX		2048
 
+#define STREAM_QUEUE_INITIAL_SIZE	8
+
 struct stream_pkt {
 
 	struct packet *pkt;
@@ -44,10 +46,15 @@ struct stream_pkt {
 	uint32_t seq, ack, plen;
 	unsigned int stack_index;
 	unsigned int flags;
-	struct stream_pkt *prev, *next;
 
 };
 
+// Packets waiting in one direction, sorted by sequence
+struct stream_queue {
+	struct stream_pkt **pkts;
+	unsigned int first, count, size;
+};
+
 struct stream_thread_wait {
 	ptime ts;
 	pthread_t thread;
@@ -61,12 +68,17 @@ struct stream {
 	uint32_t cur_buff_size, max_buff_size;
 	unsigned int flags;
 	unsigned int timeout;
-	struct stream_pkt *head[POM_DIR_TOT], *tail[POM_DIR_TOT];
+	struct stream_queue queue[POM_DIR_TOT];
 	int (*handler) (struct conntrack_entry *ce, struct packet *p, struct proto_process_stack *stack, unsigned int stack_index);
 	ptime last_ts;
 	struct conntrack_entry *ce;
 	pthread_mutex_t lock;
 
+	// First thread to process a packet on this stream
+	// As long as no other thread shows up, the wait list is not used
+	void *owner;
+	int shared;
+
 	pthread_mutex_t wait_lock;
 	struct stream_thread_wait *wait_list_head, *wait_list_tail, *wait_list_unused;
 };
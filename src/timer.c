@@ -34,8 +34,13 @@ static struct timer_sys *timer_sys_head = NULL, *timer_sys_tail = NULL;
 static pthread_mutex_t timer_sys_lock;
 
 
-static pthread_mutex_t timer_main_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct timer_queue *timer_queues = NULL;
+// Timers queued by threads which don't have their own wheel
+static struct timer_wheel timer_global_wheel = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Per processing thread wheels
+static pthread_mutex_t timer_wheels_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timer_wheel *timer_wheels = NULL;
+static __thread struct timer_wheel *timer_thread_wheel = NULL;
 
 static struct registry_perf *perf_timer_processed = NULL;
 static struct registry_perf *perf_timer_queued = NULL;
@@ -47,7 +52,7 @@ int timers_init() {
 	perf_timer_processed = core_add_perf("timer_processed", registry_perf_type_counter, "Number of timers processeds", "timers");
 	perf_timer_queued = core_add_perf("timer_queued", registry_perf_type_gauge, "Number of timers queued", "timers");
 	perf_timer_allocated = core_add_perf("timer_allocated", registry_perf_type_gauge, "Number of timers allocated", "timers");
-	perf_timer_queues = core_add_perf("timer_queues", registry_perf_type_gauge, "Number of timer queues", "queues");
+	perf_timer_queues = core_add_perf("timer_queues", registry_perf_type_gauge, "Number of timer wheels", "wheels");
 
 	if (!perf_timer_processed || !perf_timer_queued || !perf_timer_allocated || !perf_timer_queues)
 		return POM_ERR;
@@ -55,99 +60,360 @@ int timers_init() {
 	return POM_OK;
 }
 
-int timers_process() {
+static void timer_wheel_link(struct timer **slot, struct timer *t) {
 
+	t->next = *slot;
+	if (t->next)
+		t->next->pprev = &t->next;
+	*slot = t;
+	t->pprev = slot;
+}
 
-	static int processing = 0;
+static void timer_wheel_unlink(struct timer_wheel *w, struct timer *t) {
 
-	int res = pthread_mutex_trylock(&timer_main_lock);
-	if (res == EBUSY) {
-		// Already locked, give up
-		return POM_OK;
-	} else if (res) {
-		// Something went wrong
-		pomlog(POMLOG_ERR "Error while trying to lock the main timer lock : %s", pom_strerror(res));
-		abort();
-		return POM_ERR;
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+
+	if (t->level < TIMER_WHEEL_LEVELS) {
+		w->count--;
+		w->level_count[t->level]--;
 	}
+}
 
-	// Another thread is already processing the timers, drop out
-	if (processing) {
-		pom_mutex_unlock(&timer_main_lock);
+static void timer_wheel_add(struct timer_wheel *w, struct timer *t) {
+
+	uint64_t tick = t->expires >> TIMER_WHEEL_TICK_SHIFT;
+
+	// Already expired, fire it with the next tick
+	if (tick < w->base)
+		tick = w->base;
+
+	uint64_t delta = tick - w->base;
+
+	struct timer **slot = NULL;
+	if (delta < TIMER_WHEEL_ROOT_SIZE) {
+		t->level = 0;
+		slot = &w->root[tick & TIMER_WHEEL_ROOT_MASK];
+	} else {
+		unsigned int level, shift = TIMER_WHEEL_ROOT_BITS;
+		for (level = 1; level < TIMER_WHEEL_LEVELS - 1; level++) {
+			if (delta < (1ULL << (shift + TIMER_WHEEL_LEVEL_BITS)))
+				break;
+			shift += TIMER_WHEEL_LEVEL_BITS;
+		}
+
+		// Too far in the future, it will be cascaded again later
+		uint64_t max = 1ULL << (shift + TIMER_WHEEL_LEVEL_BITS);
+		if (delta >= max)
+			tick = w->base + max - 1;
+
+		t->level = level;
+		slot = &w->levels[level - 1][(tick >> shift) & TIMER_WHEEL_LEVEL_MASK];
+	}
+
+	timer_wheel_link(slot, t);
+	w->count++;
+	w->level_count[t->level]++;
+}
+
+static void timer_wheel_cascade(struct timer_wheel *w, unsigned int level, unsigned int idx) {
+
+	struct timer *t = w->levels[level - 1][idx];
+	w->levels[level - 1][idx] = NULL;
+
+	while (t) {
+		struct timer *next = t->next;
+		t->next = NULL;
+		t->pprev = NULL;
+		w->count--;
+		w->level_count[level]--;
+		timer_wheel_add(w, t);
+		t = next;
+	}
+}
+
+// Advance the wheel up to the tick of now, must be called with the wheel locked
+static int timer_wheel_run(struct timer_wheel *w, ptime now) {
+
+	uint64_t target = now >> TIMER_WHEEL_TICK_SHIFT;
+
+	if (!w->count) {
+		w->base = target;
 		return POM_OK;
 	}
 
-	processing = 1;
+	w->processing = 1;
 
-	ptime now = core_get_clock();
+	while (w->base < target && w->count) {
 
-	struct timer_queue *tq;
-	tq = timer_queues;
+		if (!(w->base & TIMER_WHEEL_ROOT_MASK)) {
+			unsigned int level, shift = TIMER_WHEEL_ROOT_BITS;
+			for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+				unsigned int idx = (w->base >> shift) & TIMER_WHEEL_LEVEL_MASK;
+				timer_wheel_cascade(w, level, idx);
+				if (idx)
+					break;
+				shift += TIMER_WHEEL_LEVEL_BITS;
+			}
+		}
+
+		if (!w->level_count[0]) {
+			// Nothing in the lower levels, skip to the next cascade
+			unsigned int level, shift = TIMER_WHEEL_ROOT_BITS;
+			for (level = 1; level < TIMER_WHEEL_LEVELS - 1 && !w->level_count[level]; level++)
+				shift += TIMER_WHEEL_LEVEL_BITS;
+			uint64_t next = ((w->base >> shift) + 1) << shift;
+			w->base = (next < target ? next : target);
+			continue;
+		}
 
-	while (tq) {
-		while (tq->head && (tq->head->expires < now)) {
-				
-			// Dequeue the timer
-			struct timer *tmp = tq->head;
-			tq->head = tq->head->next;
-			if (tq->head)
-				tq->head->prev = NULL;
-			else
-				tq->tail = NULL;
+		struct timer *work = w->root[w->base & TIMER_WHEEL_ROOT_MASK];
+		w->root[w->base & TIMER_WHEEL_ROOT_MASK] = NULL;
+		w->base++;
+
+		if (!work)
+			continue;
+
+		// Timers can be dequeued from the work list while the handlers run
+		work->pprev = &work;
+		struct timer *t;
+		for (t = work; t; t = t->next) {
+			t->level = TIMER_WHEEL_LEVEL_FIRING;
+			w->count--;
+			w->level_count[0]--;
+		}
 
-			tmp->next = NULL;
-			tmp->prev = NULL;
-			tmp->queue = NULL;
-			pom_mutex_unlock(&timer_main_lock);
+		while (work) {
+
+			t = work;
+			timer_wheel_unlink(w, t);
+			pom_mutex_unlock(&w->lock);
 			registry_perf_dec(perf_timer_queued, 1);
 
 			// Process it
-			debug_timer( "Timer 0x%lx reached. Starting handler ...", (unsigned long) tmp);
-			if ((*tmp->handler) (tmp->priv, now) != POM_OK) {
+			debug_timer( "Timer 0x%lx reached. Starting handler ...", (unsigned long) t);
+			if ((*t->handler) (t->priv, now) != POM_OK) {
+				pom_mutex_lock(&w->lock);
+				// Put back the failed timer unless the handler dequeued or requeued it
+				if (!t->pprev && t->level == TIMER_WHEEL_LEVEL_FIRING) {
+					timer_wheel_add(w, t);
+					registry_perf_inc(perf_timer_queued, 1);
+				}
+				// Put back the remaining ones
+				while (work) {
+					t = work;
+					timer_wheel_unlink(w, t);
+					timer_wheel_add(w, t);
+				}
+				w->processing = 0;
 				return POM_ERR;
 			}
 
 			registry_perf_inc(perf_timer_processed, 1);
 
-			pom_mutex_lock(&timer_main_lock);
+			pom_mutex_lock(&w->lock);
+		}
+	}
+
+	if (!w->count)
+		w->base = target;
+
+	w->processing = 0;
+
+	return POM_OK;
+}
+
+static struct timer_wheel *timer_wheel_get() {
 
+	if (timer_thread_wheel)
+		return timer_thread_wheel;
+
+	pom_mutex_lock(&timer_wheels_lock);
+
+	// Adopt the wheel of a thread which went away, along with its timers
+	struct timer_wheel *w;
+	for (w = timer_wheels; w && w->in_use; w = w->next);
+
+	if (!w) {
+		w = malloc(sizeof(struct timer_wheel));
+		if (!w) {
+			pom_mutex_unlock(&timer_wheels_lock);
+			pom_oom(sizeof(struct timer_wheel));
+			return NULL;
 		}
-		tq = tq->next;
+		memset(w, 0, sizeof(struct timer_wheel));
+
+		int res = pthread_mutex_init(&w->lock, NULL);
+		if (res) {
+			pom_mutex_unlock(&timer_wheels_lock);
+			pomlog(POMLOG_ERR "Error while initializing a timer wheel lock : %s", pom_strerror(res));
+			free(w);
+			return NULL;
+		}
+
+		w->next = timer_wheels;
+		timer_wheels = w;
 
+		registry_perf_inc(perf_timer_queues, 1);
 	}
 
-	processing = 0;
+	w->in_use = 1;
+
+	pom_mutex_unlock(&timer_wheels_lock);
+
+	timer_thread_wheel = w;
+
+	return w;
+}
+
+static int timer_wheels_catch_up(ptime now) {
+
+	uint64_t target = now >> TIMER_WHEEL_TICK_SHIFT;
+	if (target < TIMER_WHEEL_IDLE_LAG)
+		return POM_OK;
+
+	// Wheels are never removed before timers_cleanup() so the list can be walked unlocked
+	pom_mutex_lock(&timer_wheels_lock);
+	struct timer_wheel *w = timer_wheels;
+	pom_mutex_unlock(&timer_wheels_lock);
+
+	for (; w; w = w->next) {
+
+		if (w == timer_thread_wheel || !w->count || w->base + TIMER_WHEEL_IDLE_LAG > target)
+			continue;
+
+		// Don't wait for the owner, it's obviously alive
+		if (pthread_mutex_trylock(&w->lock))
+			continue;
 
-	pom_mutex_unlock(&timer_main_lock);
+		int res = POM_OK;
+		if (!w->processing && w->base + TIMER_WHEEL_IDLE_LAG <= target) {
+			debug_timer("Catching up with idle wheel %p", w);
+			res = timer_wheel_run(w, now);
+		}
+
+		pom_mutex_unlock(&w->lock);
+
+		if (res != POM_OK)
+			return res;
+	}
 
 	return POM_OK;
 }
 
+int timers_process(ptime now) {
 
-int timers_cleanup() {
+	// Each processing thread advances its own wheel with its own clock
+	struct timer_wheel *w = timer_wheel_get();
+	if (!w)
+		return POM_ERR;
 
+	pom_mutex_lock(&w->lock);
+	int res = POM_OK;
+	// Another thread may be catching up with this wheel, it will be advanced with the next packet
+	if (!w->processing)
+		res = timer_wheel_run(w, now);
+	pom_mutex_unlock(&w->lock);
 
-	// Free the timers
+	if (res != POM_OK)
+		return res;
 
-	while (timer_queues) {
-		struct timer_queue *tmpq;
-		tmpq = timer_queues;
+	// Process the timers which don't belong to a processing thread
+	w = &timer_global_wheel;
 
-		while (tmpq->head) {
-			
-			struct timer *tmp;
-			tmp = tmpq->head;
+	res = pthread_mutex_trylock(&w->lock);
+	if (res == EBUSY) {
+		// Already locked, give up
+		return POM_OK;
+	} else if (res) {
+		// Something went wrong
+		pomlog(POMLOG_ERR "Error while trying to lock the global timer wheel : %s", pom_strerror(res));
+		abort();
+		return POM_ERR;
+	}
 
-			tmpq->head = tmpq->head->next;
+	// Another thread is already processing the timers, drop out
+	if (w->processing) {
+		pom_mutex_unlock(&w->lock);
+		return POM_OK;
+	}
 
-			free(tmp);
+	ptime clock = core_get_clock();
+	res = timer_wheel_run(w, clock);
+
+	if (res == POM_OK) {
+		// Catch up with the wheels of the threads which didn't get packets for a while
+		w->processing = 1;
+		pom_mutex_unlock(&w->lock);
+		res = timer_wheels_catch_up(clock);
+		pom_mutex_lock(&w->lock);
+		w->processing = 0;
+	}
+
+	pom_mutex_unlock(&w->lock);
+
+	return res;
+}
+
+void timers_thread_cleanup() {
+
+	if (!timer_thread_wheel)
+		return;
+
+	// Queued timers stay in the wheel until another thread adopts it
+	pom_mutex_lock(&timer_wheels_lock);
+	timer_thread_wheel->in_use = 0;
+	pom_mutex_unlock(&timer_wheels_lock);
+
+	timer_thread_wheel = NULL;
+}
+
+static void timer_wheel_cleanup(struct timer_wheel *w) {
 
+	unsigned int i, j;
+	for (i = 0; i < TIMER_WHEEL_ROOT_SIZE; i++) {
+		while (w->root[i]) {
+			struct timer *tmp = w->root[i];
+			w->root[i] = tmp->next;
+			free(tmp);
 			pomlog(POMLOG_WARN "Timer not dequeued");
+		}
+	}
 
+	for (i = 0; i < TIMER_WHEEL_LEVELS - 1; i++) {
+		for (j = 0; j < TIMER_WHEEL_LEVEL_SIZE; j++) {
+			while (w->levels[i][j]) {
+				struct timer *tmp = w->levels[i][j];
+				w->levels[i][j] = tmp->next;
+				free(tmp);
+				pomlog(POMLOG_WARN "Timer not dequeued");
+			}
 		}
-		timer_queues = timer_queues->next;
+	}
+
+	w->count = 0;
+	memset(w->level_count, 0, sizeof(w->level_count));
+}
+
+int timers_cleanup() {
+
+
+	// Free the timers
+
+	timer_wheel_cleanup(&timer_global_wheel);
+
+	while (timer_wheels) {
+		struct timer_wheel *tmp = timer_wheels;
+		timer_wheels = tmp->next;
+
+		timer_wheel_cleanup(tmp);
+		pthread_mutex_destroy(&tmp->lock);
+		free(tmp);
 
-		free(tmpq);
+		registry_perf_dec(perf_timer_queues, 1);
 	}
 
 	return POM_OK;
@@ -172,10 +438,33 @@ struct timer *timer_alloc(void* priv, int (*handler) (void*, ptime)) {
 	return t;
 }
 
+// Lock the wheel owning the timer, returns NULL if it was never queued
+static struct timer_wheel *timer_lock_wheel(struct timer *t) {
+
+	while (1) {
+		struct timer_wheel *w = __atomic_load_n(&t->wheel, __ATOMIC_ACQUIRE);
+		if (!w)
+			return NULL;
+
+		pom_mutex_lock(&w->lock);
+		if (t->wheel == w)
+			return w;
+
+		// The timer migrated in the meantime
+		pom_mutex_unlock(&w->lock);
+	}
+}
+
 int timer_cleanup(struct timer *t) {
 
-	if (t->queue)
-		timer_dequeue(t);
+	struct timer_wheel *w = timer_lock_wheel(t);
+	if (w) {
+		if (t->pprev) {
+			timer_wheel_unlink(w, t);
+			registry_perf_dec(perf_timer_queued, 1);
+		}
+		pom_mutex_unlock(&w->lock);
+	}
 
 	free(t);
 	
@@ -191,141 +480,71 @@ int timer_queue(struct timer *t, unsigned int expiry) {
 
 int timer_queue_now(struct timer *t, unsigned int expiry, ptime now) {
 
+	// Processing threads queue in their own wheel, others in the global one
+	struct timer_wheel *self = timer_thread_wheel;
+	if (!self)
+		self = &timer_global_wheel;
 
-	pom_mutex_lock(&timer_main_lock);
+	struct timer_wheel *w = NULL;
 
-	struct timer_queue *tq = timer_queues;
+	while (1) {
 
-	// Timer is still queued, dequeue it
-	if (t->queue) {
-
-		// Start further in the list of queues if possible
-		if (expiry >= t->queue->expiry)
-			tq = t->queue;
+		w = timer_lock_wheel(t);
 
-		if (t->prev) {
-			t->prev->next = t->next;
-		} else {
-			t->queue->head = t->next;
-			if (t->queue->head)
-				t->queue->head->prev = NULL;
+		if (!w) {
+			// First time this timer is queued, claim it
+			pom_mutex_lock(&self->lock);
+			if (__sync_bool_compare_and_swap(&t->wheel, NULL, self)) {
+				w = self;
+				break;
+			}
+			pom_mutex_unlock(&self->lock);
+			continue;
 		}
 
-		if (t->next) {
-			t->next->prev = t->prev;
+		// Threads without a wheel leave the timer with its owner
+		if (w == self || !timer_thread_wheel)
+			break;
+
+		// Migrate the timer to this thread, take both locks in order
+		if (self < w) {
+			pom_mutex_unlock(&w->lock);
+			pom_mutex_lock(&self->lock);
+			pom_mutex_lock(&w->lock);
+			if (t->wheel != w) {
+				pom_mutex_unlock(&w->lock);
+				pom_mutex_unlock(&self->lock);
+				continue;
+			}
 		} else {
-			t->queue->tail = t->prev;
-			if (t->queue->tail)
-				t->queue->tail->next = NULL;
-			
-		}
-		t->queue = NULL;
-		t->prev = NULL;
-		t->next = NULL;
-	} else {
-		registry_perf_inc(perf_timer_queued, 1);
-	}
-
-	// First find the right queue or create it
-	
-	if (!tq) {
-
-		// There is no queue yet
-		tq = malloc(sizeof(struct timer_queue));
-		if (!tq) {
-			pom_mutex_unlock(&timer_main_lock);
-			pom_oom(sizeof(struct timer_queue));
-			return POM_ERR;
+			pom_mutex_lock(&self->lock);
 		}
-		memset(tq, 0, sizeof(struct timer_queue));
-		timer_queues = tq;
-
-		tq->expiry = expiry;
-
-		registry_perf_inc(perf_timer_queues, 1);
-
-	} else {
-
-		while (tq) {
-			
-			if (tq->expiry == expiry) { // The right queue already exists
-				
-				break;
-
-			} else if (tq->expiry > expiry) { // The right queue doesn't exists and we are too far in the list
-
-				struct timer_queue *tmp;
-				tmp = malloc(sizeof(struct timer_queue));
-				if (!tmp) {
-					pom_oom(sizeof(struct timer_queue));
-					pom_mutex_unlock(&timer_main_lock);
-					return POM_ERR;
-				}
-				memset(tmp, 0, sizeof(struct timer_queue));
-
-				tmp->prev = tq->prev;
-				tmp->next = tq;
-				tq->prev = tmp;
-
-				if (tmp->prev)
-					tmp->prev->next = tmp;
-				else
-					timer_queues = tmp;
-
-
-				tq = tmp;
-				tq->expiry = expiry;
-
-				registry_perf_inc(perf_timer_queues, 1);
-
-				break;
-			
-			} else if (!tq->next) { // Looks like we are at the end of our list
-
-				struct timer_queue *tmp;
-				tmp = malloc(sizeof(struct timer_queue));
-				if (!tmp) {
-					pom_oom(sizeof(struct timer_queue));
-					pom_mutex_unlock(&timer_main_lock);
-					return POM_ERR;
-				}
-				memset(tmp, 0, sizeof(struct timer_queue));
-
-				tmp->prev = tq;
-				
-				tq->next = tmp;
-
-				tq = tmp;
-
-				tq->expiry = expiry;
 
-				registry_perf_inc(perf_timer_queues, 1);
-				
-				break;
-			}
-
-			tq = tq->next;
+		if (t->pprev) {
+			timer_wheel_unlink(w, t);
+			registry_perf_dec(perf_timer_queued, 1);
 		}
+		__atomic_store_n(&t->wheel, self, __ATOMIC_RELEASE);
+		pom_mutex_unlock(&w->lock);
 
+		w = self;
+		break;
 	}
 
-	// Now we can queue the timer
-	
-	if (tq->head == NULL) {
-		tq->head = t;
-		tq->tail = t;
-	} else {
-		t->prev = tq->tail;
-		tq->tail = t;
-		t->prev->next = t;
-	}
+	// Timer is still queued, dequeue it
+	if (t->pprev)
+		timer_wheel_unlink(w, t);
+	else
+		registry_perf_inc(perf_timer_queued, 1);
+
+	// Start from the current time if the wheel was idle
+	if (!w->count && !w->processing)
+		w->base = now >> TIMER_WHEEL_TICK_SHIFT;
 
-	// Update the expiry time
-	
 	t->expires = now + (expiry * 1000000UL);
-	t->queue = tq;
-	pom_mutex_unlock(&timer_main_lock);
+	timer_wheel_add(w, t);
 
+	pom_mutex_unlock(&w->lock);
 
 	return POM_OK;
 }
@@ -333,40 +552,18 @@ int timer_queue_now(struct timer *t, unsigned int expiry, ptime now) {
 
 int timer_dequeue(struct timer *t) {
 
-	// First let's check if it's the one at the begining of the queue
+	struct timer_wheel *w = timer_lock_wheel(t);
 
-	pom_mutex_lock(&timer_main_lock);
-
-	if (!t->queue) {
+	if (!w || !t->pprev) {
 		pomlog(POMLOG_WARN "Warning, timer %p was already dequeued", t);
-		pom_mutex_unlock(&timer_main_lock);
+		if (w)
+			pom_mutex_unlock(&w->lock);
 		return POM_OK;
 	}
 
-	if (t->prev) {
-		t->prev->next = t->next;
-	} else {
-		t->queue->head = t->next;
-		if (t->queue->head)
-			t->queue->head->prev = NULL;
-	}
+	timer_wheel_unlink(w, t);
 
-	if (t->next) {
-		t->next->prev = t->prev;
-	} else {
-		t->queue->tail = t->prev;
-		if (t->queue->tail)
-			t->queue->tail->next = NULL;
-		
-	}
-
-
-	// Make sure this timer will not reference anything
-
-	t->prev = NULL;
-	t->next = NULL;
-	t->queue = NULL;
-	pom_mutex_unlock(&timer_main_lock);
+	pom_mutex_unlock(&w->lock);
 
 	registry_perf_dec(perf_timer_queued, 1);
 
@@ -23,6 +23,7 @@
 #define __TIMER_H__
 
 #include <pom-ng/timer.h>
+#include <pthread.h>
 
 struct timer_sys {
 	time_t expiry;
@@ -31,34 +32,56 @@ struct timer_sys {
 	struct timer_sys *prev, *next;
 };
 
+// Each wheel tick is 2^14 usec (~16ms) of packet time
+#define TIMER_WHEEL_TICK_SHIFT	14
+
+// The first level has 256 slots, the upper ones 64 each
+#define TIMER_WHEEL_ROOT_BITS	8
+#define TIMER_WHEEL_ROOT_SIZE	(1 << TIMER_WHEEL_ROOT_BITS)
+#define TIMER_WHEEL_ROOT_MASK	(TIMER_WHEEL_ROOT_SIZE - 1)
+#define TIMER_WHEEL_LEVEL_BITS	6
+#define TIMER_WHEEL_LEVEL_SIZE	(1 << TIMER_WHEEL_LEVEL_BITS)
+#define TIMER_WHEEL_LEVEL_MASK	(TIMER_WHEEL_LEVEL_SIZE - 1)
+
+// Total number of levels, the last one covers up to 2^32 ticks
+#define TIMER_WHEEL_LEVELS	5
+
+// Wheels lagging this many ticks (~4s) behind the global clock are advanced by other threads
+#define TIMER_WHEEL_IDLE_LAG	TIMER_WHEEL_ROOT_SIZE
+
+// Level of timers which were taken out of a slot and are about to fire
+#define TIMER_WHEEL_LEVEL_FIRING	TIMER_WHEEL_LEVELS
+
 struct timer {
 
 	ptime expires;
 	void *priv;
 	int (*handler) (void *, ptime);
-	struct timer_queue *queue;
+	struct timer_wheel *wheel; // Wheel owning this timer
+	unsigned int level;
 	struct timer *next;
-	struct timer *prev;
+	struct timer **pprev; // NULL when not queued
 
 };
 
-struct timer_queue {
+struct timer_wheel {
 
-	unsigned int expiry;
-	struct timer_queue *next;
-	struct timer_queue *prev;
-	struct timer *head;
-	struct timer *tail;
+	pthread_mutex_t lock;
+	uint64_t base; // Next tick to process
+	unsigned int count; // Timers in the slots
+	unsigned int level_count[TIMER_WHEEL_LEVELS];
+	int processing, in_use;
+	struct timer *root[TIMER_WHEEL_ROOT_SIZE];
+	struct timer *levels[TIMER_WHEEL_LEVELS - 1][TIMER_WHEEL_LEVEL_SIZE];
+	struct timer_wheel *next;
 
 };
 
 int timers_init();
-int timers_process();
+int timers_process(ptime now);
+void timers_thread_cleanup();
 int timers_cleanup();
 
-void timer_queue_lock(struct timer_queue *q, int write);
-void timer_queue_unlock(struct timer_queue *q);
-
 int timer_sys_process();
 
 #endif
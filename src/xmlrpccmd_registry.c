@@ -240,6 +240,9 @@ static xmlrpc_value *xmlrpccmd_registry_build_perfs(xmlrpc_env * const envP, str
 			case registry_perf_type_timeticks:
 				type_str = "timeticks";
 				break;
+			case registry_perf_type_histogram:
+				type_str = "histogram";
+				break;
 		}
 		
 		xmlrpc_value *perf = NULL;
@@ -257,6 +260,35 @@ static xmlrpc_value *xmlrpccmd_registry_build_perfs(xmlrpc_env * const envP, str
 	return perfs;
 }
 
+static xmlrpc_value *xmlrpccmd_registry_build_histogram(xmlrpc_env * const envP, struct registry_perf *p) {
+
+	uint64_t buckets[REGISTRY_PERF_HISTOGRAM_BUCKETS];
+	uint64_t sum = 0;
+	uint64_t count = registry_perf_histogram_getval(p, buckets, &sum);
+
+	// Only send the buckets which are not empty
+	xmlrpc_value *xml_buckets = xmlrpc_array_new(envP);
+	unsigned int i;
+	for (i = 0; i < REGISTRY_PERF_HISTOGRAM_BUCKETS; i++) {
+		if (!buckets[i])
+			continue;
+
+		xmlrpc_value *bucket = xmlrpc_build_value(envP, "{s:I,s:I}",
+						"min", registry_perf_histogram_bucket_min(i),
+						"count", buckets[i]);
+		xmlrpc_array_append_item(envP, xml_buckets, bucket);
+		xmlrpc_DECREF(bucket);
+	}
+
+	xmlrpc_value *hist = xmlrpc_build_value(envP, "{s:I,s:I,s:A}",
+						"count", count,
+						"sum", sum,
+						"buckets", xml_buckets);
+	xmlrpc_DECREF(xml_buckets);
+
+	return hist;
+}
+
 xmlrpc_value *xmlrpccmd_registry_list(xmlrpc_env * const envP, xmlrpc_value * const paramArrayP, void * const userData) {
 
 	xmlrpc_value *classes = xmlrpc_struct_new(envP);
@@ -897,6 +929,12 @@ xmlrpc_value *xmlrpccmd_registry_get_perfs(xmlrpc_env * const envP, xmlrpc_value
 						"sys_time", sys_time);
 		xmlrpc_DECREF(sys_time);
 
+		if (perf_array[i].perf->type == registry_perf_type_histogram) {
+			xmlrpc_value *hist = xmlrpccmd_registry_build_histogram(envP, perf_array[i].perf);
+			xmlrpc_struct_set_value(envP, item, "histogram", hist);
+			xmlrpc_DECREF(hist);
+		}
+
 		if (perf_array[i].inst_name) {
 			xmlrpc_value *inst_name = xmlrpc_string_new(envP, perf_array[i].inst_name);
 			xmlrpc_struct_set_value(envP, item, "instance", inst_name);
@@ -970,14 +1008,14 @@ xmlrpc_value *xmlrpccmd_registry_reset_class_perfs(xmlrpc_env * const envP, xmlr
 
 	struct registry_perf *p;
 	for (p = c->perfs; p; p = p->next) {
-		if (p->type == registry_perf_type_counter)
+		if (p->type == registry_perf_type_counter || p->type == registry_perf_type_histogram)
 			registry_perf_reset(p);
 	}
 
 	struct registry_instance *inst;
 	for (inst = c->instances; inst; inst = inst->next) {
 		for (p = inst->perfs; p; p = p->next) {
-			if (p->type == registry_perf_type_counter)
+			if (p->type == registry_perf_type_counter || p->type == registry_perf_type_histogram)
 				registry_perf_reset(p);
 		}
 	}
@@ -1005,7 +1043,7 @@ xmlrpc_value *xmlrpccmd_registry_reset_instance_perfs(xmlrpc_env * const envP, x
 
 	struct registry_perf *p;
 	for (p = i->perfs; p; p = p->next) {
-		if (p->type == registry_perf_type_counter)
+		if (p->type == registry_perf_type_counter || p->type == registry_perf_type_histogram)
 			registry_perf_reset(p);
 	}
 